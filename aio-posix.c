@@ -18,6 +18,7 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "trace.h"
 #ifdef CONFIG_EPOLL_CREATE1
 #include <sys/epoll.h>
 #endif
@@ -27,6 +28,9 @@ struct AioHandler
     GPollFD pfd;
     IOHandler *io_read;
     IOHandler *io_write;
+    AioPollFn *io_poll;
+    IOHandler *io_poll_begin;
+    IOHandler *io_poll_end;
     int deleted;
     void *opaque;
     bool is_external;
@@ -219,6 +223,13 @@ void aio_set_fd_handler(AioContext *ctx,
     if (!io_read && !io_write) {
         if (node) {
             g_source_remove_poll(&ctx->source, &node->pfd);
+            if (!node->io_poll) {
+                ctx->poll_disable_cnt--;
+            }
+            /* Do not leave notifications suppressed behind us */
+            if (ctx->poll_started && node->io_poll_end) {
+                node->io_poll_end(node->opaque);
+            }
 
             /* If the lock is held, just mark the node as deleted */
             if (ctx->walking_handlers) {
@@ -242,6 +253,7 @@ void aio_set_fd_handler(AioContext *ctx,
 
             g_source_add_poll(&ctx->source, &node->pfd);
             is_new = true;
+            ctx->poll_disable_cnt++;
         }
         /* Update handler with latest information */
         node->io_read = io_read;
@@ -269,6 +281,50 @@ void aio_set_event_notifier(AioContext *ctx,
                        is_external, (IOHandler *)io_read, NULL, notifier);
 }
 
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll)
+{
+    AioHandler *node = find_aio_handler(ctx, fd);
+
+    if (!node) {
+        return;
+    }
+
+    ctx->poll_disable_cnt += !io_poll - !node->io_poll;
+    node->io_poll = io_poll;
+    aio_notify(ctx);
+}
+
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+    aio_set_fd_poll(ctx, event_notifier_get_fd(notifier), io_poll);
+}
+
+void aio_set_fd_poll_begin_end(AioContext *ctx, int fd,
+                               IOHandler *io_poll_begin,
+                               IOHandler *io_poll_end)
+{
+    AioHandler *node = find_aio_handler(ctx, fd);
+
+    if (!node) {
+        return;
+    }
+
+    node->io_poll_begin = io_poll_begin;
+    node->io_poll_end = io_poll_end;
+}
+
+void aio_set_event_notifier_poll_begin_end(AioContext *ctx,
+                                           EventNotifier *notifier,
+                                           EventNotifierHandler *io_poll_begin,
+                                           EventNotifierHandler *io_poll_end)
+{
+    aio_set_fd_poll_begin_end(ctx, event_notifier_get_fd(notifier),
+                              (IOHandler *)io_poll_begin,
+                              (IOHandler *)io_poll_end);
+}
+
 bool aio_prepare(AioContext *ctx)
 {
     return false;
@@ -405,12 +461,127 @@ static void add_pollfd(AioHandler *node)
     npfd++;
 }
 
+/* Called with ctx->walking_handlers incremented */
+static bool run_poll_handlers_once(AioContext *ctx)
+{
+    bool progress = false;
+    AioHandler *node;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_poll &&
+            aio_node_check(ctx, node->is_external) &&
+            node->io_poll(node->opaque)) {
+            progress = true;
+        }
+    }
+
+    return progress;
+}
+
+/* Tell the handlers that busy-waiting starts or stops, so that they can
+ * suppress notifications (e.g. virtqueue kicks) that polling makes useless.
+ *
+ * Called with ctx->walking_handlers incremented.
+ */
+static void poll_set_started(AioContext *ctx, bool started)
+{
+    AioHandler *node;
+
+    if (started == ctx->poll_started) {
+        return;
+    }
+    ctx->poll_started = started;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        IOHandler *fn = started ? node->io_poll_begin : node->io_poll_end;
+
+        if (!node->deleted && fn) {
+            fn(node->opaque);
+        }
+    }
+}
+
+/* Busy-wait for up to the current polling time, but never past @timeout.
+ * If a poll handler makes progress, @timeout is set to 0 so that the
+ * following poll() only picks up what is already pending.
+ *
+ * Polling stays started across aio_poll() calls as long as it makes
+ * progress; notifications are only re-enabled before blocking.
+ *
+ * Called with ctx->walking_handlers incremented and the AioContext held;
+ * the time is bounded by poll_max_ns so other users of the context are
+ * only delayed briefly.
+ */
+static bool try_poll_mode(AioContext *ctx, int64_t *timeout)
+{
+    /* A negative timeout is infinite, see qemu_soonest_timeout() */
+    int64_t max_ns = MIN((uint64_t)*timeout, (uint64_t)ctx->poll_ns);
+    int64_t end_time;
+
+    if (max_ns && !ctx->poll_disable_cnt) {
+        poll_set_started(ctx, true);
+
+        end_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + max_ns;
+        do {
+            if (run_poll_handlers_once(ctx)) {
+                *timeout = 0;
+                return true;
+            }
+        } while (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) < end_time);
+    }
+
+    if (ctx->poll_started) {
+        poll_set_started(ctx, false);
+
+        /* Work that was queued while notifications were suppressed will
+         * not make the fd readable, so look for it once more.
+         */
+        if (run_poll_handlers_once(ctx)) {
+            *timeout = 0;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Adjust the polling time based on how long the last blocking aio_poll()
+ * had to wait for an event, including the time spent polling.
+ */
+static void adjust_poll_time(AioContext *ctx, int64_t block_ns)
+{
+    int64_t old = ctx->poll_ns;
+
+    if (block_ns <= ctx->poll_ns) {
+        /* The event arrived while polling, no adjustment needed */
+        return;
+    }
+
+    if (block_ns > ctx->poll_max_ns) {
+        /* Polling could not have caught it, poll less */
+        ctx->poll_ns = ctx->poll_shrink ? ctx->poll_ns / ctx->poll_shrink : 0;
+        if (ctx->poll_ns != old) {
+            trace_poll_shrink(ctx, old, ctx->poll_ns);
+        }
+    } else if (ctx->poll_ns < ctx->poll_max_ns) {
+        /* Polling a bit longer would have caught it */
+        int64_t grow = ctx->poll_grow ? ctx->poll_grow : 2;
+
+        ctx->poll_ns = ctx->poll_ns ? ctx->poll_ns * grow : 4000;
+        if (ctx->poll_ns > ctx->poll_max_ns) {
+            ctx->poll_ns = ctx->poll_max_ns;
+        }
+        trace_poll_grow(ctx, old, ctx->poll_ns);
+    }
+}
+
 bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
     int i, ret;
     bool progress;
     int64_t timeout;
+    int64_t start = 0;
 
     aio_context_acquire(ctx);
     progress = false;
@@ -430,6 +601,15 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     assert(npfd == 0);
 
+    timeout = blocking ? aio_compute_timeout(ctx) : 0;
+
+    if (blocking && ctx->poll_max_ns) {
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    }
+    if (try_poll_mode(ctx, &timeout)) {
+        progress = true;
+    }
+
     /* fill pollfds */
     QLIST_FOREACH(node, &ctx->aio_handlers, node) {
         if (!node->deleted && node->pfd.events
@@ -439,8 +619,6 @@ bool aio_poll(AioContext *ctx, bool blocking)
         }
     }
 
-    timeout = blocking ? aio_compute_timeout(ctx) : 0;
-
     /* wait until next event */
     if (timeout) {
         aio_context_release(ctx);
@@ -465,6 +643,10 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     aio_notify_accept(ctx);
 
+    if (start) {
+        adjust_poll_time(ctx, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+    }
+
     /* if we have any readable fds, dispatch event */
     if (ret > 0) {
         for (i = 0; i < npfd; i++) {
@@ -498,3 +680,17 @@ void aio_context_setup(AioContext *ctx)
     }
 #endif
 }
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink, Error **errp)
+{
+    /* No thread synchronization here, it doesn't matter if an incorrect
+     * value is used once.
+     */
+    ctx->poll_max_ns = max_ns;
+    ctx->poll_ns = 0;
+    ctx->poll_grow = grow;
+    ctx->poll_shrink = shrink;
+
+    aio_notify(ctx);
+}
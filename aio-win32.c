@@ -18,6 +18,7 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "block/block.h"
+#include "qapi/error.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
 
@@ -374,3 +375,34 @@ bool aio_poll(AioContext *ctx, bool blocking)
 void aio_context_setup(AioContext *ctx)
 {
 }
+
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll)
+{
+}
+
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+}
+
+void aio_set_fd_poll_begin_end(AioContext *ctx, int fd,
+                               IOHandler *io_poll_begin,
+                               IOHandler *io_poll_end)
+{
+}
+
+void aio_set_event_notifier_poll_begin_end(AioContext *ctx,
+                                           EventNotifier *notifier,
+                                           EventNotifierHandler *io_poll_begin,
+                                           EventNotifierHandler *io_poll_end)
+{
+}
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink, Error **errp)
+{
+    if (max_ns) {
+        error_setg(errp, "AioContext polling is not implemented on Windows");
+    }
+}
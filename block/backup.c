@@ -25,6 +25,7 @@
 #include "qemu/bitmap.h"
 
 #define BACKUP_CLUSTER_SIZE_DEFAULT (1 << 16)
+#define BACKUP_MAX_WORKERS 64
 #define SLICE_TIME 100000000ULL /* ns */
 
 typedef struct CowRequest {
@@ -49,8 +50,25 @@ typedef struct BackupBlockJob {
     int64_t cluster_size;
     NotifierWithReturn before_write;
     QLIST_HEAD(, CowRequest) inflight_reqs;
+    /* Writes to the target must not race with reads of the target that
+     * fall through to the source, i.e. the target is a fleecing image */
+    bool serialize_target_writes;
+
+    /* Background copy workers */
+    int max_workers;
+    int in_flight;
+    bool waiting_for_workers;
+    /* First error reported by a worker, and the cluster it failed on */
+    int worker_ret;
+    bool worker_error_is_read;
+    int64_t worker_error_cluster;
 } BackupBlockJob;
 
+typedef struct BackupWorkerOp {
+    BackupBlockJob *job;
+    int64_t cluster;
+} BackupWorkerOp;
+
 /* Size of a cluster in sectors, instead of bytes. */
 static inline int64_t cluster_size_sectors(BackupBlockJob *job)
 {
@@ -104,6 +122,7 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
     struct iovec iov;
     QEMUIOVector bounce_qiov;
     void *bounce_buffer = NULL;
+    int write_flags = job->serialize_target_writes ? BDRV_REQ_SERIALISING : 0;
     int ret = 0;
     int64_t sectors_per_cluster = cluster_size_sectors(job);
     int64_t start, end;
@@ -151,10 +170,11 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
 
         if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
             ret = blk_co_pwrite_zeroes(job->target, start * job->cluster_size,
-                                       bounce_qiov.size, BDRV_REQ_MAY_UNMAP);
+                                       bounce_qiov.size,
+                                       write_flags | BDRV_REQ_MAY_UNMAP);
         } else {
             ret = blk_co_pwritev(job->target, start * job->cluster_size,
-                                 bounce_qiov.size, &bounce_qiov, 0);
+                                 bounce_qiov.size, &bounce_qiov, write_flags);
         }
         if (ret < 0) {
             trace_backup_do_cow_write_fail(job, start, ret);
@@ -314,9 +334,95 @@ static bool coroutine_fn yield_and_check(BackupBlockJob *job)
     return false;
 }
 
-static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
+static void coroutine_fn backup_worker_entry(void *opaque)
 {
+    BackupWorkerOp *op = opaque;
+    BackupBlockJob *job = op->job;
+    int64_t sectors_per_cluster = cluster_size_sectors(job);
     bool error_is_read;
+    int ret;
+
+    ret = backup_do_cow(job, op->cluster * sectors_per_cluster,
+                        sectors_per_cluster, &error_is_read, false);
+    if (ret < 0 &&
+        (!job->worker_ret || op->cluster < job->worker_error_cluster)) {
+        job->worker_ret = ret;
+        job->worker_error_is_read = error_is_read;
+        job->worker_error_cluster = op->cluster;
+    }
+
+    g_free(op);
+    job->in_flight--;
+    if (job->waiting_for_workers) {
+        qemu_coroutine_enter(job->common.co);
+    }
+}
+
+/* Wait until at most @max workers are in flight */
+static void coroutine_fn backup_wait_for_workers(BackupBlockJob *job, int max)
+{
+    while (job->in_flight > max) {
+        trace_backup_wait_for_workers(job, job->in_flight);
+        assert(!job->waiting_for_workers);
+        job->waiting_for_workers = true;
+        qemu_coroutine_yield();
+        job->waiting_for_workers = false;
+    }
+}
+
+/* Copy @cluster in the background, once a worker slot is free.  Returns
+ * false without starting the copy if an earlier worker has failed. */
+static bool coroutine_fn backup_start_worker(BackupBlockJob *job,
+                                             int64_t cluster)
+{
+    BackupWorkerOp *op;
+    Coroutine *co;
+
+    backup_wait_for_workers(job, job->max_workers - 1);
+    if (job->worker_ret < 0) {
+        return false;
+    }
+
+    op = g_new(BackupWorkerOp, 1);
+    *op = (BackupWorkerOp) {
+        .job        = job,
+        .cluster    = cluster,
+    };
+    job->in_flight++;
+    co = qemu_coroutine_create(backup_worker_entry, op);
+    qemu_coroutine_enter(co);
+    return true;
+}
+
+/* Wait for all workers to finish and handle the first error that one of them
+ * reported, if any.  Returns true if the copy must be resumed at *cluster,
+ * false if it is complete or failed; in the latter case *ret is set. */
+static bool coroutine_fn backup_drain_workers(BackupBlockJob *job, int *ret,
+                                              int64_t *cluster)
+{
+    BlockErrorAction action;
+
+    backup_wait_for_workers(job, 0);
+    *ret = job->worker_ret;
+    if (*ret >= 0) {
+        return false;
+    }
+
+    job->worker_ret = 0;
+    action = backup_error_action(job, job->worker_error_is_read, -*ret);
+    if (action == BLOCK_ERROR_ACTION_REPORT) {
+        return false;
+    }
+
+    /* Retry from the first failed cluster; clusters that have been copied in
+     * the meantime are skipped thanks to done_bitmap */
+    *ret = 0;
+    *cluster = job->worker_error_cluster;
+    return true;
+}
+
+static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
+{
     int ret = 0;
     int clusters_per_iter;
     uint32_t granularity;
@@ -325,45 +431,54 @@ static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
     int64_t end;
     int64_t last_cluster = -1;
     int64_t sectors_per_cluster = cluster_size_sectors(job);
+    bool stop = false;
     HBitmapIter hbi;
 
     granularity = bdrv_dirty_bitmap_granularity(job->sync_bitmap);
     clusters_per_iter = MAX((granularity / job->cluster_size), 1);
     bdrv_dirty_iter_init(job->sync_bitmap, &hbi);
 
-    /* Find the next dirty sector(s) */
-    while ((sector = hbitmap_iter_next(&hbi)) != -1) {
-        cluster = sector / sectors_per_cluster;
+    for (;;) {
+        /* Find the next dirty sector(s) */
+        while (!stop && (sector = hbitmap_iter_next(&hbi)) != -1) {
+            cluster = sector / sectors_per_cluster;
 
-        /* Fake progress updates for any clusters we skipped */
-        if (cluster != last_cluster + 1) {
-            job->common.offset += ((cluster - last_cluster - 1) *
-                                   job->cluster_size);
-        }
+            /* Fake progress updates for any clusters we skipped */
+            if (cluster > last_cluster + 1) {
+                job->common.offset += ((cluster - last_cluster - 1) *
+                                       job->cluster_size);
+            }
 
-        for (end = cluster + clusters_per_iter; cluster < end; cluster++) {
-            do {
-                if (yield_and_check(job)) {
-                    return ret;
-                }
-                ret = backup_do_cow(job, cluster * sectors_per_cluster,
-                                    sectors_per_cluster, &error_is_read,
-                                    false);
-                if ((ret < 0) &&
-                    backup_error_action(job, error_is_read, -ret) ==
-                    BLOCK_ERROR_ACTION_REPORT) {
-                    return ret;
+            for (end = cluster + clusters_per_iter; cluster < end; cluster++) {
+                if (yield_and_check(job) ||
+                    !backup_start_worker(job, cluster)) {
+                    stop = true;
+                    break;
                 }
-            } while (ret < 0);
+            }
+
+            /* If the bitmap granularity is smaller than the backup
+             * granularity, we need to advance the iterator pointer to the
+             * next cluster. */
+            if (granularity < job->cluster_size) {
+                bdrv_set_dirty_iter(&hbi, cluster * sectors_per_cluster);
+            }
+
+            last_cluster = MAX(last_cluster, cluster - 1);
         }
 
-        /* If the bitmap granularity is smaller than the backup granularity,
-         * we need to advance the iterator pointer to the next cluster. */
-        if (granularity < job->cluster_size) {
-            bdrv_set_dirty_iter(&hbi, cluster * sectors_per_cluster);
+        if (!backup_drain_workers(job, &ret, &cluster)) {
+            break;
         }
 
-        last_cluster = cluster - 1;
+        /* The sync bitmap is frozen, so rewinding the iterator finds the
+         * failed cluster again */
+        bdrv_set_dirty_iter(&hbi, cluster * sectors_per_cluster);
+        stop = false;
+    }
+
+    if (ret < 0 || block_job_is_cancelled(&job->common)) {
+        return ret;
     }
 
     /* Play some final catchup with the progress meter */
@@ -406,60 +521,54 @@ static void coroutine_fn backup_run(void *opaque)
         ret = backup_run_incremental(job);
     } else {
         /* Both FULL and TOP SYNC_MODE's require copying.. */
-        for (; start < end; start++) {
-            bool error_is_read;
-            if (yield_and_check(job)) {
-                break;
-            }
+        do {
+            for (; start < end; start++) {
+                if (yield_and_check(job)) {
+                    break;
+                }
 
-            if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
-                int i, n;
-                int alloced = 0;
-
-                /* Check to see if these blocks are already in the
-                 * backing file. */
-
-                for (i = 0; i < sectors_per_cluster;) {
-                    /* bdrv_is_allocated() only returns true/false based
-                     * on the first set of sectors it comes across that
-                     * are are all in the same state.
-                     * For that reason we must verify each sector in the
-                     * backup cluster length.  We end up copying more than
-                     * needed but at some point that is always the case. */
-                    alloced =
-                        bdrv_is_allocated(bs,
-                                start * sectors_per_cluster + i,
-                                sectors_per_cluster - i, &n);
-                    i += n;
-
-                    if (alloced == 1 || n == 0) {
-                        break;
+                if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
+                    int i, n;
+                    int alloced = 0;
+
+                    /* Check to see if these blocks are already in the
+                     * backing file. */
+
+                    for (i = 0; i < sectors_per_cluster;) {
+                        /* bdrv_is_allocated() only returns true/false based
+                         * on the first set of sectors it comes across that
+                         * are are all in the same state.
+                         * For that reason we must verify each sector in the
+                         * backup cluster length.  We end up copying more than
+                         * needed but at some point that is always the case. */
+                        alloced =
+                            bdrv_is_allocated(bs,
+                                    start * sectors_per_cluster + i,
+                                    sectors_per_cluster - i, &n);
+                        i += n;
+
+                        if (alloced == 1 || n == 0) {
+                            break;
+                        }
                     }
-                }
 
-                /* If the above loop never found any sectors that are in
-                 * the topmost image, skip this backup. */
-                if (alloced == 0) {
-                    continue;
+                    /* If the above loop never found any sectors that are in
+                     * the topmost image, skip this backup. */
+                    if (alloced == 0) {
+                        continue;
+                    }
                 }
-            }
-            /* FULL sync mode we copy the whole drive. */
-            ret = backup_do_cow(job, start * sectors_per_cluster,
-                                sectors_per_cluster, &error_is_read, false);
-            if (ret < 0) {
-                /* Depending on error action, fail now or retry cluster */
-                BlockErrorAction action =
-                    backup_error_action(job, error_is_read, -ret);
-                if (action == BLOCK_ERROR_ACTION_REPORT) {
+                /* FULL sync mode we copy the whole drive. */
+                if (!backup_start_worker(job, start)) {
                     break;
-                } else {
-                    start--;
-                    continue;
                 }
             }
-        }
+            /* Depending on error action, fail now or retry from the first
+             * cluster that could not be copied */
+        } while (backup_drain_workers(job, &ret, &start));
     }
 
+    assert(job->in_flight == 0);
     notifier_with_return_remove(&job->before_write);
 
     /* wait until pending backup_do_cow() calls have completed */
@@ -478,7 +587,7 @@ void backup_start(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *target, int64_t speed,
                   MirrorSyncMode sync_mode, BdrvDirtyBitmap *sync_bitmap,
                   BlockdevOnError on_source_error,
-                  BlockdevOnError on_target_error,
+                  BlockdevOnError on_target_error, int64_t max_workers,
                   BlockCompletionFunc *cb, void *opaque,
                   BlockJobTxn *txn, Error **errp)
 {
@@ -515,6 +624,12 @@ void backup_start(const char *job_id, BlockDriverState *bs,
         return;
     }
 
+    if (max_workers < 1 || max_workers > BACKUP_MAX_WORKERS) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-workers",
+                   "a value between 1 and " stringify(BACKUP_MAX_WORKERS));
+        return;
+    }
+
     if (sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
         if (!sync_bitmap) {
             error_setg(errp, "must provide a valid bitmap name for "
@@ -555,6 +670,13 @@ void backup_start(const char *job_id, BlockDriverState *bs,
     job->sync_mode = sync_mode;
     job->sync_bitmap = sync_mode == MIRROR_SYNC_MODE_INCREMENTAL ?
                        sync_bitmap : NULL;
+    job->max_workers = max_workers;
+
+    /* If the target is backed by the source, e.g. because it is a fleecing
+     * image exported over NBD, reads from the target can fall through to the
+     * source while we are copying the old data of the same clusters.  Make
+     * our writes to the target wait for such reads, and vice versa. */
+    job->serialize_target_writes = backing_bs(target) == bs;
 
     /* If there is no backing file on the target, we cannot rely on COW if our
      * backup cluster size is smaller than the target cluster size. Even for
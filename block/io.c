@@ -1485,6 +1485,12 @@ int coroutine_fn bdrv_co_pwritev(BdrvChild *child,
      */
     tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_WRITE);
 
+    if (flags & BDRV_REQ_SERIALISING) {
+        mark_request_serialising(&req, bdrv_get_cluster_size(bs));
+        wait_serialising_requests(&req);
+        flags &= ~BDRV_REQ_SERIALISING;
+    }
+
     if (!qiov) {
         ret = bdrv_co_do_zero_pwritev(bs, offset, bytes, flags, &req);
         goto out;
@@ -189,6 +189,14 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         return ret;
     }
 
+    /* The table may reference clusters that only the dirty log covers */
+    if (c == s->l2_table_cache) {
+        ret = qcow2_dirty_log_write(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     if (c == s->refcount_block_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_REFCOUNT_BLOCK,
                 c->entries[i].offset, s->cluster_size);
@@ -796,6 +796,11 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
     /* Update L2 table. */
     if (s->use_lazy_refcounts) {
         qcow2_mark_dirty(bs);
+        ret = qcow2_dirty_log_mark(bs, m->offset >> (s->l2_bits +
+                                                     s->cluster_bits));
+        if (ret < 0) {
+            goto err;
+        }
     }
     if (qcow2_need_accurate_refcounts(s)) {
         qcow2_cache_set_dependency(bs, s->l2_table_cache,
@@ -699,6 +699,12 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         return 0;
     }
 
+    /* Refcounts are not maintained in ephemeral mode, they are only
+     * recalculated when the image is repaired */
+    if (s->ephemeral) {
+        return 0;
+    }
+
     if (decrease) {
         qcow2_cache_set_dependency(bs, s->refcount_block_cache,
             s->l2_table_cache);
@@ -813,12 +819,49 @@ int qcow2_update_cluster_refcount(BlockDriverState *bs,
 
 
 /* return < 0 if error */
+/*
+ * In ephemeral mode clusters are simply appended to the end of the image file.
+ * They are never reused and their refcounts are never updated, so the image
+ * is marked dirty: it has to be repaired before it can be used normally again.
+ */
+static int64_t alloc_clusters_ephemeral(BlockDriverState *bs, uint64_t size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t offset;
+    int ret;
+
+    ret = qcow2_mark_dirty(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (!s->ephemeral_end) {
+        int64_t file_size = bdrv_getlength(bs->file->bs);
+        if (file_size < 0) {
+            return file_size;
+        }
+        s->ephemeral_end = ROUND_UP(file_size, s->cluster_size);
+    }
+
+    offset = s->ephemeral_end;
+    if (size > INT64_MAX - offset - s->cluster_size) {
+        return -EFBIG;
+    }
+    s->ephemeral_end += size_to_clusters(s, size) << s->cluster_bits;
+
+    return offset;
+}
+
 static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t i, nb_clusters, refcount;
     int ret;
 
+    if (s->ephemeral) {
+        return alloc_clusters_ephemeral(bs, size);
+    }
+
     /* We can't allocate clusters if they may still be queued for discard. */
     if (s->cache_discards) {
         qcow2_process_discards(bs, 0);
@@ -888,6 +931,15 @@ int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
         return 0;
     }
 
+    if (s->ephemeral) {
+        /* Only the clusters right after the last allocation are free */
+        if (!s->ephemeral_end || offset != s->ephemeral_end) {
+            return 0;
+        }
+        s->ephemeral_end += nb_clusters << s->cluster_bits;
+        return nb_clusters;
+    }
+
     do {
         /* Check how many clusters there are free */
         cluster_index = offset >> s->cluster_bits;
@@ -1240,61 +1292,120 @@ fail:
 /* refcount checking functions */
 
 
-static uint64_t refcount_array_byte_size(BDRVQcow2State *s, uint64_t entries)
+/*
+ * The in-memory refcount table (IMRT) used by the checks below is an array of
+ * pointers to refblock-sized slices. A slice is only allocated once one of the
+ * clusters it covers gets a non-zero refcount, so that the memory needed for
+ * checking an image follows the number of clusters actually in use rather
+ * than the size of the image file. Every slice has the layout of an on-disk
+ * refblock and can be written out as such when rebuilding the refcount
+ * structure.
+ */
+
+static uint64_t imrt_get(BDRVQcow2State *s, void *imrt, int64_t cluster)
+{
+    void **slices = imrt;
+    void *slice = slices[cluster >> s->refcount_block_bits];
+
+    if (!slice) {
+        return 0;
+    }
+    return s->get_refcount(slice, cluster & (s->refcount_block_size - 1));
+}
+
+static int imrt_set(BDRVQcow2State *s, void *imrt, int64_t cluster,
+                    uint64_t value)
+{
+    void **slices = imrt;
+    void **slice = &slices[cluster >> s->refcount_block_bits];
+
+    if (!*slice) {
+        if (!value) {
+            return 0;
+        }
+        *slice = g_try_malloc0(s->cluster_size);
+        if (!*slice) {
+            return -ENOMEM;
+        }
+    }
+    s->set_refcount(*slice, cluster & (s->refcount_block_size - 1), value);
+    return 0;
+}
+
+/* Returns the refblock-sized slice with the given index, or NULL if all of
+ * its refcounts are zero */
+static void *imrt_slice(void *imrt, int64_t index)
+{
+    void **slices = imrt;
+
+    return slices[index];
+}
+
+static int64_t imrt_nb_slices(BDRVQcow2State *s, int64_t nb_clusters)
 {
     /* This assertion holds because there is no way we can address more than
      * 2^(64 - 9) clusters at once (with cluster size 512 = 2^9, and because
-     * offsets have to be representable in bytes); due to every cluster
-     * corresponding to one refcount entry, we are well below that limit */
-    assert(entries < (UINT64_C(1) << (64 - 9)));
-
-    /* Thanks to the assertion this will not overflow, because
-     * s->refcount_order < 7.
-     * (note: x << s->refcount_order == x * s->refcount_bits) */
-    return DIV_ROUND_UP(entries << s->refcount_order, 8);
+     * offsets have to be representable in bytes) */
+    assert(nb_clusters < (INT64_C(1) << (64 - 9)));
+
+    return DIV_ROUND_UP(nb_clusters, s->refcount_block_size);
+}
+
+/* Resets all refcounts in the IMRT to zero and frees the slices */
+static void imrt_clear(BDRVQcow2State *s, void *imrt, int64_t nb_clusters)
+{
+    void **slices = imrt;
+    int64_t i;
+
+    for (i = 0; i < imrt_nb_slices(s, nb_clusters); i++) {
+        g_free(slices[i]);
+        slices[i] = NULL;
+    }
+}
+
+static void imrt_free(BDRVQcow2State *s, void *imrt, int64_t nb_clusters)
+{
+    if (imrt) {
+        imrt_clear(s, imrt, nb_clusters);
+        g_free(imrt);
+    }
 }
 
 /**
- * Reallocates *array so that it can hold new_size entries. *size must contain
- * the current number of entries in *array. If the reallocation fails, *array
- * and *size will not be modified and -errno will be returned. If the
- * reallocation is successful, *array will be set to the new buffer, *size
- * will be set to new_size and 0 will be returned. The size of the reallocated
- * refcount array buffer will be aligned to a cluster boundary, and the newly
- * allocated area will be zeroed.
+ * Reallocates the IMRT *array so that it can hold new_size entries. *size
+ * must contain the current number of entries in *array. If the reallocation
+ * fails, *array and *size will not be modified and -errno will be returned.
+ * If the reallocation is successful, *array will be set to the new buffer,
+ * *size will be set to new_size and 0 will be returned. The refcounts of
+ * all new entries are zero.
  */
 static int realloc_refcount_array(BDRVQcow2State *s, void **array,
                                   int64_t *size, int64_t new_size)
 {
-    int64_t old_byte_size, new_byte_size;
+    int64_t old_slices, new_slices;
     void *new_ptr;
 
-    /* Round to clusters so the array can be directly written to disk */
-    old_byte_size = size_to_clusters(s, refcount_array_byte_size(s, *size))
-                    * s->cluster_size;
-    new_byte_size = size_to_clusters(s, refcount_array_byte_size(s, new_size))
-                    * s->cluster_size;
+    old_slices = imrt_nb_slices(s, *size);
+    new_slices = imrt_nb_slices(s, new_size);
 
-    if (new_byte_size == old_byte_size) {
+    if (new_slices == old_slices) {
         *size = new_size;
         return 0;
     }
 
-    assert(new_byte_size > 0);
+    assert(new_slices > old_slices);
 
-    if (new_byte_size > SIZE_MAX) {
+    if (new_slices > SIZE_MAX / sizeof(void *)) {
         return -ENOMEM;
     }
 
-    new_ptr = g_try_realloc(*array, new_byte_size);
+    new_ptr = g_try_realloc(*array, new_slices * sizeof(void *));
     if (!new_ptr) {
         return -ENOMEM;
     }
 
-    if (new_byte_size > old_byte_size) {
-        memset((char *)new_ptr + old_byte_size, 0,
-               new_byte_size - old_byte_size);
-    }
+    memset((void **)new_ptr + old_slices, 0,
+           (new_slices - old_slices) * sizeof(void *));
 
     *array = new_ptr;
     *size  = new_size;
@@ -1337,7 +1448,7 @@ static int inc_refcounts(BlockDriverState *bs,
             }
         }
 
-        refcount = s->get_refcount(*refcount_table, k);
+        refcount = imrt_get(s, *refcount_table, k);
         if (refcount == s->refcount_max) {
             fprintf(stderr, "ERROR: overflow cluster offset=0x%" PRIx64
                     "\n", cluster_offset);
@@ -1347,7 +1458,11 @@ static int inc_refcounts(BlockDriverState *bs,
             res->corruptions++;
             continue;
         }
-        s->set_refcount(*refcount_table, k, refcount + 1);
+        ret = imrt_set(s, *refcount_table, k, refcount + 1);
+        if (ret < 0) {
+            res->check_errors++;
+            return ret;
+        }
     }
 
     return 0;
@@ -1363,28 +1478,27 @@ enum {
  * referenced in the L2 table. While doing so, performs some checks on L2
  * entries.
  *
+ * The L2 table has already been read from disk by the caller; @read_ret is
+ * the result of that read.
+ *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
  */
 static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                               void **refcount_table,
-                              int64_t *refcount_table_size, int64_t l2_offset,
+                              int64_t *refcount_table_size,
+                              const uint64_t *l2_table, int read_ret,
                               int flags)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table, l2_entry;
+    uint64_t l2_entry;
     uint64_t next_contiguous_offset = 0;
-    int i, l2_size, nb_csectors, ret;
-
-    /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
-    l2_table = g_malloc(l2_size);
+    int i, nb_csectors, ret;
 
-    ret = bdrv_pread(bs->file, l2_offset, l2_table, l2_size);
-    if (ret < 0) {
+    if (read_ret < 0) {
         fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
         res->check_errors++;
-        goto fail;
+        return read_ret;
     }
 
     /* Do the actual checks */
@@ -1409,7 +1523,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
                                 l2_entry & ~511, nb_csectors * 512);
             if (ret < 0) {
-                goto fail;
+                return ret;
             }
 
             if (flags & CHECK_FRAG_INFO) {
@@ -1448,7 +1562,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
                                 offset, s->cluster_size);
             if (ret < 0) {
-                goto fail;
+                return ret;
             }
 
             /* Correct offsets are cluster aligned */
@@ -1468,12 +1582,88 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
         }
     }
 
-    g_free(l2_table);
     return 0;
+}
 
-fail:
-    g_free(l2_table);
-    return ret;
+/* Number of L2 tables that check_refcounts_l1() reads concurrently */
+#define CHECK_L2_BATCH 16
+
+typedef struct CheckL2Batch {
+    int pending;
+    /* Coroutine waiting for the batch to complete, if any */
+    Coroutine *waiter;
+} CheckL2Batch;
+
+typedef struct CheckL2Read {
+    BlockDriverState *bs;
+    int64_t offset;
+    uint64_t *l2_table;
+    int ret;
+    CheckL2Batch *batch;
+} CheckL2Read;
+
+static void coroutine_fn check_l2_read_entry(void *opaque)
+{
+    CheckL2Read *r = opaque;
+    CheckL2Batch *batch = r->batch;
+    BDRVQcow2State *s = r->bs->opaque;
+
+    r->ret = bdrv_pread(r->bs->file, r->offset, r->l2_table,
+                        s->l2_size * sizeof(uint64_t));
+
+    if (--batch->pending == 0 && batch->waiter) {
+        qemu_coroutine_enter(batch->waiter);
+    }
+}
+
+/*
+ * Reads the L2 tables referenced by @count L1 entries in parallel, using one
+ * coroutine per table. Entries that are unused are skipped.
+ *
+ * When called from coroutine context, the calling coroutine yields until the
+ * last read has completed; otherwise the AioContext is polled.
+ */
+static void check_read_l2_tables(BlockDriverState *bs, const uint64_t *l1,
+                                 int count, CheckL2Read *reads)
+{
+    CheckL2Batch batch = { 0 };
+    int i;
+
+    /* Account for all reads before starting any, so that a read completing
+     * right away cannot finish the batch early */
+    for (i = 0; i < count; i++) {
+        reads[i].ret = 0;
+        if (l1[i]) {
+            batch.pending++;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        Coroutine *co;
+
+        if (!l1[i]) {
+            continue;
+        }
+
+        reads[i].bs = bs;
+        reads[i].offset = l1[i] & L1E_OFFSET_MASK;
+        reads[i].batch = &batch;
+
+        co = qemu_coroutine_create(check_l2_read_entry, &reads[i]);
+        qemu_coroutine_enter(co);
+    }
+
+    if (qemu_in_coroutine()) {
+        if (batch.pending > 0) {
+            batch.waiter = qemu_coroutine_self();
+            qemu_coroutine_yield();
+        }
+    } else {
+        while (batch.pending > 0) {
+            aio_poll(bdrv_get_aio_context(bs), true);
+        }
+    }
+    assert(batch.pending == 0);
 }
 
 /*
@@ -1481,6 +1671,9 @@ fail:
  * clusters in the given refcount table. While doing so, performs some checks
  * on L1 and L2 entries.
  *
+ * L2 tables are read CHECK_L2_BATCH at a time so that large images are not
+ * bound by the latency of each read, but they are still checked in order.
+ *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
  */
@@ -1493,7 +1686,12 @@ static int check_refcounts_l1(BlockDriverState *bs,
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t *l1_table = NULL, l2_offset, l1_size2;
-    int i, ret;
+    CheckL2Read reads[CHECK_L2_BATCH];
+    int i, j, ret;
+
+    for (j = 0; j < CHECK_L2_BATCH; j++) {
+        reads[j].l2_table = NULL;
+    }
 
     l1_size2 = l1_size * sizeof(uint64_t);
 
@@ -1524,6 +1722,20 @@ static int check_refcounts_l1(BlockDriverState *bs,
 
     /* Do the actual checks */
     for(i = 0; i < l1_size; i++) {
+        j = i % CHECK_L2_BATCH;
+        if (j == 0) {
+            int count = MIN(l1_size - i, CHECK_L2_BATCH);
+            int k;
+
+            for (k = 0; k < count; k++) {
+                if (l1_table[i + k] && !reads[k].l2_table) {
+                    reads[k].l2_table =
+                        g_malloc(s->l2_size * sizeof(uint64_t));
+                }
+            }
+            check_read_l2_tables(bs, l1_table + i, count, reads);
+        }
+
         l2_offset = l1_table[i];
         if (l2_offset) {
             /* Mark L2 table as used */
@@ -1543,16 +1755,19 @@ static int check_refcounts_l1(BlockDriverState *bs,
 
             /* Process and check L2 entries */
             ret = check_refcounts_l2(bs, res, refcount_table,
-                                     refcount_table_size, l2_offset, flags);
+                                     refcount_table_size, reads[j].l2_table,
+                                     reads[j].ret, flags);
             if (ret < 0) {
                 goto fail;
             }
         }
     }
-    g_free(l1_table);
-    return 0;
+    ret = 0;
 
 fail:
+    for (j = 0; j < CHECK_L2_BATCH; j++) {
+        g_free(reads[j].l2_table);
+    }
     g_free(l1_table);
     return ret;
 }
@@ -1771,10 +1986,10 @@ resize_fail:
             if (ret < 0) {
                 return ret;
             }
-            if (s->get_refcount(*refcount_table, cluster) != 1) {
+            if (imrt_get(s, *refcount_table, cluster) != 1) {
                 fprintf(stderr, "ERROR refcount block %" PRId64
                         " refcount=%" PRIu64 "\n", i,
-                        s->get_refcount(*refcount_table, cluster));
+                        imrt_get(s, *refcount_table, cluster));
                 res->corruptions++;
                 *rebuild = true;
             }
@@ -1869,7 +2084,7 @@ static void compare_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
             continue;
         }
 
-        refcount2 = s->get_refcount(refcount_table, i);
+        refcount2 = imrt_get(s, refcount_table, i);
 
         if (refcount1 > 0 || refcount2 > 0) {
             *highest_cluster = i;
@@ -1945,7 +2160,7 @@ static int64_t alloc_clusters_imrt(BlockDriverState *bs,
          contiguous_free_clusters < cluster_count;
          cluster++)
     {
-        if (!s->get_refcount(*refcount_table, cluster)) {
+        if (!imrt_get(s, *refcount_table, cluster)) {
             contiguous_free_clusters++;
             if (first_gap) {
                 /* If this is the first free cluster found, update
@@ -1983,7 +2198,10 @@ static int64_t alloc_clusters_imrt(BlockDriverState *bs,
     /* Go back to the first free cluster */
     cluster -= contiguous_free_clusters;
     for (i = 0; i < cluster_count; i++) {
-        s->set_refcount(*refcount_table, cluster + i, 1);
+        ret = imrt_set(s, *refcount_table, cluster + i, 1);
+        if (ret < 0) {
+            return ret;
+        }
     }
 
     return cluster << s->cluster_bits;
@@ -2018,7 +2236,7 @@ static int rebuild_refcount_structure(BlockDriverState *bs,
 
 write_refblocks:
     for (; cluster < *nb_clusters; cluster++) {
-        if (!s->get_refcount(*refcount_table, cluster)) {
+        if (!imrt_get(s, *refcount_table, cluster)) {
             continue;
         }
 
@@ -2091,10 +2309,10 @@ write_refblocks:
             goto fail;
         }
 
-        /* The size of *refcount_table is always cluster-aligned, therefore the
-         * write operation will not overflow */
-        on_disk_refblock = (void *)((char *) *refcount_table +
-                                    refblock_index * s->cluster_size);
+        /* Each slice of the IMRT is exactly one refblock; this one exists
+         * because the refcount of cluster is not zero */
+        on_disk_refblock = imrt_slice(*refcount_table, refblock_index);
+        assert(on_disk_refblock);
 
         ret = bdrv_write(bs->file, refblock_offset / BDRV_SECTOR_SIZE,
                          on_disk_refblock, s->cluster_sectors);
@@ -2240,7 +2458,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         /* Because the old reftable has been exchanged for a new one the
          * references have to be recalculated */
         rebuild = false;
-        memset(refcount_table, 0, refcount_array_byte_size(s, nb_clusters));
+        imrt_clear(s, refcount_table, nb_clusters);
         ret = calculate_refcounts(bs, res, 0, &rebuild, &refcount_table,
                                   &nb_clusters);
         if (ret < 0) {
@@ -2300,11 +2518,146 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     ret = 0;
 
 fail:
-    g_free(refcount_table);
+    imrt_free(s, refcount_table, nb_clusters);
 
     return ret;
 }
 
+/*
+ * Makes sure that the cluster at @offset, which is referenced exactly once
+ * with QCOW_OFLAG_COPIED, has a refcount of one. Returns -EAGAIN if the image
+ * needs a full check to be repaired.
+ */
+static int check_dirty_log_cluster(BlockDriverState *bs, BdrvCheckResult *res,
+                                   uint64_t offset, int64_t nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t cluster = offset >> s->cluster_bits;
+    uint64_t refcount, reftable_index;
+    int ret;
+
+    if (offset_into_cluster(s, offset) || cluster >= nb_clusters) {
+        return -EAGAIN;
+    }
+
+    ret = qcow2_get_refcount(bs, cluster, &refcount);
+    if (ret < 0) {
+        res->check_errors++;
+        return ret;
+    }
+
+    if (refcount == 1) {
+        return 0;
+    } else if (refcount > 1) {
+        return -EAGAIN;
+    }
+
+    /* Allocating a refblock now could hand out a cluster whose reference has
+     * not been accounted for yet */
+    reftable_index = cluster >> s->refcount_block_bits;
+    if (reftable_index >= s->refcount_table_size ||
+        !(s->refcount_table[reftable_index] & REFT_OFFSET_MASK))
+    {
+        return -EAGAIN;
+    }
+
+    fprintf(stderr, "Repairing cluster %" PRId64 " refcount=0 reference=1\n",
+            cluster);
+    ret = update_refcount(bs, offset, s->cluster_size, 1, false,
+                          QCOW2_DISCARD_NEVER);
+    if (ret < 0) {
+        res->check_errors++;
+        return ret;
+    }
+    res->corruptions_fixed++;
+    return 0;
+}
+
+/*
+ * Repairs the refcounts of an image that was left dirty with lazy refcounts,
+ * looking only at the L2 tables of the L1 ranges marked in the refcount dirty
+ * log.
+ *
+ * With lazy refcounts, the refcount updates that may be missing are those for
+ * clusters that were allocated for guest writes. Such clusters are referenced
+ * by an entry with QCOW_OFLAG_COPIED, so their refcount has to be exactly one.
+ * Decrements are never written before the L2 update that drops a reference,
+ * so the only other inconsistency that can remain is leaked clusters, which
+ * are harmless and left to 'qemu-img check -r leaks'.
+ *
+ * Returns 0 on success, -EAGAIN if a full check is needed and -errno if an
+ * internal error occurred.
+ */
+int qcow2_check_dirty_log(BlockDriverState *bs, BdrvCheckResult *res)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t size, nb_clusters;
+    uint64_t bit, i, end;
+    uint64_t *l2_table;
+    int j, ret;
+
+    size = bdrv_getlength(bs->file->bs);
+    if (size < 0) {
+        res->check_errors++;
+        return size;
+    }
+    nb_clusters = size_to_clusters(s, size);
+
+    for (bit = 0; bit < s->dirty_log_bits; bit++) {
+        if (!(s->dirty_log[bit / 8] & (1 << (bit % 8)))) {
+            continue;
+        }
+
+        i = bit << s->dirty_log_granularity;
+        end = MIN((bit + 1) << s->dirty_log_granularity, s->l1_size);
+        for (; i < end; i++) {
+            uint64_t l2_offset = s->l1_table[i] & L1E_OFFSET_MASK;
+
+            if (!l2_offset || !(s->l1_table[i] & QCOW_OFLAG_COPIED)) {
+                continue;
+            }
+
+            ret = check_dirty_log_cluster(bs, res, l2_offset, nb_clusters);
+            if (ret < 0) {
+                return ret;
+            }
+
+            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
+                                  (void **)&l2_table);
+            if (ret < 0) {
+                res->check_errors++;
+                return ret;
+            }
+
+            for (j = 0; j < s->l2_size; j++) {
+                uint64_t l2_entry = be64_to_cpu(l2_table[j]);
+                uint64_t offset = l2_entry & L2E_OFFSET_MASK;
+
+                switch (qcow2_get_cluster_type(l2_entry)) {
+                case QCOW2_CLUSTER_NORMAL:
+                case QCOW2_CLUSTER_ZERO:
+                    if (!offset || !(l2_entry & QCOW_OFLAG_COPIED)) {
+                        continue;
+                    }
+                    break;
+                default:
+                    continue;
+                }
+
+                ret = check_dirty_log_cluster(bs, res, offset, nb_clusters);
+                if (ret < 0) {
+                    qcow2_cache_put(bs, s->l2_table_cache, (void **)&l2_table);
+                    return ret;
+                }
+            }
+
+            qcow2_cache_put(bs, s->l2_table_cache, (void **)&l2_table);
+        }
+    }
+
+    return 0;
+}
+
 #define overlaps_with(ofs, sz) \
     ranges_overlap(offset, size, ofs, sz)
 
@@ -63,6 +63,13 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_DIRTY_LOG 0x6472746c
+
+typedef struct {
+    uint32_t granularity;
+    uint32_t nb_bits;
+    /* followed by the bitmap */
+} QEMU_PACKED Qcow2DirtyLogExt;
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -162,6 +169,48 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_DIRTY_LOG:
+        {
+            Qcow2DirtyLogExt log_ext;
+            size_t log_size;
+
+            if (ext.len < sizeof(log_ext)) {
+                error_setg(errp, "ERROR: ext_dirty_log: Invalid size");
+                return -EINVAL;
+            }
+            ret = bdrv_pread(bs->file, offset, &log_ext, sizeof(log_ext));
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: ext_dirty_log: "
+                                 "Could not read header");
+                return ret;
+            }
+            be32_to_cpus(&log_ext.granularity);
+            be32_to_cpus(&log_ext.nb_bits);
+
+            log_size = DIV_ROUND_UP(log_ext.nb_bits, 8);
+            if (log_ext.granularity >= 32 || log_ext.nb_bits == 0 ||
+                log_size > QCOW2_DIRTY_LOG_MAX_SIZE ||
+                log_size > ext.len - sizeof(log_ext))
+            {
+                error_setg(errp, "ERROR: ext_dirty_log: Invalid log");
+                return -EINVAL;
+            }
+
+            g_free(s->dirty_log);
+            s->dirty_log = g_malloc(log_size);
+            s->dirty_log_bits = log_ext.nb_bits;
+            s->dirty_log_granularity = log_ext.granularity;
+            s->dirty_log_offset = offset + sizeof(log_ext);
+            ret = bdrv_pread(bs->file, s->dirty_log_offset, s->dirty_log,
+                             log_size);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: ext_dirty_log: "
+                                 "Could not read log");
+                return ret;
+            }
+            break;
+        }
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -264,6 +313,52 @@ int qcow2_mark_dirty(BlockDriverState *bs)
     return 0;
 }
 
+/*
+ * The refcount dirty log lets a dirty image with lazy refcounts be repaired
+ * without scanning all of its metadata. Guest writes that allocate clusters
+ * mark the part of the L1 table they update in the log. The marks are
+ * collected in memory and written and flushed before the L2 table cache
+ * writes any table, so after a crash only the L2 tables of marked L1 ranges
+ * can reference clusters with missing refcounts.
+ */
+
+static void qcow2_dirty_log_disable(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    s->use_dirty_log = false;
+    s->autoclear_features &= ~QCOW2_AUTOCLEAR_DIRTY_LOG;
+    g_free(s->dirty_log);
+    s->dirty_log = NULL;
+    s->dirty_log_pending = false;
+}
+
+/*
+ * Starts an empty log sized for the current L1 table. Only call this when
+ * the refcounts of the image are accurate; the header must be updated
+ * afterwards.
+ */
+static void qcow2_dirty_log_reset(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint32_t granularity = 0;
+    uint64_t max_bits = MIN(QCOW2_DIRTY_LOG_MAX_SIZE, s->cluster_size / 4) * 8;
+
+    while (DIV_ROUND_UP((uint64_t)s->l1_size, 1ULL << granularity) >
+           max_bits)
+    {
+        granularity++;
+    }
+
+    g_free(s->dirty_log);
+    s->dirty_log_granularity = granularity;
+    s->dirty_log_bits = MAX(DIV_ROUND_UP((uint64_t)s->l1_size,
+                                         1ULL << granularity), 1);
+    s->dirty_log = g_malloc0(DIV_ROUND_UP(s->dirty_log_bits, 8));
+    s->dirty_log_pending = false;
+    s->autoclear_features |= QCOW2_AUTOCLEAR_DIRTY_LOG;
+}
+
 /*
  * Clears the dirty bit and flushes before if necessary.  Only call this
  * function when there are no pending requests, it does not guard against
@@ -283,11 +378,151 @@ static int qcow2_mark_clean(BlockDriverState *bs)
             return ret;
         }
 
-        return qcow2_update_header(bs);
+        /* Refcounts are accurate again, start over with an empty log */
+        if (s->use_dirty_log && s->use_lazy_refcounts) {
+            qcow2_dirty_log_reset(bs);
+        }
+
+        ret = qcow2_update_header(bs);
+        if (ret == -ENOSPC && s->use_dirty_log) {
+            /* There is no room for the log in the header cluster */
+            qcow2_dirty_log_disable(bs);
+            ret = qcow2_update_header(bs);
+        }
+        return ret;
+    }
+    return 0;
+}
+
+/*
+ * Records in the refcount dirty log that the L2 table for @l1_index is about
+ * to reference clusters whose refcount may not reach the disk before it does.
+ * Must be called with s->lock held, before the L2 table is updated. The mark
+ * only reaches the image with qcow2_dirty_log_write().
+ */
+int qcow2_dirty_log_mark(BlockDriverState *bs, uint64_t l1_index)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t bit = l1_index >> s->dirty_log_granularity;
+    uint8_t *byte;
+
+    if (!(s->autoclear_features & QCOW2_AUTOCLEAR_DIRTY_LOG)) {
+        return 0;
+    }
+
+    /* The L1 table has grown beyond what the log covers */
+    if (bit >= s->dirty_log_bits) {
+        return qcow2_dirty_log_invalidate(bs);
+    }
+
+    byte = &s->dirty_log[bit / 8];
+    if (*byte & (1 << (bit % 8))) {
+        return 0;
+    }
+
+    *byte |= 1 << (bit % 8);
+    s->dirty_log_pending = true;
+    return 0;
+}
+
+/*
+ * Writes the marks collected since the last call and flushes them. The L2
+ * table cache calls this before it writes a table, so that a single write
+ * covers all the allocations that went into the cache meanwhile.
+ */
+int qcow2_dirty_log_write(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (!s->dirty_log_pending) {
+        return 0;
+    }
+    if (!(s->autoclear_features & QCOW2_AUTOCLEAR_DIRTY_LOG)) {
+        s->dirty_log_pending = false;
+        return 0;
+    }
+
+    ret = bdrv_pwrite(bs->file, s->dirty_log_offset, s->dirty_log,
+                      DIV_ROUND_UP(s->dirty_log_bits, 8));
+    if (ret >= 0) {
+        ret = bdrv_flush(bs->file->bs);
     }
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->dirty_log_pending = false;
     return 0;
 }
 
+/*
+ * Declares the refcount dirty log invalid, so that a full check is used if
+ * the image has to be repaired. This is needed before any operation that may
+ * leave refcounts inconsistent in ways the log does not track. The log is
+ * started again the next time the image is marked clean.
+ */
+int qcow2_dirty_log_invalidate(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (!(s->autoclear_features & QCOW2_AUTOCLEAR_DIRTY_LOG)) {
+        return 0;
+    }
+
+    s->autoclear_features &= ~QCOW2_AUTOCLEAR_DIRTY_LOG;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->autoclear_features |= QCOW2_AUTOCLEAR_DIRTY_LOG;
+        return ret;
+    }
+    return bdrv_flush(bs->file->bs);
+}
+
+/*
+ * Repairs a dirty image by fixing up only the refcounts covered by the log.
+ * Returns -EAGAIN if a full check is needed instead.
+ */
+static int qcow2_repair_dirty_log(BlockDriverState *bs)
+{
+    BdrvCheckResult result = {0};
+    int ret;
+
+    ret = qcow2_check_dirty_log(bs, &result);
+    if (ret < 0) {
+        return ret;
+    }
+    return qcow2_mark_clean(bs);
+}
+
+/*
+ * Starts or stops maintaining the refcount dirty log after the image has
+ * been opened for writing.
+ */
+static int qcow2_dirty_log_setup(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (!s->use_dirty_log || !s->use_lazy_refcounts || s->ephemeral ||
+        (s->incompatible_features & QCOW2_INCOMPAT_DIRTY))
+    {
+        bool had_log = s->autoclear_features & QCOW2_AUTOCLEAR_DIRTY_LOG;
+
+        qcow2_dirty_log_disable(bs);
+        return had_log ? qcow2_update_header(bs) : 0;
+    }
+
+    qcow2_dirty_log_reset(bs);
+    ret = qcow2_update_header(bs);
+    if (ret == -ENOSPC) {
+        qcow2_dirty_log_disable(bs);
+        ret = qcow2_update_header(bs);
+    }
+    return ret;
+}
+
 /*
  * Marks the image as corrupt.
  */
@@ -322,7 +557,27 @@ int qcow2_mark_consistent(BlockDriverState *bs)
 static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result,
                        BdrvCheckMode fix)
 {
-    int ret = qcow2_check_refcounts(bs, result, fix);
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (fix && s->ephemeral) {
+        /* Refcounts are not updated in ephemeral mode, so leave it while the
+         * image is repaired. The L2 tables must be on disk for the check. */
+        ret = bdrv_flush(bs);
+        if (ret < 0) {
+            return ret;
+        }
+
+        s->ephemeral = false;
+        ret = qcow2_check_refcounts(bs, result, fix);
+        s->ephemeral = true;
+
+        /* The repair may have allocated clusters at the end of the image, so
+         * look up where to append new clusters again */
+        s->ephemeral_end = 0;
+    } else {
+        ret = qcow2_check_refcounts(bs, result, fix);
+    }
     if (ret < 0) {
         return ret;
     }
@@ -372,6 +627,18 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Postpone refcount updates",
         },
+        {
+            .name = QCOW2_OPT_EPHEMERAL,
+            .type = QEMU_OPT_BOOL,
+            .help = "Never update refcounts, allocate at the end of the "
+                    "image file",
+        },
+        {
+            .name = QCOW2_OPT_DIRTY_LOG,
+            .type = QEMU_OPT_BOOL,
+            .help = "Keep a log of the regions with lazy refcounts so that "
+                    "a dirty image can be repaired quickly",
+        },
         {
             .name = QCOW2_OPT_DISCARD_REQUEST,
             .type = QEMU_OPT_BOOL,
@@ -582,6 +849,8 @@ typedef struct Qcow2ReopenState {
     Qcow2Cache *l2_table_cache;
     Qcow2Cache *refcount_block_cache;
     bool use_lazy_refcounts;
+    bool ephemeral;
+    bool use_dirty_log;
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
@@ -692,6 +961,33 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         }
     }
 
+    /* ephemeral mode; the refcounts of an image that has been used in this
+     * mode are only valid again after a repair, so it can only be chosen
+     * when the image is opened */
+    r->ephemeral = qemu_opt_get_bool(opts, QCOW2_OPT_EPHEMERAL, s->ephemeral);
+    if (r->ephemeral && s->qcow_version < 3) {
+        error_setg(errp, "Ephemeral mode requires a qcow2 image with at least "
+                   "qemu 1.1 compatibility level");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    if (s->l2_table_cache && r->ephemeral != s->ephemeral) {
+        error_setg(errp, "Ephemeral mode cannot be changed on an open image");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    /* refcount dirty log; it is set up once the image has been opened */
+    r->use_dirty_log = qemu_opt_get_bool(opts, QCOW2_OPT_DIRTY_LOG,
+                                         s->use_dirty_log);
+    if (s->l2_table_cache && r->use_dirty_log != s->use_dirty_log) {
+        error_setg(errp, "The refcount dirty log cannot be changed on an "
+                   "open image");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* Overlap check options */
     opt_overlap_check = qemu_opt_get(opts, QCOW2_OPT_OVERLAP);
     opt_overlap_check_template = qemu_opt_get(opts, QCOW2_OPT_OVERLAP_TEMPLATE);
@@ -767,6 +1063,8 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
 
     s->overlap_check = r->overlap_check;
     s->use_lazy_refcounts = r->use_lazy_refcounts;
+    s->ephemeral = r->ephemeral;
+    s->use_dirty_log = r->use_dirty_log;
 
     for (i = 0; i < QCOW2_DISCARD_MAX; i++) {
         s->discard_passthrough[i] = r->discard_passthrough[i];
@@ -1142,9 +1440,15 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    /* A log without the extension that holds it is not valid */
+    if (!s->dirty_log) {
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_DIRTY_LOG;
+    }
+
     /* Clear unknown autoclear feature bits */
-    if (!bs->read_only && !(flags & BDRV_O_INACTIVE) && s->autoclear_features) {
-        s->autoclear_features = 0;
+    if (!bs->read_only && !(flags & BDRV_O_INACTIVE) &&
+        (s->autoclear_features & ~QCOW2_AUTOCLEAR_MASK)) {
+        s->autoclear_features &= QCOW2_AUTOCLEAR_MASK;
         ret = qcow2_update_header(bs);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Could not update qcow2 header");
@@ -1155,18 +1459,34 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
 
-    /* Repair image if dirty */
+    /* Repair image if dirty. There is no point in doing so in ephemeral mode,
+     * where refcounts are not maintained anyway. */
     if (!(flags & (BDRV_O_CHECK | BDRV_O_INACTIVE)) && !bs->read_only &&
-        (s->incompatible_features & QCOW2_INCOMPAT_DIRTY)) {
+        !s->ephemeral && (s->incompatible_features & QCOW2_INCOMPAT_DIRTY)) {
         BdrvCheckResult result = {0};
 
-        ret = qcow2_check(bs, &result, BDRV_FIX_ERRORS | BDRV_FIX_LEAKS);
+        /* Only look at the regions in the refcount dirty log if possible */
+        ret = -EAGAIN;
+        if (s->autoclear_features & QCOW2_AUTOCLEAR_DIRTY_LOG) {
+            ret = qcow2_repair_dirty_log(bs);
+        }
+        if (ret == -EAGAIN) {
+            ret = qcow2_check(bs, &result, BDRV_FIX_ERRORS | BDRV_FIX_LEAKS);
+        }
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Could not repair dirty image");
             goto fail;
         }
     }
 
+    if (!bs->read_only && !(flags & BDRV_O_INACTIVE)) {
+        ret = qcow2_dirty_log_setup(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not set up refcount dirty log");
+            goto fail;
+        }
+    }
+
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
@@ -1178,6 +1498,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
  fail:
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
+    g_free(s->dirty_log);
     qcow2_free_snapshots(bs);
     qcow2_refcount_close(bs);
     qemu_vfree(s->l1_table);
@@ -1714,7 +2035,9 @@ static int qcow2_inactivate(BlockDriverState *bs)
                      strerror(-ret));
     }
 
-    if (result == 0) {
+    /* In ephemeral mode the refcounts are out of date, so the image must
+     * stay dirty until it is repaired */
+    if (result == 0 && !s->ephemeral) {
         qcow2_mark_clean(bs);
     }
 
@@ -1741,6 +2064,7 @@ static void qcow2_close(BlockDriverState *bs)
 
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
+    g_free(s->dirty_log);
 
     g_free(s->image_backing_file);
     g_free(s->image_backing_format);
@@ -1928,6 +2252,11 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
                 .name = "lazy refcounts",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+                .bit  = QCOW2_AUTOCLEAR_DIRTY_LOG_BITNR,
+                .name = "refcount dirty log",
+            },
         };
 
         ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -1939,6 +2268,28 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Refcount dirty log */
+    if (s->autoclear_features & QCOW2_AUTOCLEAR_DIRTY_LOG) {
+        size_t log_size = DIV_ROUND_UP(s->dirty_log_bits, 8);
+        Qcow2DirtyLogExt *log_ext = g_malloc(sizeof(*log_ext) + log_size);
+
+        log_ext->granularity = cpu_to_be32(s->dirty_log_granularity);
+        log_ext->nb_bits = cpu_to_be32(s->dirty_log_bits);
+        memcpy(log_ext + 1, s->dirty_log, log_size);
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_DIRTY_LOG, log_ext,
+                             sizeof(*log_ext) + log_size, buflen);
+        g_free(log_ext);
+        if (ret < 0) {
+            goto fail;
+        }
+        s->dirty_log_offset = (buf - (char *)header) + sizeof(QCowExtension) +
+                              sizeof(*log_ext);
+
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Keep unknown header extensions */
     QLIST_FOREACH(uext, &s->unknown_header_ext, next) {
         ret = header_ext_add(buf, uext->magic, uext->data, uext->len, buflen);
@@ -2826,6 +3177,10 @@ static int qcow2_make_empty(BlockDriverState *bs)
     int sector_step = INT_MAX / BDRV_SECTOR_SIZE;
     int l1_clusters, ret = 0;
 
+    if (s->ephemeral) {
+        return -ENOTSUP;
+    }
+
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / sizeof(uint64_t));
 
     if (s->qcow_version >= 3 && !s->snapshots &&
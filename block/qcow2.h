@@ -97,6 +97,11 @@
 #define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_EPHEMERAL "ephemeral"
+#define QCOW2_OPT_DIRTY_LOG "dirty-log"
+
+/* Maximum size of the refcount dirty log bitmap in bytes */
+#define QCOW2_DIRTY_LOG_MAX_SIZE 512
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -195,6 +200,14 @@ enum {
     QCOW2_COMPAT_FEAT_MASK            = QCOW2_COMPAT_LAZY_REFCOUNTS,
 };
 
+/* Autoclear feature bits */
+enum {
+    QCOW2_AUTOCLEAR_DIRTY_LOG_BITNR = 1,
+    QCOW2_AUTOCLEAR_DIRTY_LOG       = 1 << QCOW2_AUTOCLEAR_DIRTY_LOG_BITNR,
+
+    QCOW2_AUTOCLEAR_MASK            = QCOW2_AUTOCLEAR_DIRTY_LOG,
+};
+
 enum qcow2_discard_type {
     QCOW2_DISCARD_NEVER = 0,
     QCOW2_DISCARD_ALWAYS,
@@ -266,6 +279,19 @@ typedef struct BDRVQcow2State {
     int flags;
     int qcow_version;
     bool use_lazy_refcounts;
+    bool ephemeral;
+    uint64_t ephemeral_end;
+
+    /* Refcount dirty log: bit i is set if the L2 tables referenced by L1
+     * entries [i << dirty_log_granularity, (i + 1) << dirty_log_granularity)
+     * may point to clusters whose refcount has not been written yet. The log
+     * is only valid while QCOW2_AUTOCLEAR_DIRTY_LOG is set. */
+    bool use_dirty_log;
+    uint8_t *dirty_log;
+    uint32_t dirty_log_bits;
+    uint32_t dirty_log_granularity;
+    uint64_t dirty_log_offset; /* of the bitmap in the image file */
+    bool dirty_log_pending; /* marks not written to the image yet */
     int refcount_order;
     int refcount_bits;
     uint64_t refcount_max;
@@ -483,6 +509,9 @@ int qcow2_mark_dirty(BlockDriverState *bs);
 int qcow2_mark_corrupt(BlockDriverState *bs);
 int qcow2_mark_consistent(BlockDriverState *bs);
 int qcow2_update_header(BlockDriverState *bs);
+int qcow2_dirty_log_mark(BlockDriverState *bs, uint64_t l1_index);
+int qcow2_dirty_log_write(BlockDriverState *bs);
+int qcow2_dirty_log_invalidate(BlockDriverState *bs);
 
 void qcow2_signal_corruption(BlockDriverState *bs, bool fatal, int64_t offset,
                              int64_t size, const char *message_format, ...)
@@ -514,6 +543,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
 
 int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                           BdrvCheckMode fix);
+int qcow2_check_dirty_log(BlockDriverState *bs, BdrvCheckResult *res);
 
 void qcow2_process_discards(BlockDriverState *bs, int ret);
 
@@ -23,6 +23,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qapi/error.h"
 #include "sysemu/block-backend.h"
 #include "block/throttle-groups.h"
 #include "qemu/queue.h"
@@ -52,9 +53,31 @@
  * bdrv_set_aio_context()). Therefore in this file a thread will
  * access some other BlockBackend's timers only after verifying that
  * that BlockBackend has throttled requests in the queue.
+ *
+ * Groups can be nested by using THROTTLE_GROUP_SEPARATOR in their
+ * names: "tenant/vm/disk" is a child of "tenant/vm", which is in turn
+ * a child of "tenant". Parent groups are created on demand and live as
+ * long as any of their children does. The ThrottleState of a group
+ * points to the one of its parent, so a request is only allowed when
+ * none of the levels of the hierarchy is over its limits. Since the
+ * ThrottleState of the parent is shared with all its children, its
+ * lock must be taken as well when accessing it. To avoid deadlocks
+ * locks are always taken from the child to the parent.
+ *
+ * Sibling groups take turns when they are waiting for the budget of
+ * their parent: each parent keeps a queue of the children that have
+ * throttled requests, and only the child at the head of the queue
+ * (recursively, up to the root) may issue the next request. The head
+ * moves to the back of the queue after each request, so every sibling
+ * gets the same share of the parent no matter how many requests it
+ * has queued. A child that is held back by its own limits yields its
+ * turn, and a child that has to wait for its turn is parked until the
+ * queues move and give it the turn. The queues are protected by
+ * throttle_fair_lock, which is always taken last.
  */
 typedef struct ThrottleGroup {
     char *name; /* This is constant during the lifetime of the group */
+    QEMUClockType clock_type; /* This is constant as well */
 
     QemuMutex lock; /* This lock protects the following four fields */
     ThrottleState ts;
@@ -62,51 +85,171 @@ typedef struct ThrottleGroup {
     BlockBackend *tokens[2];
     bool any_timer_armed[2];
 
+    /* These are protected by throttle_fair_lock */
+    QTAILQ_HEAD(, ThrottleGroup) waiters[2]; /* children with queued I/O */
+    QTAILQ_ENTRY(ThrottleGroup) wait_entry[2];
+    unsigned waiting[2]; /* throttled requests in this group and below */
+    BlockBackend *parked[2]; /* waits for its turn to issue a request */
+
     /* These two are protected by the global throttle_groups_lock */
     unsigned refcount;
     QTAILQ_ENTRY(ThrottleGroup) list;
 } ThrottleGroup;
 
 static QemuMutex throttle_groups_lock;
+static QemuMutex throttle_fair_lock;
 static QTAILQ_HEAD(, ThrottleGroup) throttle_groups =
     QTAILQ_HEAD_INITIALIZER(throttle_groups);
 
-/* Increments the reference count of a ThrottleGroup given its name.
+/* Check that a group name is valid, i.e. that it does not contain
+ * empty components and that it does not exceed the maximum depth of
+ * the throttling hierarchy.
  *
- * If no ThrottleGroup is found with the given name a new one is
- * created.
+ * @name: the name of the ThrottleGroup
+ * @errp: error object
+ * @ret:  true if valid else false
+ */
+bool throttle_group_name_is_valid(const char *name, Error **errp)
+{
+    const char *p = name;
+    int depth = 1;
+
+    for (;;) {
+        const char *sep = strchr(p, THROTTLE_GROUP_SEPARATOR);
+        if (sep == p || *p == '\0') {
+            error_setg(errp, "Throttle group name '%s' has an empty "
+                       "component", name);
+            return false;
+        }
+        if (!sep) {
+            break;
+        }
+        p = sep + 1;
+        depth++;
+    }
+
+    if (depth > THROTTLE_MAX_DEPTH) {
+        error_setg(errp, "Throttle group '%s' is nested more than %d levels",
+                   name, THROTTLE_MAX_DEPTH);
+        return false;
+    }
+
+    return true;
+}
+
+/* Check whether a group name refers to a nested group, i.e. one that
+ * has a parent.
  *
  * @name: the name of the ThrottleGroup
- * @ret:  the ThrottleState member of the ThrottleGroup
+ * @ret:  true if the group is nested
  */
-ThrottleState *throttle_group_incref(const char *name)
+bool throttle_group_is_nested(const char *name)
 {
-    ThrottleGroup *tg = NULL;
-    ThrottleGroup *iter;
+    return strchr(name, THROTTLE_GROUP_SEPARATOR) != NULL;
+}
 
-    qemu_mutex_lock(&throttle_groups_lock);
+/* Look for a ThrottleGroup given its name.
+ *
+ * This assumes that throttle_groups_lock is held.
+ *
+ * @name: the name of the ThrottleGroup
+ * @ret:  the ThrottleGroup, or NULL if not found
+ */
+static ThrottleGroup *throttle_group_by_name(const char *name)
+{
+    ThrottleGroup *iter;
 
-    /* Look for an existing group with that name */
     QTAILQ_FOREACH(iter, &throttle_groups, list) {
         if (!strcmp(name, iter->name)) {
-            tg = iter;
-            break;
+            return iter;
         }
     }
 
+    return NULL;
+}
+
+/* Increments the reference count of a ThrottleGroup given its name,
+ * creating it (and its parents) if necessary.
+ *
+ * This assumes that throttle_groups_lock is held.
+ *
+ * @name: the name of the ThrottleGroup
+ * @ret:  the ThrottleGroup
+ */
+static ThrottleGroup *throttle_group_do_incref(const char *name)
+{
+    ThrottleGroup *tg = throttle_group_by_name(name);
+
     /* Create a new one if not found */
     if (!tg) {
+        const char *sep = strrchr(name, THROTTLE_GROUP_SEPARATOR);
+
         tg = g_new0(ThrottleGroup, 1);
         tg->name = g_strdup(name);
+        tg->clock_type = QEMU_CLOCK_REALTIME;
+        if (qtest_enabled()) {
+            /* For testing block IO throttling only */
+            tg->clock_type = QEMU_CLOCK_VIRTUAL;
+        }
         qemu_mutex_init(&tg->lock);
         throttle_init(&tg->ts);
         QLIST_INIT(&tg->head);
+        QTAILQ_INIT(&tg->waiters[0]);
+        QTAILQ_INIT(&tg->waiters[1]);
+
+        /* Nested groups hold a reference to their parent */
+        if (sep) {
+            char *parent_name = g_strndup(name, sep - name);
+            ThrottleGroup *parent = throttle_group_do_incref(parent_name);
+            throttle_set_parent(&tg->ts, &parent->ts);
+            g_free(parent_name);
+        }
 
         QTAILQ_INSERT_TAIL(&throttle_groups, tg, list);
     }
 
     tg->refcount++;
 
+    return tg;
+}
+
+/* Decrease the reference count of a ThrottleGroup, destroying it (and
+ * dropping the reference to its parent) when it reaches zero.
+ *
+ * This assumes that throttle_groups_lock is held.
+ *
+ * @tg: the ThrottleGroup to unref
+ */
+static void throttle_group_do_unref(ThrottleGroup *tg)
+{
+    if (--tg->refcount == 0) {
+        ThrottleState *parent = tg->ts.parent;
+
+        QTAILQ_REMOVE(&throttle_groups, tg, list);
+        qemu_mutex_destroy(&tg->lock);
+        g_free(tg->name);
+        g_free(tg);
+
+        if (parent) {
+            throttle_group_do_unref(container_of(parent, ThrottleGroup, ts));
+        }
+    }
+}
+
+/* Increments the reference count of a ThrottleGroup given its name.
+ *
+ * If no ThrottleGroup is found with the given name a new one is
+ * created.
+ *
+ * @name: the name of the ThrottleGroup
+ * @ret:  the ThrottleState member of the ThrottleGroup
+ */
+ThrottleState *throttle_group_incref(const char *name)
+{
+    ThrottleGroup *tg;
+
+    qemu_mutex_lock(&throttle_groups_lock);
+    tg = throttle_group_do_incref(name);
     qemu_mutex_unlock(&throttle_groups_lock);
 
     return &tg->ts;
@@ -124,15 +267,163 @@ void throttle_group_unref(ThrottleState *ts)
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
 
     qemu_mutex_lock(&throttle_groups_lock);
-    if (--tg->refcount == 0) {
-        QTAILQ_REMOVE(&throttle_groups, tg, list);
-        qemu_mutex_destroy(&tg->lock);
-        g_free(tg->name);
-        g_free(tg);
-    }
+    throttle_group_do_unref(tg);
     qemu_mutex_unlock(&throttle_groups_lock);
 }
 
+/* Lock or unlock all the ancestors of a ThrottleGroup, so that their
+ * ThrottleStates can be accessed.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tg:   the ThrottleGroup
+ * @lock: whether to lock or to unlock
+ */
+static void throttle_group_lock_parents(ThrottleGroup *tg, bool lock)
+{
+    ThrottleState *ts;
+
+    for (ts = tg->ts.parent; ts; ts = ts->parent) {
+        ThrottleGroup *parent = container_of(ts, ThrottleGroup, ts);
+        if (lock) {
+            qemu_mutex_lock(&parent->lock);
+        } else {
+            qemu_mutex_unlock(&parent->lock);
+        }
+    }
+}
+
+static ThrottleGroup *throttle_group_parent(ThrottleGroup *tg)
+{
+    return tg->ts.parent ? container_of(tg->ts.parent, ThrottleGroup, ts)
+                         : NULL;
+}
+
+/* Check whether a group may issue its next request as far as the
+ * fairness among siblings is concerned, i.e. whether no sibling at any
+ * level of the hierarchy is ahead of it. If it may not, park @blk until
+ * the group gets its turn.
+ *
+ * @tg:       the ThrottleGroup
+ * @blk:      the BlockBackend of @tg whose timer fires on the turn
+ * @is_write: the type of operation (read/write)
+ * @ret:      true if it is the turn of @tg
+ */
+static bool throttle_group_has_turn(ThrottleGroup *tg, BlockBackend *blk,
+                                    bool is_write)
+{
+    ThrottleGroup *parent, *child = tg;
+    bool ret = true;
+
+    qemu_mutex_lock(&throttle_fair_lock);
+    for (; (parent = throttle_group_parent(child)); child = parent) {
+        ThrottleGroup *head = QTAILQ_FIRST(&parent->waiters[is_write]);
+        if (head && head != child) {
+            tg->parked[is_write] = blk;
+            ret = false;
+            break;
+        }
+    }
+    qemu_mutex_unlock(&throttle_fair_lock);
+
+    return ret;
+}
+
+/* Fire the timer of every parked group that has the turn now, i.e. of
+ * the groups at the head of the queues all the way from the root of the
+ * hierarchy. Called whenever the queues change.
+ *
+ * This assumes that throttle_fair_lock is held.
+ *
+ * @tg:       a ThrottleGroup of the hierarchy
+ * @is_write: the type of operation (read/write)
+ */
+static void throttle_group_pass_turn(ThrottleGroup *tg, bool is_write)
+{
+    ThrottleGroup *parent;
+
+    while ((parent = throttle_group_parent(tg))) {
+        tg = parent;
+    }
+
+    while ((tg = QTAILQ_FIRST(&tg->waiters[is_write]))) {
+        BlockBackend *blk = tg->parked[is_write];
+        if (blk) {
+            ThrottleTimers *tt = &blk_get_public(blk)->throttle_timers;
+            tg->parked[is_write] = NULL;
+            timer_mod(tt->timers[is_write],
+                      qemu_clock_get_ns(tt->clock_type));
+        }
+    }
+}
+
+/* Queue a throttled request of a group in every level of the hierarchy.
+ *
+ * @tg:       the ThrottleGroup
+ * @is_write: the type of operation (read/write)
+ */
+static void throttle_group_wait_begin(ThrottleGroup *tg, bool is_write)
+{
+    ThrottleGroup *parent;
+
+    qemu_mutex_lock(&throttle_fair_lock);
+    for (; (parent = throttle_group_parent(tg)); tg = parent) {
+        if (tg->waiting[is_write]++ == 0) {
+            QTAILQ_INSERT_TAIL(&parent->waiters[is_write], tg,
+                               wait_entry[is_write]);
+        }
+    }
+    throttle_group_pass_turn(tg, is_write);
+    qemu_mutex_unlock(&throttle_fair_lock);
+}
+
+/* A throttled request of a group is about to be issued. Remove it from
+ * the queues and pass the turn to the next sibling at each level.
+ *
+ * @tg:       the ThrottleGroup
+ * @is_write: the type of operation (read/write)
+ */
+static void throttle_group_wait_end(ThrottleGroup *tg, bool is_write)
+{
+    ThrottleGroup *parent;
+
+    qemu_mutex_lock(&throttle_fair_lock);
+    for (; (parent = throttle_group_parent(tg)); tg = parent) {
+        QTAILQ_REMOVE(&parent->waiters[is_write], tg, wait_entry[is_write]);
+        if (--tg->waiting[is_write]) {
+            QTAILQ_INSERT_TAIL(&parent->waiters[is_write], tg,
+                               wait_entry[is_write]);
+        }
+    }
+    throttle_group_pass_turn(tg, is_write);
+    qemu_mutex_unlock(&throttle_fair_lock);
+}
+
+/* Give the turn to the next sibling at every level where a group is at
+ * the head of the queue, because it is held back by its own limits and
+ * would only stall the others.
+ *
+ * @tg:       the ThrottleGroup
+ * @is_write: the type of operation (read/write)
+ */
+static void throttle_group_yield_turn(ThrottleGroup *tg, bool is_write)
+{
+    ThrottleGroup *parent;
+
+    qemu_mutex_lock(&throttle_fair_lock);
+    for (; (parent = throttle_group_parent(tg)); tg = parent) {
+        if (tg->waiting[is_write] &&
+            QTAILQ_FIRST(&parent->waiters[is_write]) == tg) {
+            QTAILQ_REMOVE(&parent->waiters[is_write], tg,
+                          wait_entry[is_write]);
+            QTAILQ_INSERT_TAIL(&parent->waiters[is_write], tg,
+                               wait_entry[is_write]);
+        }
+    }
+    throttle_group_pass_turn(tg, is_write);
+    qemu_mutex_unlock(&throttle_fair_lock);
+}
+
 /* Get the name from a BlockBackend's ThrottleGroup. The name (and the pointer)
  * is guaranteed to remain constant during the lifetime of the group.
  *
@@ -219,7 +510,7 @@ static bool throttle_group_schedule_timer(BlockBackend *blk, bool is_write)
     ThrottleState *ts = blkp->throttle_state;
     ThrottleTimers *tt = &blkp->throttle_timers;
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
-    bool must_wait;
+    bool must_wait, own_limits = false;
 
     if (blkp->io_limits_disabled) {
         return false;
@@ -230,7 +521,21 @@ static bool throttle_group_schedule_timer(BlockBackend *blk, bool is_write)
         return true;
     }
 
+    throttle_group_lock_parents(tg, true);
     must_wait = throttle_schedule_timer(ts, tt, is_write);
+    if (must_wait && ts->parent) {
+        own_limits = throttle_own_limits_exceeded(ts, is_write);
+    }
+    throttle_group_lock_parents(tg, false);
+
+    if (ts->parent) {
+        if (own_limits) {
+            throttle_group_yield_turn(tg, is_write);
+        } else if (!must_wait && !throttle_group_has_turn(tg, blk, is_write)) {
+            /* A sibling goes first, the timer fires once it is done */
+            must_wait = true;
+        }
+    }
 
     /* If a timer just got armed, set blk as the current token */
     if (must_wait) {
@@ -306,14 +611,18 @@ void coroutine_fn throttle_group_co_io_limits_intercept(BlockBackend *blk,
     /* Wait if there's a timer set or queued requests of this type */
     if (must_wait || blkp->pending_reqs[is_write]) {
         blkp->pending_reqs[is_write]++;
+        throttle_group_wait_begin(tg, is_write);
         qemu_mutex_unlock(&tg->lock);
         qemu_co_queue_wait(&blkp->throttled_reqs[is_write]);
         qemu_mutex_lock(&tg->lock);
+        throttle_group_wait_end(tg, is_write);
         blkp->pending_reqs[is_write]--;
     }
 
     /* The I/O will be executed, so do the accounting */
+    throttle_group_lock_parents(tg, true);
     throttle_account(blkp->throttle_state, is_write, bytes);
+    throttle_group_lock_parents(tg, false);
 
     /* Schedule the next request */
     schedule_next_request(blk, is_write);
@@ -361,6 +670,47 @@ void throttle_group_config(BlockBackend *blk, ThrottleConfig *cfg)
     qemu_co_enter_next(&blkp->throttled_reqs[1]);
 }
 
+/* Update the throttle configuration of a group given its name. This
+ * also works for groups without BlockBackends of their own, like the
+ * parents of nested groups.
+ *
+ * @name: the name of the group
+ * @cfg:  the configuration to set
+ * @errp: error object
+ */
+void throttle_group_config_by_name(const char *name, ThrottleConfig *cfg,
+                                   Error **errp)
+{
+    ThrottleGroup *tg;
+    BlockBackendPublic *blkp;
+
+    qemu_mutex_lock(&throttle_groups_lock);
+    tg = throttle_group_by_name(name);
+    if (tg) {
+        tg->refcount++;
+    }
+    qemu_mutex_unlock(&throttle_groups_lock);
+
+    if (!tg) {
+        error_setg(errp, "Throttle group '%s' not found", name);
+        return;
+    }
+
+    qemu_mutex_lock(&tg->lock);
+    blkp = QLIST_FIRST(&tg->head);
+    if (!blkp) {
+        throttle_config_state(&tg->ts, tg->clock_type, cfg);
+    }
+    qemu_mutex_unlock(&tg->lock);
+
+    /* Groups with members also need to update their timers */
+    if (blkp) {
+        throttle_group_config(blk_by_public(blkp), cfg);
+    }
+
+    throttle_group_unref(&tg->ts);
+}
+
 /* Get the throttle configuration from a particular group. Similar to
  * throttle_get_config(), but guarantees atomicity within the
  * throttling group.
@@ -394,6 +744,14 @@ static void timer_cb(BlockBackend *blk, bool is_write)
     /* The timer has just been fired, so we can update the flag */
     qemu_mutex_lock(&tg->lock);
     tg->any_timer_armed[is_write] = false;
+
+    /* In nested groups the timer may have fired because it is our turn
+     * now, so the request is not necessarily allowed to run yet */
+    if (ts->parent && !qemu_co_queue_empty(&blkp->throttled_reqs[is_write]) &&
+        throttle_group_schedule_timer(blk, is_write)) {
+        qemu_mutex_unlock(&tg->lock);
+        return;
+    }
     qemu_mutex_unlock(&tg->lock);
 
     /* Run the request that was waiting for this timer */
@@ -431,12 +789,6 @@ void throttle_group_register_blk(BlockBackend *blk, const char *groupname)
     BlockBackendPublic *blkp = blk_get_public(blk);
     ThrottleState *ts = throttle_group_incref(groupname);
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
-    int clock_type = QEMU_CLOCK_REALTIME;
-
-    if (qtest_enabled()) {
-        /* For testing block IO throttling only */
-        clock_type = QEMU_CLOCK_VIRTUAL;
-    }
 
     blkp->throttle_state = ts;
 
@@ -452,7 +804,7 @@ void throttle_group_register_blk(BlockBackend *blk, const char *groupname)
 
     throttle_timers_init(&blkp->throttle_timers,
                          blk_get_aio_context(blk),
-                         clock_type,
+                         tg->clock_type,
                          read_timer_cb,
                          write_timer_cb,
                          blk);
@@ -481,6 +833,13 @@ void throttle_group_unregister_blk(BlockBackend *blk)
     assert(qemu_co_queue_empty(&blkp->throttled_reqs[1]));
 
     qemu_mutex_lock(&tg->lock);
+    qemu_mutex_lock(&throttle_fair_lock);
+    for (i = 0; i < 2; i++) {
+        if (tg->parked[i] == blk) {
+            tg->parked[i] = NULL;
+        }
+    }
+    qemu_mutex_unlock(&throttle_fair_lock);
     for (i = 0; i < 2; i++) {
         if (tg->tokens[i] == blk) {
             BlockBackend *token = throttle_group_next_blk(blk);
@@ -504,6 +863,7 @@ void throttle_group_unregister_blk(BlockBackend *blk)
 static void throttle_groups_init(void)
 {
     qemu_mutex_init(&throttle_groups_lock);
+    qemu_mutex_init(&throttle_fair_lock);
 }
 
 block_init(throttle_groups_init);
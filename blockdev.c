@@ -389,6 +389,10 @@ static void extract_common_blockdev_options(QemuOpts *opts, int *bdrv_flags,
     /* disk I/O throttling */
     if (throttling_group) {
         *throttling_group = qemu_opt_get(opts, "throttling.group");
+        if (*throttling_group &&
+            !throttle_group_name_is_valid(*throttling_group, errp)) {
+            return;
+        }
     }
 
     if (throttle_cfg) {
@@ -616,7 +620,8 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
     }
 
     /* disk I/O throttling */
-    if (throttle_enabled(&cfg)) {
+    if (throttle_enabled(&cfg) ||
+        (throttling_group && throttle_group_is_nested(throttling_group))) {
         if (!throttling_group) {
             throttling_group = id;
         }
@@ -1861,6 +1866,7 @@ static void do_drive_backup(const char *job_id, const char *device,
                             BlockdevOnError on_source_error,
                             bool has_on_target_error,
                             BlockdevOnError on_target_error,
+                            bool has_max_workers, int64_t max_workers,
                             BlockJobTxn *txn, Error **errp);
 
 static void drive_backup_prepare(BlkActionState *common, Error **errp)
@@ -1900,6 +1906,7 @@ static void drive_backup_prepare(BlkActionState *common, Error **errp)
                     backup->has_bitmap, backup->bitmap,
                     backup->has_on_source_error, backup->on_source_error,
                     backup->has_on_target_error, backup->on_target_error,
+                    backup->has_max_workers, backup->max_workers,
                     common->block_job_txn, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -1944,6 +1951,7 @@ static void do_blockdev_backup(const char *job_id, const char *device,
                                BlockdevOnError on_source_error,
                                bool has_on_target_error,
                                BlockdevOnError on_target_error,
+                               bool has_max_workers, int64_t max_workers,
                                BlockJobTxn *txn, Error **errp);
 
 static void blockdev_backup_prepare(BlkActionState *common, Error **errp)
@@ -1989,6 +1997,7 @@ static void blockdev_backup_prepare(BlkActionState *common, Error **errp)
                        backup->has_speed, backup->speed,
                        backup->has_on_source_error, backup->on_source_error,
                        backup->has_on_target_error, backup->on_target_error,
+                       backup->has_max_workers, backup->max_workers,
                        common->block_job_txn, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -2647,12 +2656,74 @@ fail:
 }
 
 /* throttling disk I/O limits */
+/* Fill a ThrottleConfig from the I/O limits given via QMP */
+static void throttle_config_from_limits(ThrottleConfig *cfg,
+                                        BlockIOThrottleLimits *limits)
+{
+    throttle_config_init(cfg);
+    cfg->buckets[THROTTLE_BPS_TOTAL].avg = limits->bps;
+    cfg->buckets[THROTTLE_BPS_READ].avg  = limits->bps_rd;
+    cfg->buckets[THROTTLE_BPS_WRITE].avg = limits->bps_wr;
+
+    cfg->buckets[THROTTLE_OPS_TOTAL].avg = limits->iops;
+    cfg->buckets[THROTTLE_OPS_READ].avg  = limits->iops_rd;
+    cfg->buckets[THROTTLE_OPS_WRITE].avg = limits->iops_wr;
+
+    if (limits->has_bps_max) {
+        cfg->buckets[THROTTLE_BPS_TOTAL].max = limits->bps_max;
+    }
+    if (limits->has_bps_rd_max) {
+        cfg->buckets[THROTTLE_BPS_READ].max = limits->bps_rd_max;
+    }
+    if (limits->has_bps_wr_max) {
+        cfg->buckets[THROTTLE_BPS_WRITE].max = limits->bps_wr_max;
+    }
+    if (limits->has_iops_max) {
+        cfg->buckets[THROTTLE_OPS_TOTAL].max = limits->iops_max;
+    }
+    if (limits->has_iops_rd_max) {
+        cfg->buckets[THROTTLE_OPS_READ].max = limits->iops_rd_max;
+    }
+    if (limits->has_iops_wr_max) {
+        cfg->buckets[THROTTLE_OPS_WRITE].max = limits->iops_wr_max;
+    }
+
+    if (limits->has_bps_max_length) {
+        cfg->buckets[THROTTLE_BPS_TOTAL].burst_length = limits->bps_max_length;
+    }
+    if (limits->has_bps_rd_max_length) {
+        cfg->buckets[THROTTLE_BPS_READ].burst_length =
+            limits->bps_rd_max_length;
+    }
+    if (limits->has_bps_wr_max_length) {
+        cfg->buckets[THROTTLE_BPS_WRITE].burst_length =
+            limits->bps_wr_max_length;
+    }
+    if (limits->has_iops_max_length) {
+        cfg->buckets[THROTTLE_OPS_TOTAL].burst_length =
+            limits->iops_max_length;
+    }
+    if (limits->has_iops_rd_max_length) {
+        cfg->buckets[THROTTLE_OPS_READ].burst_length =
+            limits->iops_rd_max_length;
+    }
+    if (limits->has_iops_wr_max_length) {
+        cfg->buckets[THROTTLE_OPS_WRITE].burst_length =
+            limits->iops_wr_max_length;
+    }
+
+    if (limits->has_iops_size) {
+        cfg->op_size = limits->iops_size;
+    }
+}
+
 void qmp_block_set_io_throttle(BlockIOThrottle *arg, Error **errp)
 {
     ThrottleConfig cfg;
     BlockDriverState *bs;
     BlockBackend *blk;
     AioContext *aio_context;
+    const char *group = NULL;
 
     blk = blk_by_name(arg->device);
     if (!blk) {
@@ -2670,62 +2741,25 @@ void qmp_block_set_io_throttle(BlockIOThrottle *arg, Error **errp)
         goto out;
     }
 
-    throttle_config_init(&cfg);
-    cfg.buckets[THROTTLE_BPS_TOTAL].avg = arg->bps;
-    cfg.buckets[THROTTLE_BPS_READ].avg  = arg->bps_rd;
-    cfg.buckets[THROTTLE_BPS_WRITE].avg = arg->bps_wr;
-
-    cfg.buckets[THROTTLE_OPS_TOTAL].avg = arg->iops;
-    cfg.buckets[THROTTLE_OPS_READ].avg  = arg->iops_rd;
-    cfg.buckets[THROTTLE_OPS_WRITE].avg = arg->iops_wr;
+    throttle_config_from_limits(&cfg, qapi_BlockIOThrottle_base(arg));
 
-    if (arg->has_bps_max) {
-        cfg.buckets[THROTTLE_BPS_TOTAL].max = arg->bps_max;
-    }
-    if (arg->has_bps_rd_max) {
-        cfg.buckets[THROTTLE_BPS_READ].max = arg->bps_rd_max;
-    }
-    if (arg->has_bps_wr_max) {
-        cfg.buckets[THROTTLE_BPS_WRITE].max = arg->bps_wr_max;
-    }
-    if (arg->has_iops_max) {
-        cfg.buckets[THROTTLE_OPS_TOTAL].max = arg->iops_max;
-    }
-    if (arg->has_iops_rd_max) {
-        cfg.buckets[THROTTLE_OPS_READ].max = arg->iops_rd_max;
-    }
-    if (arg->has_iops_wr_max) {
-        cfg.buckets[THROTTLE_OPS_WRITE].max = arg->iops_wr_max;
-    }
-
-    if (arg->has_bps_max_length) {
-        cfg.buckets[THROTTLE_BPS_TOTAL].burst_length = arg->bps_max_length;
-    }
-    if (arg->has_bps_rd_max_length) {
-        cfg.buckets[THROTTLE_BPS_READ].burst_length = arg->bps_rd_max_length;
-    }
-    if (arg->has_bps_wr_max_length) {
-        cfg.buckets[THROTTLE_BPS_WRITE].burst_length = arg->bps_wr_max_length;
-    }
-    if (arg->has_iops_max_length) {
-        cfg.buckets[THROTTLE_OPS_TOTAL].burst_length = arg->iops_max_length;
-    }
-    if (arg->has_iops_rd_max_length) {
-        cfg.buckets[THROTTLE_OPS_READ].burst_length = arg->iops_rd_max_length;
-    }
-    if (arg->has_iops_wr_max_length) {
-        cfg.buckets[THROTTLE_OPS_WRITE].burst_length = arg->iops_wr_max_length;
+    if (!throttle_is_valid(&cfg, errp)) {
+        goto out;
     }
 
-    if (arg->has_iops_size) {
-        cfg.op_size = arg->iops_size;
+    if (arg->has_group && !throttle_group_name_is_valid(arg->group, errp)) {
+        goto out;
     }
 
-    if (!throttle_is_valid(&cfg, errp)) {
-        goto out;
+    if (arg->has_group) {
+        group = arg->group;
+    } else if (blk_get_public(blk)->throttle_state) {
+        group = throttle_group_get_name(blk);
     }
 
-    if (throttle_enabled(&cfg)) {
+    /* A device in a nested group stays in it even without limits of
+     * its own, otherwise its I/O would escape the limits of the parents */
+    if (throttle_enabled(&cfg) || (group && throttle_group_is_nested(group))) {
         /* Enable I/O limits if they're not enabled yet, otherwise
          * just update the throttling group. */
         if (!blk_get_public(blk)->throttle_state) {
@@ -2745,6 +2779,21 @@ out:
     aio_context_release(aio_context);
 }
 
+void qmp_block_set_group_io_throttle(const char *group,
+                                     BlockIOThrottleLimits *limits,
+                                     Error **errp)
+{
+    ThrottleConfig cfg;
+
+    throttle_config_from_limits(&cfg, limits);
+
+    if (!throttle_is_valid(&cfg, errp)) {
+        return;
+    }
+
+    throttle_group_config_by_name(group, &cfg, errp);
+}
+
 void qmp_block_dirty_bitmap_add(const char *node, const char *name,
                                 bool has_granularity, uint32_t granularity,
                                 Error **errp)
@@ -3178,6 +3227,7 @@ static void do_drive_backup(const char *job_id, const char *device,
                             BlockdevOnError on_source_error,
                             bool has_on_target_error,
                             BlockdevOnError on_target_error,
+                            bool has_max_workers, int64_t max_workers,
                             BlockJobTxn *txn, Error **errp)
 {
     BlockBackend *blk;
@@ -3194,6 +3244,9 @@ static void do_drive_backup(const char *job_id, const char *device,
     if (!has_speed) {
         speed = 0;
     }
+    if (!has_max_workers) {
+        max_workers = 1;
+    }
     if (!has_on_source_error) {
         on_source_error = BLOCKDEV_ON_ERROR_REPORT;
     }
@@ -3290,7 +3343,7 @@ static void do_drive_backup(const char *job_id, const char *device,
     }
 
     backup_start(job_id, bs, target_bs, speed, sync, bmap,
-                 on_source_error, on_target_error,
+                 on_source_error, on_target_error, max_workers,
                  block_job_cb, bs, txn, &local_err);
     bdrv_unref(target_bs);
     if (local_err != NULL) {
@@ -3311,6 +3364,7 @@ void qmp_drive_backup(bool has_job_id, const char *job_id,
                       bool has_bitmap, const char *bitmap,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
+                      bool has_max_workers, int64_t max_workers,
                       Error **errp)
 {
     return do_drive_backup(has_job_id ? job_id : NULL, device, target,
@@ -3319,6 +3373,7 @@ void qmp_drive_backup(bool has_job_id, const char *job_id,
                            has_bitmap, bitmap,
                            has_on_source_error, on_source_error,
                            has_on_target_error, on_target_error,
+                           has_max_workers, max_workers,
                            NULL, errp);
 }
 
@@ -3334,6 +3389,7 @@ void do_blockdev_backup(const char *job_id, const char *device,
                          BlockdevOnError on_source_error,
                          bool has_on_target_error,
                          BlockdevOnError on_target_error,
+                         bool has_max_workers, int64_t max_workers,
                          BlockJobTxn *txn, Error **errp)
 {
     BlockBackend *blk;
@@ -3345,6 +3401,9 @@ void do_blockdev_backup(const char *job_id, const char *device,
     if (!has_speed) {
         speed = 0;
     }
+    if (!has_max_workers) {
+        max_workers = 1;
+    }
     if (!has_on_source_error) {
         on_source_error = BLOCKDEV_ON_ERROR_REPORT;
     }
@@ -3384,7 +3443,8 @@ void do_blockdev_backup(const char *job_id, const char *device,
         }
     }
     backup_start(job_id, bs, target_bs, speed, sync, NULL, on_source_error,
-                 on_target_error, block_job_cb, bs, txn, &local_err);
+                 on_target_error, max_workers, block_job_cb, bs, txn,
+                 &local_err);
     if (local_err != NULL) {
         error_propagate(errp, local_err);
     }
@@ -3400,12 +3460,14 @@ void qmp_blockdev_backup(bool has_job_id, const char *job_id,
                          BlockdevOnError on_source_error,
                          bool has_on_target_error,
                          BlockdevOnError on_target_error,
+                         bool has_max_workers, int64_t max_workers,
                          Error **errp)
 {
     do_blockdev_backup(has_job_id ? job_id : NULL, device, target,
                        sync, has_speed, speed,
                        has_on_source_error, on_source_error,
                        has_on_target_error, on_target_error,
+                       has_max_workers, max_workers,
                        NULL, errp);
 }
 
@@ -0,0 +1,1253 @@
+/*
+ * vhost-user-blk reference backend
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Serves a disk image to a vhost-user-blk device in QEMU.  The image is
+ * accessed through QEMU's block layer, so any format and protocol that
+ * qemu-img supports can be used, and the process can be scheduled,
+ * confined and restarted independently of the virtual machine.
+ *
+ * Only one vhost-user master is served at a time.  When it goes away the
+ * backend keeps listening, so that a QEMU started with reconnect=N on its
+ * chardev picks up where it left off.  Dirty page logging is not
+ * implemented, hence QEMU blocks migration while using this backend.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu-common.h"
+#include "qemu/cutils.h"
+#include "qemu/iov.h"
+#include "qemu/bswap.h"
+#include "qemu/atomic.h"
+#include "qemu/sockets.h"
+#include "qemu/main-loop.h"
+#include "qemu/error-report.h"
+#include "qemu/config-file.h"
+#include "qemu/log.h"
+#include "qapi/qmp/qstring.h"
+#include "sysemu/block-backend.h"
+#include "block/block.h"
+#include "crypto/init.h"
+#include "trace/control.h"
+#include "standard-headers/linux/virtio_ring.h"
+#include "standard-headers/linux/virtio_blk.h"
+#include "standard-headers/linux/virtio_config.h"
+
+#include <getopt.h>
+#include <sys/socket.h>
+#include <linux/vhost.h>
+
+#define VUB_OPT_CACHE           256
+#define VUB_OPT_AIO             257
+#define VUB_OPT_SERIAL          258
+
+#define VUB_MAX_QUEUES          16
+#define VUB_MAX_QUEUE_SIZE      1024
+#define VUB_SEG_MAX             126
+/* room for VUB_SEG_MAX segments that each cross one memory region boundary */
+#define VUB_MAX_IOV             (2 * VUB_SEG_MAX + 4)
+
+#define VHOST_MEMORY_MAX_NREGIONS       8
+#define VHOST_USER_MAX_CONFIG_SIZE      256
+
+#define VHOST_USER_F_PROTOCOL_FEATURES  30
+
+#define VHOST_USER_PROTOCOL_F_MQ        0
+#define VHOST_USER_PROTOCOL_F_REPLY_ACK 3
+#define VHOST_USER_PROTOCOL_F_CONFIG    4
+
+typedef enum VhostUserRequest {
+    VHOST_USER_NONE = 0,
+    VHOST_USER_GET_FEATURES = 1,
+    VHOST_USER_SET_FEATURES = 2,
+    VHOST_USER_SET_OWNER = 3,
+    VHOST_USER_RESET_OWNER = 4,
+    VHOST_USER_SET_MEM_TABLE = 5,
+    VHOST_USER_SET_LOG_BASE = 6,
+    VHOST_USER_SET_LOG_FD = 7,
+    VHOST_USER_SET_VRING_NUM = 8,
+    VHOST_USER_SET_VRING_ADDR = 9,
+    VHOST_USER_SET_VRING_BASE = 10,
+    VHOST_USER_GET_VRING_BASE = 11,
+    VHOST_USER_SET_VRING_KICK = 12,
+    VHOST_USER_SET_VRING_CALL = 13,
+    VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+    VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+    VHOST_USER_GET_QUEUE_NUM = 17,
+    VHOST_USER_SET_VRING_ENABLE = 18,
+    VHOST_USER_SEND_RARP = 19,
+    VHOST_USER_GET_CONFIG = 20,
+    VHOST_USER_SET_CONFIG = 21,
+    VHOST_USER_MAX
+} VhostUserRequest;
+
+typedef struct VhostUserMemoryRegion {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr;
+    uint64_t mmap_offset;
+} VhostUserMemoryRegion;
+
+typedef struct VhostUserMemory {
+    uint32_t nregions;
+    uint32_t padding;
+    VhostUserMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
+} VhostUserMemory;
+
+typedef struct VhostUserConfig {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t flags;
+    uint8_t region[VHOST_USER_MAX_CONFIG_SIZE];
+} VhostUserConfig;
+
+#define VHOST_USER_CONFIG_HDR_SIZE offsetof(VhostUserConfig, region)
+
+typedef struct VhostUserMsg {
+    VhostUserRequest request;
+
+#define VHOST_USER_VERSION_MASK     (0x3)
+#define VHOST_USER_REPLY_MASK       (0x1 << 2)
+#define VHOST_USER_NEED_REPLY_MASK  (0x1 << 3)
+    uint32_t flags;
+    uint32_t size; /* the following payload size */
+    union {
+#define VHOST_USER_VRING_IDX_MASK   (0xff)
+#define VHOST_USER_VRING_NOFD_MASK  (0x1 << 8)
+        uint64_t u64;
+        struct vhost_vring_state state;
+        struct vhost_vring_addr addr;
+        VhostUserMemory memory;
+        VhostUserConfig config;
+    } payload;
+    int fds[VHOST_MEMORY_MAX_NREGIONS];
+    int fd_num;
+} QEMU_PACKED VhostUserMsg;
+
+#define VHOST_USER_HDR_SIZE offsetof(VhostUserMsg, payload.u64)
+
+/* The version of the protocol we support */
+#define VHOST_USER_VERSION    (0x1)
+
+typedef struct VubRegion {
+    uint64_t gpa;
+    uint64_t size;
+    uint64_t qva;
+    uint64_t mmap_offset;
+    uint8_t *mmap_addr;
+} VubRegion;
+
+typedef struct VubDev VubDev;
+
+typedef struct VubVirtqueue {
+    VubDev *dev;
+    unsigned int size;
+    uint16_t last_avail_idx;
+    uint16_t used_idx;
+    struct vhost_vring_addr addr;
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    struct vring_used *used;
+    int kick_fd;
+    int call_fd;
+    bool started;
+    bool enabled;
+    bool broken;
+    unsigned int inflight;
+} VubVirtqueue;
+
+struct VubDev {
+    BlockBackend *blk;
+    const char *serial;
+    bool read_only;
+    int num_queues;
+
+    int listen_fd;
+    int sock;
+    uint64_t features;
+    uint64_t protocol_features;
+    unsigned int nregions;
+    VubRegion regions[VHOST_MEMORY_MAX_NREGIONS];
+    VubVirtqueue vqs[VUB_MAX_QUEUES];
+};
+
+typedef struct VubReq {
+    VubVirtqueue *vq;
+    uint16_t head;
+    struct virtio_blk_outhdr hdr;
+    uint8_t *status;
+    size_t in_len;
+    unsigned int out_num;
+    unsigned int in_num;
+    struct iovec out_iov[VUB_MAX_IOV];
+    struct iovec in_iov[VUB_MAX_IOV];
+    QEMUIOVector qiov;
+} VubReq;
+
+static enum { RUNNING, TERMINATE } state;
+
+static void termsig_handler(int signum)
+{
+    atomic_set(&state, TERMINATE);
+    qemu_notify_event();
+}
+
+static bool vub_has_feature(VubDev *dev, unsigned int fbit)
+{
+    return !!(dev->features & (1ULL << fbit));
+}
+
+/*
+ * Legacy guests use their native byte order for the rings; this backend
+ * runs on the same host as QEMU, so that is also ours.
+ */
+static uint16_t vub_lduw(VubDev *dev, const void *ptr)
+{
+    return vub_has_feature(dev, VIRTIO_F_VERSION_1) ?
+        lduw_le_p(ptr) : lduw_he_p(ptr);
+}
+
+static uint32_t vub_ldl(VubDev *dev, const void *ptr)
+{
+    return vub_has_feature(dev, VIRTIO_F_VERSION_1) ?
+        ldl_le_p(ptr) : ldl_he_p(ptr);
+}
+
+static uint64_t vub_ldq(VubDev *dev, const void *ptr)
+{
+    return vub_has_feature(dev, VIRTIO_F_VERSION_1) ?
+        ldq_le_p(ptr) : ldq_he_p(ptr);
+}
+
+static void vub_stw(VubDev *dev, void *ptr, uint16_t v)
+{
+    if (vub_has_feature(dev, VIRTIO_F_VERSION_1)) {
+        stw_le_p(ptr, v);
+    } else {
+        stw_he_p(ptr, v);
+    }
+}
+
+static void vub_stl(VubDev *dev, void *ptr, uint32_t v)
+{
+    if (vub_has_feature(dev, VIRTIO_F_VERSION_1)) {
+        stl_le_p(ptr, v);
+    } else {
+        stl_he_p(ptr, v);
+    }
+}
+
+/* Translate a guest physical address, clamping *len to the region */
+static void *vub_gpa_to_va(VubDev *dev, uint64_t gpa, uint64_t *len)
+{
+    unsigned int i;
+
+    for (i = 0; i < dev->nregions; i++) {
+        VubRegion *r = &dev->regions[i];
+
+        if (gpa >= r->gpa && gpa - r->gpa < r->size) {
+            *len = MIN(*len, r->size - (gpa - r->gpa));
+            return r->mmap_addr + r->mmap_offset + (gpa - r->gpa);
+        }
+    }
+
+    return NULL;
+}
+
+/* Translate an address in QEMU's address space, used for the rings */
+static void *vub_qva_to_va(VubDev *dev, uint64_t qva, uint64_t len)
+{
+    unsigned int i;
+
+    for (i = 0; i < dev->nregions; i++) {
+        VubRegion *r = &dev->regions[i];
+
+        if (qva >= r->qva && qva - r->qva < r->size &&
+            len <= r->size - (qva - r->qva)) {
+            return r->mmap_addr + r->mmap_offset + (qva - r->qva);
+        }
+    }
+
+    return NULL;
+}
+
+static void vub_unmap_regions(VubDev *dev)
+{
+    unsigned int i;
+
+    for (i = 0; i < dev->nregions; i++) {
+        VubRegion *r = &dev->regions[i];
+
+        munmap(r->mmap_addr, r->size + r->mmap_offset);
+    }
+    dev->nregions = 0;
+}
+
+static bool vub_map_ring(VubVirtqueue *vq)
+{
+    VubDev *dev = vq->dev;
+
+    vq->desc = vub_qva_to_va(dev, vq->addr.desc_user_addr,
+                             vq->size * sizeof(struct vring_desc));
+    vq->avail = vub_qva_to_va(dev, vq->addr.avail_user_addr,
+                              offsetof(struct vring_avail, ring) +
+                              vq->size * sizeof(uint16_t));
+    vq->used = vub_qva_to_va(dev, vq->addr.used_user_addr,
+                             offsetof(struct vring_used, ring) +
+                             vq->size * sizeof(struct vring_used_elem));
+
+    return vq->desc && vq->avail && vq->used;
+}
+
+static void vub_notify(VubVirtqueue *vq)
+{
+    VubDev *dev = vq->dev;
+    uint64_t one = 1;
+
+    /* make the used index visible before reading the guest's flags */
+    smp_mb();
+    if (vq->call_fd < 0 ||
+        (vub_lduw(dev, &vq->avail->flags) & VRING_AVAIL_F_NO_INTERRUPT)) {
+        return;
+    }
+
+    if (write(vq->call_fd, &one, sizeof(one)) != sizeof(one)) {
+        error_report("failed to signal queue %td: %s",
+                     vq - dev->vqs, strerror(errno));
+    }
+}
+
+static void vub_req_complete(VubReq *req, uint8_t status)
+{
+    VubVirtqueue *vq = req->vq;
+    VubDev *dev = vq->dev;
+    struct vring_used_elem *elem;
+
+    *req->status = status;
+
+    elem = &vq->used->ring[vq->used_idx % vq->size];
+    vub_stl(dev, &elem->id, req->head);
+    vub_stl(dev, &elem->len, req->in_len);
+    /* the element must be visible before the index that exposes it */
+    smp_wmb();
+    vq->used_idx++;
+    vub_stw(dev, &vq->used->idx, vq->used_idx);
+
+    vq->inflight--;
+    vub_notify(vq);
+    g_free(req);
+}
+
+static void vub_rw_complete(void *opaque, int ret)
+{
+    VubReq *req = opaque;
+
+    if (ret < 0) {
+        error_report("I/O error on queue %td: %s",
+                     req->vq - req->vq->dev->vqs, strerror(-ret));
+    }
+    vub_req_complete(req, ret < 0 ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK);
+}
+
+static bool vub_map_desc(VubDev *dev, struct iovec *iov, unsigned int *num,
+                         uint64_t gpa, uint32_t len)
+{
+    while (len) {
+        uint64_t chunk = len;
+        void *ptr;
+
+        if (*num == VUB_MAX_IOV) {
+            error_report("too many segments in request");
+            return false;
+        }
+
+        ptr = vub_gpa_to_va(dev, gpa, &chunk);
+        if (!ptr) {
+            error_report("invalid guest address 0x%" PRIx64, gpa);
+            return false;
+        }
+
+        iov[*num].iov_base = ptr;
+        iov[*num].iov_len = chunk;
+        (*num)++;
+        gpa += chunk;
+        len -= chunk;
+    }
+
+    return true;
+}
+
+/*
+ * Take the next request off the avail ring.  Malformed descriptor chains
+ * are a guest bug; mark the queue as broken instead of guessing.
+ */
+static VubReq *vub_queue_pop(VubVirtqueue *vq)
+{
+    VubDev *dev = vq->dev;
+    struct vring_desc *desc = vq->desc;
+    unsigned int max = vq->size;
+    unsigned int i, count = 0;
+    uint16_t avail_idx, flags;
+    VubReq *req;
+
+    avail_idx = vub_lduw(dev, &vq->avail->idx);
+    if (avail_idx == vq->last_avail_idx) {
+        return NULL;
+    }
+    if ((uint16_t)(avail_idx - vq->last_avail_idx) > vq->size) {
+        error_report("guest moved avail index from %u to %u",
+                     vq->last_avail_idx, avail_idx);
+        goto broken;
+    }
+
+    /* read the ring entry only after seeing the index */
+    smp_rmb();
+
+    req = g_new(VubReq, 1);
+    req->vq = vq;
+    req->head = vub_lduw(dev,
+                         &vq->avail->ring[vq->last_avail_idx % vq->size]);
+    req->in_len = 0;
+    req->out_num = 0;
+    req->in_num = 0;
+
+    if (req->head >= vq->size) {
+        error_report("invalid descriptor head %u", req->head);
+        goto err;
+    }
+
+    i = req->head;
+    if (vub_lduw(dev, &desc[i].flags) & VRING_DESC_F_INDIRECT) {
+        uint32_t len = vub_ldl(dev, &desc[i].len);
+        uint64_t maplen = len;
+
+        if (!len || len % sizeof(struct vring_desc)) {
+            error_report("invalid size for indirect buffer table");
+            goto err;
+        }
+        desc = vub_gpa_to_va(dev, vub_ldq(dev, &desc[i].addr), &maplen);
+        if (!desc || maplen != len) {
+            error_report("indirect buffer table is not contiguous");
+            goto err;
+        }
+        max = len / sizeof(struct vring_desc);
+        i = 0;
+    }
+
+    for (;;) {
+        uint64_t addr;
+        uint32_t len;
+
+        if (i >= max || ++count > max) {
+            error_report("looped or invalid descriptor chain");
+            goto err;
+        }
+
+        addr = vub_ldq(dev, &desc[i].addr);
+        len = vub_ldl(dev, &desc[i].len);
+        flags = vub_lduw(dev, &desc[i].flags);
+
+        if (flags & VRING_DESC_F_WRITE) {
+            if (!vub_map_desc(dev, req->in_iov, &req->in_num, addr, len)) {
+                goto err;
+            }
+            req->in_len += len;
+        } else {
+            if (req->in_num) {
+                error_report("descriptor has out after in buffers");
+                goto err;
+            }
+            if (!vub_map_desc(dev, req->out_iov, &req->out_num, addr, len)) {
+                goto err;
+            }
+        }
+
+        if (!(flags & VRING_DESC_F_NEXT)) {
+            break;
+        }
+        i = vub_lduw(dev, &desc[i].next);
+    }
+
+    vq->last_avail_idx++;
+    return req;
+
+err:
+    g_free(req);
+broken:
+    vq->broken = true;
+    return NULL;
+}
+
+static bool vub_req_in_range(VubDev *dev, uint64_t sector, size_t size)
+{
+    int64_t length = blk_getlength(dev->blk);
+    uint64_t nb_sectors = size >> BDRV_SECTOR_BITS;
+
+    if (length < 0 || size & (BDRV_SECTOR_SIZE - 1)) {
+        return false;
+    }
+    length >>= BDRV_SECTOR_BITS;
+
+    return sector <= length && nb_sectors <= length - sector;
+}
+
+static void vub_handle_req(VubReq *req)
+{
+    VubDev *dev = req->vq->dev;
+    struct iovec *out_iov = req->out_iov;
+    unsigned int out_num = req->out_num;
+    struct iovec *status_iov;
+    uint64_t sector;
+    uint32_t type;
+
+    if (iov_to_buf(out_iov, out_num, 0, &req->hdr, sizeof(req->hdr)) !=
+        sizeof(req->hdr)) {
+        error_report("request header is missing");
+        goto broken;
+    }
+    iov_discard_front(&out_iov, &out_num, sizeof(req->hdr));
+
+    if (!req->in_num) {
+        error_report("request status is missing");
+        goto broken;
+    }
+    status_iov = &req->in_iov[req->in_num - 1];
+    req->status = (uint8_t *)status_iov->iov_base + status_iov->iov_len - 1;
+    iov_discard_back(req->in_iov, &req->in_num, 1);
+
+    type = vub_ldl(dev, &req->hdr.type);
+    sector = vub_ldq(dev, &req->hdr.sector);
+
+    switch (type & ~VIRTIO_BLK_T_BARRIER) {
+    case VIRTIO_BLK_T_IN:
+    case VIRTIO_BLK_T_OUT: {
+        bool is_write = type & VIRTIO_BLK_T_OUT;
+
+        if (is_write) {
+            qemu_iovec_init_external(&req->qiov, out_iov, out_num);
+        } else {
+            qemu_iovec_init_external(&req->qiov, req->in_iov, req->in_num);
+        }
+
+        if ((is_write && dev->read_only) ||
+            !vub_req_in_range(dev, sector, req->qiov.size)) {
+            vub_req_complete(req, VIRTIO_BLK_S_IOERR);
+            return;
+        }
+
+        if (is_write) {
+            blk_aio_pwritev(dev->blk, sector << BDRV_SECTOR_BITS, &req->qiov,
+                            0, vub_rw_complete, req);
+        } else {
+            blk_aio_preadv(dev->blk, sector << BDRV_SECTOR_BITS, &req->qiov,
+                           0, vub_rw_complete, req);
+        }
+        return;
+    }
+    case VIRTIO_BLK_T_FLUSH:
+        blk_aio_flush(dev->blk, vub_rw_complete, req);
+        return;
+    case VIRTIO_BLK_T_GET_ID:
+        iov_from_buf(req->in_iov, req->in_num, 0, dev->serial,
+                     MIN(strlen(dev->serial), VIRTIO_BLK_ID_BYTES));
+        vub_req_complete(req, VIRTIO_BLK_S_OK);
+        return;
+    default:
+        vub_req_complete(req, VIRTIO_BLK_S_UNSUPP);
+        return;
+    }
+
+broken:
+    /* the buffer is lost to the guest, like with any broken queue */
+    req->vq->broken = true;
+    req->vq->inflight--;
+    g_free(req);
+}
+
+static void vub_process_vq(VubVirtqueue *vq)
+{
+    VubDev *dev = vq->dev;
+    VubReq *req;
+
+    if (!vq->started || !vq->enabled || vq->broken) {
+        return;
+    }
+
+    blk_io_plug(dev->blk);
+    while (!vq->broken && (req = vub_queue_pop(vq))) {
+        vq->inflight++;
+        vub_handle_req(req);
+    }
+    blk_io_unplug(dev->blk);
+}
+
+static void vub_kick_cb(void *opaque)
+{
+    VubVirtqueue *vq = opaque;
+    uint64_t v;
+
+    if (read(vq->kick_fd, &v, sizeof(v)) < 0 && errno != EAGAIN) {
+        error_report("failed to read kick eventfd: %s", strerror(errno));
+        return;
+    }
+
+    vub_process_vq(vq);
+}
+
+static void vub_vq_stop(VubVirtqueue *vq)
+{
+    if (vq->kick_fd >= 0) {
+        qemu_set_fd_handler(vq->kick_fd, NULL, NULL, NULL);
+        close(vq->kick_fd);
+        vq->kick_fd = -1;
+    }
+    vq->started = false;
+}
+
+static void vub_vq_reset(VubVirtqueue *vq)
+{
+    vub_vq_stop(vq);
+    if (vq->call_fd >= 0) {
+        close(vq->call_fd);
+        vq->call_fd = -1;
+    }
+    vq->size = 0;
+    vq->last_avail_idx = 0;
+    vq->used_idx = 0;
+    vq->desc = NULL;
+    vq->avail = NULL;
+    vq->used = NULL;
+    vq->enabled = false;
+    vq->broken = false;
+}
+
+static void vub_close_fds(VhostUserMsg *vmsg)
+{
+    int i;
+
+    for (i = 0; i < vmsg->fd_num; i++) {
+        close(vmsg->fds[i]);
+    }
+}
+
+static VubVirtqueue *vub_get_vq(VubDev *dev, unsigned int index)
+{
+    if (index >= dev->num_queues) {
+        error_report("invalid queue index %u", index);
+        return NULL;
+    }
+    return &dev->vqs[index];
+}
+
+static bool vub_set_mem_table(VubDev *dev, VhostUserMsg *vmsg)
+{
+    VhostUserMemory *memory = &vmsg->payload.memory;
+    unsigned int i;
+
+    if (memory->nregions > VHOST_MEMORY_MAX_NREGIONS ||
+        memory->nregions != vmsg->fd_num) {
+        error_report("invalid memory table");
+        vub_close_fds(vmsg);
+        return false;
+    }
+
+    /* requests in flight may point into the old mappings */
+    blk_drain(dev->blk);
+    vub_unmap_regions(dev);
+
+    for (i = 0; i < memory->nregions; i++) {
+        VhostUserMemoryRegion *msg_region = &memory->regions[i];
+        VubRegion *r = &dev->regions[i];
+        void *addr;
+
+        addr = mmap(NULL, msg_region->memory_size + msg_region->mmap_offset,
+                    PROT_READ | PROT_WRITE, MAP_SHARED, vmsg->fds[i], 0);
+        close(vmsg->fds[i]);
+        if (addr == MAP_FAILED) {
+            error_report("failed to map guest memory: %s", strerror(errno));
+            for (i++; i < memory->nregions; i++) {
+                close(vmsg->fds[i]);
+            }
+            vub_unmap_regions(dev);
+            return false;
+        }
+
+        r->gpa = msg_region->guest_phys_addr;
+        r->size = msg_region->memory_size;
+        r->qva = msg_region->userspace_addr;
+        r->mmap_offset = msg_region->mmap_offset;
+        r->mmap_addr = addr;
+        dev->nregions++;
+    }
+
+    /* memory hotplug moves rings that are already running */
+    for (i = 0; i < dev->num_queues; i++) {
+        VubVirtqueue *vq = &dev->vqs[i];
+
+        if (vq->desc && !vub_map_ring(vq)) {
+            error_report("queue %u is not in guest memory anymore", i);
+            vq->broken = true;
+        }
+    }
+
+    return true;
+}
+
+static void vub_fill_config(VubDev *dev, struct virtio_blk_config *blkcfg)
+{
+    int64_t length = blk_getlength(dev->blk);
+
+    memset(blkcfg, 0, sizeof(*blkcfg));
+    stq_le_p(&blkcfg->capacity,
+             length < 0 ? 0 : length >> BDRV_SECTOR_BITS);
+    stl_le_p(&blkcfg->seg_max, VUB_SEG_MAX);
+    stl_le_p(&blkcfg->blk_size, BDRV_SECTOR_SIZE);
+    blkcfg->wce = blk_enable_write_cache(dev->blk);
+    stw_le_p(&blkcfg->num_queues, dev->num_queues);
+}
+
+static uint64_t vub_get_features(VubDev *dev)
+{
+    uint64_t features = (1ULL << VIRTIO_BLK_F_SEG_MAX) |
+                        (1ULL << VIRTIO_BLK_F_BLK_SIZE) |
+                        (1ULL << VIRTIO_BLK_F_FLUSH) |
+                        (1ULL << VIRTIO_BLK_F_CONFIG_WCE) |
+                        (1ULL << VIRTIO_F_VERSION_1) |
+                        (1ULL << VIRTIO_RING_F_INDIRECT_DESC) |
+                        (1ULL << VIRTIO_F_NOTIFY_ON_EMPTY) |
+                        (1ULL << VHOST_USER_F_PROTOCOL_FEATURES);
+
+    if (dev->read_only) {
+        features |= 1ULL << VIRTIO_BLK_F_RO;
+    }
+    if (dev->num_queues > 1) {
+        features |= 1ULL << VIRTIO_BLK_F_MQ;
+    }
+
+    return features;
+}
+
+/*
+ * Execute one message.  Returns whether vmsg now holds a reply; failures
+ * are reported to the master through REPLY_ACK when it asked for one.
+ */
+static bool vub_execute_request(VubDev *dev, VhostUserMsg *vmsg)
+{
+    VubVirtqueue *vq;
+    bool ok = true;
+
+    switch (vmsg->request) {
+    case VHOST_USER_GET_FEATURES:
+        vmsg->payload.u64 = vub_get_features(dev);
+        vmsg->size = sizeof(vmsg->payload.u64);
+        return true;
+    case VHOST_USER_SET_FEATURES:
+        dev->features = vmsg->payload.u64;
+        break;
+    case VHOST_USER_SET_OWNER:
+        break;
+    case VHOST_USER_RESET_OWNER:
+        dev->features = 0;
+        break;
+    case VHOST_USER_SET_MEM_TABLE:
+        ok = vub_set_mem_table(dev, vmsg);
+        break;
+    case VHOST_USER_SET_LOG_BASE:
+    case VHOST_USER_SET_LOG_FD:
+        /* never offered VHOST_USER_PROTOCOL_F_LOG_SHMFD */
+        vub_close_fds(vmsg);
+        ok = false;
+        break;
+    case VHOST_USER_SET_VRING_NUM:
+        vq = vub_get_vq(dev, vmsg->payload.state.index);
+        if (!vq || !vmsg->payload.state.num ||
+            vmsg->payload.state.num > VUB_MAX_QUEUE_SIZE) {
+            ok = false;
+            break;
+        }
+        vq->size = vmsg->payload.state.num;
+        break;
+    case VHOST_USER_SET_VRING_ADDR:
+        vq = vub_get_vq(dev, vmsg->payload.addr.index);
+        if (!vq) {
+            ok = false;
+            break;
+        }
+        vq->addr = vmsg->payload.addr;
+        if (!vub_map_ring(vq)) {
+            error_report("queue %u is not in guest memory",
+                         vmsg->payload.addr.index);
+            ok = false;
+        }
+        break;
+    case VHOST_USER_SET_VRING_BASE:
+        vq = vub_get_vq(dev, vmsg->payload.state.index);
+        if (!vq) {
+            ok = false;
+            break;
+        }
+        vq->last_avail_idx = vmsg->payload.state.num;
+        break;
+    case VHOST_USER_GET_VRING_BASE:
+        vq = vub_get_vq(dev, vmsg->payload.state.index);
+        if (!vq) {
+            vmsg->payload.state.num = 0;
+        } else {
+            vub_vq_stop(vq);
+            /* QEMU takes last_avail_idx as the point to restart from */
+            blk_drain(dev->blk);
+            vq->enabled = false;
+            vq->broken = false;
+            vmsg->payload.state.num = vq->last_avail_idx;
+        }
+        vmsg->size = sizeof(vmsg->payload.state);
+        return true;
+    case VHOST_USER_SET_VRING_KICK:
+        vq = vub_get_vq(dev, vmsg->payload.u64 & VHOST_USER_VRING_IDX_MASK);
+        if (!vq || !vq->desc) {
+            vub_close_fds(vmsg);
+            ok = false;
+            break;
+        }
+        vub_vq_stop(vq);
+        if (vmsg->payload.u64 & VHOST_USER_VRING_NOFD_MASK ||
+            vmsg->fd_num != 1) {
+            error_report("no kick eventfd for queue %td, "
+                         "QEMU needs to run with KVM", vq - dev->vqs);
+            vub_close_fds(vmsg);
+            ok = false;
+            break;
+        }
+        vq->kick_fd = vmsg->fds[0];
+        qemu_set_nonblock(vq->kick_fd);
+        qemu_set_fd_handler(vq->kick_fd, vub_kick_cb, NULL, vq);
+        /* the used index is ours, except after a restart of the backend */
+        vq->used_idx = vub_lduw(dev, &vq->used->idx);
+        vq->started = true;
+        if (!vub_has_feature(dev, VHOST_USER_F_PROTOCOL_FEATURES)) {
+            vq->enabled = true;
+        }
+        /* pick up whatever the guest queued before we were listening */
+        vub_process_vq(vq);
+        break;
+    case VHOST_USER_SET_VRING_CALL:
+        vq = vub_get_vq(dev, vmsg->payload.u64 & VHOST_USER_VRING_IDX_MASK);
+        if (!vq) {
+            vub_close_fds(vmsg);
+            ok = false;
+            break;
+        }
+        if (vq->call_fd >= 0) {
+            close(vq->call_fd);
+            vq->call_fd = -1;
+        }
+        if (!(vmsg->payload.u64 & VHOST_USER_VRING_NOFD_MASK) &&
+            vmsg->fd_num == 1) {
+            vq->call_fd = vmsg->fds[0];
+        }
+        break;
+    case VHOST_USER_SET_VRING_ERR:
+        vub_close_fds(vmsg);
+        break;
+    case VHOST_USER_GET_PROTOCOL_FEATURES:
+        vmsg->payload.u64 = (1ULL << VHOST_USER_PROTOCOL_F_MQ) |
+                            (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK) |
+                            (1ULL << VHOST_USER_PROTOCOL_F_CONFIG);
+        vmsg->size = sizeof(vmsg->payload.u64);
+        return true;
+    case VHOST_USER_SET_PROTOCOL_FEATURES:
+        dev->protocol_features = vmsg->payload.u64;
+        break;
+    case VHOST_USER_GET_QUEUE_NUM:
+        vmsg->payload.u64 = dev->num_queues;
+        vmsg->size = sizeof(vmsg->payload.u64);
+        return true;
+    case VHOST_USER_SET_VRING_ENABLE:
+        vq = vub_get_vq(dev, vmsg->payload.state.index);
+        if (!vq) {
+            ok = false;
+            break;
+        }
+        vq->enabled = vmsg->payload.state.num;
+        vub_process_vq(vq);
+        break;
+    case VHOST_USER_GET_CONFIG: {
+        struct virtio_blk_config blkcfg;
+        VhostUserConfig *config = &vmsg->payload.config;
+
+        if (config->offset || config->size > sizeof(blkcfg)) {
+            error_report("invalid config space read of %u bytes at %u",
+                         config->size, config->offset);
+            config->size = 0;
+        } else {
+            vub_fill_config(dev, &blkcfg);
+            memcpy(config->region, &blkcfg, config->size);
+        }
+        vmsg->size = VHOST_USER_CONFIG_HDR_SIZE + config->size;
+        return true;
+    }
+    case VHOST_USER_SET_CONFIG: {
+        VhostUserConfig *config = &vmsg->payload.config;
+
+        /* only the cache mode is writable */
+        if (config->offset != offsetof(struct virtio_blk_config, wce) ||
+            config->size != 1) {
+            ok = false;
+            break;
+        }
+        blk_set_enable_write_cache(dev->blk, config->region[0]);
+        break;
+    }
+    default:
+        error_report("unsupported vhost-user request %d", vmsg->request);
+        vub_close_fds(vmsg);
+        ok = false;
+        break;
+    }
+
+    if (vmsg->flags & VHOST_USER_NEED_REPLY_MASK) {
+        vmsg->payload.u64 = !ok;
+        vmsg->size = sizeof(vmsg->payload.u64);
+        return true;
+    }
+
+    return false;
+}
+
+static bool vub_read_msg(int fd, VhostUserMsg *vmsg)
+{
+    char control[CMSG_SPACE(VHOST_MEMORY_MAX_NREGIONS * sizeof(int))] = { };
+    struct iovec iov = {
+        .iov_base = vmsg,
+        .iov_len = VHOST_USER_HDR_SIZE,
+    };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+
+    do {
+        ret = recvmsg(fd, &msg, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret != VHOST_USER_HDR_SIZE) {
+        if (ret < 0) {
+            error_report("failed to read message header: %s",
+                         strerror(errno));
+        }
+        return false;
+    }
+
+    vmsg->fd_num = 0;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            vmsg->fd_num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(vmsg->fds, CMSG_DATA(cmsg), vmsg->fd_num * sizeof(int));
+            break;
+        }
+    }
+
+    if (vmsg->size > sizeof(vmsg->payload)) {
+        error_report("message payload of %u bytes is too big", vmsg->size);
+        vub_close_fds(vmsg);
+        return false;
+    }
+
+    if (vmsg->size) {
+        do {
+            ret = read(fd, &vmsg->payload, vmsg->size);
+        } while (ret < 0 && errno == EINTR);
+
+        if (ret != vmsg->size) {
+            error_report("failed to read message payload");
+            vub_close_fds(vmsg);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool vub_write_msg(int fd, VhostUserMsg *vmsg)
+{
+    vmsg->flags &= ~(VHOST_USER_VERSION_MASK | VHOST_USER_NEED_REPLY_MASK);
+    vmsg->flags |= VHOST_USER_VERSION | VHOST_USER_REPLY_MASK;
+
+    return qemu_write_full(fd, vmsg, VHOST_USER_HDR_SIZE + vmsg->size) ==
+           VHOST_USER_HDR_SIZE + vmsg->size;
+}
+
+static void vub_accept(void *opaque);
+
+static void vub_disconnect(VubDev *dev)
+{
+    int i;
+
+    qemu_set_fd_handler(dev->sock, NULL, NULL, NULL);
+    close(dev->sock);
+    dev->sock = -1;
+
+    /* completions write to guest memory, so wait for them before unmapping */
+    blk_drain(dev->blk);
+    for (i = 0; i < dev->num_queues; i++) {
+        vub_vq_reset(&dev->vqs[i]);
+    }
+    vub_unmap_regions(dev);
+    dev->features = 0;
+    dev->protocol_features = 0;
+
+    /* wait for QEMU to reconnect */
+    qemu_set_fd_handler(dev->listen_fd, vub_accept, NULL, dev);
+}
+
+static void vub_receive(void *opaque)
+{
+    VubDev *dev = opaque;
+    VhostUserMsg vmsg;
+
+    if (!vub_read_msg(dev->sock, &vmsg)) {
+        vub_disconnect(dev);
+        return;
+    }
+
+    if (vub_execute_request(dev, &vmsg) && !vub_write_msg(dev->sock, &vmsg)) {
+        error_report("failed to send reply: %s", strerror(errno));
+        vub_disconnect(dev);
+    }
+}
+
+static void vub_accept(void *opaque)
+{
+    VubDev *dev = opaque;
+    int fd;
+
+    fd = qemu_accept(dev->listen_fd, NULL, NULL);
+    if (fd < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+            error_report("failed to accept connection: %s", strerror(errno));
+        }
+        return;
+    }
+
+    /* one master at a time; stop listening until it goes away */
+    qemu_set_fd_handler(dev->listen_fd, NULL, NULL, NULL);
+    dev->sock = fd;
+    qemu_set_fd_handler(dev->sock, vub_receive, NULL, dev);
+}
+
+static void usage(const char *name)
+{
+    printf(
+"Usage: %s [OPTIONS] FILE\n"
+"Serve a disk image to a vhost-user-blk device\n"
+"\n"
+"  -h, --help                display this help and exit\n"
+"  -V, --version             output version information and exit\n"
+"\n"
+"Connection properties:\n"
+"  -s, --socket=PATH         listen for QEMU on the Unix socket PATH\n"
+"  -q, --queues=NUM          number of request queues (default 1, max %d)\n"
+"\n"
+"Block device options:\n"
+"  -f, --format=FORMAT       set image format (raw, qcow2, ...)\n"
+"  -r, --read-only           export read-only\n"
+"  -n, --nocache             disable host cache\n"
+"      --cache=MODE          set cache mode (none, writeback, ...)\n"
+"      --aio=MODE            set AIO mode (native or threads)\n"
+"      --serial=SERIAL       set the disk serial number\n"
+"  -T, --trace [[enable=]<pattern>][,events=<file>][,file=<file>]\n"
+"                            specify tracing options\n"
+"\n"
+"Report bugs to <qemu-devel@nongnu.org>\n"
+    , name, VUB_MAX_QUEUES);
+}
+
+static void version(const char *name)
+{
+    printf(
+"%s version " QEMU_VERSION QEMU_PKGVERSION "\n"
+"This is free software; see the source for copying conditions.  There is NO\n"
+"warranty; not even for MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.\n"
+    , name);
+}
+
+int main(int argc, char **argv)
+{
+    const char *sopt = "hVs:q:f:rnT:";
+    struct option lopt[] = {
+        { "help", no_argument, NULL, 'h' },
+        { "version", no_argument, NULL, 'V' },
+        { "socket", required_argument, NULL, 's' },
+        { "queues", required_argument, NULL, 'q' },
+        { "format", required_argument, NULL, 'f' },
+        { "read-only", no_argument, NULL, 'r' },
+        { "nocache", no_argument, NULL, 'n' },
+        { "cache", required_argument, NULL, VUB_OPT_CACHE },
+        { "aio", required_argument, NULL, VUB_OPT_AIO },
+        { "serial", required_argument, NULL, VUB_OPT_SERIAL },
+        { "trace", required_argument, NULL, 'T' },
+        { NULL, 0, NULL, 0 }
+    };
+    static VubDev dev;
+    struct sigaction sa_sigterm;
+    const char *sockpath = NULL;
+    const char *fmt = NULL;
+    char *trace_file = NULL;
+    QDict *options = NULL;
+    Error *local_err = NULL;
+    int flags = BDRV_O_RDWR;
+    bool writethrough = true;
+    bool seen_cache = false;
+    unsigned long num;
+    int ch, i;
+
+    memset(&sa_sigterm, 0, sizeof(sa_sigterm));
+    sa_sigterm.sa_handler = termsig_handler;
+    sigaction(SIGTERM, &sa_sigterm, NULL);
+    sigaction(SIGINT, &sa_sigterm, NULL);
+    /* QEMU going away must not kill us */
+    signal(SIGPIPE, SIG_IGN);
+
+    qcrypto_init(&error_fatal);
+    module_call_init(MODULE_INIT_QOM);
+    qemu_add_opts(&qemu_trace_opts);
+    qemu_init_exec_dir(argv[0]);
+
+    dev.num_queues = 1;
+    dev.serial = "";
+
+    while ((ch = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
+        switch (ch) {
+        case 's':
+            sockpath = optarg;
+            break;
+        case 'q':
+            if (qemu_strtoul(optarg, NULL, 10, &num) < 0 ||
+                num < 1 || num > VUB_MAX_QUEUES) {
+                error_report("Invalid number of queues `%s'", optarg);
+                exit(EXIT_FAILURE);
+            }
+            dev.num_queues = num;
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'r':
+            dev.read_only = true;
+            flags &= ~BDRV_O_RDWR;
+            break;
+        case 'n':
+            optarg = (char *) "none";
+            /* fallthrough */
+        case VUB_OPT_CACHE:
+            if (seen_cache) {
+                error_report("-n and --cache can only be specified once");
+                exit(EXIT_FAILURE);
+            }
+            seen_cache = true;
+            if (bdrv_parse_cache_mode(optarg, &flags, &writethrough) == -1) {
+                error_report("Invalid cache mode `%s'", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case VUB_OPT_AIO:
+            if (!strcmp(optarg, "native")) {
+                flags |= BDRV_O_NATIVE_AIO;
+            } else if (strcmp(optarg, "threads")) {
+                error_report("invalid aio mode `%s'", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case VUB_OPT_SERIAL:
+            dev.serial = optarg;
+            break;
+        case 'T':
+            g_free(trace_file);
+            trace_file = trace_opt_parse(optarg);
+            break;
+        case 'V':
+            version(argv[0]);
+            exit(0);
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            error_report("Try `%s --help' for more information.", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc - optind != 1 || !sockpath) {
+        error_report("Need a socket path and exactly one image file");
+        error_report("Try `%s --help' for more information.", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (!trace_init_backends()) {
+        exit(EXIT_FAILURE);
+    }
+    trace_init_file(trace_file);
+    qemu_set_log(LOG_TRACE);
+
+    if (qemu_init_main_loop(&local_err)) {
+        error_report_err(local_err);
+        exit(EXIT_FAILURE);
+    }
+    bdrv_init();
+    atexit(bdrv_close_all);
+
+    if ((flags & BDRV_O_NATIVE_AIO) && !(flags & BDRV_O_NOCACHE)) {
+        error_report("aio=native was specified, but it requires "
+                     "cache.direct=on, which was not specified.");
+        exit(EXIT_FAILURE);
+    }
+
+    if (fmt) {
+        options = qdict_new();
+        qdict_put(options, "driver", qstring_from_str(fmt));
+    }
+    dev.blk = blk_new_open(argv[optind], NULL, options, flags, &local_err);
+    if (!dev.blk) {
+        error_reportf_err(local_err, "Failed to blk_new_open '%s': ",
+                          argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    blk_set_enable_write_cache(dev.blk, !writethrough);
+
+    for (i = 0; i < VUB_MAX_QUEUES; i++) {
+        dev.vqs[i].dev = &dev;
+        dev.vqs[i].kick_fd = -1;
+        dev.vqs[i].call_fd = -1;
+    }
+    dev.sock = -1;
+
+    dev.listen_fd = unix_listen(sockpath, NULL, 0, &local_err);
+    if (dev.listen_fd < 0) {
+        error_report_err(local_err);
+        exit(EXIT_FAILURE);
+    }
+    qemu_set_nonblock(dev.listen_fd);
+    qemu_set_fd_handler(dev.listen_fd, vub_accept, NULL, &dev);
+
+    while (atomic_read(&state) == RUNNING) {
+        main_loop_wait(false);
+    }
+
+    if (dev.sock >= 0) {
+        vub_disconnect(&dev);
+    }
+    qemu_set_fd_handler(dev.listen_fd, NULL, NULL, NULL);
+    close(dev.listen_fd);
+    unlink(sockpath);
+
+    blk_unref(dev.blk);
+    exit(EXIT_SUCCESS);
+}
@@ -54,6 +54,7 @@
 
 #include "exec/memory-internal.h"
 #include "exec/ram_addr.h"
+#include "exec/ramlist.h"
 #include "exec/log.h"
 
 #include "migration/vmstate.h"
@@ -1503,6 +1504,35 @@ int qemu_ram_resize(RAMBlock *block, ram_addr_t newsize, Error **errp)
 }
 
 /* Called with ram_list.mutex held */
+static void dirty_memory_extend_blocks(DirtyMemoryBlocks **blocks,
+                                       ram_addr_t old_num_blocks,
+                                       ram_addr_t new_num_blocks,
+                                       long bits_per_block)
+{
+    DirtyMemoryBlocks *old_blocks;
+    DirtyMemoryBlocks *new_blocks;
+    int j;
+
+    old_blocks = atomic_rcu_read(blocks);
+    new_blocks = g_malloc(sizeof(*new_blocks) +
+                          sizeof(new_blocks->blocks[0]) * new_num_blocks);
+
+    if (old_num_blocks) {
+        memcpy(new_blocks->blocks, old_blocks->blocks,
+               old_num_blocks * sizeof(old_blocks->blocks[0]));
+    }
+
+    for (j = old_num_blocks; j < new_num_blocks; j++) {
+        new_blocks->blocks[j] = bitmap_new(bits_per_block);
+    }
+
+    atomic_rcu_set(blocks, new_blocks);
+
+    if (old_blocks) {
+        g_free_rcu(old_blocks, rcu);
+    }
+}
+
 static void dirty_memory_extend(ram_addr_t old_ram_size,
                                 ram_addr_t new_ram_size)
 {
@@ -1518,29 +1548,14 @@ static void dirty_memory_extend(ram_addr_t old_ram_size,
     }
 
     for (i = 0; i < DIRTY_MEMORY_NUM; i++) {
-        DirtyMemoryBlocks *old_blocks;
-        DirtyMemoryBlocks *new_blocks;
-        int j;
-
-        old_blocks = atomic_rcu_read(&ram_list.dirty_memory[i]);
-        new_blocks = g_malloc(sizeof(*new_blocks) +
-                              sizeof(new_blocks->blocks[0]) * new_num_blocks);
-
-        if (old_num_blocks) {
-            memcpy(new_blocks->blocks, old_blocks->blocks,
-                   old_num_blocks * sizeof(old_blocks->blocks[0]));
-        }
-
-        for (j = old_num_blocks; j < new_num_blocks; j++) {
-            new_blocks->blocks[j] = bitmap_new(DIRTY_MEMORY_BLOCK_SIZE);
-        }
-
-        atomic_rcu_set(&ram_list.dirty_memory[i], new_blocks);
-
-        if (old_blocks) {
-            g_free_rcu(old_blocks, rcu);
-        }
+        dirty_memory_extend_blocks(&ram_list.dirty_memory[i],
+                                   old_num_blocks, new_num_blocks,
+                                   DIRTY_MEMORY_BLOCK_SIZE);
     }
+    dirty_memory_extend_blocks(&ram_list.dirty_memory_summary,
+                               old_num_blocks, new_num_blocks,
+                               DIRTY_MEMORY_BLOCK_SIZE /
+                               DIRTY_MEMORY_SUMMARY_PAGES);
 }
 
 static void ram_block_add(RAMBlock *new_block, Error **errp)
@@ -1619,6 +1634,7 @@ static void ram_block_add(RAMBlock *new_block, Error **errp)
         if (kvm_enabled()) {
             kvm_setup_guest_memory(new_block->host, new_block->max_length);
         }
+        ram_block_notify_add(new_block->host, new_block->max_length);
     }
 }
 
@@ -1748,6 +1764,10 @@ void qemu_ram_free(RAMBlock *block)
         return;
     }
 
+    if (block->host) {
+        ram_block_notify_remove(block->host, block->max_length);
+    }
+
     qemu_mutex_lock_ramlist();
     QLIST_REMOVE_RCU(block, next);
     ram_list.mru_block = NULL;
@@ -2985,6 +3005,53 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
     cpu_notify_map_clients();
 }
 
+bool address_space_cache_init(MemoryRegionCache *cache, AddressSpace *as,
+                              hwaddr addr, hwaddr len, bool is_write)
+{
+    MemoryRegion *mr;
+    hwaddr l = len;
+
+    assert(len > 0);
+    cache->as = as;
+    cache->addr = addr;
+    cache->len = len;
+    cache->is_write = is_write;
+    cache->ptr = NULL;
+    cache->mr = NULL;
+
+    /* Xen's map cache may drop the mapping behind our back */
+    if (xen_enabled()) {
+        return false;
+    }
+
+    rcu_read_lock();
+    mr = address_space_translate(as, addr, &cache->xlat, &l, is_write);
+    if (l == len && memory_access_is_direct(mr, is_write)) {
+        memory_region_ref(mr);
+        cache->mr = mr;
+        cache->ptr = qemu_map_ram_ptr(mr->ram_block, cache->xlat);
+    }
+    rcu_read_unlock();
+
+    return cache->ptr != NULL;
+}
+
+void address_space_cache_invalidate(MemoryRegionCache *cache, hwaddr addr,
+                                    hwaddr access_len)
+{
+    assert(cache->is_write && cache->mr);
+    invalidate_and_set_dirty(cache->mr, cache->xlat + addr, access_len);
+}
+
+void address_space_cache_destroy(MemoryRegionCache *cache)
+{
+    if (cache->mr) {
+        memory_region_unref(cache->mr);
+    }
+    cache->mr = NULL;
+    cache->ptr = NULL;
+}
+
 void *cpu_physical_memory_map(hwaddr addr,
                               hwaddr *plen,
                               int is_write)
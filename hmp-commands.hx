@@ -327,19 +327,26 @@ ETEXI
 
     {
         .name       = "savevm",
-        .args_type  = "name:s?",
-        .params     = "[tag|id]",
-        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created",
+        .args_type  = "live:-l,name:s?",
+        .params     = "[-l] [tag|id]",
+        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created\n\t\t\t"
+                      "-l: save the RAM while the VM keeps running",
         .mhandler.cmd = hmp_savevm,
     },
 
 STEXI
-@item savevm [@var{tag}|@var{id}]
+@item savevm [-l] [@var{tag}|@var{id}]
 @findex savevm
 Create a snapshot of the whole virtual machine. If @var{tag} is
 provided, it is used as human readable identifier. If there is already
 a snapshot with the same tag or ID, it is replaced. More info at
 @ref{vm_snapshots}.
+
+With @option{-l}, the RAM is saved while the VM keeps running, like a
+migration: it is only stopped at the end to save the remaining dirty
+pages and the devices, and the snapshot is the state of the VM at that
+point.  The migration speed and downtime limits apply, and the progress
+shows in @code{info migrate}; @code{migrate_cancel} aborts the snapshot.
 ETEXI
 
     {
@@ -894,23 +901,25 @@ ETEXI
 
     {
         .name       = "migrate",
-        .args_type  = "detach:-d,blk:-b,inc:-i,uri:s",
-        .params     = "[-d] [-b] [-i] uri",
+        .args_type  = "detach:-d,blk:-b,inc:-i,resume:-r,uri:s",
+        .params     = "[-d] [-b] [-i] [-r] uri",
         .help       = "migrate to URI (using -d to not wait for completion)"
 		      "\n\t\t\t -b for migration without shared storage with"
 		      " full copy of disk\n\t\t\t -i for migration without "
 		      "shared storage with incremental copy of disk "
-		      "(base image shared between src and destination)",
+		      "(base image shared between src and destination)"
+		      "\n\t\t\t -r to resume a paused postcopy migration",
         .mhandler.cmd = hmp_migrate,
     },
 
 
 STEXI
-@item migrate [-d] [-b] [-i] @var{uri}
+@item migrate [-d] [-b] [-i] [-r] @var{uri}
 @findex migrate
 Migrate to @var{uri} (using -d to not wait for completion).
 	-b for migration with full copy of disk
 	-i for migration with incremental copy of disk (base image is shared)
+	-r to resume a paused postcopy migration over a new channel
 ETEXI
 
     {
@@ -942,6 +951,38 @@ STEXI
 Continue an incoming migration using the @var{uri} (that has the same syntax
 as the -incoming option).
 
+ETEXI
+
+    {
+        .name       = "migrate_recover",
+        .args_type  = "uri:s",
+        .params     = "uri",
+        .help       = "Wait for a new channel to resume a paused postcopy",
+        .mhandler.cmd = hmp_migrate_recover,
+    },
+
+STEXI
+@item migrate_recover @var{uri}
+@findex migrate_recover
+On the destination, listen on @var{uri} (that has the same syntax as the
+-incoming option) for the source to resume a paused postcopy migration.
+
+ETEXI
+
+    {
+        .name       = "migrate_pause",
+        .args_type  = "",
+        .params     = "",
+        .help       = "Pause an ongoing postcopy migration",
+        .mhandler.cmd = hmp_migrate_pause,
+    },
+
+STEXI
+@item migrate_pause
+@findex migrate_pause
+Break the channel of an ongoing postcopy migration, which pauses it until
+it is resumed with migrate_recover and migrate -r.
+
 ETEXI
 
     {
@@ -961,6 +1002,22 @@ STEXI
 @item migrate_set_cache_size @var{value}
 @findex migrate_set_cache_size
 Set cache size to @var{value} (in bytes) for xbzrle migrations.
+ETEXI
+
+    {
+        .name       = "calc_dirty_rate",
+        .args_type  = "calc_time:i",
+        .params     = "calc_time",
+        .help       = "measure the dirty page rate of the guest for "
+                      "calc_time seconds, see 'info dirty_rate'",
+        .mhandler.cmd = hmp_calc_dirty_rate,
+    },
+
+STEXI
+@item calc_dirty_rate @var{calc_time}
+@findex calc_dirty_rate
+Measure how fast the guest dirties its memory for @var{calc_time} seconds,
+without migrating it.  The result is shown by @code{info dirty_rate}.
 ETEXI
 
     {
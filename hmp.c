@@ -149,6 +149,17 @@ void hmp_info_mice(Monitor *mon, const QDict *qdict)
     qapi_free_MouseInfoList(mice_list);
 }
 
+static void hmp_info_block_dirty_rates(Monitor *mon,
+                                       RAMBlockDirtyRateList *blocks)
+{
+    for (; blocks; blocks = blocks->next) {
+        monitor_printf(mon, "  %s: %" PRIu64 " pages/s of %" PRIu64
+                       " kbytes\n", blocks->value->name,
+                       blocks->value->dirty_pages_rate,
+                       blocks->value->size >> 10);
+    }
+}
+
 void hmp_info_migrate(Monitor *mon, const QDict *qdict)
 {
     MigrationInfo *info;
@@ -184,6 +195,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "expected downtime: %" PRIu64 " milliseconds\n",
                            info->expected_downtime);
         }
+        if (info->has_expected_converge_time) {
+            monitor_printf(mon, "expected converge time: %" PRIu64
+                           " milliseconds\n", info->expected_converge_time);
+        }
         if (info->has_downtime) {
             monitor_printf(mon, "downtime: %" PRIu64 " milliseconds\n",
                            info->downtime);
@@ -213,9 +228,18 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->ram->normal_bytes >> 10);
         monitor_printf(mon, "dirty sync count: %" PRIu64 "\n",
                        info->ram->dirty_sync_count);
+        monitor_printf(mon, "dirty sync time: %" PRIu64 " us "
+                       "(total %" PRIu64 " us)\n",
+                       info->ram->dirty_sync_time,
+                       info->ram->dirty_sync_total_time);
         if (info->ram->dirty_pages_rate) {
             monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages\n",
                            info->ram->dirty_pages_rate);
+            hmp_info_block_dirty_rates(mon, info->ram->blocks);
+        }
+        if (info->ram->dirty_sync_count) {
+            monitor_printf(mon, "dirty sync pages: %" PRIu64 " pages\n",
+                           info->ram->dirty_sync_pages);
         }
         if (info->ram->postcopy_requests) {
             monitor_printf(mon, "postcopy request count: %" PRIu64 "\n",
@@ -223,6 +247,26 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
         }
     }
 
+    if (info->has_postcopy_faults) {
+        PostcopyFaultStats *pf = info->postcopy_faults;
+        intList *bucket;
+        int i = 0;
+
+        monitor_printf(mon, "postcopy faults: %" PRIu64 " in %" PRIu64
+                       " requests\n", pf->faults, pf->requests);
+        monitor_printf(mon, "postcopy fault latency: avg %" PRIu64
+                       " us max %" PRIu64 " us\n",
+                       pf->latency_avg, pf->latency_max);
+        monitor_printf(mon, "postcopy fault latency histogram (us):");
+        for (bucket = pf->latency_histogram; bucket; bucket = bucket->next) {
+            monitor_printf(mon, " %s%d: %" PRIu64,
+                           bucket->next ? "<" : ">=",
+                           64 << (bucket->next ? i : i - 1), bucket->value);
+            i++;
+        }
+        monitor_printf(mon, "\n");
+    }
+
     if (info->has_disk) {
         monitor_printf(mon, "transferred disk: %" PRIu64 " kbytes\n",
                        info->disk->transferred >> 10);
@@ -245,6 +289,16 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss_rate);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
+        if (info->xbzrle_cache->has_blocks) {
+            XBZRLECacheBlockStatsList *b;
+
+            for (b = info->xbzrle_cache->blocks; b; b = b->next) {
+                monitor_printf(mon, "xbzrle cache hit rate (%s): %0.2f "
+                               "(%" PRIu64 " hits, %" PRIu64 " misses)\n",
+                               b->value->name, b->value->hit_rate,
+                               b->value->hits, b->value->misses);
+            }
+        }
     }
 
     if (info->has_cpu_throttle_percentage) {
@@ -304,6 +358,18 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, " %s: '%s'",
             MigrationParameter_lookup[MIGRATION_PARAMETER_TLS_HOSTNAME],
             params->tls_hostname ? : "");
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS],
+            params->x_multifd_channels);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_MULTIFD_PAGE_COUNT],
+            params->x_multifd_page_count);
+        monitor_printf(mon, " %s: %s",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_COMPRESS_METHOD],
+            MigrationCompressMethod_lookup[params->compress_method]);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_POSTCOPY_PREFETCH_PAGES],
+            params->postcopy_prefetch_pages);
         monitor_printf(mon, "\n");
     }
 
@@ -316,6 +382,31 @@ void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
                    qmp_query_migrate_cache_size(NULL) >> 10);
 }
 
+void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    DirtyRateInfo *info = qmp_query_dirty_rate(NULL);
+
+    monitor_printf(mon, "Status: %s\n", DirtyRateStatus_lookup[info->status]);
+    if (info->status != DIRTY_RATE_STATUS_UNSTARTED) {
+        monitor_printf(mon, "Start time: %" PRId64 " s\n", info->start_time);
+        monitor_printf(mon, "Period: %" PRId64 " s\n", info->calc_time);
+    }
+    if (info->has_dirty_rate) {
+        monitor_printf(mon, "Dirty rate: %" PRId64 " MB/s\n",
+                       info->dirty_rate);
+        hmp_info_block_dirty_rates(mon, info->blocks);
+        if (info->has_expected_converge_time) {
+            monitor_printf(mon, "Expected converge time at max bandwidth: %"
+                           PRId64 " milliseconds\n",
+                           info->expected_converge_time);
+        } else {
+            monitor_printf(mon, "Precopy won't converge at max bandwidth\n");
+        }
+    }
+
+    qapi_free_DirtyRateInfo(info);
+}
+
 void hmp_info_cpus(Monitor *mon, const QDict *qdict)
 {
     CpuInfoList *cpu_list, *cpu;
@@ -1127,7 +1218,7 @@ void hmp_drive_backup(Monitor *mon, const QDict *qdict)
     qmp_drive_backup(false, NULL, device, filename, !!format, format,
                      full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
                      true, mode, false, 0, false, NULL,
-                     false, 0, false, 0, &err);
+                     false, 0, false, 0, false, 0, &err);
     hmp_handle_error(mon, &err);
 }
 
@@ -1193,6 +1284,25 @@ void hmp_migrate_incoming(Monitor *mon, const QDict *qdict)
     hmp_handle_error(mon, &err);
 }
 
+void hmp_migrate_recover(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+    const char *uri = qdict_get_str(qdict, "uri");
+
+    qmp_migrate_recover(uri, &err);
+
+    hmp_handle_error(mon, &err);
+}
+
+void hmp_migrate_pause(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_migrate_pause(&err);
+
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_migrate_set_downtime(Monitor *mon, const QDict *qdict)
 {
     double value = qdict_get_double(qdict, "value");
@@ -1211,6 +1321,17 @@ void hmp_migrate_set_cache_size(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    int64_t calc_time = qdict_get_int(qdict, "calc_time");
+    Error *err = NULL;
+
+    qmp_calc_dirty_rate(calc_time, &err);
+    if (err) {
+        error_report_err(err);
+    }
+}
+
 void hmp_migrate_set_speed(Monitor *mon, const QDict *qdict)
 {
     int64_t value = qdict_get_int(qdict, "value");
@@ -1260,6 +1381,11 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
     bool has_cpu_throttle_increment = false;
     bool has_tls_creds = false;
     bool has_tls_hostname = false;
+    bool has_x_multifd_channels = false;
+    bool has_x_multifd_page_count = false;
+    bool has_compress_method = false;
+    int compress_method = 0;
+    bool has_postcopy_prefetch_pages = false;
     bool use_int_value = false;
     int i;
 
@@ -1291,6 +1417,27 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
             case MIGRATION_PARAMETER_TLS_HOSTNAME:
                 has_tls_hostname = true;
                 break;
+            case MIGRATION_PARAMETER_X_MULTIFD_CHANNELS:
+                has_x_multifd_channels = true;
+                use_int_value = true;
+                break;
+            case MIGRATION_PARAMETER_X_MULTIFD_PAGE_COUNT:
+                has_x_multifd_page_count = true;
+                use_int_value = true;
+                break;
+            case MIGRATION_PARAMETER_COMPRESS_METHOD:
+                compress_method =
+                    qapi_enum_parse(MigrationCompressMethod_lookup, valuestr,
+                                    MIGRATION_COMPRESS_METHOD__MAX, -1, &err);
+                if (err) {
+                    goto cleanup;
+                }
+                has_compress_method = true;
+                break;
+            case MIGRATION_PARAMETER_POSTCOPY_PREFETCH_PAGES:
+                has_postcopy_prefetch_pages = true;
+                use_int_value = true;
+                break;
             }
 
             if (use_int_value) {
@@ -1308,6 +1455,10 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
                                        has_cpu_throttle_increment, valueint,
                                        has_tls_creds, valuestr,
                                        has_tls_hostname, valuestr,
+                                       has_x_multifd_channels, valueint,
+                                       has_x_multifd_page_count, valueint,
+                                       has_compress_method, compress_method,
+                                       has_postcopy_prefetch_pages, valueint,
                                        &err);
             break;
         }
@@ -1565,10 +1716,12 @@ void hmp_migrate(Monitor *mon, const QDict *qdict)
     bool detach = qdict_get_try_bool(qdict, "detach", false);
     bool blk = qdict_get_try_bool(qdict, "blk", false);
     bool inc = qdict_get_try_bool(qdict, "inc", false);
+    bool resume = qdict_get_try_bool(qdict, "resume", false);
     const char *uri = qdict_get_str(qdict, "uri");
     Error *err = NULL;
 
-    qmp_migrate(uri, !!blk, blk, !!inc, inc, false, false, &err);
+    qmp_migrate(uri, !!blk, blk, !!inc, inc, false, false,
+                true, resume, &err);
     if (err) {
         error_report_err(err);
         return;
@@ -2031,8 +2184,13 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
     IOThreadInfoList *info;
 
     for (info = info_list; info; info = info->next) {
-        monitor_printf(mon, "%s: thread_id=%" PRId64 "\n",
-                       info->value->id, info->value->thread_id);
+        IOThreadInfo *value = info->value;
+
+        monitor_printf(mon, "%s:\n", value->id);
+        monitor_printf(mon, "  thread_id=%" PRId64 "\n", value->thread_id);
+        monitor_printf(mon, "  poll-max-ns=%" PRId64 "\n", value->poll_max_ns);
+        monitor_printf(mon, "  poll-grow=%" PRId64 "\n", value->poll_grow);
+        monitor_printf(mon, "  poll-shrink=%" PRId64 "\n", value->poll_shrink);
     }
 
     qapi_free_IOThreadInfoList(info_list);
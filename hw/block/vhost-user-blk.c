@@ -0,0 +1,484 @@
+/*
+ * vhost-user-blk host device
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The block device is implemented by a separate process that talks the
+ * vhost-user protocol, for example contrib/vhost-user-blk.  QEMU only
+ * sets up the virtqueues and forwards config space accesses; requests
+ * never go through QEMU's block layer.  The backend may be restarted
+ * while the guest runs: requests that it did not complete are resubmitted
+ * to the new instance once the chardev reconnects.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/cutils.h"
+#include "hw/qdev-core.h"
+#include "hw/virtio/vhost.h"
+#include "hw/virtio/vhost-user-blk.h"
+#include "hw/virtio/virtio.h"
+#include "hw/virtio/virtio-bus.h"
+#include "hw/virtio/virtio-access.h"
+#include "standard-headers/linux/virtio_ids.h"
+#include "sysemu/sysemu.h"
+#include "trace.h"
+
+/* Features that the backend may offer, all others are masked out */
+static const int user_feature_bits[] = {
+    VIRTIO_BLK_F_SIZE_MAX,
+    VIRTIO_BLK_F_SEG_MAX,
+    VIRTIO_BLK_F_GEOMETRY,
+    VIRTIO_BLK_F_BLK_SIZE,
+    VIRTIO_BLK_F_TOPOLOGY,
+    VIRTIO_BLK_F_MQ,
+    VIRTIO_BLK_F_RO,
+    VIRTIO_BLK_F_FLUSH,
+    VIRTIO_BLK_F_CONFIG_WCE,
+    VIRTIO_F_VERSION_1,
+    VIRTIO_RING_F_INDIRECT_DESC,
+    VIRTIO_RING_F_EVENT_IDX,
+    VIRTIO_F_NOTIFY_ON_EMPTY,
+    VHOST_INVALID_FEATURE_BIT
+};
+
+/*
+ * The backend sends its config space in little endian byte order; convert
+ * it to the byte order that the guest negotiated.
+ */
+static void vhost_user_blk_update_config(VirtIODevice *vdev, uint8_t *config)
+{
+    VHostUserBlk *s = VHOST_USER_BLK(vdev);
+    struct virtio_blk_config *blkcfg = (struct virtio_blk_config *)config;
+
+    memcpy(blkcfg, &s->blkcfg, sizeof(*blkcfg));
+    virtio_stq_p(vdev, &blkcfg->capacity, le64_to_cpu(s->blkcfg.capacity));
+    virtio_stl_p(vdev, &blkcfg->size_max, le32_to_cpu(s->blkcfg.size_max));
+    virtio_stl_p(vdev, &blkcfg->seg_max, le32_to_cpu(s->blkcfg.seg_max));
+    virtio_stw_p(vdev, &blkcfg->geometry.cylinders,
+                 le16_to_cpu(s->blkcfg.geometry.cylinders));
+    virtio_stl_p(vdev, &blkcfg->blk_size, le32_to_cpu(s->blkcfg.blk_size));
+    virtio_stw_p(vdev, &blkcfg->min_io_size,
+                 le16_to_cpu(s->blkcfg.min_io_size));
+    virtio_stl_p(vdev, &blkcfg->opt_io_size,
+                 le32_to_cpu(s->blkcfg.opt_io_size));
+    /* the guest sees the queues that QEMU created */
+    virtio_stw_p(vdev, &blkcfg->num_queues, s->num_queues);
+}
+
+static void vhost_user_blk_set_config(VirtIODevice *vdev,
+                                      const uint8_t *config)
+{
+    VHostUserBlk *s = VHOST_USER_BLK(vdev);
+    struct virtio_blk_config *blkcfg = (struct virtio_blk_config *)config;
+    int ret;
+
+    /* writeback mode is the only writable field */
+    if (blkcfg->wce == s->blkcfg.wce) {
+        return;
+    }
+
+    if (!s->connected) {
+        error_report("vhost-user-blk: cannot change the cache mode while "
+                     "the backend is disconnected");
+        return;
+    }
+
+    ret = vhost_dev_set_config(&s->dev, &blkcfg->wce,
+                               offsetof(struct virtio_blk_config, wce),
+                               sizeof(blkcfg->wce));
+    if (ret < 0) {
+        error_report("vhost-user-blk: set device config space failed");
+        return;
+    }
+
+    s->blkcfg.wce = blkcfg->wce;
+}
+
+static int vhost_user_blk_start(VirtIODevice *vdev)
+{
+    VHostUserBlk *s = VHOST_USER_BLK(vdev);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int i, ret;
+
+    if (!k->set_guest_notifiers) {
+        error_report("binding does not support guest notifiers");
+        return -ENOSYS;
+    }
+
+    ret = vhost_dev_enable_notifiers(&s->dev, vdev);
+    if (ret < 0) {
+        error_report("Error enabling host notifiers: %d", -ret);
+        return ret;
+    }
+
+    ret = k->set_guest_notifiers(qbus->parent, s->dev.nvqs, true);
+    if (ret < 0) {
+        error_report("Error binding guest notifier: %d", -ret);
+        goto err_host_notifiers;
+    }
+
+    s->dev.acked_features = vdev->guest_features;
+    ret = vhost_dev_start(&s->dev, vdev);
+    if (ret < 0) {
+        error_report("Error starting vhost: %d", -ret);
+        goto err_guest_notifiers;
+    }
+
+    /* with protocol features, vhost-user rings start out disabled */
+    if (s->dev.vhost_ops->vhost_set_vring_enable) {
+        s->dev.vhost_ops->vhost_set_vring_enable(&s->dev, 1);
+    }
+
+    /* guest_notifier_mask/pending not used yet, so just unmask
+     * everything here.  virtio-pci will do the right thing by
+     * enabling/disabling irqfd.
+     */
+    for (i = 0; i < s->dev.nvqs; i++) {
+        vhost_virtqueue_mask(&s->dev, vdev, i, false);
+    }
+
+    return ret;
+
+err_guest_notifiers:
+    k->set_guest_notifiers(qbus->parent, s->dev.nvqs, false);
+err_host_notifiers:
+    vhost_dev_disable_notifiers(&s->dev, vdev);
+    return ret;
+}
+
+static void vhost_user_blk_stop(VirtIODevice *vdev)
+{
+    VHostUserBlk *s = VHOST_USER_BLK(vdev);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int ret;
+
+    if (!k->set_guest_notifiers) {
+        return;
+    }
+
+    vhost_dev_stop(&s->dev, vdev);
+
+    ret = k->set_guest_notifiers(qbus->parent, s->dev.nvqs, false);
+    if (ret < 0) {
+        error_report("vhost guest notifier cleanup failed: %d", ret);
+    }
+
+    vhost_dev_disable_notifiers(&s->dev, vdev);
+}
+
+static void vhost_user_blk_set_status(VirtIODevice *vdev, uint8_t status)
+{
+    VHostUserBlk *s = VHOST_USER_BLK(vdev);
+    bool should_start = (status & VIRTIO_CONFIG_S_DRIVER_OK) &&
+                        vdev->vm_running;
+
+    if (!s->connected || s->dev.started == should_start) {
+        return;
+    }
+
+    if (should_start) {
+        if (vhost_user_blk_start(vdev) < 0) {
+            /* let the backend come back and try again */
+            qemu_chr_disconnect(s->chr);
+        }
+    } else {
+        vhost_user_blk_stop(vdev);
+    }
+}
+
+static uint64_t vhost_user_blk_get_features(VirtIODevice *vdev,
+                                            uint64_t features,
+                                            Error **errp)
+{
+    VHostUserBlk *s = VHOST_USER_BLK(vdev);
+
+    /* Turn on pre-defined features; the backend masks what it lacks */
+    virtio_add_feature(&features, VIRTIO_BLK_F_SEG_MAX);
+    virtio_add_feature(&features, VIRTIO_BLK_F_GEOMETRY);
+    virtio_add_feature(&features, VIRTIO_BLK_F_TOPOLOGY);
+    virtio_add_feature(&features, VIRTIO_BLK_F_BLK_SIZE);
+    virtio_add_feature(&features, VIRTIO_BLK_F_FLUSH);
+    virtio_add_feature(&features, VIRTIO_BLK_F_RO);
+
+    if (s->config_wce) {
+        virtio_add_feature(&features, VIRTIO_BLK_F_CONFIG_WCE);
+    }
+    if (s->num_queues > 1) {
+        virtio_add_feature(&features, VIRTIO_BLK_F_MQ);
+    }
+
+    return vhost_get_features(&s->dev, user_feature_bits, features);
+}
+
+static void vhost_user_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VHostUserBlk *s = VHOST_USER_BLK(vdev);
+    int i;
+
+    /*
+     * Legacy guests may kick before setting DRIVER_OK; start the backend
+     * early and pass the notification on.
+     */
+    if (!s->connected || s->dev.started ||
+        virtio_vdev_has_feature(vdev, VIRTIO_F_VERSION_1)) {
+        return;
+    }
+
+    if (vhost_user_blk_start(vdev) < 0) {
+        qemu_chr_disconnect(s->chr);
+        return;
+    }
+
+    for (i = 0; i < s->dev.nvqs; i++) {
+        VirtQueue *kick_vq = virtio_get_queue(vdev, i);
+
+        if (!virtio_queue_get_desc_addr(vdev, i)) {
+            continue;
+        }
+        event_notifier_set(virtio_queue_get_host_notifier(kick_vq));
+    }
+}
+
+static int vhost_user_blk_connect(DeviceState *dev)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(dev);
+    VHostUserBlk *s = VHOST_USER_BLK(vdev);
+    struct virtio_blk_config blkcfg;
+    int ret;
+
+    if (s->connected) {
+        return 0;
+    }
+
+    /* vhost_dev_cleanup() clears everything, including these */
+    s->dev.nvqs = s->num_queues;
+    s->dev.vqs = s->vqs;
+    s->dev.vq_index = 0;
+    s->dev.backend_features = 0;
+
+    ret = vhost_dev_init(&s->dev, s->chr, VHOST_BACKEND_TYPE_USER, 0);
+    if (ret < 0) {
+        error_report("vhost-user-blk: vhost initialization failed: %s",
+                     strerror(-ret));
+        return ret;
+    }
+
+    /* max_queues is only known if the backend has multiqueue support */
+    if (s->num_queues > 1 && s->dev.max_queues < s->num_queues) {
+        error_report("vhost-user-blk: backend supports %" PRIu64
+                     " queues, %d requested",
+                     s->dev.max_queues, s->num_queues);
+        goto err;
+    }
+
+    ret = vhost_dev_get_config(&s->dev, (uint8_t *)&blkcfg, sizeof(blkcfg));
+    if (ret < 0) {
+        error_report("vhost-user-blk: cannot read the config space, "
+                     "the backend must support VHOST_USER_PROTOCOL_F_CONFIG");
+        goto err;
+    }
+
+    s->connected = true;
+    trace_vhost_user_blk_connect(s, le64_to_cpu(blkcfg.capacity));
+
+    if (dev->realized && memcmp(&blkcfg, &s->blkcfg, sizeof(blkcfg))) {
+        /* e.g. the new backend instance opened a resized image */
+        s->blkcfg = blkcfg;
+        virtio_notify_config(vdev);
+    } else {
+        s->blkcfg = blkcfg;
+    }
+
+    /* restore vhost state if the guest was already using the device */
+    vhost_user_blk_set_status(vdev, vdev->status);
+    return 0;
+
+err:
+    vhost_dev_cleanup(&s->dev);
+    return -1;
+}
+
+static void vhost_user_blk_disconnect(DeviceState *dev)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(dev);
+    VHostUserBlk *s = VHOST_USER_BLK(vdev);
+
+    if (!s->connected) {
+        return;
+    }
+    s->connected = false;
+    trace_vhost_user_blk_disconnect(s);
+
+    if (s->dev.started) {
+        /* Uncompleted requests are rewound, see vhost_virtqueue_stop() */
+        vhost_user_blk_stop(vdev);
+    }
+
+    vhost_dev_cleanup(&s->dev);
+}
+
+static gboolean vhost_user_blk_watch(GIOChannel *chan, GIOCondition cond,
+                                     void *opaque)
+{
+    VHostUserBlk *s = VHOST_USER_BLK(opaque);
+
+    qemu_chr_disconnect(s->chr);
+
+    return FALSE;
+}
+
+static void vhost_user_blk_event(void *opaque, int event)
+{
+    DeviceState *dev = opaque;
+    VHostUserBlk *s = VHOST_USER_BLK(dev);
+
+    switch (event) {
+    case CHR_EVENT_OPENED:
+        if (vhost_user_blk_connect(dev) < 0) {
+            qemu_chr_disconnect(s->chr);
+            return;
+        }
+        s->watch = qemu_chr_fe_add_watch(s->chr, G_IO_HUP,
+                                         vhost_user_blk_watch, dev);
+        break;
+    case CHR_EVENT_CLOSED:
+        vhost_user_blk_disconnect(dev);
+        if (s->watch) {
+            g_source_remove(s->watch);
+            s->watch = 0;
+        }
+        break;
+    }
+}
+
+static void vhost_user_blk_device_realize(DeviceState *dev, Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(dev);
+    VHostUserBlk *s = VHOST_USER_BLK(vdev);
+    int i;
+
+    if (!s->chr) {
+        error_setg(errp, "vhost-user-blk: chardev is mandatory");
+        return;
+    }
+
+    if (!s->num_queues || s->num_queues > VIRTIO_QUEUE_MAX) {
+        error_setg(errp, "vhost-user-blk: invalid number of IO queues");
+        return;
+    }
+
+    if (!s->queue_size || s->queue_size > VIRTQUEUE_MAX_SIZE ||
+        (s->queue_size & (s->queue_size - 1))) {
+        error_setg(errp, "vhost-user-blk: queue size must be a power of 2 "
+                   "no larger than %d", VIRTQUEUE_MAX_SIZE);
+        return;
+    }
+
+    virtio_init(vdev, "virtio-blk", VIRTIO_ID_BLOCK,
+                sizeof(struct virtio_blk_config));
+
+    for (i = 0; i < s->num_queues; i++) {
+        virtio_add_queue(vdev, s->queue_size, vhost_user_blk_handle_output);
+    }
+
+    s->vqs = g_new0(struct vhost_virtqueue, s->num_queues);
+    s->connected = false;
+
+    /* like vhost-user net devices, wait for a usable backend */
+    do {
+        Error *err = NULL;
+
+        if (qemu_chr_wait_connected(s->chr, &err) < 0) {
+            error_propagate(errp, err);
+            goto virtio_err;
+        }
+        qemu_chr_add_handlers(s->chr, NULL, NULL, vhost_user_blk_event, dev);
+    } while (!s->connected);
+
+    return;
+
+virtio_err:
+    qemu_chr_add_handlers(s->chr, NULL, NULL, NULL, NULL);
+    g_free(s->vqs);
+    virtio_cleanup(vdev);
+}
+
+static void vhost_user_blk_device_unrealize(DeviceState *dev, Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(dev);
+    VHostUserBlk *s = VHOST_USER_BLK(dev);
+
+    vhost_user_blk_set_status(vdev, 0);
+    qemu_chr_add_handlers(s->chr, NULL, NULL, NULL, NULL);
+    if (s->watch) {
+        g_source_remove(s->watch);
+        s->watch = 0;
+    }
+    if (s->connected) {
+        vhost_dev_cleanup(&s->dev);
+        s->connected = false;
+    }
+    g_free(s->vqs);
+    virtio_cleanup(vdev);
+}
+
+static void vhost_user_blk_instance_init(Object *obj)
+{
+    VHostUserBlk *s = VHOST_USER_BLK(obj);
+
+    device_add_bootindex_property(obj, &s->bootindex, "bootindex",
+                                  "/disk@0,0", DEVICE(obj), NULL);
+}
+
+static int vhost_user_blk_load(QEMUFile *f, void *opaque, size_t size)
+{
+    return virtio_load(VIRTIO_DEVICE(opaque), f, 1);
+}
+
+VMSTATE_VIRTIO_DEVICE(vhost_user_blk, 1, vhost_user_blk_load,
+                      virtio_vmstate_save);
+
+static Property vhost_user_blk_properties[] = {
+    DEFINE_PROP_CHR("chardev", VHostUserBlk, chr),
+    DEFINE_PROP_UINT16("num-queues", VHostUserBlk, num_queues, 1),
+    DEFINE_PROP_UINT32("queue-size", VHostUserBlk, queue_size, 128),
+    DEFINE_PROP_BOOL("config-wce", VHostUserBlk, config_wce, true),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void vhost_user_blk_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    VirtioDeviceClass *vdc = VIRTIO_DEVICE_CLASS(klass);
+
+    dc->props = vhost_user_blk_properties;
+    dc->vmsd = &vmstate_virtio_vhost_user_blk;
+    set_bit(DEVICE_CATEGORY_STORAGE, dc->categories);
+
+    vdc->realize = vhost_user_blk_device_realize;
+    vdc->unrealize = vhost_user_blk_device_unrealize;
+    vdc->get_config = vhost_user_blk_update_config;
+    vdc->set_config = vhost_user_blk_set_config;
+    vdc->get_features = vhost_user_blk_get_features;
+    vdc->set_status = vhost_user_blk_set_status;
+}
+
+static const TypeInfo vhost_user_blk_info = {
+    .name = TYPE_VHOST_USER_BLK,
+    .parent = TYPE_VIRTIO_DEVICE,
+    .instance_size = sizeof(VHostUserBlk),
+    .instance_init = vhost_user_blk_instance_init,
+    .class_init = vhost_user_blk_class_init,
+};
+
+static void virtio_register_types(void)
+{
+    type_register_static(&vhost_user_blk_info);
+}
+
+type_init(virtio_register_types)
@@ -29,8 +29,22 @@
 #define VIRTIO_NET_VM_VERSION    11
 
 #define MAC_TABLE_ENTRIES    64
+
+/* Packets popped from the tx queue at once, and the elements kept for them */
+#define VIRTIO_NET_TX_BATCH     32
+#define VIRTIO_NET_TX_POOL_SIZE (VIRTIO_NET_TX_BATCH + 1)
+/* Enough for a TSO packet with the maximum number of fragments */
+#define VIRTIO_NET_TX_POOL_SG   20
 #define MAX_VLAN    (1 << 12)   /* Per 802.1Q definition */
 
+/* previously fixed value */
+#define VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE 256
+#define VIRTIO_NET_TX_QUEUE_DEFAULT_SIZE 256
+
+/* for now, only allow larger queues; with virtio-1, guest can downsize */
+#define VIRTIO_NET_RX_QUEUE_MIN_SIZE VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE
+#define VIRTIO_NET_TX_QUEUE_MIN_SIZE VIRTIO_NET_TX_QUEUE_DEFAULT_SIZE
+
 /*
  * Calculate the number of bytes up to and including the given 'field' of
  * 'container'.
@@ -213,6 +227,8 @@ static void virtio_net_vnet_endian_status(VirtIONet *n, uint8_t status)
     }
 }
 
+static void virtio_net_dataplane_status(VirtIONet *n, uint8_t status);
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -222,7 +238,11 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 
     virtio_net_vnet_endian_status(n, status);
     virtio_net_vhost_status(n, status);
+    virtio_net_dataplane_status(n, status);
 
+    if (n->ctx) {
+        aio_context_acquire(n->ctx);
+    }
     for (i = 0; i < n->max_queues; i++) {
         NetClientState *ncs = qemu_get_subqueue(n->nic, i);
         bool queue_started;
@@ -259,6 +279,9 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             }
         }
     }
+    if (n->ctx) {
+        aio_context_release(n->ctx);
+    }
 }
 
 static void virtio_net_set_link_status(NetClientState *nc)
@@ -885,6 +908,10 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
     struct iovec *iov, *iov2;
     unsigned int iov_cnt;
 
+    /* The filters and queue count are also used by the dataplane thread */
+    if (n->ctx) {
+        aio_context_acquire(n->ctx);
+    }
     for (;;) {
         elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
         if (!elem) {
@@ -924,6 +951,26 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         g_free(iov2);
         g_free(elem);
     }
+    if (n->ctx) {
+        aio_context_release(n->ctx);
+    }
+}
+
+/*
+ * With dataplane the guest notifiers are irqfds, which can be signalled
+ * from the IOThread without taking the global mutex.
+ */
+static void virtio_net_notify(VirtIONet *n, VirtQueue *vq)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+
+    if (n->dataplane_started && !n->dataplane_fenced) {
+        if (virtio_should_notify(vdev, vq)) {
+            event_notifier_set(virtio_queue_get_guest_notifier(vq));
+        }
+    } else {
+        virtio_notify(vdev, vq);
+    }
 }
 
 /* RX */
@@ -1184,7 +1231,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    virtio_net_notify(n, q->rx_vq);
 
     return size;
 }
@@ -1195,12 +1242,11 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
-    VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+    virtio_net_notify(n, q->tx_vq);
 
-    g_free(q->async_tx.elem);
+    virtqueue_element_release(q->tx_pool, q->async_tx.elem);
     q->async_tx.elem = NULL;
 
     virtio_queue_set_notification(q->tx_vq, 1);
@@ -1208,13 +1254,120 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 }
 
 /* TX */
+
+/* Returns false if the backend queued the packet, to complete it later */
+static bool virtio_net_tx_one(VirtIONetQueue *q, VirtQueueElement *elem)
+{
+    VirtIONet *n = q->n;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    ssize_t ret;
+    unsigned int out_num;
+    struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
+    struct virtio_net_hdr_mrg_rxbuf mhdr;
+
+    out_num = elem->out_num;
+    out_sg = elem->out_sg;
+    if (out_num < 1) {
+        error_report("virtio-net header not in first element");
+        exit(1);
+    }
+
+    if (n->has_vnet_hdr) {
+        if (iov_to_buf(out_sg, out_num, 0, &mhdr, n->guest_hdr_len) <
+            n->guest_hdr_len) {
+            error_report("virtio-net header incorrect");
+            exit(1);
+        }
+        if (n->needs_vnet_hdr_swap) {
+            virtio_net_hdr_swap(vdev, (void *) &mhdr);
+            sg2[0].iov_base = &mhdr;
+            sg2[0].iov_len = n->guest_hdr_len;
+            out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
+                               out_sg, out_num,
+                               n->guest_hdr_len, -1);
+            if (out_num == VIRTQUEUE_MAX_SIZE) {
+                /* drop the packet */
+                return true;
+            }
+            out_num += 1;
+            out_sg = sg2;
+        }
+    }
+    /*
+     * If host wants to see the guest header as is, we can
+     * pass it on unchanged. Otherwise, copy just the parts
+     * that host is interested in.
+     */
+    assert(n->host_hdr_len <= n->guest_hdr_len);
+    if (n->host_hdr_len != n->guest_hdr_len) {
+        unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
+                                   out_sg, out_num,
+                                   0, n->host_hdr_len);
+        sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
+                         out_sg, out_num,
+                         n->guest_hdr_len, -1);
+        out_num = sg_num;
+        out_sg = sg;
+    }
+
+    ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
+                                  out_sg, out_num, virtio_net_tx_complete);
+    return ret != 0;
+}
+
+/*
+ * Send @nr packets, handing them to the backend as a single batch when
+ * the guest's headers can be passed on unchanged.  Returns the number of
+ * packets sent; if less than @nr, elems[ret] was queued by the backend.
+ */
+static unsigned int virtio_net_tx_batch(VirtIONetQueue *q,
+                                        VirtQueueElement **elems,
+                                        unsigned int nr)
+{
+    VirtIONet *n = q->n;
+    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    NetBatchPacket pkts[VIRTIO_NET_TX_BATCH];
+    unsigned int i;
+
+    assert(nr <= VIRTIO_NET_TX_BATCH);
+
+    if (n->needs_vnet_hdr_swap || n->host_hdr_len != n->guest_hdr_len) {
+        for (i = 0; i < nr; i++) {
+            if (!virtio_net_tx_one(q, elems[i])) {
+                break;
+            }
+        }
+        return i;
+    }
+
+    for (i = 0; i < nr; i++) {
+        VirtQueueElement *elem = elems[i];
+
+        if (elem->out_num < 1) {
+            error_report("virtio-net header not in first element");
+            exit(1);
+        }
+        if (n->has_vnet_hdr &&
+            iov_size(elem->out_sg, elem->out_num) < n->guest_hdr_len) {
+            error_report("virtio-net header incorrect");
+            exit(1);
+        }
+        pkts[i].iov = elem->out_sg;
+        pkts[i].iovcnt = elem->out_num;
+    }
+
+    return qemu_sendv_packet_batch(qemu_get_subqueue(n->nic, queue_index),
+                                   pkts, nr, virtio_net_tx_complete);
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
-    VirtQueueElement *elem;
+    VirtQueueElement *elems[VIRTIO_NET_TX_BATCH];
     int32_t num_packets = 0;
-    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
     }
@@ -1224,77 +1377,41 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         return num_packets;
     }
 
-    for (;;) {
-        ssize_t ret;
-        unsigned int out_num;
-        struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
-        struct virtio_net_hdr_mrg_rxbuf mhdr;
+    while (num_packets < n->tx_burst) {
+        unsigned int nr, sent, i;
 
-        elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
-        if (!elem) {
+        nr = virtqueue_pop_batch(q->tx_vq, q->tx_pool, (void **)elems,
+                                 MIN(VIRTIO_NET_TX_BATCH,
+                                     n->tx_burst - num_packets));
+        if (!nr) {
             break;
         }
 
-        out_num = elem->out_num;
-        out_sg = elem->out_sg;
-        if (out_num < 1) {
-            error_report("virtio-net header not in first element");
-            exit(1);
-        }
+        sent = virtio_net_tx_batch(q, elems, nr);
 
-        if (n->has_vnet_hdr) {
-            if (iov_to_buf(out_sg, out_num, 0, &mhdr, n->guest_hdr_len) <
-                n->guest_hdr_len) {
-                error_report("virtio-net header incorrect");
-                exit(1);
+        /* One used ring update and notification for the whole batch */
+        if (sent) {
+            virtqueue_push_batch(q->tx_vq, elems, NULL, sent);
+            virtio_net_notify(n, q->tx_vq);
+            for (i = 0; i < sent; i++) {
+                virtqueue_element_release(q->tx_pool, elems[i]);
             }
-            if (n->needs_vnet_hdr_swap) {
-                virtio_net_hdr_swap(vdev, (void *) &mhdr);
-                sg2[0].iov_base = &mhdr;
-                sg2[0].iov_len = n->guest_hdr_len;
-                out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
-                                   out_sg, out_num,
-                                   n->guest_hdr_len, -1);
-                if (out_num == VIRTQUEUE_MAX_SIZE) {
-                    goto drop;
-		}
-                out_num += 1;
-                out_sg = sg2;
-	    }
-        }
-        /*
-         * If host wants to see the guest header as is, we can
-         * pass it on unchanged. Otherwise, copy just the parts
-         * that host is interested in.
-         */
-        assert(n->host_hdr_len <= n->guest_hdr_len);
-        if (n->host_hdr_len != n->guest_hdr_len) {
-            unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
-                                       out_sg, out_num,
-                                       0, n->host_hdr_len);
-            sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
-                             out_sg, out_num,
-                             n->guest_hdr_len, -1);
-            out_num = sg_num;
-            out_sg = sg;
+            num_packets += sent;
         }
 
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
-        if (ret == 0) {
+        if (sent < nr) {
+            /*
+             * The backend is busy with elems[sent]; give the packets after
+             * it back to the guest, most recently popped first.
+             */
+            for (i = nr - 1; i > sent; i--) {
+                virtqueue_discard(q->tx_vq, elems[i], 0);
+                virtqueue_element_release(q->tx_pool, elems[i]);
+            }
             virtio_queue_set_notification(q->tx_vq, 0);
-            q->async_tx.elem = elem;
+            q->async_tx.elem = elems[sent];
             return -EBUSY;
         }
-
-drop:
-        virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
-        g_free(elem);
-
-        if (++num_packets >= n->tx_burst) {
-            break;
-        }
     }
     return num_packets;
 }
@@ -1412,19 +1529,26 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
-    n->vqs[index].rx_vq = virtio_add_queue(vdev, 256, virtio_net_handle_rx);
+    n->vqs[index].rx_vq = virtio_add_queue(vdev, n->net_conf.rx_queue_size,
+                                           virtio_net_handle_rx);
     if (n->net_conf.tx && !strcmp(n->net_conf.tx, "timer")) {
         n->vqs[index].tx_vq =
-            virtio_add_queue(vdev, 256, virtio_net_handle_tx_timer);
+            virtio_add_queue(vdev, n->net_conf.tx_queue_size,
+                             virtio_net_handle_tx_timer);
         n->vqs[index].tx_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
                                               virtio_net_tx_timer,
                                               &n->vqs[index]);
     } else {
         n->vqs[index].tx_vq =
-            virtio_add_queue(vdev, 256, virtio_net_handle_tx_bh);
+            virtio_add_queue(vdev, n->net_conf.tx_queue_size,
+                             virtio_net_handle_tx_bh);
         n->vqs[index].tx_bh = qemu_bh_new(virtio_net_tx_bh, &n->vqs[index]);
     }
 
+    n->vqs[index].tx_pool =
+        virtqueue_element_pool_new(sizeof(VirtQueueElement),
+                                   VIRTIO_NET_TX_POOL_SG,
+                                   VIRTIO_NET_TX_POOL_SIZE);
     n->vqs[index].tx_waiting = 0;
     n->vqs[index].n = n;
 }
@@ -1445,6 +1569,8 @@ static void virtio_net_del_queue(VirtIONet *n, int index)
         qemu_bh_delete(q->tx_bh);
     }
     virtio_del_queue(vdev, index * 2 + 1);
+    virtqueue_element_pool_free(q->tx_pool);
+    q->tx_pool = NULL;
 }
 
 static void virtio_net_change_num_queues(VirtIONet *n, int new_max_queues)
@@ -1492,6 +1618,176 @@ static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue)
     virtio_net_set_queues(n);
 }
 
+/* Dataplane */
+
+static void virtio_net_dataplane_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+
+    assert(n->ctx && n->dataplane_started);
+    virtio_net_handle_rx(vdev, vq);
+}
+
+static void virtio_net_dataplane_handle_tx(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+
+    assert(n->ctx && n->dataplane_started);
+    virtio_net_handle_tx_bh(vdev, vq);
+}
+
+/* Recreate the TX bottom half in @ctx, or in the main loop if NULL */
+static void virtio_net_tx_bh_set_aio_context(VirtIONetQueue *q,
+                                             AioContext *ctx)
+{
+    qemu_bh_delete(q->tx_bh);
+    if (ctx) {
+        q->tx_bh = aio_bh_new(ctx, virtio_net_tx_bh, q);
+    } else {
+        q->tx_bh = qemu_bh_new(virtio_net_tx_bh, q);
+    }
+    if (q->tx_waiting) {
+        qemu_bh_schedule(q->tx_bh);
+    }
+}
+
+/* Context: QEMU global mutex held, n->ctx acquired */
+static void virtio_net_dataplane_set_aio_context(VirtIONet *n, int queues,
+                                                 AioContext *ctx)
+{
+    int i;
+
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+        NetClientState *nc = qemu_get_subqueue(n->nic, i);
+
+        virtio_queue_aio_set_host_notifier_handler(q->rx_vq, n->ctx,
+            ctx ? virtio_net_dataplane_handle_rx : NULL);
+        virtio_queue_aio_set_host_notifier_handler(q->tx_vq, n->ctx,
+            ctx ? virtio_net_dataplane_handle_tx : NULL);
+        virtio_net_tx_bh_set_aio_context(q, ctx);
+        qemu_set_aio_context(nc->peer, ctx);
+    }
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_dataplane_start(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(n)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int nvqs = queues * 2;
+    int i, rc;
+
+    if (n->dataplane_started || n->dataplane_starting ||
+        n->dataplane_fenced) {
+        return;
+    }
+
+    n->dataplane_starting = true;
+
+    /* Filters may have been added since realize; they need the main loop */
+    for (i = 0; i < queues; i++) {
+        NetClientState *nc = qemu_get_subqueue(n->nic, i);
+
+        if (nc->peer && !QTAILQ_EMPTY(&nc->peer->filters)) {
+            error_report("virtio-net: network filters in use, "
+                         "not using the iothread");
+            goto fail_guest_notifiers;
+        }
+    }
+
+    /* Set up guest notifier (irq) */
+    rc = k->set_guest_notifiers(qbus->parent, nvqs, true);
+    if (rc != 0) {
+        error_report("virtio-net: Failed to set guest notifiers (%d), "
+                     "ensure -enable-kvm is set", rc);
+        goto fail_guest_notifiers;
+    }
+
+    /* Set up virtqueue notify */
+    for (i = 0; i < nvqs; i++) {
+        rc = virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, true);
+        if (rc != 0) {
+            error_report("virtio-net: Failed to set host notifier (%d)", rc);
+            while (i--) {
+                virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
+            }
+            goto fail_host_notifiers;
+        }
+    }
+
+    aio_context_acquire(n->ctx);
+    n->dataplane_starting = false;
+    n->dataplane_started = true;
+    virtio_net_dataplane_set_aio_context(n, queues, n->ctx);
+    aio_context_release(n->ctx);
+
+    /* Kick right away to pick up buffers the guest already made available */
+    for (i = 0; i < nvqs; i++) {
+        VirtQueue *vq = virtio_get_queue(vdev, i);
+
+        event_notifier_set(virtio_queue_get_host_notifier(vq));
+    }
+    return;
+
+fail_host_notifiers:
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
+fail_guest_notifiers:
+    n->dataplane_fenced = true;
+    n->dataplane_starting = false;
+    n->dataplane_started = true;
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_dataplane_stop(VirtIONet *n)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(n)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int nvqs = queues * 2;
+    int i;
+
+    if (!n->dataplane_started || n->dataplane_stopping) {
+        return;
+    }
+
+    /* Better luck next time. */
+    if (n->dataplane_fenced) {
+        n->dataplane_fenced = false;
+        n->dataplane_started = false;
+        return;
+    }
+    n->dataplane_stopping = true;
+
+    aio_context_acquire(n->ctx);
+    virtio_net_dataplane_set_aio_context(n, queues, NULL);
+    aio_context_release(n->ctx);
+
+    for (i = 0; i < nvqs; i++) {
+        virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
+    }
+
+    /* Clean up guest notifier (irq) */
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
+    n->dataplane_stopping = false;
+    n->dataplane_started = false;
+}
+
+static void virtio_net_dataplane_status(VirtIONet *n, uint8_t status)
+{
+    if (!n->ctx) {
+        return;
+    }
+
+    if (virtio_net_started(n, status)) {
+        virtio_net_dataplane_start(n);
+    } else {
+        virtio_net_dataplane_stop(n);
+    }
+}
+
 static void virtio_net_save(QEMUFile *f, void *opaque, size_t size)
 {
     VirtIONet *n = opaque;
@@ -1710,6 +2006,68 @@ void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
     n->netclient_type = g_strdup(type);
 }
 
+static uint16_t virtio_net_max_tx_queue_size(VirtIONet *n)
+{
+    NetClientState *peer = n->nic_conf.peers.ncs[0];
+
+    /*
+     * Backends other than vhost-user don't support max queue size.
+     * Packets sent by QEMU itself go through writev(), and a chain of
+     * more than 256 descriptors could exceed what the host accepts.
+     */
+    if (!peer) {
+        return VIRTIO_NET_TX_QUEUE_DEFAULT_SIZE;
+    }
+
+    if (peer->info->type != NET_CLIENT_DRIVER_VHOST_USER) {
+        return VIRTIO_NET_TX_QUEUE_DEFAULT_SIZE;
+    }
+
+    return VIRTQUEUE_MAX_SIZE;
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_set_iothread(VirtIONet *n, IOThread *iothread,
+                                    Error **errp)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(n)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int i;
+
+    /* Don't try if transport does not support notifiers. */
+    if (!k->set_guest_notifiers || !k->ioeventfd_started) {
+        error_setg(errp, "device is incompatible with iothread "
+                   "(transport does not support notifiers)");
+        return;
+    }
+
+    if (n->net_conf.tx && !strcmp(n->net_conf.tx, "timer")) {
+        error_setg(errp, "iothread is incompatible with tx=timer");
+        return;
+    }
+
+    for (i = 0; i < MAX(n->nic_conf.peers.queues, 1); i++) {
+        NetClientState *peer = n->nic_conf.peers.ncs[i];
+
+        if (!peer || !peer->info->set_aio_context) {
+            error_setg(errp, "iothread requires a network backend that "
+                       "can be polled from an IOThread, such as tap");
+            return;
+        }
+        if (get_vhost_net(peer)) {
+            error_setg(errp, "iothread is incompatible with vhost");
+            return;
+        }
+        if (!QTAILQ_EMPTY(&peer->filters)) {
+            error_setg(errp, "iothread is incompatible with network "
+                       "filters");
+            return;
+        }
+    }
+
+    n->ctx = iothread_get_aio_context(iothread);
+}
+
 static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
@@ -1720,6 +2078,43 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     virtio_net_set_config_size(n, n->host_features);
     virtio_init(vdev, "virtio-net", VIRTIO_ID_NET, n->config_size);
 
+    /*
+     * We set a lower limit on RX queue size to what it always was.
+     * Guests that want a smaller ring can always resize it without
+     * help from us (using virtio 1 and up).
+     */
+    if (n->net_conf.rx_queue_size < VIRTIO_NET_RX_QUEUE_MIN_SIZE ||
+        n->net_conf.rx_queue_size > VIRTQUEUE_MAX_SIZE ||
+        !is_power_of_2(n->net_conf.rx_queue_size)) {
+        error_setg(errp, "Invalid rx_queue_size (= %" PRIu16 "), "
+                   "must be a power of 2 between %d and %d.",
+                   n->net_conf.rx_queue_size, VIRTIO_NET_RX_QUEUE_MIN_SIZE,
+                   VIRTQUEUE_MAX_SIZE);
+        virtio_cleanup(vdev);
+        return;
+    }
+
+    if (n->net_conf.tx_queue_size < VIRTIO_NET_TX_QUEUE_MIN_SIZE ||
+        n->net_conf.tx_queue_size > VIRTQUEUE_MAX_SIZE ||
+        !is_power_of_2(n->net_conf.tx_queue_size)) {
+        error_setg(errp, "Invalid tx_queue_size (= %" PRIu16 "), "
+                   "must be a power of 2 between %d and %d.",
+                   n->net_conf.tx_queue_size, VIRTIO_NET_TX_QUEUE_MIN_SIZE,
+                   VIRTQUEUE_MAX_SIZE);
+        virtio_cleanup(vdev);
+        return;
+    }
+    n->net_conf.tx_queue_size = MIN(virtio_net_max_tx_queue_size(n),
+                                    n->net_conf.tx_queue_size);
+
+    if (n->net_conf.iothread) {
+        virtio_net_set_iothread(n, n->net_conf.iothread, errp);
+        if (n->ctx == NULL) {
+            virtio_cleanup(vdev);
+            return;
+        }
+    }
+
     n->max_queues = MAX(n->nic_conf.peers.queues, 1);
     if (n->max_queues * 2 + 1 > VIRTIO_QUEUE_MAX) {
         error_setg(errp, "Invalid number of queues (= %" PRIu32 "), "
@@ -1830,6 +2225,10 @@ static void virtio_net_instance_init(Object *obj)
     device_add_bootindex_property(obj, &n->nic_conf.bootindex,
                                   "bootindex", "/ethernet-phy@0",
                                   DEVICE(n), NULL);
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&n->net_conf.iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, &error_abort);
 }
 
 VMSTATE_VIRTIO_DEVICE(net, VIRTIO_NET_VM_VERSION, virtio_net_load,
@@ -1880,6 +2279,10 @@ static Property virtio_net_properties[] = {
                        TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIONet, net_conf.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtIONet, net_conf.tx),
+    DEFINE_PROP_UINT16("rx_queue_size", VirtIONet, net_conf.rx_queue_size,
+                       VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE),
+    DEFINE_PROP_UINT16("tx_queue_size", VirtIONet, net_conf.tx_queue_size,
+                       VIRTIO_NET_TX_QUEUE_DEFAULT_SIZE),
     DEFINE_PROP_END_OF_LIST(),
 };
 
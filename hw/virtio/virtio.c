@@ -39,6 +39,18 @@ typedef struct VRingDesc
     uint16_t next;
 } VRingDesc;
 
+typedef struct VRingPackedDesc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+} VRingPackedDesc;
+
+typedef struct VRingPackedDescEvent {
+    uint16_t off_wrap;
+    uint16_t flags;
+} VRingPackedDescEvent;
+
 typedef struct VRingAvail
 {
     uint16_t flags;
@@ -59,6 +71,13 @@ typedef struct VRingUsed
     VRingUsedElem ring[0];
 } VRingUsed;
 
+typedef struct VRingMemoryRegionCaches {
+    struct rcu_head rcu;
+    MemoryRegionCache desc;
+    MemoryRegionCache avail;
+    MemoryRegionCache used;
+} VRingMemoryRegionCaches;
+
 typedef struct VRing
 {
     unsigned int num;
@@ -67,21 +86,37 @@ typedef struct VRing
     hwaddr desc;
     hwaddr avail;
     hwaddr used;
+    /* Translation of the rings, NULL until they are set up */
+    VRingMemoryRegionCaches *caches;
 } VRing;
 
+/*
+ * With the packed layout, the indices below are positions in the
+ * descriptor ring, each paired with the wrap counter that the driver
+ * uses to tell new descriptors from the ones of the previous lap.
+ */
 struct VirtQueue
 {
     VRing vring;
 
     /* Next head to pop */
     uint16_t last_avail_idx;
+    bool last_avail_wrap_counter;
 
     /* Last avail_idx read from VQ. */
     uint16_t shadow_avail_idx;
+    bool shadow_avail_wrap_counter;
 
     uint16_t used_idx;
+    bool used_wrap_counter;
 
-    /* Last used index value we have signalled on */
+    /* Packed layout: descriptors filled but not flushed yet */
+    uint16_t used_pending;
+
+    /*
+     * Last used index value we have signalled on; with the packed
+     * layout, the wrap counter is in bit 15 like in the event structures.
+     */
     uint16_t signalled_used;
 
     /* Last used index value we have signalled on */
@@ -104,6 +139,60 @@ struct VirtQueue
     QLIST_ENTRY(VirtQueue) node;
 };
 
+static void virtio_free_region_cache(VRingMemoryRegionCaches *caches)
+{
+    address_space_cache_destroy(&caches->desc);
+    address_space_cache_destroy(&caches->avail);
+    address_space_cache_destroy(&caches->used);
+    g_free(caches);
+}
+
+static void virtio_virtqueue_reset_region_cache(VirtQueue *vq)
+{
+    VRingMemoryRegionCaches *caches = vq->vring.caches;
+
+    atomic_rcu_set(&vq->vring.caches, NULL);
+    if (caches) {
+        call_rcu(caches, virtio_free_region_cache, rcu);
+    }
+}
+
+/*
+ * Translate the rings of queue @n, so that accessing them doesn't go
+ * through the memory API every time.  Called with the iothread lock held
+ * whenever the rings or the memory map change.
+ */
+static void virtio_init_region_cache(VirtIODevice *vdev, int n)
+{
+    VirtQueue *vq = &vdev->vq[n];
+    VRingMemoryRegionCaches *new;
+    bool packed = virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED);
+    /* With the split layout, the event fields follow the rings */
+    hwaddr event_size = packed ? 0 : sizeof(uint16_t);
+
+    if (!vq->vring.desc || !vq->vring.num) {
+        virtio_virtqueue_reset_region_cache(vq);
+        return;
+    }
+
+    new = g_new0(VRingMemoryRegionCaches, 1);
+    /* The packed layout returns used descriptors in the descriptor ring */
+    address_space_cache_init(&new->desc, &address_space_memory,
+                             vq->vring.desc,
+                             virtio_queue_get_desc_size(vdev, n), packed);
+    address_space_cache_init(&new->avail, &address_space_memory,
+                             vq->vring.avail,
+                             virtio_queue_get_avail_size(vdev, n) +
+                             event_size, false);
+    address_space_cache_init(&new->used, &address_space_memory,
+                             vq->vring.used,
+                             virtio_queue_get_used_size(vdev, n) +
+                             event_size, true);
+
+    virtio_virtqueue_reset_region_cache(vq);
+    atomic_rcu_set(&vq->vring.caches, new);
+}
+
 /* virt queue functions */
 void virtio_queue_update_rings(VirtIODevice *vdev, int n)
 {
@@ -117,39 +206,162 @@ void virtio_queue_update_rings(VirtIODevice *vdev, int n)
     vring->used = vring_align(vring->avail +
                               offsetof(VRingAvail, ring[vring->num]),
                               vring->align);
+    virtio_init_region_cache(vdev, n);
+}
+
+/*
+ * The ring accessors below are called within rcu_read_lock(), which keeps
+ * the caches alive.  Before the rings are set up, reads return 0 and
+ * writes are dropped.
+ */
+static VRingMemoryRegionCaches *vring_get_region_caches(VirtQueue *vq)
+{
+    return atomic_rcu_read(&vq->vring.caches);
 }
 
 static void vring_desc_read(VirtIODevice *vdev, VRingDesc *desc,
-                            hwaddr desc_pa, int i)
+                            MemoryRegionCache *cache, int i)
 {
-    address_space_read(&address_space_memory, desc_pa + i * sizeof(VRingDesc),
-                       MEMTXATTRS_UNSPECIFIED, (void *)desc, sizeof(VRingDesc));
+    address_space_read_cached(cache, i * sizeof(VRingDesc),
+                              desc, sizeof(VRingDesc));
     virtio_tswap64s(vdev, &desc->addr);
     virtio_tswap32s(vdev, &desc->len);
     virtio_tswap16s(vdev, &desc->flags);
     virtio_tswap16s(vdev, &desc->next);
 }
 
+static void vring_packed_desc_read_flags(VirtIODevice *vdev, uint16_t *flags,
+                                         MemoryRegionCache *cache, int i)
+{
+    *flags = virtio_lduw_phys_cached(vdev, cache,
+                                     i * sizeof(VRingPackedDesc) +
+                                     offsetof(VRingPackedDesc, flags));
+}
+
+static void vring_packed_desc_read(VirtIODevice *vdev, VRingPackedDesc *desc,
+                                   MemoryRegionCache *cache, int i,
+                                   bool strict_order)
+{
+    hwaddr off = i * sizeof(VRingPackedDesc);
+
+    vring_packed_desc_read_flags(vdev, &desc->flags, cache, i);
+    if (strict_order) {
+        /* The rest of the descriptor is only valid once flags say so */
+        smp_rmb();
+    }
+    address_space_read_cached(cache, off + offsetof(VRingPackedDesc, addr),
+                              &desc->addr, sizeof(desc->addr));
+    address_space_read_cached(cache, off + offsetof(VRingPackedDesc, len),
+                              &desc->len, sizeof(desc->len));
+    address_space_read_cached(cache, off + offsetof(VRingPackedDesc, id),
+                              &desc->id, sizeof(desc->id));
+    virtio_tswap64s(vdev, &desc->addr);
+    virtio_tswap32s(vdev, &desc->len);
+    virtio_tswap16s(vdev, &desc->id);
+}
+
+static void vring_packed_desc_write_data(VirtIODevice *vdev,
+                                         VRingPackedDesc *desc,
+                                         MemoryRegionCache *cache, int i)
+{
+    hwaddr off = i * sizeof(VRingPackedDesc);
+
+    virtio_tswap32s(vdev, &desc->len);
+    virtio_tswap16s(vdev, &desc->id);
+    address_space_write_cached(cache, off + offsetof(VRingPackedDesc, id),
+                               &desc->id, sizeof(desc->id));
+    address_space_write_cached(cache, off + offsetof(VRingPackedDesc, len),
+                               &desc->len, sizeof(desc->len));
+}
+
+/* Hand a used descriptor back to the driver, after its id and length */
+static void vring_packed_desc_write_flags(VirtIODevice *vdev,
+                                          MemoryRegionCache *cache, int i,
+                                          bool wrap_counter)
+{
+    uint16_t flags = 0;
+
+    if (wrap_counter) {
+        flags |= 1 << VRING_PACKED_DESC_F_AVAIL;
+        flags |= 1 << VRING_PACKED_DESC_F_USED;
+    }
+    smp_wmb();
+    virtio_stw_phys_cached(vdev, cache,
+                           i * sizeof(VRingPackedDesc) +
+                           offsetof(VRingPackedDesc, flags), flags);
+}
+
+static bool is_desc_avail(uint16_t flags, bool wrap_counter)
+{
+    bool avail, used;
+
+    avail = !!(flags & (1 << VRING_PACKED_DESC_F_AVAIL));
+    used = !!(flags & (1 << VRING_PACKED_DESC_F_USED));
+    return (avail != used) && (avail == wrap_counter);
+}
+
+static void vring_packed_event_read(VirtIODevice *vdev,
+                                    MemoryRegionCache *cache,
+                                    VRingPackedDescEvent *e)
+{
+    e->flags = virtio_lduw_phys_cached(vdev, cache,
+                                       offsetof(VRingPackedDescEvent, flags));
+    /* off_wrap is only meaningful with VRING_PACKED_EVENT_FLAG_DESC */
+    smp_rmb();
+    e->off_wrap = virtio_lduw_phys_cached(vdev, cache,
+                                          offsetof(VRingPackedDescEvent,
+                                                   off_wrap));
+}
+
+static void vring_packed_off_wrap_write(VirtIODevice *vdev,
+                                        MemoryRegionCache *cache,
+                                        uint16_t off_wrap)
+{
+    virtio_stw_phys_cached(vdev, cache,
+                           offsetof(VRingPackedDescEvent, off_wrap),
+                           off_wrap);
+}
+
+static void vring_packed_flags_write(VirtIODevice *vdev,
+                                     MemoryRegionCache *cache, uint16_t flags)
+{
+    virtio_stw_phys_cached(vdev, cache,
+                           offsetof(VRingPackedDescEvent, flags), flags);
+}
+
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, flags);
-    return virtio_lduw_phys(vq->vdev, pa);
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    hwaddr pa = offsetof(VRingAvail, flags);
+
+    if (!caches) {
+        return 0;
+    }
+    return virtio_lduw_phys_cached(vq->vdev, &caches->avail, pa);
 }
 
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, idx);
-    vq->shadow_avail_idx = virtio_lduw_phys(vq->vdev, pa);
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    hwaddr pa = offsetof(VRingAvail, idx);
+
+    if (!caches) {
+        return 0;
+    }
+    vq->shadow_avail_idx = virtio_lduw_phys_cached(vq->vdev, &caches->avail,
+                                                   pa);
     return vq->shadow_avail_idx;
 }
 
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
-    return virtio_lduw_phys(vq->vdev, pa);
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    hwaddr pa = offsetof(VRingAvail, ring[i]);
+
+    if (!caches) {
+        return 0;
+    }
+    return virtio_lduw_phys_cached(vq->vdev, &caches->avail, pa);
 }
 
 static inline uint16_t vring_get_used_event(VirtQueue *vq)
@@ -160,58 +372,104 @@ static inline uint16_t vring_get_used_event(VirtQueue *vq)
 static inline void vring_used_write(VirtQueue *vq, VRingUsedElem *uelem,
                                     int i)
 {
-    hwaddr pa;
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    hwaddr pa = offsetof(VRingUsed, ring[i]);
+
+    if (!caches) {
+        return;
+    }
     virtio_tswap32s(vq->vdev, &uelem->id);
     virtio_tswap32s(vq->vdev, &uelem->len);
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i]);
-    address_space_write(&address_space_memory, pa, MEMTXATTRS_UNSPECIFIED,
-                       (void *)uelem, sizeof(VRingUsedElem));
+    address_space_write_cached(&caches->used, pa, uelem,
+                               sizeof(VRingUsedElem));
 }
 
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    return virtio_lduw_phys(vq->vdev, pa);
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    hwaddr pa = offsetof(VRingUsed, idx);
+
+    if (!caches) {
+        return 0;
+    }
+    return virtio_lduw_phys_cached(vq->vdev, &caches->used, pa);
 }
 
 static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    virtio_stw_phys(vq->vdev, pa, val);
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    hwaddr pa = offsetof(VRingUsed, idx);
+
+    if (caches) {
+        virtio_stw_phys_cached(vq->vdev, &caches->used, pa, val);
+    }
     vq->used_idx = val;
 }
 
 static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
 {
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
     VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) | mask);
+    hwaddr pa = offsetof(VRingUsed, flags);
+
+    if (!caches) {
+        return;
+    }
+    virtio_stw_phys_cached(vdev, &caches->used, pa,
+                           virtio_lduw_phys_cached(vdev, &caches->used, pa) |
+                           mask);
 }
 
 static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
 {
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
     VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) & ~mask);
+    hwaddr pa = offsetof(VRingUsed, flags);
+
+    if (!caches) {
+        return;
+    }
+    virtio_stw_phys_cached(vdev, &caches->used, pa,
+                           virtio_lduw_phys_cached(vdev, &caches->used, pa) &
+                           ~mask);
 }
 
 static inline void vring_set_avail_event(VirtQueue *vq, uint16_t val)
 {
+    VRingMemoryRegionCaches *caches;
     hwaddr pa;
+
     if (!vq->notification) {
         return;
     }
-    pa = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]);
-    virtio_stw_phys(vq->vdev, pa, val);
+    caches = vring_get_region_caches(vq);
+    if (!caches) {
+        return;
+    }
+    pa = offsetof(VRingUsed, ring[vq->vring.num]);
+    virtio_stw_phys_cached(vq->vdev, &caches->used, pa, val);
 }
 
-void virtio_queue_set_notification(VirtQueue *vq, int enable)
+/* Ask the driver for a kick once it makes the next descriptor available */
+static void vring_packed_set_avail_event(VirtQueue *vq)
+{
+    VRingMemoryRegionCaches *caches;
+
+    if (!vq->notification) {
+        return;
+    }
+    caches = vring_get_region_caches(vq);
+    if (!caches) {
+        return;
+    }
+    vring_packed_off_wrap_write(vq->vdev, &caches->used,
+                                vq->last_avail_idx |
+                                vq->last_avail_wrap_counter <<
+                                VRING_PACKED_EVENT_F_WRAP_CTR);
+}
+
+static void virtio_queue_split_set_notification(VirtQueue *vq, int enable)
 {
-    vq->notification = enable;
     if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
         vring_set_avail_event(vq, vring_avail_idx(vq));
     } else if (enable) {
@@ -219,6 +477,42 @@ void virtio_queue_set_notification(VirtQueue *vq, int enable)
     } else {
         vring_used_flags_set_bit(vq, VRING_USED_F_NO_NOTIFY);
     }
+}
+
+static void virtio_queue_packed_set_notification(VirtQueue *vq, int enable)
+{
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    uint16_t flags;
+
+    if (!caches) {
+        return;
+    }
+
+    if (!enable) {
+        flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+    } else if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_packed_set_avail_event(vq);
+        /* The offset must be visible before the flags that enable it */
+        smp_wmb();
+        flags = VRING_PACKED_EVENT_FLAG_DESC;
+    } else {
+        flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+    }
+    vring_packed_flags_write(vq->vdev, &caches->used, flags);
+}
+
+void virtio_queue_set_notification(VirtQueue *vq, int enable)
+{
+    vq->notification = enable;
+
+    rcu_read_lock();
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtio_queue_packed_set_notification(vq, enable);
+    } else {
+        virtio_queue_split_set_notification(vq, enable);
+    }
+    rcu_read_unlock();
+
     if (enable) {
         /* Expose avail event/used flags before caller checks the avail idx. */
         smp_mb();
@@ -232,7 +526,8 @@ int virtio_queue_ready(VirtQueue *vq)
 
 /* Fetch avail_idx from VQ memory only when we really need to know if
  * guest has added some buffers. */
-int virtio_queue_empty(VirtQueue *vq)
+/* Called within rcu_read_lock().  */
+static int virtio_queue_split_empty(VirtQueue *vq)
 {
     if (vq->shadow_avail_idx != vq->last_avail_idx) {
         return 0;
@@ -241,6 +536,35 @@ int virtio_queue_empty(VirtQueue *vq)
     return vring_avail_idx(vq) == vq->last_avail_idx;
 }
 
+/* Called within rcu_read_lock().  */
+static int virtio_queue_packed_empty(VirtQueue *vq)
+{
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    uint16_t flags;
+
+    if (!caches) {
+        return 1;
+    }
+
+    vring_packed_desc_read_flags(vq->vdev, &flags, &caches->desc,
+                                 vq->last_avail_idx);
+    return !is_desc_avail(flags, vq->last_avail_wrap_counter);
+}
+
+int virtio_queue_empty(VirtQueue *vq)
+{
+    bool empty;
+
+    rcu_read_lock();
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        empty = virtio_queue_packed_empty(vq);
+    } else {
+        empty = virtio_queue_split_empty(vq);
+    }
+    rcu_read_unlock();
+    return empty;
+}
+
 static void virtqueue_unmap_sg(VirtQueue *vq, const VirtQueueElement *elem,
                                unsigned int len)
 {
@@ -267,20 +591,27 @@ static void virtqueue_unmap_sg(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem,
                        unsigned int len)
 {
-    vq->last_avail_idx--;
-    vq->inuse--;
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        if (vq->last_avail_idx < elem->ndescs) {
+            vq->last_avail_idx += vq->vring.num;
+            vq->last_avail_wrap_counter ^= 1;
+        }
+        vq->last_avail_idx -= elem->ndescs;
+        vq->shadow_avail_idx = vq->last_avail_idx;
+        vq->shadow_avail_wrap_counter = vq->last_avail_wrap_counter;
+        vq->inuse -= elem->ndescs;
+    } else {
+        vq->last_avail_idx--;
+        vq->inuse--;
+    }
     virtqueue_unmap_sg(vq, elem, len);
 }
 
-void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
-                    unsigned int len, unsigned int idx)
+static void virtqueue_split_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                                 unsigned int len, unsigned int idx)
 {
     VRingUsedElem uelem;
 
-    trace_virtqueue_fill(vq, elem, len, idx);
-
-    virtqueue_unmap_sg(vq, elem, len);
-
     idx = (idx + vq->used_idx) % vq->vring.num;
 
     uelem.id = elem->index;
@@ -288,12 +619,63 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
     vring_used_write(vq, &uelem, idx);
 }
 
-void virtqueue_flush(VirtQueue *vq, unsigned int count)
+/*
+ * With the packed layout, used elements go back to the descriptor ring
+ * in the order they are filled, whatever @idx says.  Each one takes the
+ * ring slots of the chain it came from.  The flags of the first element
+ * are only written by virtqueue_flush(), so that the driver sees the
+ * whole batch at once.
+ */
+static void virtqueue_packed_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                                  unsigned int len)
+{
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    VRingPackedDesc desc = {
+        .id = elem->index,
+        .len = len,
+    };
+    bool wrap_counter = vq->used_wrap_counter;
+    bool first = !vq->used_pending;
+    unsigned int head;
+
+    head = vq->used_idx + vq->used_pending;
+    if (head >= vq->vring.num) {
+        head -= vq->vring.num;
+        wrap_counter ^= 1;
+    }
+    vq->used_pending += elem->ndescs;
+
+    if (!caches) {
+        return;
+    }
+    vring_packed_desc_write_data(vq->vdev, &desc, &caches->desc, head);
+    if (!first) {
+        vring_packed_desc_write_flags(vq->vdev, &caches->desc, head,
+                                      wrap_counter);
+    }
+}
+
+void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                    unsigned int len, unsigned int idx)
+{
+    trace_virtqueue_fill(vq, elem, len, idx);
+
+    virtqueue_unmap_sg(vq, elem, len);
+
+    rcu_read_lock();
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtqueue_packed_fill(vq, elem, len);
+    } else {
+        virtqueue_split_fill(vq, elem, len, idx);
+    }
+    rcu_read_unlock();
+}
+
+static void virtqueue_split_flush(VirtQueue *vq, unsigned int count)
 {
     uint16_t old, new;
     /* Make sure buffer is written before we update index. */
     smp_wmb();
-    trace_virtqueue_flush(vq, count);
     old = vq->used_idx;
     new = old + count;
     vring_used_idx_set(vq, new);
@@ -302,6 +684,40 @@ void virtqueue_flush(VirtQueue *vq, unsigned int count)
         vq->signalled_used_valid = false;
 }
 
+static void virtqueue_packed_flush(VirtQueue *vq, unsigned int count)
+{
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+
+    if (!count || !vq->used_pending) {
+        return;
+    }
+
+    if (caches) {
+        vring_packed_desc_write_flags(vq->vdev, &caches->desc, vq->used_idx,
+                                      vq->used_wrap_counter);
+    }
+
+    vq->inuse -= vq->used_pending;
+    vq->used_idx += vq->used_pending;
+    if (vq->used_idx >= vq->vring.num) {
+        vq->used_idx -= vq->vring.num;
+        vq->used_wrap_counter ^= 1;
+    }
+    vq->used_pending = 0;
+}
+
+void virtqueue_flush(VirtQueue *vq, unsigned int count)
+{
+    trace_virtqueue_flush(vq, count);
+    rcu_read_lock();
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtqueue_packed_flush(vq, count);
+    } else {
+        virtqueue_split_flush(vq, count);
+    }
+    rcu_read_unlock();
+}
+
 void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len)
 {
@@ -309,6 +725,20 @@ void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
     virtqueue_flush(vq, 1);
 }
 
+void virtqueue_push_batch(VirtQueue *vq, VirtQueueElement **elems,
+                          const unsigned int *lens, unsigned int count)
+{
+    unsigned int i;
+
+    if (!count) {
+        return;
+    }
+    for (i = 0; i < count; i++) {
+        virtqueue_fill(vq, elems[i], lens ? lens[i] : 0, i);
+    }
+    virtqueue_flush(vq, count);
+}
+
 static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
 {
     uint16_t num_heads = vring_avail_idx(vq) - idx;
@@ -346,7 +776,8 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
 }
 
 static unsigned virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
-                                         hwaddr desc_pa, unsigned int max)
+                                         MemoryRegionCache *desc_cache,
+                                         unsigned int max)
 {
     unsigned int next;
 
@@ -365,35 +796,40 @@ static unsigned virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
         exit(1);
     }
 
-    vring_desc_read(vdev, desc, desc_pa, next);
+    vring_desc_read(vdev, desc, desc_cache, next);
     return next;
 }
 
-void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
-                               unsigned int *out_bytes,
-                               unsigned max_in_bytes, unsigned max_out_bytes)
+static void virtqueue_split_get_avail_bytes(VirtQueue *vq,
+                                            VRingMemoryRegionCaches *caches,
+                                            unsigned int *in_bytes,
+                                            unsigned int *out_bytes,
+                                            unsigned max_in_bytes,
+                                            unsigned max_out_bytes)
 {
+    MemoryRegionCache indirect_desc_cache;
     unsigned int idx;
     unsigned int total_bufs, in_total, out_total;
 
     idx = vq->last_avail_idx;
 
     total_bufs = in_total = out_total = 0;
+
     while (virtqueue_num_heads(vq, idx)) {
         VirtIODevice *vdev = vq->vdev;
         unsigned int max, num_bufs, indirect = 0;
+        MemoryRegionCache *desc_cache;
         VRingDesc desc;
-        hwaddr desc_pa;
         int i;
 
         max = vq->vring.num;
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
-        desc_pa = vq->vring.desc;
-        vring_desc_read(vdev, &desc, desc_pa, i);
+        desc_cache = &caches->desc;
+        vring_desc_read(vdev, &desc, desc_cache, i);
 
         if (desc.flags & VRING_DESC_F_INDIRECT) {
-            if (desc.len % sizeof(VRingDesc)) {
+            if (!desc.len || (desc.len % sizeof(VRingDesc))) {
                 error_report("Invalid size for indirect buffer table");
                 exit(1);
             }
@@ -407,9 +843,12 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
             /* loop over the indirect descriptor table */
             indirect = 1;
             max = desc.len / sizeof(VRingDesc);
-            desc_pa = desc.addr;
+            address_space_cache_init(&indirect_desc_cache,
+                                     &address_space_memory,
+                                     desc.addr, desc.len, false);
+            desc_cache = &indirect_desc_cache;
             num_bufs = i = 0;
-            vring_desc_read(vdev, &desc, desc_pa, i);
+            vring_desc_read(vdev, &desc, desc_cache, i);
         }
 
         do {
@@ -425,16 +864,166 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                 out_total += desc.len;
             }
             if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
+                if (indirect) {
+                    address_space_cache_destroy(&indirect_desc_cache);
+                }
                 goto done;
             }
-        } while ((i = virtqueue_read_next_desc(vdev, &desc, desc_pa, max)) != max);
+        } while ((i = virtqueue_read_next_desc(vdev, &desc, desc_cache,
+                                               max)) != max);
 
-        if (!indirect)
+        if (!indirect) {
             total_bufs = num_bufs;
-        else
+        } else {
+            address_space_cache_destroy(&indirect_desc_cache);
             total_bufs++;
+        }
     }
 done:
+    *in_bytes = in_total;
+    *out_bytes = out_total;
+}
+
+static bool virtqueue_packed_read_next_desc(VirtQueue *vq,
+                                            VRingPackedDesc *desc,
+                                            MemoryRegionCache *desc_cache,
+                                            unsigned int max,
+                                            unsigned int *next,
+                                            bool indirect)
+{
+    /* Indirect tables are used whole, NEXT is ignored there */
+    if (!indirect && !(desc->flags & VRING_DESC_F_NEXT)) {
+        return false;
+    }
+
+    ++*next;
+    if (*next == max) {
+        if (indirect) {
+            return false;
+        }
+        /* Chains wrap around the end of the ring */
+        *next = 0;
+    }
+
+    vring_packed_desc_read(vq->vdev, desc, desc_cache, *next, false);
+    return true;
+}
+
+static void virtqueue_packed_get_avail_bytes(VirtQueue *vq,
+                                             VRingMemoryRegionCaches *caches,
+                                             unsigned int *in_bytes,
+                                             unsigned int *out_bytes,
+                                             unsigned max_in_bytes,
+                                             unsigned max_out_bytes)
+{
+    VirtIODevice *vdev = vq->vdev;
+    MemoryRegionCache indirect_desc_cache;
+    unsigned int idx;
+    unsigned int total_bufs, in_total, out_total;
+    bool wrap_counter;
+
+    idx = vq->last_avail_idx;
+    wrap_counter = vq->last_avail_wrap_counter;
+
+    total_bufs = in_total = out_total = 0;
+
+    for (;;) {
+        unsigned int max, num_bufs;
+        MemoryRegionCache *desc_cache;
+        VRingPackedDesc desc;
+        bool indirect = false;
+        unsigned int i;
+
+        max = vq->vring.num;
+        num_bufs = total_bufs;
+        i = idx;
+        desc_cache = &caches->desc;
+        vring_packed_desc_read(vdev, &desc, desc_cache, i, true);
+        if (!is_desc_avail(desc.flags, wrap_counter)) {
+            break;
+        }
+
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (!desc.len || (desc.len % sizeof(VRingPackedDesc))) {
+                error_report("Invalid size for indirect buffer table");
+                exit(1);
+            }
+
+            /* If we've got too many, that implies a descriptor loop. */
+            if (num_bufs >= max) {
+                error_report("Looped descriptor");
+                exit(1);
+            }
+
+            /* loop over the indirect descriptor table */
+            indirect = true;
+            max = desc.len / sizeof(VRingPackedDesc);
+            address_space_cache_init(&indirect_desc_cache,
+                                     &address_space_memory,
+                                     desc.addr, desc.len, false);
+            desc_cache = &indirect_desc_cache;
+            num_bufs = i = 0;
+            vring_packed_desc_read(vdev, &desc, desc_cache, i, false);
+        }
+
+        do {
+            /* If we've got too many, that implies a descriptor loop. */
+            if (++num_bufs > max) {
+                error_report("Looped descriptor");
+                exit(1);
+            }
+
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                in_total += desc.len;
+            } else {
+                out_total += desc.len;
+            }
+            if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
+                if (indirect) {
+                    address_space_cache_destroy(&indirect_desc_cache);
+                }
+                goto done;
+            }
+        } while (virtqueue_packed_read_next_desc(vq, &desc, desc_cache, max,
+                                                 &i, indirect));
+
+        if (indirect) {
+            address_space_cache_destroy(&indirect_desc_cache);
+            total_bufs++;
+            idx++;
+        } else {
+            idx += num_bufs - total_bufs;
+            total_bufs = num_bufs;
+        }
+
+        if (idx >= vq->vring.num) {
+            idx -= vq->vring.num;
+            wrap_counter ^= 1;
+        }
+    }
+done:
+    *in_bytes = in_total;
+    *out_bytes = out_total;
+}
+
+void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
+                               unsigned int *out_bytes,
+                               unsigned max_in_bytes, unsigned max_out_bytes)
+{
+    VRingMemoryRegionCaches *caches;
+    unsigned int in_total = 0, out_total = 0;
+
+    rcu_read_lock();
+    caches = vring_get_region_caches(vq);
+    if (caches && virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtqueue_packed_get_avail_bytes(vq, caches, &in_total, &out_total,
+                                         max_in_bytes, max_out_bytes);
+    } else if (caches) {
+        virtqueue_split_get_avail_bytes(vq, caches, &in_total, &out_total,
+                                        max_in_bytes, max_out_bytes);
+    }
+    rcu_read_unlock();
+
     if (in_bytes) {
         *in_bytes = in_total;
     }
@@ -502,62 +1091,159 @@ static void virtqueue_map_iovec(struct iovec *sg, hwaddr *addr,
 #endif
     assert(*num_sg <= max_size);
 
-    for (i = 0; i < *num_sg; i++) {
-        len = sg[i].iov_len;
-        sg[i].iov_base = cpu_physical_memory_map(addr[i], &len, is_write);
-        if (!sg[i].iov_base) {
-            error_report("virtio: error trying to map MMIO memory");
-            exit(1);
-        }
-        if (len != sg[i].iov_len) {
-            error_report("virtio: unexpected memory split");
-            exit(1);
-        }
+    for (i = 0; i < *num_sg; i++) {
+        len = sg[i].iov_len;
+        sg[i].iov_base = cpu_physical_memory_map(addr[i], &len, is_write);
+        if (!sg[i].iov_base) {
+            error_report("virtio: error trying to map MMIO memory");
+            exit(1);
+        }
+        if (len != sg[i].iov_len) {
+            error_report("virtio: unexpected memory split");
+            exit(1);
+        }
+    }
+}
+
+void virtqueue_map(VirtQueueElement *elem)
+{
+    virtqueue_map_iovec(elem->in_sg, elem->in_addr, &elem->in_num,
+                        VIRTQUEUE_MAX_SIZE, 1);
+    virtqueue_map_iovec(elem->out_sg, elem->out_addr, &elem->out_num,
+                        VIRTQUEUE_MAX_SIZE, 0);
+}
+
+/*
+ * Lay out an element of @sz bytes followed by its scatter-gather arrays
+ * in @elem, which may be NULL to just get the total size.
+ */
+static size_t virtqueue_element_layout(VirtQueueElement *elem, size_t sz,
+                                       unsigned out_num, unsigned in_num)
+{
+    size_t in_addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0]));
+    size_t out_addr_ofs = in_addr_ofs + in_num * sizeof(elem->in_addr[0]);
+    size_t out_addr_end = out_addr_ofs + out_num * sizeof(elem->out_addr[0]);
+    size_t in_sg_ofs = QEMU_ALIGN_UP(out_addr_end, __alignof__(elem->in_sg[0]));
+    size_t out_sg_ofs = in_sg_ofs + in_num * sizeof(elem->in_sg[0]);
+    size_t out_sg_end = out_sg_ofs + out_num * sizeof(elem->out_sg[0]);
+
+    assert(sz >= sizeof(VirtQueueElement));
+    if (elem) {
+        elem->ndescs = 1;
+        elem->out_num = out_num;
+        elem->in_num = in_num;
+        elem->in_addr = (void *)elem + in_addr_ofs;
+        elem->out_addr = (void *)elem + out_addr_ofs;
+        elem->in_sg = (void *)elem + in_sg_ofs;
+        elem->out_sg = (void *)elem + out_sg_ofs;
+    }
+    return out_sg_end;
+}
+
+void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
+{
+    VirtQueueElement *elem;
+
+    elem = g_malloc(virtqueue_element_layout(NULL, sz, out_num, in_num));
+    virtqueue_element_layout(elem, sz, out_num, in_num);
+    return elem;
+}
+
+/*
+ * A pool is a single allocation carved into equally sized slots, each
+ * big enough for an element with up to max_sg buffers.  Elements that
+ * don't fit, or that are popped while the pool is empty, come from the
+ * heap as usual; virtqueue_element_release() tells them apart by their
+ * address.
+ */
+struct VirtQueueElementPool {
+    size_t sz;
+    size_t slot_size;
+    unsigned int nr_slots;
+    unsigned int nr_free;
+    uint8_t *slots;
+    void **free;
+};
+
+VirtQueueElementPool *virtqueue_element_pool_new(size_t sz,
+                                                 unsigned int max_sg,
+                                                 unsigned int nr_slots)
+{
+    VirtQueueElementPool *pool = g_new0(VirtQueueElementPool, 1);
+    unsigned int i;
+
+    pool->sz = sz;
+    /* The layout only depends on the total number of buffers */
+    pool->slot_size = QEMU_ALIGN_UP(virtqueue_element_layout(NULL, sz,
+                                                             max_sg, 0),
+                                    __alignof__(VirtQueueElement));
+    pool->nr_slots = nr_slots;
+    pool->slots = g_malloc(pool->slot_size * nr_slots);
+    pool->free = g_new(void *, nr_slots);
+    for (i = 0; i < nr_slots; i++) {
+        pool->free[i] = pool->slots + (nr_slots - 1 - i) * pool->slot_size;
     }
+    pool->nr_free = nr_slots;
+    return pool;
 }
 
-void virtqueue_map(VirtQueueElement *elem)
+void virtqueue_element_pool_free(VirtQueueElementPool *pool)
 {
-    virtqueue_map_iovec(elem->in_sg, elem->in_addr, &elem->in_num,
-                        VIRTQUEUE_MAX_SIZE, 1);
-    virtqueue_map_iovec(elem->out_sg, elem->out_addr, &elem->out_num,
-                        VIRTQUEUE_MAX_SIZE, 0);
+    if (!pool) {
+        return;
+    }
+    g_free(pool->slots);
+    g_free(pool->free);
+    g_free(pool);
 }
 
-void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
+static void *virtqueue_element_get(VirtQueueElementPool *pool, size_t sz,
+                                   unsigned out_num, unsigned in_num)
 {
     VirtQueueElement *elem;
-    size_t in_addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0]));
-    size_t out_addr_ofs = in_addr_ofs + in_num * sizeof(elem->in_addr[0]);
-    size_t out_addr_end = out_addr_ofs + out_num * sizeof(elem->out_addr[0]);
-    size_t in_sg_ofs = QEMU_ALIGN_UP(out_addr_end, __alignof__(elem->in_sg[0]));
-    size_t out_sg_ofs = in_sg_ofs + in_num * sizeof(elem->in_sg[0]);
-    size_t out_sg_end = out_sg_ofs + out_num * sizeof(elem->out_sg[0]);
 
-    assert(sz >= sizeof(VirtQueueElement));
-    elem = g_malloc(out_sg_end);
-    elem->out_num = out_num;
-    elem->in_num = in_num;
-    elem->in_addr = (void *)elem + in_addr_ofs;
-    elem->out_addr = (void *)elem + out_addr_ofs;
-    elem->in_sg = (void *)elem + in_sg_ofs;
-    elem->out_sg = (void *)elem + out_sg_ofs;
+    if (!pool || !pool->nr_free ||
+        virtqueue_element_layout(NULL, pool->sz, out_num, in_num) >
+        pool->slot_size) {
+        return virtqueue_alloc_element(sz, out_num, in_num);
+    }
+    elem = pool->free[--pool->nr_free];
+    virtqueue_element_layout(elem, pool->sz, out_num, in_num);
     return elem;
 }
 
-void *virtqueue_pop(VirtQueue *vq, size_t sz)
+void virtqueue_element_release(VirtQueueElementPool *pool, void *elem)
+{
+    uint8_t *p = elem;
+
+    if (pool && p >= pool->slots &&
+        p < pool->slots + pool->slot_size * pool->nr_slots) {
+        assert(pool->nr_free < pool->nr_slots);
+        pool->free[pool->nr_free++] = elem;
+    } else {
+        g_free(elem);
+    }
+}
+
+static void *virtqueue_split_pop(VirtQueue *vq, size_t sz,
+                                 VirtQueueElementPool *pool)
 {
     unsigned int i, head, max;
-    hwaddr desc_pa = vq->vring.desc;
+    VRingMemoryRegionCaches *caches;
+    MemoryRegionCache indirect_desc_cache;
+    MemoryRegionCache *desc_cache;
     VirtIODevice *vdev = vq->vdev;
-    VirtQueueElement *elem;
+    VirtQueueElement *elem = NULL;
     unsigned out_num, in_num;
     hwaddr addr[VIRTQUEUE_MAX_SIZE];
     struct iovec iov[VIRTQUEUE_MAX_SIZE];
     VRingDesc desc;
+    bool indirect = false;
 
-    if (virtio_queue_empty(vq)) {
-        return NULL;
+    rcu_read_lock();
+    caches = vring_get_region_caches(vq);
+    if (!caches || virtio_queue_split_empty(vq)) {
+        goto done;
     }
     /* Needed after virtio_queue_empty(), see comment in
      * virtqueue_num_heads(). */
@@ -578,18 +1264,22 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
         vring_set_avail_event(vq, vq->last_avail_idx);
     }
 
-    vring_desc_read(vdev, &desc, desc_pa, i);
+    desc_cache = &caches->desc;
+    vring_desc_read(vdev, &desc, desc_cache, i);
     if (desc.flags & VRING_DESC_F_INDIRECT) {
-        if (desc.len % sizeof(VRingDesc)) {
+        if (!desc.len || (desc.len % sizeof(VRingDesc))) {
             error_report("Invalid size for indirect buffer table");
             exit(1);
         }
 
         /* loop over the indirect descriptor table */
         max = desc.len / sizeof(VRingDesc);
-        desc_pa = desc.addr;
+        address_space_cache_init(&indirect_desc_cache, &address_space_memory,
+                                 desc.addr, desc.len, false);
+        desc_cache = &indirect_desc_cache;
+        indirect = true;
         i = 0;
-        vring_desc_read(vdev, &desc, desc_pa, i);
+        vring_desc_read(vdev, &desc, desc_cache, i);
     }
 
     /* Collect all the descriptors */
@@ -611,10 +1301,15 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_read_next_desc(vdev, &desc, desc_pa, max)) != max);
+    } while ((i = virtqueue_read_next_desc(vdev, &desc, desc_cache,
+                                           max)) != max);
+
+    if (indirect) {
+        address_space_cache_destroy(&indirect_desc_cache);
+    }
 
     /* Now copy what we have collected and mapped */
-    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem = virtqueue_element_get(pool, sz, out_num, in_num);
     elem->index = head;
     for (i = 0; i < out_num; i++) {
         elem->out_addr[i] = addr[i];
@@ -628,9 +1323,157 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     vq->inuse++;
 
     trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
+done:
+    rcu_read_unlock();
+    return elem;
+}
+
+static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz,
+                                  VirtQueueElementPool *pool)
+{
+    unsigned int i, max;
+    VRingMemoryRegionCaches *caches;
+    MemoryRegionCache indirect_desc_cache;
+    MemoryRegionCache *desc_cache;
+    VirtIODevice *vdev = vq->vdev;
+    VirtQueueElement *elem = NULL;
+    unsigned out_num, in_num, elem_entries;
+    hwaddr addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    VRingPackedDesc desc;
+    uint16_t id;
+    bool indirect = false;
+
+    rcu_read_lock();
+    caches = vring_get_region_caches(vq);
+    if (!caches || virtio_queue_packed_empty(vq)) {
+        goto done;
+    }
+
+    /* When we start there are none of either input nor output. */
+    out_num = in_num = elem_entries = 0;
+
+    max = vq->vring.num;
+
+    if (vq->inuse >= vq->vring.num) {
+        error_report("Virtqueue size exceeded");
+        exit(1);
+    }
+
+    i = vq->last_avail_idx;
+    desc_cache = &caches->desc;
+    vring_packed_desc_read(vdev, &desc, desc_cache, i, true);
+    id = desc.id;
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (!desc.len || (desc.len % sizeof(VRingPackedDesc))) {
+            error_report("Invalid size for indirect buffer table");
+            exit(1);
+        }
+
+        /* loop over the indirect descriptor table */
+        max = desc.len / sizeof(VRingPackedDesc);
+        address_space_cache_init(&indirect_desc_cache, &address_space_memory,
+                                 desc.addr, desc.len, false);
+        desc_cache = &indirect_desc_cache;
+        indirect = true;
+        i = 0;
+        vring_packed_desc_read(vdev, &desc, desc_cache, i, false);
+    }
+
+    /* Collect all the descriptors */
+    do {
+        /* The buffer id is in the last descriptor of a direct chain */
+        if (!indirect) {
+            id = desc.id;
+        }
+
+        if (desc.flags & VRING_DESC_F_WRITE) {
+            virtqueue_map_desc(&in_num, addr + out_num, iov + out_num,
+                               VIRTQUEUE_MAX_SIZE - out_num, true,
+                               desc.addr, desc.len);
+        } else {
+            if (in_num) {
+                error_report("Incorrect order for descriptors");
+                exit(1);
+            }
+            virtqueue_map_desc(&out_num, addr, iov,
+                               VIRTQUEUE_MAX_SIZE, false, desc.addr, desc.len);
+        }
+
+        /* If we've got too many, that implies a descriptor loop. */
+        if (++elem_entries > max || (in_num + out_num) > max) {
+            error_report("Looped descriptor");
+            exit(1);
+        }
+    } while (virtqueue_packed_read_next_desc(vq, &desc, desc_cache, max, &i,
+                                             indirect));
+
+    if (indirect) {
+        address_space_cache_destroy(&indirect_desc_cache);
+    }
+
+    /* Now copy what we have collected and mapped */
+    elem = virtqueue_element_get(pool, sz, out_num, in_num);
+    elem->index = id;
+    elem->ndescs = indirect ? 1 : elem_entries;
+    for (i = 0; i < out_num; i++) {
+        elem->out_addr[i] = addr[i];
+        elem->out_sg[i] = iov[i];
+    }
+    for (i = 0; i < in_num; i++) {
+        elem->in_addr[i] = addr[out_num + i];
+        elem->in_sg[i] = iov[out_num + i];
+    }
+
+    vq->inuse += elem->ndescs;
+    vq->last_avail_idx += elem->ndescs;
+    if (vq->last_avail_idx >= vq->vring.num) {
+        vq->last_avail_idx -= vq->vring.num;
+        vq->last_avail_wrap_counter ^= 1;
+    }
+    vq->shadow_avail_idx = vq->last_avail_idx;
+    vq->shadow_avail_wrap_counter = vq->last_avail_wrap_counter;
+
+    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_packed_set_avail_event(vq);
+    }
+
+    trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
+done:
+    rcu_read_unlock();
     return elem;
 }
 
+void *virtqueue_pop(VirtQueue *vq, size_t sz)
+{
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        return virtqueue_packed_pop(vq, sz, NULL);
+    }
+    return virtqueue_split_pop(vq, sz, NULL);
+}
+
+unsigned int virtqueue_pop_batch(VirtQueue *vq, VirtQueueElementPool *pool,
+                                 void **elems, unsigned int max)
+{
+    bool packed = virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED);
+    unsigned int n;
+
+    /* One read-side critical section and cache lookup for the batch */
+    rcu_read_lock();
+    for (n = 0; n < max; n++) {
+        if (packed) {
+            elems[n] = virtqueue_packed_pop(vq, pool->sz, pool);
+        } else {
+            elems[n] = virtqueue_split_pop(vq, pool->sz, pool);
+        }
+        if (!elems[n]) {
+            break;
+        }
+    }
+    rcu_read_unlock();
+    return n;
+}
+
 /* Reading and writing a structure directly to QEMUFile is *awful*, but
  * it is what QEMU has always done by mistake.  We can change it sooner
  * or later by bumping the version number of the affected vm states.
@@ -648,7 +1491,7 @@ typedef struct VirtQueueElementOld {
     struct iovec out_sg[VIRTQUEUE_MAX_SIZE];
 } VirtQueueElementOld;
 
-void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
+void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz)
 {
     VirtQueueElement *elem;
     VirtQueueElementOld data;
@@ -659,6 +1502,14 @@ void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
     elem = virtqueue_alloc_element(sz, data.out_num, data.in_num);
     elem->index = data.index;
 
+    /*
+     * Guest features are not loaded yet when devices load their requests,
+     * so this has to depend on the host features like on the source.
+     */
+    if (virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        elem->ndescs = qemu_get_be32(f);
+    }
+
     for (i = 0; i < elem->in_num; i++) {
         elem->in_addr[i] = data.in_addr[i];
     }
@@ -683,7 +1534,8 @@ void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
     return elem;
 }
 
-void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
+void qemu_put_virtqueue_element(VirtIODevice *vdev, QEMUFile *f,
+                                VirtQueueElement *elem)
 {
     VirtQueueElementOld data;
     int i;
@@ -712,6 +1564,10 @@ void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
         data.out_sg[i].iov_len = elem->out_sg[i].iov_len;
     }
     qemu_put_buffer(f, (uint8_t *)&data, sizeof(VirtQueueElementOld));
+
+    if (virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        qemu_put_be32(f, elem->ndescs);
+    }
 }
 
 /* virtio device */
@@ -815,13 +1671,18 @@ void virtio_reset(void *opaque)
         vdev->vq[i].vring.avail = 0;
         vdev->vq[i].vring.used = 0;
         vdev->vq[i].last_avail_idx = 0;
+        vdev->vq[i].last_avail_wrap_counter = true;
         vdev->vq[i].shadow_avail_idx = 0;
+        vdev->vq[i].shadow_avail_wrap_counter = true;
         vdev->vq[i].used_idx = 0;
+        vdev->vq[i].used_wrap_counter = true;
+        vdev->vq[i].used_pending = 0;
         virtio_queue_set_vector(vdev, i, VIRTIO_NO_VECTOR);
         vdev->vq[i].signalled_used = 0;
         vdev->vq[i].signalled_used_valid = false;
         vdev->vq[i].notification = true;
         vdev->vq[i].vring.num = vdev->vq[i].vring.num_default;
+        virtio_virtqueue_reset_region_cache(&vdev->vq[i]);
     }
 }
 
@@ -1031,6 +1892,7 @@ void virtio_queue_set_rings(VirtIODevice *vdev, int n, hwaddr desc,
     vdev->vq[n].vring.desc = desc;
     vdev->vq[n].vring.avail = avail;
     vdev->vq[n].vring.used = used;
+    virtio_init_region_cache(vdev, n);
 }
 
 void virtio_queue_set_num(VirtIODevice *vdev, int n, int num)
@@ -1044,6 +1906,9 @@ void virtio_queue_set_num(VirtIODevice *vdev, int n, int num)
         return;
     }
     vdev->vq[n].vring.num = num;
+    if (vdev->vq[n].vring.desc) {
+        virtio_init_region_cache(vdev, n);
+    }
 }
 
 VirtQueue *virtio_vector_first_queue(VirtIODevice *vdev, uint16_t vector)
@@ -1191,6 +2056,7 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
 
     vdev->vq[n].vring.num = 0;
     vdev->vq[n].vring.num_default = 0;
+    virtio_virtqueue_reset_region_cache(&vdev->vq[n]);
 }
 
 void virtio_irq(VirtQueue *vq)
@@ -1200,17 +2066,11 @@ void virtio_irq(VirtQueue *vq)
     virtio_notify_vector(vq->vdev, vq->vector);
 }
 
-bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
+/* Called within rcu_read_lock().  */
+static bool virtio_split_should_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
     uint16_t old, new;
     bool v;
-    /* We need to expose used array entries before checking used event. */
-    smp_mb();
-    /* Always notify when queue is empty (when feature acknowledge) */
-    if (virtio_vdev_has_feature(vdev, VIRTIO_F_NOTIFY_ON_EMPTY) &&
-        !vq->inuse && virtio_queue_empty(vq)) {
-        return true;
-    }
 
     if (!virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
         return !(vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT);
@@ -1223,6 +2083,79 @@ bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
     return !v || vring_need_event(vring_get_used_event(vq), new, old);
 }
 
+/*
+ * Both @new_wrap and @old_wrap are ring positions with the wrap counter
+ * in bit 15.  Positions of the previous lap are moved below zero, so that
+ * vring_need_event() can work on the distances between them.
+ */
+static bool vring_packed_need_event(VirtQueue *vq, uint16_t off_wrap,
+                                    uint16_t new_wrap, uint16_t old_wrap)
+{
+    uint16_t wrap_bit = 1 << VRING_PACKED_EVENT_F_WRAP_CTR;
+    uint16_t off = off_wrap & ~wrap_bit;
+    uint16_t new = new_wrap & ~wrap_bit;
+    uint16_t old = old_wrap & ~wrap_bit;
+
+    if ((off_wrap ^ new_wrap) & wrap_bit) {
+        off -= vq->vring.num;
+    }
+    if ((old_wrap ^ new_wrap) & wrap_bit) {
+        old -= vq->vring.num;
+    }
+    return vring_need_event(off, new, old);
+}
+
+/* Called within rcu_read_lock().  */
+static bool virtio_packed_should_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    VRingPackedDescEvent e;
+    uint16_t old, new;
+    bool v;
+
+    if (!caches) {
+        return false;
+    }
+
+    vring_packed_event_read(vdev, &caches->avail, &e);
+
+    v = vq->signalled_used_valid;
+    vq->signalled_used_valid = true;
+    old = vq->signalled_used;
+    new = vq->signalled_used = vq->used_idx |
+        vq->used_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR;
+
+    if (e.flags == VRING_PACKED_EVENT_FLAG_DISABLE) {
+        return false;
+    } else if (e.flags == VRING_PACKED_EVENT_FLAG_ENABLE ||
+               !virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        return true;
+    }
+    return !v || vring_packed_need_event(vq, e.off_wrap, new, old);
+}
+
+bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    bool v;
+
+    /* We need to expose used array entries before checking used event. */
+    smp_mb();
+    /* Always notify when queue is empty (when feature acknowledge) */
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_NOTIFY_ON_EMPTY) &&
+        !vq->inuse && virtio_queue_empty(vq)) {
+        return true;
+    }
+
+    rcu_read_lock();
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        v = virtio_packed_should_notify(vdev, vq);
+    } else {
+        v = virtio_split_should_notify(vdev, vq);
+    }
+    rcu_read_unlock();
+    return v;
+}
+
 void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
     if (!virtio_should_notify(vdev, vq)) {
@@ -1270,6 +2203,13 @@ static bool virtio_virtqueue_needed(void *opaque)
     return virtio_host_has_feature(vdev, VIRTIO_F_VERSION_1);
 }
 
+static bool virtio_packed_virtqueue_needed(void *opaque)
+{
+    VirtIODevice *vdev = opaque;
+
+    return virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED);
+}
+
 static bool virtio_ringsize_needed(void *opaque)
 {
     VirtIODevice *vdev = opaque;
@@ -1316,6 +2256,32 @@ static const VMStateDescription vmstate_virtio_virtqueues = {
     }
 };
 
+/* last_avail_idx is in the main section, used_idx can't be read back */
+static const VMStateDescription vmstate_packed_virtqueue = {
+    .name = "packed_virtqueue_state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(last_avail_wrap_counter, struct VirtQueue),
+        VMSTATE_UINT16(used_idx, struct VirtQueue),
+        VMSTATE_BOOL(used_wrap_counter, struct VirtQueue),
+        VMSTATE_INT32(inuse, struct VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_virtio_packed_virtqueues = {
+    .name = "virtio/packed_virtqueues",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = &virtio_packed_virtqueue_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_VARRAY_POINTER_KNOWN(vq, struct VirtIODevice,
+                      VIRTIO_QUEUE_MAX, 0, vmstate_packed_virtqueue, VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_ringsize = {
     .name = "ringsize_state",
     .version_id = 1,
@@ -1420,6 +2386,7 @@ static const VMStateDescription vmstate_virtio = {
         &vmstate_virtio_64bit_features,
         &vmstate_virtio_virtqueues,
         &vmstate_virtio_ringsize,
+        &vmstate_virtio_packed_virtqueues,
         &vmstate_virtio_extra_state,
         NULL
     }
@@ -1634,9 +2601,25 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
         }
     }
 
+    rcu_read_lock();
     for (i = 0; i < num; i++) {
         if (vdev->vq[i].vring.desc) {
             uint16_t nheads;
+
+            /*
+             * The subsections may have moved the avail and used rings of
+             * virtio-1 devices, translate them again.
+             */
+            virtio_init_region_cache(vdev, i);
+
+            /* The whole state of packed rings is in the migration stream */
+            if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+                vdev->vq[i].shadow_avail_idx = vdev->vq[i].last_avail_idx;
+                vdev->vq[i].shadow_avail_wrap_counter =
+                    vdev->vq[i].last_avail_wrap_counter;
+                continue;
+            }
+
             nheads = vring_avail_idx(&vdev->vq[i]) - vdev->vq[i].last_avail_idx;
             /* Check it isn't doing strange things with descriptor numbers. */
             if (nheads > vdev->vq[i].vring.num) {
@@ -1645,6 +2628,7 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
                              i, vdev->vq[i].vring.num,
                              vring_avail_idx(&vdev->vq[i]),
                              vdev->vq[i].last_avail_idx, nheads);
+                rcu_read_unlock();
                 return -1;
             }
             vdev->vq[i].used_idx = vring_used_idx(&vdev->vq[i]);
@@ -1662,17 +2646,24 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
                              i, vdev->vq[i].vring.num,
                              vdev->vq[i].last_avail_idx,
                              vdev->vq[i].used_idx);
+                rcu_read_unlock();
                 return -1;
             }
         }
     }
+    rcu_read_unlock();
 
     return 0;
 }
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
     qemu_del_vm_change_state_handler(vdev->vmstate);
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        virtio_virtqueue_reset_region_cache(&vdev->vq[i]);
+    }
     g_free(vdev->config);
     g_free(vdev->vq);
     g_free(vdev->vector_queues);
@@ -1776,33 +2767,85 @@ hwaddr virtio_queue_get_desc_size(VirtIODevice *vdev, int n)
 
 hwaddr virtio_queue_get_avail_size(VirtIODevice *vdev, int n)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return sizeof(VRingPackedDescEvent);
+    }
     return offsetof(VRingAvail, ring) +
         sizeof(uint16_t) * vdev->vq[n].vring.num;
 }
 
 hwaddr virtio_queue_get_used_size(VirtIODevice *vdev, int n)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return sizeof(VRingPackedDescEvent);
+    }
     return offsetof(VRingUsed, ring) +
         sizeof(VRingUsedElem) * vdev->vq[n].vring.num;
 }
 
 hwaddr virtio_queue_get_ring_size(VirtIODevice *vdev, int n)
 {
+    /* The event areas of packed rings need not follow the descriptors */
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return virtio_queue_get_desc_size(vdev, n);
+    }
     return vdev->vq[n].vring.used - vdev->vq[n].vring.desc +
 	    virtio_queue_get_used_size(vdev, n);
 }
 
+/*
+ * For packed rings, the wrap counter goes in bit 15 of the index, which
+ * is how vhost backends expect it in the vring base.
+ */
 uint16_t virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return vdev->vq[n].last_avail_idx |
+            vdev->vq[n].last_avail_wrap_counter <<
+            VRING_PACKED_EVENT_F_WRAP_CTR;
+    }
     return vdev->vq[n].last_avail_idx;
 }
 
 void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        uint16_t wrap_bit = 1 << VRING_PACKED_EVENT_F_WRAP_CTR;
+        bool wrap_counter = !!(idx & wrap_bit);
+
+        idx &= ~wrap_bit;
+        vdev->vq[n].last_avail_wrap_counter = wrap_counter;
+        vdev->vq[n].shadow_avail_wrap_counter = wrap_counter;
+        /* A stopped backend has returned everything it popped */
+        vdev->vq[n].used_idx = idx;
+        vdev->vq[n].used_wrap_counter = wrap_counter;
+    }
     vdev->vq[n].last_avail_idx = idx;
     vdev->vq[n].shadow_avail_idx = idx;
 }
 
+/*
+ * Rewind the available index to the used index, so that requests that a
+ * vhost backend popped but never completed are processed again.  Only
+ * possible for split rings; packed rings have no used index to go back to.
+ */
+void virtio_queue_restore_last_avail_idx(VirtIODevice *vdev, int n)
+{
+    VirtQueue *vq = &vdev->vq[n];
+
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return;
+    }
+
+    rcu_read_lock();
+    if (vq->vring.desc) {
+        vq->used_idx = vring_used_idx(vq);
+        vq->last_avail_idx = vq->used_idx;
+        vq->shadow_avail_idx = vq->used_idx;
+    }
+    rcu_read_unlock();
+}
+
 void virtio_queue_invalidate_signalled_used(VirtIODevice *vdev, int n)
 {
     vdev->vq[n].signalled_used_valid = false;
@@ -1855,6 +2898,44 @@ static void virtio_queue_host_notifier_aio_read(EventNotifier *n)
     }
 }
 
+static bool virtio_queue_host_notifier_aio_poll(void *opaque)
+{
+    EventNotifier *n = opaque;
+    VirtQueue *vq = container_of(n, VirtQueue, host_notifier);
+
+    if (!vq->vring.desc || virtio_queue_empty(vq)) {
+        return false;
+    }
+
+    virtio_queue_notify_aio_vq(vq);
+    return true;
+}
+
+/* The poll handler notices new buffers by itself, so the guest need
+ * not kick while the AioContext is polling.
+ */
+static void virtio_queue_host_notifier_aio_poll_begin(EventNotifier *n)
+{
+    VirtQueue *vq = container_of(n, VirtQueue, host_notifier);
+
+    if (vq->vring.desc) {
+        virtio_queue_set_notification(vq, 0);
+    }
+}
+
+static void virtio_queue_host_notifier_aio_poll_end(EventNotifier *n)
+{
+    VirtQueue *vq = container_of(n, VirtQueue, host_notifier);
+
+    if (vq->vring.desc) {
+        virtio_queue_set_notification(vq, 1);
+        /* The poll handler checks the avail ring once more afterwards;
+         * make sure the driver sees notifications enabled before that.
+         */
+        smp_mb();
+    }
+}
+
 void virtio_queue_aio_set_host_notifier_handler(VirtQueue *vq, AioContext *ctx,
                                                 VirtIOHandleOutput handle_output)
 {
@@ -1862,6 +2943,11 @@ void virtio_queue_aio_set_host_notifier_handler(VirtQueue *vq, AioContext *ctx,
         vq->handle_aio_output = handle_output;
         aio_set_event_notifier(ctx, &vq->host_notifier, true,
                                virtio_queue_host_notifier_aio_read);
+        aio_set_event_notifier_poll(ctx, &vq->host_notifier,
+                                    virtio_queue_host_notifier_aio_poll);
+        aio_set_event_notifier_poll_begin_end(ctx, &vq->host_notifier,
+                                    virtio_queue_host_notifier_aio_poll_begin,
+                                    virtio_queue_host_notifier_aio_poll_end);
     } else {
         aio_set_event_notifier(ctx, &vq->host_notifier, true, NULL);
         /* Test and clear notifier before after disabling event,
@@ -1916,6 +3002,21 @@ void virtio_device_set_child_bus_name(VirtIODevice *vdev, char *bus_name)
     vdev->bus_name = g_strdup(bus_name);
 }
 
+static void virtio_memory_listener_commit(MemoryListener *listener)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice, listener);
+    int i;
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        if (vdev->vq[i].vring.num == 0) {
+            break;
+        }
+        if (vdev->vq[i].vring.desc) {
+            virtio_init_region_cache(vdev, i);
+        }
+    }
+}
+
 static void virtio_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
@@ -1935,6 +3036,10 @@ static void virtio_device_realize(DeviceState *dev, Error **errp)
         error_propagate(errp, err);
         return;
     }
+
+    /* The cached ring translations go stale when the memory map changes */
+    vdev->listener.commit = virtio_memory_listener_commit;
+    memory_listener_register(&vdev->listener, &address_space_memory);
 }
 
 static void virtio_device_unrealize(DeviceState *dev, Error **errp)
@@ -1944,6 +3049,7 @@ static void virtio_device_unrealize(DeviceState *dev, Error **errp)
     Error *err = NULL;
 
     virtio_bus_device_unplugged(vdev);
+    memory_listener_unregister(&vdev->listener);
 
     if (vdc->unrealize != NULL) {
         vdc->unrealize(dev, &err);
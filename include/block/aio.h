@@ -46,6 +46,8 @@ void qemu_aio_ref(void *p);
 typedef struct AioHandler AioHandler;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
+/* Returns true if the handler made progress, i.e. it found work to do */
+typedef bool AioPollFn(void *opaque);
 
 struct ThreadPool;
 struct LinuxAioState;
@@ -138,6 +140,23 @@ struct AioContext {
     int epollfd;
     bool epoll_enabled;
     bool epoll_available;
+
+    /* Number of handlers without an io_poll callback; polling is only
+     * done when this is zero, or those handlers would starve.
+     */
+    int poll_disable_cnt;
+
+    /* Whether io_poll_begin has been called without io_poll_end */
+    bool poll_started;
+
+    /* Adaptive polling: aio_poll() busy-waits for up to poll_ns before
+     * blocking.  poll_ns is adjusted between 0 and poll_max_ns depending
+     * on how long aio_poll() ended up waiting; see aio_context_set_poll_params.
+     */
+    int64_t poll_ns;        /* current polling time in nanoseconds */
+    int64_t poll_max_ns;    /* maximum polling time in nanoseconds */
+    int64_t poll_grow;      /* polling time growth factor */
+    int64_t poll_shrink;    /* polling time shrink factor */
 };
 
 /**
@@ -337,6 +356,37 @@ void aio_set_event_notifier(AioContext *ctx,
                             bool is_external,
                             EventNotifierHandler *io_read);
 
+/* Set a callback that aio_poll() can invoke in a busy-wait loop, instead
+ * of waiting for @fd to become readable.  @io_poll must check for work
+ * in userspace, e.g. in a ring shared with the guest or the kernel, and
+ * process it.  The file descriptor must already be registered with
+ * aio_set_fd_handler(); removing the fd handler also removes @io_poll.
+ */
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll);
+
+/* Same as aio_set_fd_poll() for an EventNotifier.  The notifier is
+ * passed to @io_poll.
+ */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll);
+
+/* Set callbacks that are invoked when aio_poll() starts and stops
+ * busy-waiting.  While polling, @io_poll_begin can disable notifications
+ * that would only wake up the AioContext needlessly; @io_poll_end must
+ * re-enable them.  The io_poll callback runs once more after
+ * @io_poll_end, so work that raced with re-enabling is not lost.
+ */
+void aio_set_fd_poll_begin_end(AioContext *ctx, int fd,
+                               IOHandler *io_poll_begin,
+                               IOHandler *io_poll_end);
+
+/* Same as aio_set_fd_poll_begin_end() for an EventNotifier. */
+void aio_set_event_notifier_poll_begin_end(AioContext *ctx,
+                                           EventNotifier *notifier,
+                                           EventNotifierHandler *io_poll_begin,
+                                           EventNotifierHandler *io_poll_end);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
@@ -454,4 +504,19 @@ static inline bool aio_node_check(AioContext *ctx, bool is_external)
  */
 void aio_context_setup(AioContext *ctx);
 
+/**
+ * aio_context_set_poll_params:
+ * @ctx: the aio context
+ * @max_ns: how long to busy poll for, in nanoseconds; 0 disables polling
+ * @grow: polling time growth factor, 0 selects the default of 2
+ * @shrink: polling time shrink factor, 0 resets the polling time to 0
+ *
+ * Poll mode can be used to improve latency of I/O.  The polling time
+ * starts at 0 and is grown whenever the event that ended a blocking
+ * aio_poll() arrived within @max_ns, and shrunk when it took longer.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink,
+                                 Error **errp);
+
 #endif
@@ -66,8 +66,12 @@ typedef enum {
     BDRV_REQ_NO_SERIALISING     = 0x8,
     BDRV_REQ_FUA                = 0x10,
 
+    /* The write request waits for overlapping requests in flight, including
+     * reads, and new overlapping requests wait for it to complete. */
+    BDRV_REQ_SERIALISING        = 0x20,
+
     /* Mask of valid flags */
-    BDRV_REQ_MASK               = 0x1f,
+    BDRV_REQ_MASK               = 0x3f,
 } BdrvRequestFlags;
 
 typedef struct BlockSizes {
@@ -28,6 +28,11 @@
 #include "qemu/throttle.h"
 #include "block/block_int.h"
 
+#define THROTTLE_GROUP_SEPARATOR '/'
+
+bool throttle_group_name_is_valid(const char *name, Error **errp);
+bool throttle_group_is_nested(const char *name);
+
 const char *throttle_group_get_name(BlockBackend *blk);
 
 ThrottleState *throttle_group_incref(const char *name);
@@ -35,6 +40,8 @@ void throttle_group_unref(ThrottleState *ts);
 
 void throttle_group_config(BlockBackend *blk, ThrottleConfig *cfg);
 void throttle_group_get_config(BlockBackend *blk, ThrottleConfig *cfg);
+void throttle_group_config_by_name(const char *name, ThrottleConfig *cfg,
+                                   Error **errp);
 
 void throttle_group_register_blk(BlockBackend *blk, const char *groupname);
 void throttle_group_unregister_blk(BlockBackend *blk);
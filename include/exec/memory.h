@@ -1418,6 +1418,55 @@ void *address_space_map(AddressSpace *as, hwaddr addr,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len);
 
+/* MemoryRegionCache: a translation of an address space range that is
+ * accessed over and over, such as a ring shared with the guest.
+ *
+ * If the range is RAM, accesses through the cache are plain loads and
+ * stores to @ptr; otherwise they go through the address space as usual.
+ * The cache holds a reference to the region, and must be destroyed and
+ * initialized again when the memory map of the address space changes.
+ */
+typedef struct MemoryRegionCache {
+    void *ptr;
+    hwaddr xlat;
+    hwaddr len;
+    MemoryRegion *mr;
+    AddressSpace *as;
+    hwaddr addr;
+    bool is_write;
+} MemoryRegionCache;
+
+/* address_space_cache_init: prepare for repeated access to a range
+ *
+ * Returns true if the range is RAM, i.e. if accesses are direct.
+ *
+ * @cache: #MemoryRegionCache to be filled
+ * @as: #AddressSpace to be accessed
+ * @addr: address within that address space
+ * @len: length of the range
+ * @is_write: whether the range is going to be written to as well
+ */
+bool address_space_cache_init(MemoryRegionCache *cache, AddressSpace *as,
+                              hwaddr addr, hwaddr len, bool is_write);
+
+/* address_space_cache_invalidate: mark part of a cached range as written
+ *
+ * Only needed after writing to @cache->ptr directly;
+ * address_space_write_cached() takes care of it.
+ *
+ * @cache: #MemoryRegionCache that was written to
+ * @addr: offset of the written area within the cached range
+ * @access_len: length of the written area
+ */
+void address_space_cache_invalidate(MemoryRegionCache *cache, hwaddr addr,
+                                    hwaddr access_len);
+
+/* address_space_cache_destroy: drop the reference held by a cache
+ *
+ * @cache: #MemoryRegionCache to be released
+ */
+void address_space_cache_destroy(MemoryRegionCache *cache);
+
 
 /* Internal functions, part of the implementation of address_space_read.  */
 MemTxResult address_space_read_continue(AddressSpace *as, hwaddr addr,
@@ -1478,6 +1527,50 @@ MemTxResult address_space_read(AddressSpace *as, hwaddr addr, MemTxAttrs attrs,
     return result;
 }
 
+/**
+ * address_space_read_cached: read from a cached range
+ *
+ * @cache: #MemoryRegionCache to be accessed
+ * @addr: offset within the cached range
+ * @buf: buffer with the data transferred
+ * @len: length of the data transferred
+ */
+static inline void address_space_read_cached(MemoryRegionCache *cache,
+                                             hwaddr addr, void *buf, int len)
+{
+    assert(addr < cache->len && len <= cache->len - addr);
+    if (likely(cache->ptr)) {
+        memcpy(buf, (uint8_t *)cache->ptr + addr, len);
+    } else {
+        address_space_read(cache->as, cache->addr + addr,
+                           MEMTXATTRS_UNSPECIFIED, buf, len);
+    }
+}
+
+/**
+ * address_space_write_cached: write to a cached range
+ *
+ * The range must have been initialized with @is_write.
+ *
+ * @cache: #MemoryRegionCache to be accessed
+ * @addr: offset within the cached range
+ * @buf: buffer with the data transferred
+ * @len: length of the data transferred
+ */
+static inline void address_space_write_cached(MemoryRegionCache *cache,
+                                              hwaddr addr, const void *buf,
+                                              int len)
+{
+    assert(addr < cache->len && len <= cache->len - addr);
+    if (likely(cache->ptr)) {
+        memcpy((uint8_t *)cache->ptr + addr, buf, len);
+        address_space_cache_invalidate(cache, addr, len);
+    } else {
+        address_space_write(cache->as, cache->addr + addr,
+                            MEMTXATTRS_UNSPECIFIED, buf, len);
+    }
+}
+
 #endif
 
 #endif
@@ -36,6 +36,22 @@ struct RAMBlock {
     /* RCU-enabled, writes protected by the ramlist lock */
     QLIST_ENTRY(RAMBlock) next;
     int fd;
+    /* XBZRLE cache statistics, updated by the migration threads and read
+     * by the monitor; only access them with atomic_* (long so that this
+     * works on 32-bit hosts too)
+     */
+    unsigned long xbzrle_cache_hits;
+    unsigned long xbzrle_cache_misses;
+    /* Dirty pages found by the migration thread in the current period */
+    uint64_t dirty_pages_period;
+    /* ...and per second over the previous one */
+    uint64_t dirty_pages_rate;
+    /* Pages received by a postcopy destination, to recover after a failure */
+    unsigned long *receivedmap;
+    /* Pages stored in a mapped-ram file, and where the block lives in it */
+    unsigned long *file_bmap;
+    uint64_t bitmap_offset;
+    uint64_t pages_offset;
 };
 
 static inline bool offset_in_ramblock(RAMBlock *b, ram_addr_t offset)
@@ -73,8 +89,14 @@ static inline void *ramblock_ptr(RAMBlock *block, ram_addr_t offset)
  * memory is being grown.  When no threads are using the old DirtyMemoryBlocks
  * anymore it is freed by RCU (but the underlying blocks stay because they are
  * pointed to from the new DirtyMemoryBlocks).
+ *
+ * The migration bitmap also has a summary, organized in the same blocks.
+ * Each summary bit covers DIRTY_MEMORY_SUMMARY_PAGES pages and is set after
+ * any of them is marked dirty, so that cpu_physical_memory_sync_dirty_bitmap
+ * only has to look at the parts of memory written since the previous sync.
  */
 #define DIRTY_MEMORY_BLOCK_SIZE ((ram_addr_t)256 * 1024 * 8)
+#define DIRTY_MEMORY_SUMMARY_PAGES (BITS_PER_LONG * BITS_PER_LONG)
 typedef struct {
     struct rcu_head rcu;
     unsigned long *blocks[];
@@ -86,6 +108,7 @@ typedef struct RAMList {
     /* RCU-enabled, writes protected by the ramlist lock. */
     QLIST_HEAD(, RAMBlock) blocks;
     DirtyMemoryBlocks *dirty_memory[DIRTY_MEMORY_NUM];
+    DirtyMemoryBlocks *dirty_memory_summary;
     uint32_t version;
 } RAMList;
 extern RAMList ram_list;
@@ -230,6 +253,25 @@ static inline uint8_t cpu_physical_memory_range_includes_clean(ram_addr_t start,
     return ret;
 }
 
+/* Called from RCU critical section, after the pages themselves were marked
+ * in the DIRTY_MEMORY_MIGRATION bitmap.
+ */
+static inline void cpu_physical_memory_set_dirty_summary(unsigned long idx,
+                                                         unsigned long offset,
+                                                         unsigned long num)
+{
+    unsigned long *summary =
+        atomic_rcu_read(&ram_list.dirty_memory_summary)->blocks[idx];
+    unsigned long i = offset / DIRTY_MEMORY_SUMMARY_PAGES;
+    unsigned long last = (offset + num - 1) / DIRTY_MEMORY_SUMMARY_PAGES;
+
+    for (; i <= last; i++) {
+        if (!test_bit(i, summary)) {
+            set_bit_atomic(i, summary);
+        }
+    }
+}
+
 static inline void cpu_physical_memory_set_dirty_flag(ram_addr_t addr,
                                                       unsigned client)
 {
@@ -247,6 +289,9 @@ static inline void cpu_physical_memory_set_dirty_flag(ram_addr_t addr,
     blocks = atomic_rcu_read(&ram_list.dirty_memory[client]);
 
     set_bit_atomic(offset, blocks->blocks[idx]);
+    if (client == DIRTY_MEMORY_MIGRATION) {
+        cpu_physical_memory_set_dirty_summary(idx, offset, 1);
+    }
 
     rcu_read_unlock();
 }
@@ -282,6 +327,7 @@ static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
         if (likely(mask & (1 << DIRTY_MEMORY_MIGRATION))) {
             bitmap_set_atomic(blocks[DIRTY_MEMORY_MIGRATION]->blocks[idx],
                               offset, next - page);
+            cpu_physical_memory_set_dirty_summary(idx, offset, next - page);
         }
         if (unlikely(mask & (1 << DIRTY_MEMORY_VGA))) {
             bitmap_set_atomic(blocks[DIRTY_MEMORY_VGA]->blocks[idx],
@@ -340,6 +386,9 @@ static inline void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
                 unsigned long temp = leul_to_cpu(bitmap[k]);
 
                 atomic_or(&blocks[DIRTY_MEMORY_MIGRATION][idx][offset], temp);
+                cpu_physical_memory_set_dirty_summary(idx,
+                                                      offset * BITS_PER_LONG,
+                                                      BITS_PER_LONG);
                 atomic_or(&blocks[DIRTY_MEMORY_VGA][idx][offset], temp);
                 if (tcg_enabled()) {
                     atomic_or(&blocks[DIRTY_MEMORY_CODE][idx][offset], temp);
@@ -403,9 +452,10 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
 
     /* start address is aligned at the start of a word? */
     if (((page * BITS_PER_LONG) << TARGET_PAGE_BITS) == start) {
-        int k;
-        int nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
+        unsigned long k;
+        unsigned long nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
         unsigned long * const *src;
+        unsigned long * const *summary;
         unsigned long idx = (page * BITS_PER_LONG) / DIRTY_MEMORY_BLOCK_SIZE;
         unsigned long offset = BIT_WORD((page * BITS_PER_LONG) %
                                         DIRTY_MEMORY_BLOCK_SIZE);
@@ -414,18 +464,40 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
 
         src = atomic_rcu_read(
                 &ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION])->blocks;
-
-        for (k = page; k < page + nr; k++) {
-            if (src[idx][offset]) {
-                unsigned long bits = atomic_xchg(&src[idx][offset], 0);
-                unsigned long new_dirty;
-                new_dirty = ~dest[k];
-                dest[k] |= bits;
-                new_dirty &= bits;
-                num_dirty += ctpopl(new_dirty);
+        summary = atomic_rcu_read(&ram_list.dirty_memory_summary)->blocks;
+
+        k = page;
+        while (k < page + nr) {
+            /* Words k..next-1 are covered by the same summary bit */
+            unsigned long bit = offset / BITS_PER_LONG;
+            unsigned long next = k + BITS_PER_LONG - offset % BITS_PER_LONG;
+
+            next = MIN(next, page + nr);
+
+            if (!test_bit(bit, summary[idx])) {
+                offset += next - k;
+                k = next;
+            } else {
+                if (next - k == BITS_PER_LONG) {
+                    /* Clear the summary before reading the words it covers,
+                     * so that a page dirtied meanwhile sets it again.  Bits
+                     * shared with a neighbouring range are left alone.
+                     */
+                    atomic_and(&summary[idx][BIT_WORD(bit)], ~BIT_MASK(bit));
+                }
+                for (; k < next; k++, offset++) {
+                    if (src[idx][offset]) {
+                        unsigned long bits = atomic_xchg(&src[idx][offset], 0);
+                        unsigned long new_dirty;
+                        new_dirty = ~dest[k];
+                        dest[k] |= bits;
+                        new_dirty &= bits;
+                        num_dirty += ctpopl(new_dirty);
+                    }
+                }
             }
 
-            if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
+            if (offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
                 offset = 0;
                 idx++;
             }
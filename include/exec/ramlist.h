@@ -0,0 +1,32 @@
+/*
+ * RAM block notifiers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef RAMLIST_H
+#define RAMLIST_H
+
+#include "qemu/queue.h"
+
+typedef struct RAMBlockNotifier RAMBlockNotifier;
+struct RAMBlockNotifier {
+    void (*ram_block_added)(RAMBlockNotifier *n, void *host, size_t size);
+    void (*ram_block_removed)(RAMBlockNotifier *n, void *host, size_t size);
+    QLIST_ENTRY(RAMBlockNotifier) next;
+};
+
+/* Register @n; ram_block_added is called right away for every RAM block
+ * that already exists.  Must be called with the iothread lock held.
+ */
+void ram_block_notifier_add(RAMBlockNotifier *n);
+void ram_block_notifier_remove(RAMBlockNotifier *n);
+
+/* Called when the host memory of a RAM block is allocated or is about to
+ * be freed.
+ */
+void ram_block_notify_add(void *host, size_t size);
+void ram_block_notify_remove(void *host, size_t size);
+
+#endif
@@ -0,0 +1,39 @@
+/*
+ * vhost-user-blk host device
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef VHOST_USER_BLK_H
+#define VHOST_USER_BLK_H
+
+#include "standard-headers/linux/virtio_blk.h"
+#include "qemu-common.h"
+#include "hw/qdev.h"
+#include "hw/block/block.h"
+#include "sysemu/char.h"
+#include "hw/virtio/vhost.h"
+
+#define TYPE_VHOST_USER_BLK "vhost-user-blk"
+#define VHOST_USER_BLK(obj) \
+        OBJECT_CHECK(VHostUserBlk, (obj), TYPE_VHOST_USER_BLK)
+
+typedef struct VHostUserBlk {
+    VirtIODevice parent_obj;
+    CharDriverState *chr;
+    int32_t bootindex;
+    uint16_t num_queues;
+    uint32_t queue_size;
+    bool config_wce;
+
+    /* config space as last read from the backend */
+    struct virtio_blk_config blkcfg;
+    struct vhost_dev dev;
+    struct vhost_virtqueue *vqs;
+    guint watch;
+    bool connected;
+} VHostUserBlk;
+
+#endif
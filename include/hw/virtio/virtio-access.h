@@ -62,6 +62,31 @@ static inline uint64_t virtio_ldq_phys(VirtIODevice *vdev, hwaddr pa)
     return ldq_le_phys(&address_space_memory, pa);
 }
 
+static inline uint16_t virtio_lduw_phys_cached(VirtIODevice *vdev,
+                                               MemoryRegionCache *cache,
+                                               hwaddr pa)
+{
+    uint16_t val;
+
+    address_space_read_cached(cache, pa, &val, sizeof(val));
+    if (virtio_access_is_big_endian(vdev)) {
+        return be16_to_cpu(val);
+    }
+    return le16_to_cpu(val);
+}
+
+static inline void virtio_stw_phys_cached(VirtIODevice *vdev,
+                                          MemoryRegionCache *cache,
+                                          hwaddr pa, uint16_t value)
+{
+    if (virtio_access_is_big_endian(vdev)) {
+        value = cpu_to_be16(value);
+    } else {
+        value = cpu_to_le16(value);
+    }
+    address_space_write_cached(cache, pa, &value, sizeof(value));
+}
+
 static inline void virtio_stw_phys(VirtIODevice *vdev, hwaddr pa,
                                    uint16_t value)
 {
@@ -56,6 +56,8 @@ typedef struct VirtIOBlock {
     bool dataplane_disabled;
     bool dataplane_started;
     struct VirtIOBlockDataPlane *dataplane;
+    /* Used from the AioContext of blk */
+    VirtQueueElementPool *req_pool;
 } VirtIOBlock;
 
 typedef struct VirtIOBlockReq {
@@ -74,6 +76,11 @@ typedef struct VirtIOBlockReq {
 
 #define VIRTIO_BLK_MAX_MERGE_REQS 32
 
+/* Requests popped at once, and the elements pooled for them */
+#define VIRTIO_BLK_POP_BATCH 16
+#define VIRTIO_BLK_POOL_SIZE 128
+#define VIRTIO_BLK_POOL_SG 32
+
 typedef struct MultiReqBuffer {
     VirtIOBlockReq *reqs[VIRTIO_BLK_MAX_MERGE_REQS];
     unsigned int num_reqs;
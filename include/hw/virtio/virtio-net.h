@@ -16,6 +16,7 @@
 
 #include "standard-headers/linux/virtio_net.h"
 #include "hw/virtio/virtio.h"
+#include "sysemu/iothread.h"
 
 #define TYPE_VIRTIO_NET "virtio-net-device"
 #define VIRTIO_NET(obj) \
@@ -35,6 +36,9 @@ typedef struct virtio_net_conf
     uint32_t txtimer;
     int32_t txburst;
     char *tx;
+    uint16_t rx_queue_size;
+    uint16_t tx_queue_size;
+    IOThread *iothread;
 } virtio_net_conf;
 
 /* Maximum packet size we can receive from tap device: header + 64k */
@@ -49,6 +53,7 @@ typedef struct VirtIONetQueue {
     struct {
         VirtQueueElement *elem;
     } async_tx;
+    VirtQueueElementPool *tx_pool;
     struct VirtIONet *n;
 } VirtIONetQueue;
 
@@ -95,6 +100,12 @@ typedef struct VirtIONet {
     QEMUTimer *announce_timer;
     int announce_counter;
     bool needs_vnet_hdr_swap;
+    /* Fields for dataplane below */
+    AioContext *ctx; /* NULL unless net_conf.iothread is set */
+    bool dataplane_started;
+    bool dataplane_starting;
+    bool dataplane_stopping;
+    bool dataplane_fenced;
 } VirtIONet;
 
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
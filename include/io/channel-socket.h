@@ -48,6 +48,8 @@ struct QIOChannelSocket {
     socklen_t localAddrLen;
     struct sockaddr_storage remoteAddr;
     socklen_t remoteAddrLen;
+    uint64_t zero_copy_queued;
+    uint64_t zero_copy_sent;
 };
 
 
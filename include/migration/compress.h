@@ -0,0 +1,44 @@
+/*
+ * Compression codecs for migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_MIGRATION_COMPRESS_H
+#define QEMU_MIGRATION_COMPRESS_H
+
+#include "qapi-types.h"
+
+typedef struct MigrationCodec MigrationCodec;
+
+/*
+ * A codec compresses one page at a time.  Each thread using a codec
+ * owns a context created with context_new(), so that codecs that keep
+ * work memory around don't have to allocate it for every page.
+ */
+struct MigrationCodec {
+    const char *name;
+    /* largest possible output for an input of @len bytes */
+    size_t (*bound)(size_t len);
+    void *(*context_new)(void);
+    void (*context_free)(void *ctx);
+    /*
+     * Both return the number of bytes written to @dst, or -1 if the
+     * data could not be (de)compressed into @dst_len bytes.
+     */
+    ssize_t (*compress)(void *ctx, uint8_t *dst, size_t dst_len,
+                        const uint8_t *src, size_t len, int level);
+    ssize_t (*decompress)(void *ctx, uint8_t *dst, size_t dst_len,
+                          const uint8_t *src, size_t len);
+};
+
+/**
+ * migration_codec_get: Look up the codec implementing @method
+ *
+ * Returns NULL if QEMU was built without support for @method.
+ */
+const MigrationCodec *migration_codec_get(MigrationCompressMethod method);
+
+#endif
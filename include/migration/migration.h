@@ -37,6 +37,11 @@
 #define QEMU_VM_COMMAND              0x08
 #define QEMU_VM_SECTION_FOOTER       0x7e
 
+/* Amount of time to allocate to each "chunk" of bandwidth-throttled
+ * data. */
+#define BUFFER_DELAY     100
+#define XFER_LIMIT_RATIO (1000 / BUFFER_DELAY)
+
 struct MigrationParams {
     bool blk;
     bool shared;
@@ -51,6 +56,13 @@ enum mig_rp_message_type {
     MIG_RP_MSG_REQ_PAGES_ID, /* data (start: be64, len: be32, id: string) */
     MIG_RP_MSG_REQ_PAGES,    /* data (start: be64, len: be32) */
 
+    /*
+     * Received pages of a RAMBlock, data (len: byte, name: string),
+     * followed by the bitmap itself (see ram_send_recv_bitmap)
+     */
+    MIG_RP_MSG_RECV_BITMAP,
+    MIG_RP_MSG_RESUME_ACK,   /* Postcopy resumed; data (value: be32) */
+
     MIG_RP_MSG_MAX
 };
 
@@ -104,6 +116,18 @@ struct MigrationIncomingState {
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
     void     *postcopy_tmp_page;
 
+    /* Posted when a new channel is provided to a paused postcopy */
+    QemuSemaphore postcopy_pause_sem_dst;
+    /*
+     * Host pages requested from the source and not placed yet, so they
+     * can be requested again when a paused postcopy resumes.  The values
+     * are the times of the faults, in ns.
+     */
+    QemuMutex page_request_mutex;
+    GHashTable *page_requested;
+    /* RAMBlock of the last page request, protected by page_request_mutex */
+    RAMBlock *last_rb;
+
     QEMUBH *bh;
 
     int state;
@@ -148,8 +172,13 @@ struct MigrationState
         QEMUFile     *from_dst_file;
         QemuThread    rp_thread;
         bool          error;
+        /* Posted for each reply to a postcopy recovery request */
+        QemuSemaphore rp_sem;
     } rp_state;
 
+    /* Posted when a paused postcopy is resumed or cancelled */
+    QemuSemaphore postcopy_pause_sem;
+
     double mbps;
     int64_t total_time;
     int64_t downtime;
@@ -160,6 +189,13 @@ struct MigrationState
     int64_t xbzrle_cache_size;
     int64_t setup_time;
     int64_t dirty_sync_count;
+    /* Cost in microseconds of the last and of all dirty bitmap syncs */
+    int64_t dirty_sync_time;
+    int64_t dirty_sync_total_time;
+    /* Pages newly found dirty by the last dirty bitmap sync */
+    int64_t dirty_sync_pages;
+    /* Predicted time until precopy converges, -1 if it doesn't */
+    int64_t expected_converge_time;
     /* Count of requests incoming from destination */
     int64_t postcopy_requests;
 
@@ -217,10 +253,17 @@ void unix_start_incoming_migration(const char *path, Error **errp);
 
 void unix_start_outgoing_migration(MigrationState *s, const char *path, Error **errp);
 
+int socket_send_channel_connect(QIOChannel *ioc, Error **errp);
+
 void fd_start_incoming_migration(const char *path, Error **errp);
 
 void fd_start_outgoing_migration(MigrationState *s, const char *fdname, Error **errp);
 
+void file_start_incoming_migration(const char *path, Error **errp);
+
+void file_start_outgoing_migration(MigrationState *s, const char *path,
+                                   Error **errp);
+
 void rdma_start_outgoing_migration(void *opaque, const char *host_port, Error **errp);
 
 void rdma_start_incoming_migration(const char *host_port, Error **errp);
@@ -236,18 +279,31 @@ void remove_migration_state_change_notifier(Notifier *notify);
 MigrationState *migrate_init(const MigrationParams *params);
 bool migration_is_blocked(Error **errp);
 bool migration_in_setup(MigrationState *);
+bool migration_is_setup_or_active(int state);
 bool migration_has_finished(MigrationState *);
 bool migration_has_failed(MigrationState *);
 /* True if outgoing migration has entered postcopy phase */
 bool migration_in_postcopy(MigrationState *);
 /* ...and after the device transmission */
 bool migration_in_postcopy_after_devices(MigrationState *);
+/* True once all the channels of an incoming migration are connected */
+bool migration_has_all_channels(void);
 MigrationState *migrate_get_current(void);
+int64_t migration_predict_converge_time(uint64_t remaining,
+                                        uint64_t dirty_bytes_rate,
+                                        double bandwidth);
+/* True while calc-dirty-rate has the dirty log to itself */
+bool dirty_rate_measuring(void);
 
 void migrate_compress_threads_create(void);
 void migrate_compress_threads_join(void);
 void migrate_decompress_threads_create(void);
 void migrate_decompress_threads_join(void);
+void multifd_save_setup(void);
+void multifd_save_cleanup(void);
+void multifd_load_cleanup(void);
+bool multifd_recv_all_channels_created(void);
+int multifd_recv_new_channel(QIOChannel *ioc, Error **errp);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
@@ -266,6 +322,8 @@ uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
 double xbzrle_mig_cache_miss_rate(void);
+XBZRLECacheBlockStatsList *xbzrle_mig_block_stats(void);
+RAMBlockDirtyRateList *ram_block_dirty_rates(void);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 void ram_debug_dump_bitmap(unsigned long *todump, bool expected);
@@ -275,6 +333,18 @@ int ram_postcopy_send_discard_bitmap(MigrationState *ms);
 int ram_discard_range(MigrationIncomingState *mis, const char *block_name,
                       uint64_t start, size_t length);
 int ram_postcopy_incoming_init(MigrationIncomingState *mis);
+void ram_recv_bitmap_cleanup(void);
+bool ram_page_received(RAMBlock *rb, ram_addr_t offset);
+/* Postcopy recovery: resync of the pages received by the destination */
+int ram_postcopy_resume_prepare(MigrationState *ms);
+int ram_send_recv_bitmap(QEMUFile *f, const char *block_name);
+int ram_load_recv_bitmap(QEMUFile *f, const char *block_name);
+/* Background snapshot: write protection of guest RAM */
+bool ram_write_tracking_available(void);
+bool ram_write_tracking_compatible(void);
+int ram_write_tracking_start(void);
+void ram_write_tracking_stop(void);
+bool ram_write_tracking_wait(int64_t timeout_ms);
 
 /**
  * @migrate_add_blocker - prevent migration from proceeding
@@ -307,8 +377,16 @@ int64_t xbzrle_cache_resize(int64_t new_size);
 bool migrate_use_compression(void);
 int migrate_compress_level(void);
 int migrate_compress_threads(void);
+MigrationCompressMethod migrate_compress_method(void);
+int migrate_postcopy_prefetch_pages(void);
 int migrate_decompress_threads(void);
 bool migrate_use_events(void);
+bool migrate_use_multifd(void);
+int migrate_multifd_channels(void);
+int migrate_multifd_page_count(void);
+bool migrate_use_zero_copy(void);
+bool migrate_background_snapshot(void);
+bool migrate_use_mapped_ram(void);
 
 /* Sending on the return path - generic and then for each message type */
 void migrate_send_rp_message(MigrationIncomingState *mis,
@@ -320,6 +398,9 @@ void migrate_send_rp_pong(MigrationIncomingState *mis,
                           uint32_t value);
 void migrate_send_rp_req_pages(MigrationIncomingState *mis, const char* rbname,
                               ram_addr_t start, size_t len);
+int migrate_send_rp_recv_bitmap(MigrationIncomingState *mis,
+                                const char *block_name);
+void migrate_send_rp_resume_ack(MigrationIncomingState *mis, uint32_t value);
 
 void ram_control_before_iterate(QEMUFile *f, uint64_t flags);
 void ram_control_after_iterate(QEMUFile *f, uint64_t flags);
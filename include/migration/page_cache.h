@@ -15,7 +15,12 @@
 #ifndef PAGE_CACHE_H
 #define PAGE_CACHE_H
 
-/* Page cache for storing guest pages */
+/* Page cache for storing guest pages
+ *
+ * The cache is set-associative with per-set locking, so it may be used
+ * from several threads at once, except for cache_resize() and
+ * cache_fini() which need exclusive access.
+ */
 typedef struct PageCache PageCache;
 
 /**
@@ -24,11 +29,10 @@ typedef struct PageCache PageCache;
  *
  * Returns new allocated cache or NULL on error
  *
- * @cache pointer to the PageCache struct
- * @num_pages: cache maximal number of cached pages
+ * @new_size: cache size in bytes, rounded down to a power of 2 pages
  * @page_size: cache page size
  */
-PageCache *cache_init(int64_t num_pages, unsigned int page_size);
+PageCache *cache_init(int64_t new_size, size_t page_size);
 
 /**
  * cache_fini: free all cache resources
@@ -45,22 +49,27 @@ void cache_fini(PageCache *cache);
  * @addr: page addr
  * @current_age: current bitmap generation
  */
-bool cache_is_cached(const PageCache *cache, uint64_t addr,
+bool cache_is_cached(PageCache *cache, uint64_t addr,
                      uint64_t current_age);
 
 /**
- * get_cached_data: Get the data cached for an addr
+ * cache_get_data: Copy out the data cached for an addr
  *
- * Returns pointer to the data cached or NULL if not cached
+ * Returns %true if the page was cached and copied to @buf
  *
  * @cache pointer to the PageCache struct
  * @addr: page addr
+ * @buf: buffer of at least one page
+ * @current_age: current bitmap generation
  */
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
+bool cache_get_data(PageCache *cache, uint64_t addr, uint8_t *buf,
+                    uint64_t current_age);
 
 /**
  * cache_insert: insert the page into the cache. the page cache
- * will dup the data on insert. the previous value will be overwritten
+ * will dup the data on insert. the previous value will be overwritten.
+ * If the page is not cached yet, the least recently used page of its
+ * set is replaced unless it was used in the last two generations.
  *
  * Returns -1 when the page isn't inserted into cache
  *
@@ -73,14 +82,15 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age);
 
 /**
- * cache_resize: resize the page cache. In case of size reduction the extra
+ * cache_resize: resize the page cache, keeping as many of the most
+ * recently used pages as fit. In case of size reduction the extra
  * pages will be freed
  *
- * Returns -1 on error new cache size on success
+ * Returns -1 on error new cache size in bytes on success
  *
  * @cache pointer to the PageCache struct
- * @num_pages: new page cache size (in pages)
+ * @new_size: new page cache size in bytes
  */
-int64_t cache_resize(PageCache *cache, int64_t num_pages);
+int64_t cache_resize(PageCache *cache, int64_t new_size);
 
 #endif
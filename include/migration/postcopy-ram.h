@@ -96,4 +96,15 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host);
  */
 void *postcopy_get_tmp_page(MigrationIncomingState *mis);
 
+/*
+ * Send again the page requests that were lost while postcopy was paused
+ */
+void postcopy_ram_resend_requests(MigrationIncomingState *mis);
+
+/*
+ * Page fault statistics of the last incoming postcopy migration.
+ * Returns false if there was none.
+ */
+bool postcopy_ram_fault_stats(PostcopyFaultStats **stats);
+
 #endif
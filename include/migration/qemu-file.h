@@ -102,6 +102,23 @@ typedef QEMUFile *(QEMURetPathFunc)(void *opaque);
  */
 typedef int (QEMUFileShutdownFunc)(void *opaque, bool rd, bool wr);
 
+/*
+ * Positioned I/O, for files with random access to their contents: these
+ * transfer all of @iov at @pos, independently of the stream position,
+ * or return a negative errno value.
+ */
+typedef ssize_t (QEMUFilePWritevFunc)(void *opaque, struct iovec *iov,
+                                      int iovcnt, int64_t pos);
+typedef ssize_t (QEMUFilePReadvFunc)(void *opaque, struct iovec *iov,
+                                     int iovcnt, int64_t pos);
+
+/*
+ * Move the backing file to @pos, for files that don't use the pos
+ * argument of their read/write functions.
+ * Returns 0 on success, -err on error
+ */
+typedef int (QEMUFileSeekFunc)(void *opaque, int64_t pos);
+
 typedef struct QEMUFileOps {
     QEMUFileGetBufferFunc *get_buffer;
     QEMUFileCloseFunc *close;
@@ -109,6 +126,11 @@ typedef struct QEMUFileOps {
     QEMUFileWritevBufferFunc *writev_buffer;
     QEMURetPathFunc *get_return_path;
     QEMUFileShutdownFunc *shut_down;
+    QEMUFilePWritevFunc *pwritev_buffer;
+    QEMUFilePReadvFunc *preadv_buffer;
+    QEMUFileSeekFunc *seek;
+    /* pwritev_buffer/preadv_buffer can be called from any thread */
+    bool pio_thread_safe;
 } QEMUFileOps;
 
 typedef struct QEMUFileHooks {
@@ -136,6 +158,19 @@ void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, size_t size);
 bool qemu_file_mode_is_not_valid(const char *mode);
 bool qemu_file_is_writable(QEMUFile *f);
 
+/*
+ * Random access to files that support it: the *_at() functions don't
+ * touch the stream, which qemu_set_offset() moves to another position.
+ */
+bool qemu_file_is_seekable(QEMUFile *f);
+bool qemu_file_pio_thread_safe(QEMUFile *f);
+int64_t qemu_get_offset(QEMUFile *f);
+int qemu_set_offset(QEMUFile *f, int64_t pos);
+size_t qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t size,
+                          int64_t pos);
+size_t qemu_get_buffer_at(QEMUFile *f, uint8_t *buf, size_t size,
+                          int64_t pos);
+
 
 static inline void qemu_put_ubyte(QEMUFile *f, unsigned int v)
 {
@@ -150,8 +185,6 @@ void qemu_put_be64(QEMUFile *f, uint64_t v);
 size_t qemu_peek_buffer(QEMUFile *f, uint8_t **buf, size_t size, size_t offset);
 size_t qemu_get_buffer(QEMUFile *f, uint8_t *buf, size_t size);
 size_t qemu_get_buffer_in_place(QEMUFile *f, uint8_t **buf, size_t size);
-ssize_t qemu_put_compression_data(QEMUFile *f, const uint8_t *p, size_t size,
-                                  int level);
 int qemu_put_qemu_file(QEMUFile *f_des, QEMUFile *f_src);
 
 /*
@@ -176,6 +209,7 @@ unsigned int qemu_get_be32(QEMUFile *f);
 uint64_t qemu_get_be64(QEMUFile *f);
 
 int qemu_file_rate_limit(QEMUFile *f);
+void qemu_file_update_transfer(QEMUFile *f, int64_t len);
 void qemu_file_reset_rate_limit(QEMUFile *f);
 void qemu_file_set_rate_limit(QEMUFile *f, int64_t new_rate);
 int64_t qemu_file_get_rate_limit(QEMUFile *f);
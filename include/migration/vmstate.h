@@ -54,6 +54,12 @@ typedef struct SaveVMHandlers {
      */
     int (*save_live_iterate)(QEMUFile *f, void *opaque);
 
+    /* This runs outside the iothread lock.  Returns true if there is data
+     * that must be sent right away, even when the rate limit is reached;
+     * save_live_iterate is then called regardless of the limit.
+     */
+    bool (*save_live_urgent)(void *opaque);
+
     /* This runs outside the iothread lock!  */
     int (*save_live_setup)(QEMUFile *f, void *opaque);
     void (*save_live_pending)(QEMUFile *f, void *opaque, uint64_t max_size,
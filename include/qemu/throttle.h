@@ -30,6 +30,9 @@
 
 #define THROTTLE_VALUE_MAX 1000000000000000LL
 
+/* maximum number of nested ThrottleStates, e.g. host/tenant/vm/disk */
+#define THROTTLE_MAX_DEPTH 4
+
 typedef enum {
     THROTTLE_BPS_TOTAL,
     THROTTLE_BPS_READ,
@@ -94,9 +97,15 @@ typedef struct ThrottleConfig {
     uint64_t op_size;         /* size of an operation in bytes */
 } ThrottleConfig;
 
+/* A ThrottleState can be nested inside a parent one, forming a hierarchy of
+ * at most THROTTLE_MAX_DEPTH levels. I/O is accounted in every level of the
+ * hierarchy and it is throttled as soon as any of the levels reaches its
+ * limit, so the parent limits are shared among all of its children.
+ */
 typedef struct ThrottleState {
     ThrottleConfig cfg;       /* configuration */
     int64_t previous_leak;    /* timestamp of the last leak done */
+    struct ThrottleState *parent; /* enclosing level, or NULL */
 } ThrottleState;
 
 typedef struct ThrottleTimers {
@@ -142,8 +151,14 @@ void throttle_config(ThrottleState *ts,
                      ThrottleTimers *tt,
                      ThrottleConfig *cfg);
 
+void throttle_config_state(ThrottleState *ts,
+                           QEMUClockType clock_type,
+                           ThrottleConfig *cfg);
+
 void throttle_get_config(ThrottleState *ts, ThrottleConfig *cfg);
 
+void throttle_set_parent(ThrottleState *ts, ThrottleState *parent);
+
 void throttle_config_init(ThrottleConfig *cfg);
 
 /* usage */
@@ -151,6 +166,8 @@ bool throttle_schedule_timer(ThrottleState *ts,
                              ThrottleTimers *tt,
                              bool is_write);
 
+bool throttle_own_limits_exceeded(ThrottleState *ts, bool is_write);
+
 void throttle_account(ThrottleState *ts, bool is_write, uint64_t size);
 
 #endif
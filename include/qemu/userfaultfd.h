@@ -0,0 +1,30 @@
+/*
+ * Linux userfaultfd helpers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_USERFAULTFD_H
+#define QEMU_USERFAULTFD_H
+
+#include <linux/userfaultfd.h>
+
+/*
+ * All of these report failures with error_report() and return a
+ * negative value, except for uffd_read_events() which leaves it to the
+ * caller since EAGAIN is expected on a non-blocking descriptor.
+ */
+int uffd_query_features(uint64_t *features);
+int uffd_create_fd(uint64_t features, bool non_blocking);
+void uffd_close_fd(int uffd_fd);
+int uffd_register_memory(int uffd_fd, void *addr, uint64_t length,
+                         uint64_t mode, uint64_t *ioctls);
+int uffd_unregister_memory(int uffd_fd, void *addr, uint64_t length);
+int uffd_change_protection(int uffd_fd, void *addr, uint64_t length,
+                           bool wp, bool dont_wake);
+/* Returns the number of messages read, 0 if none, or -errno */
+int uffd_read_events(int uffd_fd, struct uffd_msg *msgs, int count);
+
+#endif /* QEMU_USERFAULTFD_H */
@@ -0,0 +1,69 @@
+/*
+ * VFIO utility
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_VFIO_HELPERS_H
+#define QEMU_VFIO_HELPERS_H
+
+#include "qemu/event_notifier.h"
+
+typedef struct QEMUVFIOState QEMUVFIOState;
+
+/**
+ * qemu_vfio_open_pci:
+ * @device: PCI address of the device, e.g. "0000:01:00.0"
+ * @errp: error object
+ *
+ * Take over the PCI device, which must already be bound to the vfio-pci
+ * driver, in a new VFIO container with a type1 IOMMU.  Bus mastering is
+ * enabled on the device.
+ */
+QEMUVFIOState *qemu_vfio_open_pci(const char *device, Error **errp);
+QEMUVFIOState *qemu_vfio_open_container(int container);
+void qemu_vfio_close(QEMUVFIOState *s);
+
+/**
+ * qemu_vfio_dma_map:
+ * @s: VFIO state
+ * @host: host virtual address, must be aligned to the host page size
+ * @size: size of the region, must be a multiple of the host page size
+ * @temporary: whether the mapping is released by the next call to
+ *             qemu_vfio_dma_reset_temporary() rather than explicitly
+ * @iova: returns the IO virtual address that the device must use
+ *
+ * Map a memory region for DMA.  Regions that are already covered by a
+ * persistent mapping are not mapped again; guest RAM is mapped persistently
+ * as soon as the state is created, so only bounce buffers and other host
+ * memory need a VFIO_IOMMU_MAP_DMA per request.  Returns -ENOMEM when the IOVA
+ * space is exhausted; callers using temporary mappings should then wait for
+ * the in-flight DMA to complete, call qemu_vfio_dma_reset_temporary() and
+ * try again.
+ */
+int qemu_vfio_dma_map(QEMUVFIOState *s, void *host, size_t size,
+                      bool temporary, uint64_t *iova);
+int qemu_vfio_dma_reset_temporary(QEMUVFIOState *s);
+void qemu_vfio_dma_unmap(QEMUVFIOState *s, void *host);
+
+void *qemu_vfio_pci_map_bar(QEMUVFIOState *s, int index,
+                            uint64_t offset, uint64_t size,
+                            Error **errp);
+void qemu_vfio_pci_unmap_bar(QEMUVFIOState *s, int index, void *bar,
+                             uint64_t offset, uint64_t size);
+
+/**
+ * qemu_vfio_pci_init_irq:
+ * @s: VFIO state
+ * @e: event notifier that is signalled for interrupts
+ * @irq_type: VFIO_PCI_INTX_IRQ_INDEX, VFIO_PCI_MSI_IRQ_INDEX or
+ *            VFIO_PCI_MSIX_IRQ_INDEX
+ * @errp: error object
+ *
+ * Route the first interrupt vector of @irq_type to @e.
+ */
+int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
+                           int irq_type, Error **errp);
+
+#endif
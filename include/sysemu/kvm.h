@@ -237,6 +237,30 @@ int kvm_set_signal_mask(CPUState *cpu, const sigset_t *sigset);
 int kvm_on_sigbus_vcpu(CPUState *cpu, int code, void *addr);
 int kvm_on_sigbus(int code, void *addr);
 
+/* interface with migration */
+
+typedef void KVMDirtyPageFunc(ram_addr_t addr, void *opaque);
+
+/**
+ * kvm_dirty_ring_enabled - Check if dirty pages are collected from
+ * per-vCPU dirty rings rather than from per-slot dirty bitmaps.
+ */
+bool kvm_dirty_ring_enabled(void);
+
+/**
+ * kvm_dirty_ring_sync - Collect the dirty rings of all vCPUs
+ * @func: called with the ram_addr_t of each page found in the rings
+ * @opaque: passed to @func
+ *
+ * Unlike a log_sync, the pages are handed straight to @func and are not
+ * recorded in the DIRTY_MEMORY_MIGRATION bitmap; the other dirty clients
+ * are updated as usual.  @func runs in the caller's thread with the RCU
+ * read lock held.
+ *
+ * Returns the number of pages collected.
+ */
+uint64_t kvm_dirty_ring_sync(KVMDirtyPageFunc *func, void *opaque);
+
 /* interface with exec.c */
 
 void phys_mem_set_alloc(void *(*alloc)(size_t, uint64_t *align));
@@ -64,6 +64,7 @@
 struct KVMParkedVcpu {
     unsigned long vcpu_id;
     int kvm_fd;
+    uint32_t kvm_fetch_index;
     QLIST_ENTRY(KVMParkedVcpu) node;
 };
 
@@ -100,7 +101,13 @@ struct KVMState
     QTAILQ_HEAD(msi_hashtab, KVMMSIRoute) msi_hashtab[KVM_MSI_HASHTAB_SIZE];
 #endif
     KVMMemoryListener memory_listener;
+    /* Listeners by KVM address space id, for harvesting dirty rings */
+    KVMMemoryListener *as_kml[2];
     QLIST_HEAD(, KVMParkedVcpu) kvm_parked_vcpus;
+    /* Entries in each vCPU dirty ring, or 0 if KVM_GET_DIRTY_LOG is used */
+    uint32_t kvm_dirty_ring_size;
+    uint32_t kvm_dirty_ring_bytes;
+    QemuMutex kvm_dirty_ring_lock;
 };
 
 KVMState *kvm_state;
@@ -251,6 +258,9 @@ static int kvm_set_user_memory_region(KVMMemoryListener *kml, KVMSlot *slot)
     return kvm_vm_ioctl(s, KVM_SET_USER_MEMORY_REGION, &mem);
 }
 
+static uint64_t kvm_dirty_ring_reap(KVMState *s, KVMDirtyPageFunc *func,
+                                    void *opaque);
+
 int kvm_destroy_vcpu(CPUState *cpu)
 {
     KVMState *s = kvm_state;
@@ -272,16 +282,28 @@ int kvm_destroy_vcpu(CPUState *cpu)
         goto err;
     }
 
+    if (cpu->kvm_dirty_gfns) {
+        /* Pages dirtied by this vCPU must not be lost */
+        kvm_dirty_ring_reap(s, NULL, NULL);
+        ret = munmap(cpu->kvm_dirty_gfns, s->kvm_dirty_ring_bytes);
+        if (ret < 0) {
+            goto err;
+        }
+        cpu->kvm_dirty_gfns = NULL;
+    }
+
     vcpu = g_malloc0(sizeof(*vcpu));
     vcpu->vcpu_id = kvm_arch_vcpu_id(cpu);
     vcpu->kvm_fd = cpu->kvm_fd;
+    vcpu->kvm_fetch_index = cpu->kvm_fetch_index;
     QLIST_INSERT_HEAD(&kvm_state->kvm_parked_vcpus, vcpu, node);
 err:
     return ret;
 }
 
-static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id)
+static int kvm_get_vcpu(KVMState *s, CPUState *cs)
 {
+    unsigned long vcpu_id = kvm_arch_vcpu_id(cs);
     struct KVMParkedVcpu *cpu;
 
     QLIST_FOREACH(cpu, &s->kvm_parked_vcpus, node) {
@@ -290,11 +312,14 @@ static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id)
 
             QLIST_REMOVE(cpu, node);
             kvm_fd = cpu->kvm_fd;
+            /* The kernel keeps its ring position across unplug */
+            cs->kvm_fetch_index = cpu->kvm_fetch_index;
             g_free(cpu);
             return kvm_fd;
         }
     }
 
+    cs->kvm_fetch_index = 0;
     return kvm_vm_ioctl(s, KVM_CREATE_VCPU, (void *)vcpu_id);
 }
 
@@ -306,7 +331,7 @@ int kvm_init_vcpu(CPUState *cpu)
 
     DPRINTF("kvm_init_vcpu\n");
 
-    ret = kvm_get_vcpu(s, kvm_arch_vcpu_id(cpu));
+    ret = kvm_get_vcpu(s, cpu);
     if (ret < 0) {
         DPRINTF("kvm_create_vcpu failed\n");
         goto err;
@@ -336,6 +361,19 @@ int kvm_init_vcpu(CPUState *cpu)
             (void *)cpu->kvm_run + s->coalesced_mmio * PAGE_SIZE;
     }
 
+    if (s->kvm_dirty_ring_size) {
+        cpu->kvm_dirty_gfns = mmap(NULL, s->kvm_dirty_ring_bytes,
+                                   PROT_READ | PROT_WRITE, MAP_SHARED,
+                                   cpu->kvm_fd,
+                                   PAGE_SIZE * KVM_DIRTY_LOG_PAGE_OFFSET);
+        if (cpu->kvm_dirty_gfns == MAP_FAILED) {
+            cpu->kvm_dirty_gfns = NULL;
+            ret = -errno;
+            DPRINTF("mmap'ing vcpu dirty ring failed\n");
+            goto err;
+        }
+    }
+
     ret = kvm_arch_init_vcpu(cpu);
 err:
     return ret;
@@ -435,6 +473,161 @@ static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
     return 0;
 }
 
+/*
+ * With KVM_CAP_DIRTY_LOG_RING every vCPU pushes the GFNs it dirties into
+ * a ring shared with us, so harvesting costs time proportional to the
+ * number of pages written rather than to the size of guest memory.
+ *
+ * Entries logged by hardware (e.g. PML) reach the ring on the next exit
+ * of the vCPU, so a sync while the guest runs may miss a few pages until
+ * the following one; once the VM is stopped the result is exact.
+ *
+ * The rings are per vCPU, not per slot: any reap empties them for every
+ * slot at once, so each page goes either to @func or, when there is none,
+ * to the dirty bitmap where a later sync of its own section will find it.
+ */
+static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t as_id,
+                                     uint32_t slot_id, uint64_t offset,
+                                     KVMDirtyPageFunc *func, void *opaque)
+{
+    ram_addr_t addr;
+    KVMMemoryListener *kml;
+    KVMSlot *mem;
+
+    if (as_id >= ARRAY_SIZE(s->as_kml) || !s->as_kml[as_id] ||
+        slot_id >= s->nr_slots) {
+        return;
+    }
+
+    kml = s->as_kml[as_id];
+    mem = &kml->slots[slot_id];
+    if (!mem->memory_size || offset >= (mem->memory_size >> TARGET_PAGE_BITS)) {
+        /* The slot went away after the page was logged */
+        return;
+    }
+
+    addr = mem->ram_start_offset + (offset << TARGET_PAGE_BITS);
+    if (func) {
+        cpu_physical_memory_set_dirty_range(addr, TARGET_PAGE_SIZE,
+                                            DIRTY_CLIENTS_NOCODE &
+                                            ~(1 << DIRTY_MEMORY_MIGRATION));
+        func(addr, opaque);
+    } else {
+        cpu_physical_memory_set_dirty_range(addr, TARGET_PAGE_SIZE,
+                                            DIRTY_CLIENTS_NOCODE);
+    }
+}
+
+static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu,
+                                        KVMDirtyPageFunc *func, void *opaque)
+{
+    struct kvm_dirty_gfn *dirty_gfns = cpu->kvm_dirty_gfns, *cur;
+    uint32_t ring_mask = s->kvm_dirty_ring_size - 1;
+    uint32_t fetch = cpu->kvm_fetch_index;
+    uint32_t count = 0;
+
+    while (true) {
+        cur = &dirty_gfns[fetch & ring_mask];
+        if (!(atomic_read(&cur->flags) & KVM_DIRTY_GFN_F_DIRTY)) {
+            break;
+        }
+        /* Read slot and offset only after seeing the dirty flag */
+        smp_rmb();
+        kvm_dirty_ring_mark_page(s, cur->slot >> 16, cur->slot & 0xffff,
+                                 cur->offset, func, opaque);
+        /* ... and hand the entry back to KVM_RESET_DIRTY_RINGS */
+        smp_mb();
+        atomic_set(&cur->flags, KVM_DIRTY_GFN_F_RESET);
+        fetch++;
+        count++;
+    }
+    cpu->kvm_fetch_index = fetch;
+
+    return count;
+}
+
+/**
+ * kvm_dirty_ring_reap - Collect dirty pages from all vCPU dirty rings
+ * into qemu's dirty bitmap, or into @func if not NULL, and let KVM recycle
+ * the entries.
+ *
+ * Returns the number of pages collected.
+ */
+static uint64_t kvm_dirty_ring_reap(KVMState *s, KVMDirtyPageFunc *func,
+                                    void *opaque)
+{
+    CPUState *cpu;
+    uint64_t total = 0;
+    int64_t start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    int ret;
+
+    qemu_mutex_lock(&s->kvm_dirty_ring_lock);
+    CPU_FOREACH(cpu) {
+        if (cpu->kvm_dirty_gfns) {
+            total += kvm_dirty_ring_reap_one(s, cpu, func, opaque);
+        }
+    }
+
+    if (total) {
+        ret = kvm_vm_ioctl(s, KVM_RESET_DIRTY_RINGS);
+        if (ret < 0) {
+            error_report("KVM: failed to reset dirty rings: %s",
+                         strerror(-ret));
+        }
+    }
+    qemu_mutex_unlock(&s->kvm_dirty_ring_lock);
+
+    trace_kvm_dirty_ring_reap(total,
+                              qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start);
+    return total;
+}
+
+bool kvm_dirty_ring_enabled(void)
+{
+    return kvm_state && kvm_state->kvm_dirty_ring_size;
+}
+
+uint64_t kvm_dirty_ring_sync(KVMDirtyPageFunc *func, void *opaque)
+{
+    uint64_t total;
+
+    assert(kvm_dirty_ring_enabled());
+    rcu_read_lock();
+    total = kvm_dirty_ring_reap(kvm_state, func, opaque);
+    rcu_read_unlock();
+    return total;
+}
+
+static void kvm_dirty_ring_init(KVMState *s, uint32_t ring_size)
+{
+    uint64_t ring_bytes = ring_size * sizeof(struct kvm_dirty_gfn);
+    int ret;
+
+    ret = kvm_vm_check_extension(s, KVM_CAP_DIRTY_LOG_RING);
+    if (ret <= 0) {
+        error_report("KVM dirty ring not supported by host kernel, "
+                     "using dirty bitmap");
+        return;
+    }
+    if (ring_bytes > ret) {
+        error_report("KVM dirty ring size %" PRIu32 " too big "
+                     "(maximum is %zu), using dirty bitmap", ring_size,
+                     ret / sizeof(struct kvm_dirty_gfn));
+        return;
+    }
+
+    ret = kvm_vm_enable_cap(s, KVM_CAP_DIRTY_LOG_RING, 0, ring_bytes);
+    if (ret) {
+        error_report("Enabling KVM dirty ring failed: %s, "
+                     "using dirty bitmap", strerror(-ret));
+        return;
+    }
+
+    qemu_mutex_init(&s->kvm_dirty_ring_lock);
+    s->kvm_dirty_ring_size = ring_size;
+    s->kvm_dirty_ring_bytes = ring_bytes;
+}
+
 #define ALIGN(x, y)  (((x)+(y)-1) & ~((y)-1))
 
 /**
@@ -459,6 +652,8 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
 
     d.dirty_bitmap = NULL;
     while (start_addr < end_addr) {
+        int64_t slot_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+
         mem = kvm_lookup_overlapping_slot(kml, start_addr, end_addr);
         if (mem == NULL) {
             break;
@@ -494,6 +689,8 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
         }
 
         kvm_get_dirty_pages_log_range(section, d.dirty_bitmap);
+        trace_kvm_physical_sync_dirty_bitmap(mem->slot, mem->memory_size,
+            qemu_clock_get_us(QEMU_CLOCK_REALTIME) - slot_start);
         start_addr = mem->start_addr + mem->memory_size;
     }
     g_free(d.dirty_bitmap);
@@ -699,6 +896,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     bool writeable = !mr->readonly && !mr->rom_device;
     hwaddr start_addr = section->offset_within_address_space;
     ram_addr_t size = int128_get64(section->size);
+    ram_addr_t ram_start_offset;
     void *ram = NULL;
     unsigned delta;
 
@@ -728,6 +926,8 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     }
 
     ram = memory_region_get_ram_ptr(mr) + section->offset_within_region + delta;
+    ram_start_offset = memory_region_get_ram_addr(mr) +
+                       section->offset_within_region + delta;
 
     while (1) {
         mem = kvm_lookup_overlapping_slot(kml, start_addr, start_addr + size);
@@ -747,7 +947,11 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
         old = *mem;
 
         if (mem->flags & KVM_MEM_LOG_DIRTY_PAGES) {
-            kvm_physical_sync_dirty_bitmap(kml, section);
+            if (s->kvm_dirty_ring_size) {
+                kvm_dirty_ring_reap(s, NULL, NULL);
+            } else {
+                kvm_physical_sync_dirty_bitmap(kml, section);
+            }
         }
 
         /* unregister the overlapping slot */
@@ -773,6 +977,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
             mem->memory_size = old.memory_size;
             mem->start_addr = old.start_addr;
             mem->ram = old.ram;
+            mem->ram_start_offset = old.ram_start_offset;
             mem->flags = kvm_mem_flags(mr);
 
             err = kvm_set_user_memory_region(kml, mem);
@@ -784,6 +989,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
 
             start_addr += old.memory_size;
             ram += old.memory_size;
+            ram_start_offset += old.memory_size;
             size -= old.memory_size;
             continue;
         }
@@ -794,6 +1000,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
             mem->memory_size = start_addr - old.start_addr;
             mem->start_addr = old.start_addr;
             mem->ram = old.ram;
+            mem->ram_start_offset = old.ram_start_offset;
             mem->flags =  kvm_mem_flags(mr);
 
             err = kvm_set_user_memory_region(kml, mem);
@@ -818,6 +1025,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
             size_delta = mem->start_addr - old.start_addr;
             mem->memory_size = old.memory_size - size_delta;
             mem->ram = old.ram + size_delta;
+            mem->ram_start_offset = old.ram_start_offset + size_delta;
             mem->flags = kvm_mem_flags(mr);
 
             err = kvm_set_user_memory_region(kml, mem);
@@ -840,6 +1048,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     mem->memory_size = size;
     mem->start_addr = start_addr;
     mem->ram = ram;
+    mem->ram_start_offset = ram_start_offset;
     mem->flags = kvm_mem_flags(mr);
 
     err = kvm_set_user_memory_region(kml, mem);
@@ -874,6 +1083,12 @@ static void kvm_log_sync(MemoryListener *listener,
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
     int r;
 
+    if (kvm_state->kvm_dirty_ring_size) {
+        /* The rings are not per section, one pass collects everything */
+        kvm_dirty_ring_reap(kvm_state, NULL, NULL);
+        return;
+    }
+
     r = kvm_physical_sync_dirty_bitmap(kml, section);
     if (r < 0) {
         abort();
@@ -956,6 +1171,9 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
 
     kml->slots = g_malloc0(s->nr_slots * sizeof(KVMSlot));
     kml->as_id = as_id;
+    if (as_id < ARRAY_SIZE(s->as_kml)) {
+        s->as_kml[as_id] = kml;
+    }
 
     for (i = 0; i < s->nr_slots; i++) {
         kml->slots[i].slot = i;
@@ -1686,6 +1904,11 @@ static int kvm_init(MachineState *ms)
 
     s->coalesced_mmio = kvm_check_extension(s, KVM_CAP_COALESCED_MMIO);
 
+    /* Must be enabled before any vCPU is created */
+    if (machine_kvm_dirty_ring_size(ms)) {
+        kvm_dirty_ring_init(s, machine_kvm_dirty_ring_size(ms));
+    }
+
     s->broken_set_mem_region = 1;
     ret = kvm_check_extension(s, KVM_CAP_JOIN_MEMORY_REGIONS_WORKS);
     if (ret > 0) {
@@ -1986,6 +2209,14 @@ int kvm_cpu_exec(CPUState *cpu)
         case KVM_EXIT_INTERNAL_ERROR:
             ret = kvm_handle_internal_error(cpu, run);
             break;
+        case KVM_EXIT_DIRTY_RING_FULL:
+            /* The vCPU cannot log more pages until the rings are reaped */
+            trace_kvm_dirty_ring_full(cpu->cpu_index);
+            qemu_mutex_lock_iothread();
+            kvm_dirty_ring_reap(kvm_state, NULL, NULL);
+            qemu_mutex_unlock_iothread();
+            ret = 0;
+            break;
         case KVM_EXIT_SYSTEM_EVENT:
             switch (run->system_event.type) {
             case KVM_SYSTEM_EVENT_SHUTDOWN:
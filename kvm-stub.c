@@ -160,4 +160,14 @@ bool kvm_has_free_slot(MachineState *ms)
 {
     return false;
 }
+
+bool kvm_dirty_ring_enabled(void)
+{
+    return false;
+}
+
+uint64_t kvm_dirty_ring_sync(KVMDirtyPageFunc *func, void *opaque)
+{
+    return 0;
+}
 #endif
@@ -0,0 +1,207 @@
+/*
+ * Compression codecs for migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
+#include "qemu-common.h"
+#include "migration/compress.h"
+
+static void *codec_no_context_new(void)
+{
+    return NULL;
+}
+
+static void codec_no_context_free(void *ctx)
+{
+}
+
+/* zlib */
+
+static size_t zlib_bound(size_t len)
+{
+    return compressBound(len);
+}
+
+static ssize_t zlib_compress(void *ctx, uint8_t *dst, size_t dst_len,
+                             const uint8_t *src, size_t len, int level)
+{
+    uLongf blen = dst_len;
+
+    if (compress2(dst, &blen, src, len, level) != Z_OK) {
+        return -1;
+    }
+    return blen;
+}
+
+static ssize_t zlib_decompress(void *ctx, uint8_t *dst, size_t dst_len,
+                               const uint8_t *src, size_t len)
+{
+    uLongf blen = dst_len;
+
+    if (uncompress(dst, &blen, src, len) != Z_OK) {
+        return -1;
+    }
+    return blen;
+}
+
+static const MigrationCodec codec_zlib = {
+    .name = "zlib",
+    .bound = zlib_bound,
+    .context_new = codec_no_context_new,
+    .context_free = codec_no_context_free,
+    .compress = zlib_compress,
+    .decompress = zlib_decompress,
+};
+
+/* zstd */
+
+#ifdef CONFIG_ZSTD
+typedef struct ZstdContext {
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+} ZstdContext;
+
+static size_t zstd_bound(size_t len)
+{
+    return ZSTD_compressBound(len);
+}
+
+static void *zstd_context_new(void)
+{
+    ZstdContext *z = g_new(ZstdContext, 1);
+
+    z->cctx = ZSTD_createCCtx();
+    z->dctx = ZSTD_createDCtx();
+    if (!z->cctx || !z->dctx) {
+        ZSTD_freeCCtx(z->cctx);
+        ZSTD_freeDCtx(z->dctx);
+        g_free(z);
+        return NULL;
+    }
+    return z;
+}
+
+static void zstd_context_free(void *ctx)
+{
+    ZstdContext *z = ctx;
+
+    if (z) {
+        ZSTD_freeCCtx(z->cctx);
+        ZSTD_freeDCtx(z->dctx);
+        g_free(z);
+    }
+}
+
+static ssize_t zstd_compress(void *ctx, uint8_t *dst, size_t dst_len,
+                             const uint8_t *src, size_t len, int level)
+{
+    ZstdContext *z = ctx;
+    size_t ret;
+
+    if (!z) {
+        return -1;
+    }
+    /* compress-level is at most 9, i.e. one of the faster zstd levels */
+    ret = ZSTD_compressCCtx(z->cctx, dst, dst_len, src, len, level);
+    if (ZSTD_isError(ret)) {
+        return -1;
+    }
+    return ret;
+}
+
+static ssize_t zstd_decompress(void *ctx, uint8_t *dst, size_t dst_len,
+                               const uint8_t *src, size_t len)
+{
+    ZstdContext *z = ctx;
+    size_t ret;
+
+    if (!z) {
+        return -1;
+    }
+    ret = ZSTD_decompressDCtx(z->dctx, dst, dst_len, src, len);
+    if (ZSTD_isError(ret)) {
+        return -1;
+    }
+    return ret;
+}
+
+static const MigrationCodec codec_zstd = {
+    .name = "zstd",
+    .bound = zstd_bound,
+    .context_new = zstd_context_new,
+    .context_free = zstd_context_free,
+    .compress = zstd_compress,
+    .decompress = zstd_decompress,
+};
+#endif
+
+/* lz4 */
+
+#ifdef CONFIG_LZ4
+static size_t lz4_bound(size_t len)
+{
+    return LZ4_compressBound(len);
+}
+
+static ssize_t lz4_compress(void *ctx, uint8_t *dst, size_t dst_len,
+                            const uint8_t *src, size_t len, int level)
+{
+    int ret;
+
+    ret = LZ4_compress_default((const char *)src, (char *)dst, len, dst_len);
+    if (ret <= 0) {
+        return -1;
+    }
+    return ret;
+}
+
+static ssize_t lz4_decompress(void *ctx, uint8_t *dst, size_t dst_len,
+                              const uint8_t *src, size_t len)
+{
+    int ret;
+
+    ret = LZ4_decompress_safe((const char *)src, (char *)dst, len, dst_len);
+    if (ret < 0) {
+        return -1;
+    }
+    return ret;
+}
+
+static const MigrationCodec codec_lz4 = {
+    .name = "lz4",
+    .bound = lz4_bound,
+    .context_new = codec_no_context_new,
+    .context_free = codec_no_context_free,
+    .compress = lz4_compress,
+    .decompress = lz4_decompress,
+};
+#endif
+
+const MigrationCodec *migration_codec_get(MigrationCompressMethod method)
+{
+    switch (method) {
+    case MIGRATION_COMPRESS_METHOD_ZLIB:
+        return &codec_zlib;
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD:
+        return &codec_zstd;
+#endif
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_METHOD_LZ4:
+        return &codec_lz4;
+#endif
+    default:
+        return NULL;
+    }
+}
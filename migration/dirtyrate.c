@@ -0,0 +1,184 @@
+/*
+ * Dirty page rate measurement
+ *
+ * Measures how fast the guest dirties its memory with the dirty log
+ * that migration uses, without migrating anything.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "cpu.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qerror.h"
+#include "qapi/clone-visitor.h"
+#include "qapi-visit.h"
+#include "qmp-commands.h"
+#include "qemu/bitmap.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu_queue.h"
+#include "qemu/timer.h"
+#include "exec/address-spaces.h"
+#include "exec/ram_addr.h"
+#include "migration/migration.h"
+#include "sysemu/sysemu.h"
+#include "trace.h"
+
+#define DIRTY_RATE_MAX_CALC_TIME 60
+
+/* Protected by the iothread lock */
+static struct {
+    DirtyRateStatus status;
+    int64_t start_time;
+    int64_t calc_time;
+    /* Result of the last measurement */
+    uint64_t dirty_pages_rate;
+    RAMBlockDirtyRateList *blocks;
+} dirty_rate;
+
+bool dirty_rate_measuring(void)
+{
+    return dirty_rate.status == DIRTY_RATE_STATUS_MEASURING;
+}
+
+/*
+ * Fetch and clear the dirty log, and count the dirty pages of each block
+ * over the last @time_ms milliseconds.  Called with the iothread lock held.
+ */
+static RAMBlockDirtyRateList *dirty_rate_sync(int64_t time_ms,
+                                              uint64_t *dirty_pages)
+{
+    RAMBlockDirtyRateList *head = NULL, **tail = &head;
+    unsigned long *bmap;
+    RAMBlock *block;
+
+    bmap = bitmap_new(last_ram_offset() >> TARGET_PAGE_BITS);
+    address_space_sync_dirty_bitmap(&address_space_memory);
+
+    *dirty_pages = 0;
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        RAMBlockDirtyRateList *entry;
+        uint64_t pages;
+
+        pages = cpu_physical_memory_sync_dirty_bitmap(bmap, block->offset,
+                                                      block->used_length);
+        *dirty_pages += pages;
+
+        entry = g_new0(RAMBlockDirtyRateList, 1);
+        entry->value = g_new0(RAMBlockDirtyRate, 1);
+        entry->value->name = g_strdup(block->idstr);
+        entry->value->size = block->used_length;
+        entry->value->dirty_pages_rate = pages * 1000 / time_ms;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    rcu_read_unlock();
+    g_free(bmap);
+
+    return head;
+}
+
+static void *dirty_rate_thread(void *opaque)
+{
+    RAMBlockDirtyRateList *blocks;
+    uint64_t dirty_pages;
+    int64_t start, elapsed;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_start();
+    /* Drop whatever was dirty before the measurement started */
+    qapi_free_RAMBlockDirtyRateList(dirty_rate_sync(1, &dirty_pages));
+    start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_mutex_unlock_iothread();
+
+    g_usleep(dirty_rate.calc_time * G_USEC_PER_SEC);
+
+    qemu_mutex_lock_iothread();
+    elapsed = MAX(qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start, 1);
+    blocks = dirty_rate_sync(elapsed, &dirty_pages);
+    memory_global_dirty_log_stop();
+
+    qapi_free_RAMBlockDirtyRateList(dirty_rate.blocks);
+    dirty_rate.blocks = blocks;
+    dirty_rate.dirty_pages_rate = dirty_pages * 1000 / elapsed;
+    dirty_rate.status = DIRTY_RATE_STATUS_MEASURED;
+    trace_dirty_rate_measured(dirty_pages, elapsed);
+    qemu_mutex_unlock_iothread();
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    QemuThread thread;
+
+    if (calc_time < 1 || calc_time > DIRTY_RATE_MAX_CALC_TIME) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "calc-time",
+                   "an integer in the range of 1 to 60");
+        return;
+    }
+    if (dirty_rate_measuring()) {
+        error_setg(errp, "Dirty page rate measurement in progress");
+        return;
+    }
+    /* Migration needs the dirty log to itself */
+    if (migration_is_setup_or_active(s->state) ||
+        s->state == MIGRATION_STATUS_CANCELLING) {
+        error_setg(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+    if (runstate_check(RUN_STATE_INMIGRATE)) {
+        error_setg(errp, "Guest is waiting for an incoming migration");
+        return;
+    }
+
+    dirty_rate.status = DIRTY_RATE_STATUS_MEASURING;
+    dirty_rate.start_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) / 1000;
+    dirty_rate.calc_time = calc_time;
+    trace_dirty_rate_start(calc_time);
+
+    qemu_thread_create(&thread, "dirtyrate", dirty_rate_thread, NULL,
+                       QEMU_THREAD_DETACHED);
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info = g_new0(DirtyRateInfo, 1);
+    MigrationState *s = migrate_get_current();
+    uint64_t dirty_bytes_rate;
+    int64_t converge_time;
+
+    info->status = dirty_rate.status;
+    info->start_time = dirty_rate.start_time;
+    info->calc_time = dirty_rate.calc_time;
+
+    if (dirty_rate.status != DIRTY_RATE_STATUS_MEASURED) {
+        return info;
+    }
+
+    dirty_bytes_rate = dirty_rate.dirty_pages_rate * TARGET_PAGE_SIZE;
+    info->has_dirty_rate = true;
+    info->dirty_rate = dirty_bytes_rate >> 20;
+    info->has_blocks = true;
+    info->blocks = QAPI_CLONE(RAMBlockDirtyRateList, dirty_rate.blocks);
+
+    /* bandwidth_limit is in bytes per second */
+    converge_time = migration_predict_converge_time(ram_bytes_total(),
+                                                    dirty_bytes_rate,
+                                                    s->bandwidth_limit /
+                                                    1000.0);
+    if (converge_time >= 0) {
+        info->has_expected_converge_time = true;
+        info->expected_converge_time = converge_time;
+    }
+
+    return info;
+}
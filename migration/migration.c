@@ -19,6 +19,7 @@
 #include "qemu/main-loop.h"
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
+#include "migration/compress.h"
 #include "sysemu/sysemu.h"
 #include "block/block.h"
 #include "qapi/qmp/qerror.h"
@@ -39,11 +40,6 @@
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration transfer speed throttling */
 
-/* Amount of time to allocate to each "chunk" of bandwidth-throttled
- * data. */
-#define BUFFER_DELAY     100
-#define XFER_LIMIT_RATIO (1000 / BUFFER_DELAY)
-
 /* Default compression thread count */
 #define DEFAULT_MIGRATE_COMPRESS_THREAD_COUNT 8
 /* Default decompression thread count, usually decompression is at
@@ -54,6 +50,13 @@
 /* Define default autoconverge cpu throttle migration parameters */
 #define DEFAULT_MIGRATE_CPU_THROTTLE_INITIAL 20
 #define DEFAULT_MIGRATE_CPU_THROTTLE_INCREMENT 10
+/* Default number of additional RAM channels for multifd */
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+/* Default number of pages in each multifd packet */
+#define DEFAULT_MIGRATE_MULTIFD_PAGE_COUNT 16
+
+/* Default number of pages sent after a postcopy page request */
+#define DEFAULT_MIGRATE_POSTCOPY_PREFETCH_PAGES 64
 
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
@@ -89,11 +92,17 @@ MigrationState *migrate_get_current(void)
             .decompress_threads = DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT,
             .cpu_throttle_initial = DEFAULT_MIGRATE_CPU_THROTTLE_INITIAL,
             .cpu_throttle_increment = DEFAULT_MIGRATE_CPU_THROTTLE_INCREMENT,
+            .x_multifd_channels = DEFAULT_MIGRATE_MULTIFD_CHANNELS,
+            .x_multifd_page_count = DEFAULT_MIGRATE_MULTIFD_PAGE_COUNT,
+            .compress_method = MIGRATION_COMPRESS_METHOD_ZLIB,
+            .postcopy_prefetch_pages = DEFAULT_MIGRATE_POSTCOPY_PREFETCH_PAGES,
         },
     };
 
     if (!once) {
         qemu_mutex_init(&current_migration.src_page_req_mutex);
+        qemu_sem_init(&current_migration.postcopy_pause_sem, 0);
+        qemu_sem_init(&current_migration.rp_state.rp_sem, 0);
         once = true;
     }
     return &current_migration;
@@ -115,6 +124,10 @@ MigrationIncomingState *migration_incoming_state_new(QEMUFile* f)
     QLIST_INIT(&mis_current->loadvm_handlers);
     qemu_mutex_init(&mis_current->rp_mutex);
     qemu_event_init(&mis_current->main_thread_load_event, false);
+    qemu_sem_init(&mis_current->postcopy_pause_sem_dst, 0);
+    qemu_mutex_init(&mis_current->page_request_mutex);
+    mis_current->page_requested = g_hash_table_new_full(NULL, NULL,
+                                                        NULL, g_free);
 
     return mis_current;
 }
@@ -122,6 +135,10 @@ MigrationIncomingState *migration_incoming_state_new(QEMUFile* f)
 void migration_incoming_state_destroy(void)
 {
     qemu_event_destroy(&mis_current->main_thread_load_event);
+    qemu_sem_destroy(&mis_current->postcopy_pause_sem_dst);
+    qemu_mutex_destroy(&mis_current->page_request_mutex);
+    g_hash_table_destroy(mis_current->page_requested);
+    ram_recv_bitmap_cleanup();
     loadvm_free_handlers(mis_current);
     g_free(mis_current);
     mis_current = NULL;
@@ -296,14 +313,57 @@ void migrate_send_rp_req_pages(MigrationIncomingState *mis, const char *rbname,
     }
 }
 
-void qemu_start_incoming_migration(const char *uri, Error **errp)
+/*
+ * Request the source to send us the bitmap of the pages it still needs
+ * to send, for a RAMBlock of a recovering postcopy migration.
+ */
+int migrate_send_rp_recv_bitmap(MigrationIncomingState *mis,
+                                const char *block_name)
+{
+    uint8_t buf[1 + 256];
+    size_t len = strlen(block_name);
+    int ret;
+
+    trace_migrate_send_rp_recv_bitmap(block_name);
+
+    buf[0] = len;
+    memcpy(buf + 1, block_name, len);
+
+    /*
+     * The bitmap follows the header directly, so send both with the
+     * lock held to keep page requests from being interleaved.
+     */
+    qemu_mutex_lock(&mis->rp_mutex);
+    if (!mis->to_src_file) {
+        qemu_mutex_unlock(&mis->rp_mutex);
+        return -EIO;
+    }
+    qemu_put_be16(mis->to_src_file, MIG_RP_MSG_RECV_BITMAP);
+    qemu_put_be16(mis->to_src_file, len + 1);
+    qemu_put_buffer(mis->to_src_file, buf, len + 1);
+    ret = ram_send_recv_bitmap(mis->to_src_file, block_name);
+    qemu_fflush(mis->to_src_file);
+    qemu_mutex_unlock(&mis->rp_mutex);
+
+    return ret;
+}
+
+/*
+ * Tell the source that we are ready to continue a recovered postcopy
+ */
+void migrate_send_rp_resume_ack(MigrationIncomingState *mis, uint32_t value)
+{
+    uint32_t buf;
+
+    buf = cpu_to_be32(value);
+    migrate_send_rp_message(mis, MIG_RP_MSG_RESUME_ACK, sizeof(buf), &buf);
+}
+
+static void migration_incoming_listen(const char *uri, Error **errp)
 {
     const char *p;
 
-    qapi_event_send_migration(MIGRATION_STATUS_SETUP, &error_abort);
-    if (!strcmp(uri, "defer")) {
-        deferred_incoming_migration(errp);
-    } else if (strstart(uri, "tcp:", &p)) {
+    if (strstart(uri, "tcp:", &p)) {
         tcp_start_incoming_migration(p, errp);
 #ifdef CONFIG_RDMA
     } else if (strstart(uri, "rdma:", &p)) {
@@ -315,11 +375,23 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_incoming_migration(p, errp);
     } else {
         error_setg(errp, "unknown migration protocol: %s", uri);
     }
 }
 
+void qemu_start_incoming_migration(const char *uri, Error **errp)
+{
+    qapi_event_send_migration(MIGRATION_STATUS_SETUP, &error_abort);
+    if (!strcmp(uri, "defer")) {
+        deferred_incoming_migration(errp);
+    } else {
+        migration_incoming_listen(uri, errp);
+    }
+}
+
 static void process_incoming_migration_bh(void *opaque)
 {
     Error *local_err = NULL;
@@ -401,6 +473,7 @@ static void process_incoming_migration_co(void *opaque)
         /* Else if something went wrong then just fall out of the normal exit */
     }
 
+    multifd_load_cleanup();
     qemu_fclose(f);
     free_xbzrle_decoded_buf();
 
@@ -418,14 +491,69 @@ static void process_incoming_migration_co(void *opaque)
 
 void migration_fd_process_incoming(QEMUFile *f)
 {
-    Coroutine *co = qemu_coroutine_create(process_incoming_migration_co, f);
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    Coroutine *co;
+
+    if (mis && mis->state == MIGRATION_STATUS_POSTCOPY_PAUSED) {
+        /* A new channel for a paused postcopy, the listen thread takes it */
+        trace_migration_fd_process_incoming_recover();
+        qemu_file_set_blocking(f, true);
+        mis->from_src_file = f;
+        migrate_set_state(&mis->state, MIGRATION_STATUS_POSTCOPY_PAUSED,
+                          MIGRATION_STATUS_POSTCOPY_RECOVER);
+        qemu_sem_post(&mis->postcopy_pause_sem_dst);
+        return;
+    }
 
+    co = qemu_coroutine_create(process_incoming_migration_co, f);
     migrate_decompress_threads_create();
     qemu_file_set_blocking(f, false);
     qemu_coroutine_enter(co);
 }
 
 
+/*
+ * With x-multifd, the main channel of an incoming migration is kept here
+ * until all the RAM channels are connected as well.  The source always
+ * connects the main channel first.
+ */
+static bool incoming_main_channel_received;
+static QEMUFile *incoming_main_file;
+
+static void migration_ioc_process_incoming(QIOChannel *ioc)
+{
+    Error *local_err = NULL;
+
+    if (!migrate_use_multifd()) {
+        migration_fd_process_incoming(qemu_fopen_channel_input(ioc));
+        return;
+    }
+
+    if (!incoming_main_channel_received) {
+        incoming_main_file = qemu_fopen_channel_input(ioc);
+        incoming_main_channel_received = true;
+    } else if (multifd_recv_new_channel(ioc, &local_err) < 0) {
+        error_report_err(local_err);
+        exit(EXIT_FAILURE);
+    }
+
+    if (incoming_main_file && multifd_recv_all_channels_created()) {
+        QEMUFile *f = incoming_main_file;
+
+        incoming_main_file = NULL;
+        migration_fd_process_incoming(f);
+    }
+}
+
+bool migration_has_all_channels(void)
+{
+    if (!migrate_use_multifd()) {
+        return true;
+    }
+    return incoming_main_channel_received &&
+           multifd_recv_all_channels_created();
+}
+
 void migration_channel_process_incoming(MigrationState *s,
                                         QIOChannel *ioc)
 {
@@ -441,8 +569,7 @@ void migration_channel_process_incoming(MigrationState *s,
             error_report_err(local_err);
         }
     } else {
-        QEMUFile *f = qemu_fopen_channel_input(ioc);
-        migration_fd_process_incoming(f);
+        migration_ioc_process_incoming(ioc);
     }
 }
 
@@ -483,6 +610,14 @@ void migrate_send_rp_message(MigrationIncomingState *mis,
 {
     trace_migrate_send_rp_message((int)message_type, len);
     qemu_mutex_lock(&mis->rp_mutex);
+    if (!mis->to_src_file) {
+        /*
+         * The return path is gone while postcopy is paused; outstanding
+         * page requests are sent again once it is recovered.
+         */
+        qemu_mutex_unlock(&mis->rp_mutex);
+        return;
+    }
     qemu_put_be16(mis->to_src_file, (unsigned int)message_type);
     qemu_put_be16(mis->to_src_file, len);
     qemu_put_buffer(mis->to_src_file, data, len);
@@ -528,6 +663,41 @@ uint64_t migrate_max_downtime(void)
     return max_downtime;
 }
 
+/* Give up on passes that shrink too slowly to ever get done */
+#define CONVERGE_MAX_PASSES 1000
+
+/*
+ * Predict the time in ms precopy needs until @remaining bytes of RAM can
+ * be sent within the downtime limit, at @bandwidth bytes per ms.  Each
+ * pass sends what the guest dirtied during the previous one, so passes
+ * shrink by the ratio of the dirty rate to the bandwidth.
+ * Returns -1 if they don't shrink, i.e. precopy doesn't converge.
+ */
+int64_t migration_predict_converge_time(uint64_t remaining,
+                                        uint64_t dirty_bytes_rate,
+                                        double bandwidth)
+{
+    double downtime = max_downtime / 1000000;
+    double ratio, pass, total = 0;
+    int i;
+
+    if (bandwidth <= 0) {
+        return -1;
+    }
+    ratio = dirty_bytes_rate / 1000.0 / bandwidth;
+    pass = remaining / bandwidth;
+
+    for (i = 0; pass > downtime; i++) {
+        if (ratio >= 1 || i == CONVERGE_MAX_PASSES) {
+            return -1;
+        }
+        total += pass;
+        pass *= ratio;
+    }
+
+    return total;
+}
+
 MigrationCapabilityStatusList *qmp_query_migrate_capabilities(Error **errp)
 {
     MigrationCapabilityStatusList *head = NULL;
@@ -566,6 +736,10 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->cpu_throttle_increment = s->parameters.cpu_throttle_increment;
     params->tls_creds = g_strdup(s->parameters.tls_creds);
     params->tls_hostname = g_strdup(s->parameters.tls_hostname);
+    params->x_multifd_channels = s->parameters.x_multifd_channels;
+    params->x_multifd_page_count = s->parameters.x_multifd_page_count;
+    params->compress_method = s->parameters.compress_method;
+    params->postcopy_prefetch_pages = s->parameters.postcopy_prefetch_pages;
 
     return params;
 }
@@ -574,11 +748,13 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
  * Return true if we're already in the middle of a migration
  * (i.e. any of the active or setup states)
  */
-static bool migration_is_setup_or_active(int state)
+bool migration_is_setup_or_active(int state)
 {
     switch (state) {
     case MIGRATION_STATUS_ACTIVE:
     case MIGRATION_STATUS_POSTCOPY_ACTIVE:
+    case MIGRATION_STATUS_POSTCOPY_PAUSED:
+    case MIGRATION_STATUS_POSTCOPY_RECOVER:
     case MIGRATION_STATUS_SETUP:
         return true;
 
@@ -599,6 +775,8 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
         info->xbzrle_cache->cache_miss_rate = xbzrle_mig_cache_miss_rate();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
+        info->xbzrle_cache->blocks = xbzrle_mig_block_stats();
+        info->xbzrle_cache->has_blocks = !!info->xbzrle_cache->blocks;
     }
 }
 
@@ -615,10 +793,15 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     info->ram->mbps = s->mbps;
     info->ram->dirty_sync_count = s->dirty_sync_count;
     info->ram->postcopy_requests = s->postcopy_requests;
+    info->ram->dirty_sync_time = s->dirty_sync_time;
+    info->ram->dirty_sync_total_time = s->dirty_sync_total_time;
+    info->ram->dirty_sync_pages = s->dirty_sync_pages;
 
     if (s->state != MIGRATION_STATUS_COMPLETED) {
         info->ram->remaining = ram_bytes_remaining();
         info->ram->dirty_pages_rate = s->dirty_pages_rate;
+        info->ram->blocks = ram_block_dirty_rates();
+        info->ram->has_blocks = !!info->ram->blocks;
     }
 }
 
@@ -645,6 +828,10 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->expected_downtime = s->expected_downtime;
         info->has_setup_time = true;
         info->setup_time = s->setup_time;
+        if (s->expected_converge_time >= 0) {
+            info->has_expected_converge_time = true;
+            info->expected_converge_time = s->expected_converge_time;
+        }
 
         populate_ram_info(info, s);
 
@@ -664,6 +851,8 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         get_xbzrle_cache_stats(info);
         break;
     case MIGRATION_STATUS_POSTCOPY_ACTIVE:
+    case MIGRATION_STATUS_POSTCOPY_PAUSED:
+    case MIGRATION_STATUS_POSTCOPY_RECOVER:
         /* Mostly the same as active; TODO add some postcopy stats */
         info->has_status = true;
         info->has_total_time = true;
@@ -712,6 +901,9 @@ MigrationInfo *qmp_query_migrate(Error **errp)
     }
     info->status = s->state;
 
+    info->has_postcopy_faults =
+        postcopy_ram_fault_stats(&info->postcopy_faults);
+
     return info;
 }
 
@@ -757,6 +949,54 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
                 false;
         }
     }
+
+    if (migrate_use_multifd() &&
+        (migrate_postcopy_ram() || migrate_use_compression() ||
+         migrate_use_xbzrle())) {
+        /* Pages on the multifd channels are not ordered with respect to
+         * the main stream, which these features rely on.
+         */
+        error_report("x-multifd is not currently compatible with "
+                     "postcopy-ram, compress or xbzrle");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD] = false;
+    }
+
+    if (migrate_use_zero_copy() && !migrate_use_multifd()) {
+        /* Only the multifd channels keep page data apart from the
+         * headers long enough for the kernel to send it in place.
+         */
+        error_report("x-zero-copy requires x-multifd");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_X_ZERO_COPY] = false;
+    }
+
+    if (migrate_background_snapshot()) {
+        if (migrate_postcopy_ram() || migrate_use_multifd() ||
+            migrate_use_xbzrle() || migrate_use_compression() ||
+            migrate_auto_converge()) {
+            /* RAM is saved in a single pass of uncompressed pages */
+            error_setg(errp, "background-snapshot is not compatible with "
+                       "postcopy-ram, x-multifd, xbzrle, compress or "
+                       "auto-converge");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT] =
+                false;
+        } else if (!ram_write_tracking_available() ||
+                   !ram_write_tracking_compatible()) {
+            error_setg(errp, "background-snapshot needs userfaultfd write "
+                       "protection of guest RAM, which the host doesn't "
+                       "support");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT] =
+                false;
+        }
+    }
+
+    if (migrate_use_mapped_ram() &&
+        (migrate_postcopy_ram() || migrate_use_multifd() ||
+         migrate_use_xbzrle() || migrate_use_compression())) {
+        /* Pages are only ever stored whole, at their own offset */
+        error_report("mapped-ram is not compatible with postcopy-ram, "
+                     "x-multifd, xbzrle or compress");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_MAPPED_RAM] = false;
+    }
 }
 
 void qmp_migrate_set_parameters(bool has_compress_level,
@@ -773,6 +1013,14 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                                 const char *tls_creds,
                                 bool has_tls_hostname,
                                 const char *tls_hostname,
+                                bool has_x_multifd_channels,
+                                int64_t x_multifd_channels,
+                                bool has_x_multifd_page_count,
+                                int64_t x_multifd_page_count,
+                                bool has_compress_method,
+                                MigrationCompressMethod compress_method,
+                                bool has_postcopy_prefetch_pages,
+                                int64_t postcopy_prefetch_pages,
                                 Error **errp)
 {
     MigrationState *s = migrate_get_current();
@@ -808,6 +1056,33 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                    "cpu_throttle_increment",
                    "an integer in the range of 1 to 99");
     }
+    if (has_x_multifd_channels &&
+            (x_multifd_channels < 1 || x_multifd_channels > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_multifd_channels",
+                   "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_x_multifd_page_count &&
+            (x_multifd_page_count < 1 || x_multifd_page_count > 10000)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_multifd_page_count",
+                   "is invalid, it should be in the range of 1 to 10000");
+        return;
+    }
+    if (has_compress_method && !migration_codec_get(compress_method)) {
+        error_setg(errp, "Compression method '%s' is not supported by "
+                   "this build",
+                   MigrationCompressMethod_lookup[compress_method]);
+        return;
+    }
+    if (has_postcopy_prefetch_pages &&
+            (postcopy_prefetch_pages < 0 || postcopy_prefetch_pages > 65536)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "postcopy_prefetch_pages",
+                   "is invalid, it should be in the range of 0 to 65536");
+        return;
+    }
 
     if (has_compress_level) {
         s->parameters.compress_level = compress_level;
@@ -832,6 +1107,18 @@ void qmp_migrate_set_parameters(bool has_compress_level,
         g_free(s->parameters.tls_hostname);
         s->parameters.tls_hostname = g_strdup(tls_hostname);
     }
+    if (has_x_multifd_channels) {
+        s->parameters.x_multifd_channels = x_multifd_channels;
+    }
+    if (has_x_multifd_page_count) {
+        s->parameters.x_multifd_page_count = x_multifd_page_count;
+    }
+    if (has_compress_method) {
+        s->parameters.compress_method = compress_method;
+    }
+    if (has_postcopy_prefetch_pages) {
+        s->parameters.postcopy_prefetch_pages = postcopy_prefetch_pages;
+    }
 }
 
 
@@ -885,6 +1172,7 @@ static void migrate_fd_cleanup(void *opaque)
         }
         qemu_mutex_lock_iothread();
 
+        multifd_save_cleanup();
         migrate_compress_threads_join();
         qemu_fclose(s->to_dst_file);
         s->to_dst_file = NULL;
@@ -904,6 +1192,12 @@ static void migrate_fd_cleanup(void *opaque)
 void migrate_fd_error(MigrationState *s, const Error *error)
 {
     trace_migrate_fd_error(error ? error_get_pretty(error) : "");
+    if (s->state == MIGRATION_STATUS_POSTCOPY_PAUSED) {
+        /* Connecting a resume channel failed; stay paused and let it retry */
+        error_report("Failed to resume postcopy migration: %s",
+                     error ? error_get_pretty(error) : "unknown error");
+        return;
+    }
     assert(s->to_dst_file == NULL);
     migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
                       MIGRATION_STATUS_FAILED);
@@ -932,6 +1226,11 @@ static void migrate_fd_cancel(MigrationState *s)
         migrate_set_state(&s->state, old_state, MIGRATION_STATUS_CANCELLING);
     } while (s->state != MIGRATION_STATUS_CANCELLING);
 
+    if (old_state == MIGRATION_STATUS_POSTCOPY_PAUSED) {
+        /* Wake the migration thread up so that it can clean up */
+        qemu_sem_post(&s->postcopy_pause_sem);
+    }
+
     /*
      * If we're unlucky the migration code might be stuck somewhere in a
      * send/write while the network has failed and is waiting to timeout;
@@ -1004,6 +1303,10 @@ MigrationState *migrate_init(const MigrationParams *params)
     s->dirty_bytes_rate = 0;
     s->setup_time = 0;
     s->dirty_sync_count = 0;
+    s->dirty_sync_time = 0;
+    s->dirty_sync_total_time = 0;
+    s->dirty_sync_pages = 0;
+    s->expected_converge_time = -1;
     s->start_postcopy = false;
     s->postcopy_after_devices = false;
     s->postcopy_requests = 0;
@@ -1071,7 +1374,7 @@ bool migration_is_blocked(Error **errp)
 
 void qmp_migrate(const char *uri, bool has_blk, bool blk,
                  bool has_inc, bool inc, bool has_detach, bool detach,
-                 Error **errp)
+                 bool has_resume, bool resume, Error **errp)
 {
     Error *local_err = NULL;
     MigrationState *s = migrate_get_current();
@@ -1080,6 +1383,20 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
 
     params.blk = has_blk && blk;
     params.shared = has_inc && inc;
+    resume = has_resume && resume;
+
+    if (resume) {
+        if (s->state != MIGRATION_STATUS_POSTCOPY_PAUSED) {
+            error_setg(errp, "Cannot resume if there is no "
+                       "paused migration");
+            return;
+        }
+        if (params.blk || params.shared) {
+            error_setg(errp, "Block migration can't be resumed");
+            return;
+        }
+        goto connect;
+    }
 
     if (migration_is_setup_or_active(s->state) ||
         s->state == MIGRATION_STATUS_CANCELLING) {
@@ -1090,13 +1407,41 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         error_setg(errp, "Guest is waiting for an incoming migration");
         return;
     }
+    if (dirty_rate_measuring()) {
+        error_setg(errp, "Dirty page rate measurement in progress");
+        return;
+    }
 
     if (migration_is_blocked(errp)) {
         return;
     }
 
+    if (migrate_use_multifd()) {
+        if (!strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+            error_setg(errp, "x-multifd requires a tcp: or unix: "
+                       "migration URI");
+            return;
+        }
+        if (s->parameters.tls_creds) {
+            error_setg(errp, "x-multifd is not supported with TLS");
+            return;
+        }
+    }
+
+    if (migrate_use_zero_copy() && !strstart(uri, "tcp:", NULL)) {
+        error_setg(errp, "x-zero-copy requires a tcp: migration URI");
+        return;
+    }
+
+    if (migrate_background_snapshot() && (params.blk || params.shared)) {
+        error_setg(errp, "Block migration is not supported with "
+                   "background-snapshot");
+        return;
+    }
+
     s = migrate_init(&params);
 
+connect:
     if (strstart(uri, "tcp:", &p)) {
         tcp_start_outgoing_migration(s, p, &local_err);
 #ifdef CONFIG_RDMA
@@ -1109,9 +1454,14 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
     } else {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
                    "a valid migration protocol");
+        if (resume) {
+            return;
+        }
         migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
                           MIGRATION_STATUS_FAILED);
         return;
@@ -1129,6 +1479,49 @@ void qmp_migrate_cancel(Error **errp)
     migrate_fd_cancel(migrate_get_current());
 }
 
+void qmp_migrate_recover(const char *uri, Error **errp)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+
+    if (!mis || mis->state != MIGRATION_STATUS_POSTCOPY_PAUSED) {
+        error_setg(errp, "Migrate recover can only be run "
+                   "when postcopy is paused");
+        return;
+    }
+
+    /* The new channel is picked up by migration_fd_process_incoming() */
+    migration_incoming_listen(uri, errp);
+}
+
+void qmp_migrate_pause(Error **errp)
+{
+    MigrationState *ms = migrate_get_current();
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    int ret = -EINVAL;
+
+    if (ms->state == MIGRATION_STATUS_POSTCOPY_ACTIVE) {
+        /* The migration thread notices the error and pauses */
+        ret = qemu_file_shutdown(ms->to_dst_file);
+    } else if (mis && mis->state == MIGRATION_STATUS_POSTCOPY_ACTIVE) {
+        /*
+         * Likewise the postcopy listen thread.  Don't take rp_mutex here,
+         * a page request stuck on the broken channel may be holding it;
+         * the iothread lock keeps from_src_file from being closed.
+         */
+        if (mis->from_src_file) {
+            ret = qemu_file_shutdown(mis->from_src_file);
+        }
+    } else {
+        error_setg(errp, "migrate-pause is only supported "
+                   "during postcopy");
+        return;
+    }
+
+    if (ret) {
+        error_setg(errp, "Failed to pause the migration channel");
+    }
+}
+
 void qmp_migrate_set_cache_size(int64_t value, Error **errp)
 {
     MigrationState *s = migrate_get_current();
@@ -1261,6 +1654,78 @@ bool migrate_use_events(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_EVENTS];
 }
 
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD];
+}
+
+bool migrate_use_zero_copy(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_ZERO_COPY];
+}
+
+bool migrate_background_snapshot(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT];
+}
+
+bool migrate_use_mapped_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MAPPED_RAM];
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_multifd_channels;
+}
+
+int migrate_multifd_page_count(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_multifd_page_count;
+}
+
+MigrationCompressMethod migrate_compress_method(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.compress_method;
+}
+
+int migrate_postcopy_prefetch_pages(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.postcopy_prefetch_pages;
+}
+
 int migrate_use_xbzrle(void)
 {
     MigrationState *s;
@@ -1298,6 +1763,8 @@ static struct rp_cmd_args {
     [MIG_RP_MSG_PONG]           = { .len =  4, .name = "PONG" },
     [MIG_RP_MSG_REQ_PAGES]      = { .len = 12, .name = "REQ_PAGES" },
     [MIG_RP_MSG_REQ_PAGES_ID]   = { .len = -1, .name = "REQ_PAGES_ID" },
+    [MIG_RP_MSG_RECV_BITMAP]    = { .len = -1, .name = "RECV_BITMAP" },
+    [MIG_RP_MSG_RESUME_ACK]     = { .len =  4, .name = "RESUME_ACK" },
     [MIG_RP_MSG_MAX]            = { .len = -1, .name = "MAX" },
 };
 
@@ -1428,6 +1895,37 @@ static void *source_return_path_thread(void *opaque)
             migrate_handle_rp_req_pages(ms, (char *)&buf[13], start, len);
             break;
 
+        case MIG_RP_MSG_RECV_BITMAP:
+            if (ms->state != MIGRATION_STATUS_POSTCOPY_RECOVER) {
+                error_report("RP: Unexpected RECV_BITMAP in state %s",
+                             MigrationStatus_lookup[ms->state]);
+                mark_source_rp_bad(ms);
+                goto out;
+            }
+            tmp32 = buf[0]; /* Length of the following block name */
+            if (header_len != tmp32 + 1) {
+                error_report("RP: Recv_Bitmap with length %d expecting %d",
+                             header_len, tmp32 + 1);
+                mark_source_rp_bad(ms);
+                goto out;
+            }
+            buf[1 + tmp32] = '\0';
+            /* The bitmap itself follows the message */
+            if (ram_load_recv_bitmap(rp, (char *)&buf[1])) {
+                mark_source_rp_bad(ms);
+                goto out;
+            }
+            qemu_sem_post(&ms->rp_state.rp_sem);
+            break;
+
+        case MIG_RP_MSG_RESUME_ACK:
+            tmp32 = ldl_be_p(buf);
+            trace_source_return_path_thread_resume_ack(tmp32);
+            migrate_set_state(&ms->state, MIGRATION_STATUS_POSTCOPY_RECOVER,
+                              MIGRATION_STATUS_POSTCOPY_ACTIVE);
+            qemu_sem_post(&ms->rp_state.rp_sem);
+            break;
+
         default:
             break;
         }
@@ -1439,6 +1937,17 @@ static void *source_return_path_thread(void *opaque)
 
     trace_source_return_path_thread_end();
 out:
+    if (ms->rp_state.error &&
+        (ms->state == MIGRATION_STATUS_POSTCOPY_ACTIVE ||
+         ms->state == MIGRATION_STATUS_POSTCOPY_RECOVER)) {
+        /*
+         * Make sure the migration thread notices the broken channel, it
+         * pauses the migration until the user recovers it.
+         */
+        qemu_file_shutdown(ms->to_dst_file);
+    }
+    /* Wake up a resuming migration thread, whatever the outcome */
+    qemu_sem_post(&ms->rp_state.rp_sem);
     ms->rp_state.from_dst_file = NULL;
     qemu_fclose(rp);
     return NULL;
@@ -1461,6 +1970,94 @@ static int open_return_path_on_source(MigrationState *ms)
     return 0;
 }
 
+/*
+ * Resynchronise with the destination over a new channel: find out which
+ * pages it already has, then let it run the postcopy again.
+ * Returns 0 once the destination acknowledged the resume.
+ */
+static int postcopy_do_resume(MigrationState *s)
+{
+    int nblocks;
+
+    trace_postcopy_do_resume();
+    qemu_savevm_send_open_return_path(s->to_dst_file);
+
+    nblocks = ram_postcopy_resume_prepare(s);
+    while (nblocks--) {
+        qemu_sem_wait(&s->rp_state.rp_sem);
+        if (s->rp_state.error ||
+            s->state != MIGRATION_STATUS_POSTCOPY_RECOVER) {
+            return -1;
+        }
+    }
+
+    qemu_savevm_send_postcopy_resume(s->to_dst_file);
+    qemu_fflush(s->to_dst_file);
+    qemu_sem_wait(&s->rp_state.rp_sem);
+    if (s->rp_state.error ||
+        s->state != MIGRATION_STATUS_POSTCOPY_ACTIVE) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * The channel broke while in postcopy.  The guest already runs on the
+ * destination and can't be brought back, so rather than failing wait for
+ * the user to provide a new channel (migrate with resume) and carry on
+ * over it.
+ * Returns true if the migration continues over s->to_dst_file, false if
+ * it was cancelled or can't be resumed.
+ */
+static bool postcopy_pause(MigrationState *s)
+{
+    int old_state = MIGRATION_STATUS_POSTCOPY_ACTIVE;
+    QEMUFile *file = s->to_dst_file;
+
+    while (true) {
+        /* Make sure the return path thread lets go of the channel too */
+        qemu_file_shutdown(file);
+        qemu_thread_join(&s->rp_state.rp_thread);
+        while (!qemu_sem_timedwait(&s->rp_state.rp_sem, 0)) {
+            /* Drop wakeups left over by the old return path */
+        }
+
+        migrate_set_state(&s->state, old_state,
+                          MIGRATION_STATUS_POSTCOPY_PAUSED);
+        trace_postcopy_pause();
+        error_report("Postcopy migration paused, "
+                     "use migrate with resume to continue it");
+
+        while (s->state == MIGRATION_STATUS_POSTCOPY_PAUSED) {
+            qemu_sem_wait(&s->postcopy_pause_sem);
+        }
+        if (s->state != MIGRATION_STATUS_POSTCOPY_RECOVER) {
+            /* Cancelled; the cleanup closes s->to_dst_file */
+            if (file != s->to_dst_file) {
+                qemu_fclose(file);
+            }
+            return false;
+        }
+
+        /* migrate_fd_connect() installed the new channel */
+        qemu_fclose(file);
+        file = s->to_dst_file;
+        s->rp_state.error = false;
+        if (open_return_path_on_source(s)) {
+            error_report("Unable to open return-path for postcopy");
+            migrate_set_state(&s->state, MIGRATION_STATUS_POSTCOPY_RECOVER,
+                              MIGRATION_STATUS_FAILED);
+            return false;
+        }
+
+        if (!postcopy_do_resume(s)) {
+            trace_postcopy_pause_continued();
+            return true;
+        }
+        old_state = MIGRATION_STATUS_POSTCOPY_RECOVER;
+    }
+}
+
 /* Returns 0 if the RP was ok, otherwise there was an error on the RP */
 static int await_return_path_close_on_source(MigrationState *ms)
 {
@@ -1696,6 +2293,93 @@ fail:
                       MIGRATION_STATUS_FAILED);
 }
 
+/*
+ * Start of a background snapshot: the VM is only paused while its device
+ * state is saved and RAM gets write protected.  The device state is kept
+ * in *bioc until RAM has been sent, so that the destination loads the
+ * stream in the usual order.
+ *
+ * Returns 0 on success, with *fb open on *bioc.
+ */
+static int bg_migration_start(MigrationState *s, QEMUFile **fb,
+                              QIOChannelBuffer **bioc)
+{
+    int64_t time_at_stop;
+    bool vm_running;
+    int ret;
+
+    qemu_mutex_lock_iothread();
+    time_at_stop = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+    vm_running = runstate_is_running();
+    /* The snapshot resumes in the state the VM is in now */
+    ret = global_state_store();
+    if (!ret) {
+        ret = vm_stop_force_state(RUN_STATE_PAUSED);
+    }
+    if (ret < 0) {
+        goto out;
+    }
+
+    *bioc = qio_channel_buffer_new(4096);
+    *fb = qemu_fopen_channel_output(QIO_CHANNEL(*bioc));
+
+    cpu_synchronize_all_states();
+    qemu_savevm_state_complete_precopy_non_iterable(*fb, false);
+    ret = qemu_file_get_error(*fb);
+    if (!ret) {
+        ret = ram_write_tracking_start();
+    }
+    if (ret) {
+        qemu_fclose(*fb);
+        object_unref(OBJECT(*bioc));
+        *fb = NULL;
+        *bioc = NULL;
+    }
+
+    s->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - time_at_stop;
+    trace_bg_migration_start(s->downtime);
+    if (vm_running) {
+        vm_start();
+    }
+
+out:
+    qemu_mutex_unlock_iothread();
+    return ret;
+}
+
+/*
+ * All of RAM has been saved: finish the RAM section and append the device
+ * state saved at the start.
+ */
+static void bg_migration_completion(MigrationState *s, QIOChannelBuffer *bioc)
+{
+    int ret;
+
+    qemu_mutex_lock_iothread();
+    qemu_file_set_rate_limit(s->to_dst_file, INT64_MAX);
+    ret = qemu_savevm_state_complete_precopy_iterable(s->to_dst_file, false);
+    qemu_mutex_unlock_iothread();
+
+    /* Nothing is protected anymore, but don't wait for the cleanup */
+    ram_write_tracking_stop();
+
+    if (!ret) {
+        qemu_put_buffer(s->to_dst_file, bioc->data, bioc->usage);
+        qemu_fflush(s->to_dst_file);
+    }
+
+    if (ret || qemu_file_get_error(s->to_dst_file)) {
+        trace_migration_completion_file_err();
+        migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
+                          MIGRATION_STATUS_FAILED);
+        return;
+    }
+
+    migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
+                      MIGRATION_STATUS_COMPLETED);
+}
+
 /*
  * Master migration thread on the source VM.
  * It drives the migration and pumps the data down the outgoing channel.
@@ -1712,6 +2396,11 @@ static void *migration_thread(void *opaque)
     int64_t end_time;
     bool old_vm_running = false;
     bool entered_postcopy = false;
+    bool background = migrate_background_snapshot();
+    bool write_fault_pending = false;
+    /* Device state of a background snapshot */
+    QEMUFile *bg_fb = NULL;
+    QIOChannelBuffer *bg_bioc = NULL;
     /* The active state we expect to be in; ACTIVE or POSTCOPY_ACTIVE */
     enum MigrationStatus current_active_state = MIGRATION_STATUS_ACTIVE;
 
@@ -1736,6 +2425,12 @@ static void *migration_thread(void *opaque)
 
     qemu_savevm_state_begin(s->to_dst_file, &s->params);
 
+    if (background && bg_migration_start(s, &bg_fb, &bg_bioc)) {
+        error_report("Failed to start the background snapshot");
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+    }
+
     s->setup_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) - setup_start;
     current_active_state = MIGRATION_STATUS_ACTIVE;
     migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
@@ -1773,15 +2468,30 @@ static void *migration_thread(void *opaque)
                 }
                 /* Just another iteration step */
                 qemu_savevm_state_iterate(s->to_dst_file, entered_postcopy);
+            } else if (background) {
+                /* max_size stays 0, so everything has been sent */
+                bg_migration_completion(s, bg_bioc);
+                break;
             } else {
                 trace_migration_thread_low_pending(pending_size);
                 migration_completion(s, current_active_state,
                                      &old_vm_running, &start_time);
                 break;
             }
+        } else if (background && write_fault_pending) {
+            /* Only the pages that vCPUs are blocked on go over the limit */
+            qemu_savevm_state_iterate(s->to_dst_file, false);
         }
+        write_fault_pending = false;
 
         if (qemu_file_get_error(s->to_dst_file)) {
+            if (s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE &&
+                postcopy_pause(s)) {
+                /* Carry on over the recovered channel */
+                initial_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+                initial_bytes = qemu_ftell(s->to_dst_file);
+                continue;
+            }
             migrate_set_state(&s->state, current_active_state,
                               MIGRATION_STATUS_FAILED);
             trace_migration_thread_file_err();
@@ -1793,7 +2503,9 @@ static void *migration_thread(void *opaque)
                                          initial_bytes;
             uint64_t time_spent = current_time - initial_time;
             double bandwidth = (double)transferred_bytes / time_spent;
-            max_size = bandwidth * migrate_max_downtime() / 1000000;
+            if (!background) {
+                max_size = bandwidth * migrate_max_downtime() / 1000000;
+            }
 
             s->mbps = (((double) transferred_bytes * 8.0) /
                     ((double) time_spent / 1000.0)) / 1000.0 / 1000.0;
@@ -1804,6 +2516,10 @@ static void *migration_thread(void *opaque)
                10000 is a small enough number for our purposes */
             if (s->dirty_bytes_rate && transferred_bytes > 10000) {
                 s->expected_downtime = s->dirty_bytes_rate / bandwidth;
+                s->expected_converge_time = background ? -1 :
+                    migration_predict_converge_time(ram_bytes_remaining(),
+                                                    s->dirty_bytes_rate,
+                                                    bandwidth);
             }
 
             qemu_file_reset_rate_limit(s->to_dst_file);
@@ -1811,29 +2527,48 @@ static void *migration_thread(void *opaque)
             initial_bytes = qemu_ftell(s->to_dst_file);
         }
         if (qemu_file_rate_limit(s->to_dst_file)) {
-            /* usleep expects microseconds */
-            g_usleep((initial_time + BUFFER_DELAY - current_time)*1000);
+            if (background) {
+                write_fault_pending =
+                    ram_write_tracking_wait(initial_time + BUFFER_DELAY -
+                                            current_time);
+            } else {
+                /* usleep expects microseconds */
+                g_usleep((initial_time + BUFFER_DELAY - current_time)*1000);
+            }
         }
     }
 
     trace_migration_thread_after_loop();
     /* If we enabled cpu throttling for auto-converge, turn it off. */
     cpu_throttle_stop();
+    if (background) {
+        /*
+         * A thread that holds the iothread lock may be waiting for a page
+         * that will never be saved now
+         */
+        ram_write_tracking_stop();
+    }
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
     qemu_mutex_lock_iothread();
     qemu_savevm_state_cleanup();
+    if (bg_fb) {
+        qemu_fclose(bg_fb);
+        object_unref(OBJECT(bg_bioc));
+    }
     if (s->state == MIGRATION_STATUS_COMPLETED) {
         uint64_t transferred_bytes = qemu_ftell(s->to_dst_file);
         s->total_time = end_time - s->total_time;
-        if (!entered_postcopy) {
+        if (!entered_postcopy && !background) {
             s->downtime = end_time - start_time;
         }
         if (s->total_time) {
             s->mbps = (((double) transferred_bytes * 8.0) /
                        ((double) s->total_time)) / 1000;
         }
-        runstate_set(RUN_STATE_POSTMIGRATE);
+        if (!background) {
+            runstate_set(RUN_STATE_POSTMIGRATE);
+        }
     } else {
         if (old_vm_running && !entered_postcopy) {
             vm_start();
@@ -1852,6 +2587,16 @@ static void *migration_thread(void *opaque)
 
 void migrate_fd_connect(MigrationState *s)
 {
+    if (s->state == MIGRATION_STATUS_POSTCOPY_PAUSED) {
+        /* Hand the new channel over to the paused migration thread */
+        qemu_file_set_blocking(s->to_dst_file, true);
+        qemu_file_set_rate_limit(s->to_dst_file, INT64_MAX);
+        migrate_set_state(&s->state, MIGRATION_STATUS_POSTCOPY_PAUSED,
+                          MIGRATION_STATUS_POSTCOPY_RECOVER);
+        qemu_sem_post(&s->postcopy_pause_sem);
+        return;
+    }
+
     /* This is a best 1st approximation. ns to ms */
     s->expected_downtime = max_downtime/1000000;
     s->cleanup_bh = qemu_bh_new(migrate_fd_cleanup, s);
@@ -1878,6 +2623,7 @@ void migrate_fd_connect(MigrationState *s)
     }
 
     migrate_compress_threads_create();
+    multifd_save_setup();
     qemu_thread_create(&s->thread, "migration", migration_thread, s,
                        QEMU_THREAD_JOINABLE);
     s->migration_thread_running = true;
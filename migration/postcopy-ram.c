@@ -24,6 +24,8 @@
 #include "sysemu/sysemu.h"
 #include "sysemu/balloon.h"
 #include "qemu/error-report.h"
+#include "qemu/host-utils.h"
+#include "qemu/timer.h"
 #include "trace.h"
 
 /* Arbitrary limit on size of each discard command,
@@ -44,6 +46,54 @@ struct PostcopyDiscardState {
     unsigned int nsentcmds;
 };
 
+#define POSTCOPY_LATENCY_BUCKETS 16
+
+/*
+ * Page fault statistics of the last incoming postcopy, kept once it
+ * ends so that they can still be queried.
+ */
+static struct {
+    QemuSpin lock;
+    bool valid;
+    uint64_t faults;
+    uint64_t requests;
+    /* in microseconds */
+    uint64_t latency_total;
+    uint64_t latency_max;
+    uint64_t latency_histogram[POSTCOPY_LATENCY_BUCKETS];
+} postcopy_fault_stats;
+
+bool postcopy_ram_fault_stats(PostcopyFaultStats **stats)
+{
+    PostcopyFaultStats *pf;
+    intList **next;
+    int i;
+
+    qemu_spin_lock(&postcopy_fault_stats.lock);
+    if (!postcopy_fault_stats.valid) {
+        qemu_spin_unlock(&postcopy_fault_stats.lock);
+        return false;
+    }
+
+    pf = g_new0(PostcopyFaultStats, 1);
+    pf->faults = postcopy_fault_stats.faults;
+    pf->requests = postcopy_fault_stats.requests;
+    pf->latency_max = postcopy_fault_stats.latency_max;
+    if (pf->faults) {
+        pf->latency_avg = postcopy_fault_stats.latency_total / pf->faults;
+    }
+    next = &pf->latency_histogram;
+    for (i = 0; i < POSTCOPY_LATENCY_BUCKETS; i++) {
+        *next = g_new0(intList, 1);
+        (*next)->value = postcopy_fault_stats.latency_histogram[i];
+        next = &(*next)->next;
+    }
+    qemu_spin_unlock(&postcopy_fault_stats.lock);
+
+    *stats = pf;
+    return true;
+}
+
 /* Postcopy needs to detect accesses to pages that haven't yet been copied
  * across, and efficiently map new pages in, the techniques for doing this
  * are target OS specific.
@@ -60,6 +110,9 @@ struct PostcopyDiscardState {
 #include <sys/eventfd.h>
 #include <linux/userfaultfd.h>
 
+/* Largest number of faults read from the userfaultfd at once */
+#define POSTCOPY_FAULT_BATCH 32
+
 static bool ufd_version_check(int ufd)
 {
     struct uffdio_api api_struct;
@@ -391,20 +444,83 @@ static int ram_block_enable_notify(const char *block_name, void *host_addr,
 /*
  * Handle faults detected by the USERFAULT markings
  */
+static void postcopy_fault_stats_reset(void)
+{
+    qemu_spin_lock(&postcopy_fault_stats.lock);
+    postcopy_fault_stats.valid = true;
+    postcopy_fault_stats.faults = 0;
+    postcopy_fault_stats.requests = 0;
+    postcopy_fault_stats.latency_total = 0;
+    postcopy_fault_stats.latency_max = 0;
+    memset(postcopy_fault_stats.latency_histogram, 0,
+           sizeof(postcopy_fault_stats.latency_histogram));
+    qemu_spin_unlock(&postcopy_fault_stats.lock);
+}
+
+static void postcopy_fault_stats_add_latency(int64_t latency_ns)
+{
+    uint64_t us = MAX(latency_ns, 0) / 1000;
+    int bucket = 0;
+
+    if (us >= 64) {
+        bucket = MIN(63 - clz64(us) - 5, POSTCOPY_LATENCY_BUCKETS - 1);
+    }
+
+    qemu_spin_lock(&postcopy_fault_stats.lock);
+    postcopy_fault_stats.latency_total += us;
+    postcopy_fault_stats.latency_max = MAX(postcopy_fault_stats.latency_max,
+                                           us);
+    postcopy_fault_stats.latency_histogram[bucket]++;
+    qemu_spin_unlock(&postcopy_fault_stats.lock);
+}
+
+static int postcopy_fault_cmp(const void *a, const void *b)
+{
+    const struct uffd_msg *ma = a, *mb = b;
+
+    if (ma->arg.pagefault.address == mb->arg.pagefault.address) {
+        return 0;
+    }
+    return ma->arg.pagefault.address < mb->arg.pagefault.address ? -1 : 1;
+}
+
+/*
+ * Request @len bytes at @offset of @rb from the source, naming the
+ * RAMBlock only if it changed since the last request.
+ * Called with page_request_mutex held.
+ */
+static void postcopy_request_pages(MigrationIncomingState *mis, RAMBlock *rb,
+                                   ram_addr_t offset, size_t len)
+{
+    if (rb != mis->last_rb) {
+        mis->last_rb = rb;
+        migrate_send_rp_req_pages(mis, qemu_ram_get_idstr(rb), offset, len);
+    } else {
+        /* Save some space */
+        migrate_send_rp_req_pages(mis, NULL, offset, len);
+    }
+
+    qemu_spin_lock(&postcopy_fault_stats.lock);
+    postcopy_fault_stats.requests++;
+    qemu_spin_unlock(&postcopy_fault_stats.lock);
+}
+
 static void *postcopy_ram_fault_thread(void *opaque)
 {
     MigrationIncomingState *mis = opaque;
-    struct uffd_msg msg;
-    int ret;
+    struct uffd_msg msgs[POSTCOPY_FAULT_BATCH];
+    int ret, i, nmsgs;
     size_t hostpagesize = getpagesize();
     RAMBlock *rb = NULL;
-    RAMBlock *last_rb = NULL; /* last RAMBlock we sent part of */
 
     trace_postcopy_ram_fault_thread_entry();
     qemu_sem_post(&mis->fault_thread_sem);
 
     while (true) {
-        ram_addr_t rb_offset;
+        ram_addr_t rb_offset, req_offset;
+        RAMBlock *req_rb;
+        size_t req_len;
+        int64_t fault_time;
         struct pollfd pfd[2];
 
         /*
@@ -429,8 +545,9 @@ static void *postcopy_ram_fault_thread(void *opaque)
             break;
         }
 
-        ret = read(mis->userfault_fd, &msg, sizeof(msg));
-        if (ret != sizeof(msg)) {
+        /* Take all the pending faults, several vCPUs may be waiting */
+        ret = read(mis->userfault_fd, msgs, sizeof(msgs));
+        if (ret < 0) {
             if (errno == EAGAIN) {
                 /*
                  * if a wake up happens on the other thread just after
@@ -438,49 +555,88 @@ static void *postcopy_ram_fault_thread(void *opaque)
                  */
                 continue;
             }
-            if (ret < 0) {
-                error_report("%s: Failed to read full userfault message: %s",
-                             __func__, strerror(errno));
+            error_report("%s: Failed to read userfault messages: %s",
+                         __func__, strerror(errno));
+            break;
+        }
+        if (ret % sizeof(msgs[0])) {
+            error_report("%s: Read %d bytes from userfaultfd expected a "
+                         "multiple of %zd", __func__, ret, sizeof(msgs[0]));
+            break; /* Lost alignment, don't know what we'd read next */
+        }
+        nmsgs = ret / sizeof(msgs[0]);
+        trace_postcopy_ram_fault_thread_batch(nmsgs);
+
+        /* Sorted, faults on adjacent pages share a single request */
+        qsort(msgs, nmsgs, sizeof(msgs[0]), postcopy_fault_cmp);
+        fault_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        req_rb = NULL;
+        req_offset = 0;
+        req_len = 0;
+
+        qemu_mutex_lock(&mis->page_request_mutex);
+        for (i = 0; i < nmsgs; i++) {
+            uint64_t address = msgs[i].arg.pagefault.address;
+            int64_t *time;
+            void *host;
+
+            if (msgs[i].event != UFFD_EVENT_PAGEFAULT) {
+                error_report("%s: Read unexpected event %ud from userfaultfd",
+                             __func__, msgs[i].event);
+                continue; /* It's not a page fault, shouldn't happen */
+            }
+
+            rb = qemu_ram_block_from_host((void *)(uintptr_t)address,
+                                          true, &rb_offset);
+            if (!rb) {
+                error_report("postcopy_ram_fault_thread: Fault outside "
+                             "guest: %" PRIx64, address);
                 break;
-            } else {
-                error_report("%s: Read %d bytes from userfaultfd expected %zd",
-                             __func__, ret, sizeof(msg));
-                break; /* Lost alignment, don't know what we'd read next */
             }
+
+            rb_offset &= ~(hostpagesize - 1);
+            trace_postcopy_ram_fault_thread_request(address,
+                                                    qemu_ram_get_idstr(rb),
+                                                    rb_offset);
+
+            host = (void *)(uintptr_t)(address & ~(hostpagesize - 1));
+            if (ram_page_received(rb, rb_offset) ||
+                g_hash_table_lookup(mis->page_requested, host)) {
+                /* Placed meanwhile, or another vCPU asked for it already */
+                continue;
+            }
+            /* Remember it in case the channel breaks before it arrives */
+            time = g_new(int64_t, 1);
+            *time = fault_time;
+            g_hash_table_insert(mis->page_requested, host, time);
+            qemu_spin_lock(&postcopy_fault_stats.lock);
+            postcopy_fault_stats.faults++;
+            qemu_spin_unlock(&postcopy_fault_stats.lock);
+
+            if (rb == req_rb && rb_offset == req_offset + req_len) {
+                req_len += hostpagesize;
+                continue;
+            }
+            /*
+             * Send the request to the source - we want to request one
+             * of our host page sizes (which is >= TPS)
+             */
+            if (req_rb) {
+                postcopy_request_pages(mis, req_rb, req_offset, req_len);
+            }
+            req_rb = rb;
+            req_offset = rb_offset;
+            req_len = hostpagesize;
         }
-        if (msg.event != UFFD_EVENT_PAGEFAULT) {
-            error_report("%s: Read unexpected event %ud from userfaultfd",
-                         __func__, msg.event);
-            continue; /* It's not a page fault, shouldn't happen */
+        if (req_rb) {
+            postcopy_request_pages(mis, req_rb, req_offset, req_len);
         }
+        qemu_mutex_unlock(&mis->page_request_mutex);
 
-        rb = qemu_ram_block_from_host(
-                 (void *)(uintptr_t)msg.arg.pagefault.address,
-                 true, &rb_offset);
-        if (!rb) {
-            error_report("postcopy_ram_fault_thread: Fault outside guest: %"
-                         PRIx64, (uint64_t)msg.arg.pagefault.address);
+        if (i < nmsgs) {
+            /* A fault outside of guest RAM */
             break;
         }
-
-        rb_offset &= ~(hostpagesize - 1);
-        trace_postcopy_ram_fault_thread_request(msg.arg.pagefault.address,
-                                                qemu_ram_get_idstr(rb),
-                                                rb_offset);
-
-        /*
-         * Send the request to the source - we want to request one
-         * of our host page sizes (which is >= TPS)
-         */
-        if (rb != last_rb) {
-            last_rb = rb;
-            migrate_send_rp_req_pages(mis, qemu_ram_get_idstr(rb),
-                                     rb_offset, hostpagesize);
-        } else {
-            /* Save some space */
-            migrate_send_rp_req_pages(mis, NULL,
-                                     rb_offset, hostpagesize);
-        }
     }
     trace_postcopy_ram_fault_thread_exit();
     return NULL;
@@ -513,6 +669,7 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
         return -1;
     }
 
+    postcopy_fault_stats_reset();
     qemu_sem_init(&mis->fault_thread_sem, 0);
     qemu_thread_create(&mis->fault_thread, "postcopy/fault",
                        postcopy_ram_fault_thread, mis, QEMU_THREAD_JOINABLE);
@@ -536,6 +693,43 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
     return 0;
 }
 
+/* Called once @host is in place, account for the fault that asked for it */
+static void postcopy_request_done(MigrationIncomingState *mis, void *host)
+{
+    int64_t *fault_time;
+
+    qemu_mutex_lock(&mis->page_request_mutex);
+    fault_time = g_hash_table_lookup(mis->page_requested, host);
+    if (fault_time) {
+        postcopy_fault_stats_add_latency(
+            qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - *fault_time);
+        g_hash_table_remove(mis->page_requested, host);
+    }
+    qemu_mutex_unlock(&mis->page_request_mutex);
+}
+
+static void postcopy_resend_request(gpointer key, gpointer value,
+                                    gpointer opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    RAMBlock *rb;
+    ram_addr_t offset;
+
+    rb = qemu_ram_block_from_host(key, true, &offset);
+    trace_postcopy_resend_request(qemu_ram_get_idstr(rb), offset);
+    migrate_send_rp_req_pages(mis, qemu_ram_get_idstr(rb), offset,
+                              getpagesize());
+}
+
+void postcopy_ram_resend_requests(MigrationIncomingState *mis)
+{
+    qemu_mutex_lock(&mis->page_request_mutex);
+    g_hash_table_foreach(mis->page_requested, postcopy_resend_request, mis);
+    /* The source doesn't know which block the next request refers to */
+    mis->last_rb = NULL;
+    qemu_mutex_unlock(&mis->page_request_mutex);
+}
+
 /*
  * Place a host page (from) at (host) atomically
  * returns 0 on success
@@ -562,6 +756,7 @@ int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from)
         return -e;
     }
 
+    postcopy_request_done(mis, host);
     trace_postcopy_place_page(host);
     return 0;
 }
@@ -586,6 +781,7 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host)
         return -e;
     }
 
+    postcopy_request_done(mis, host);
     trace_postcopy_place_page_zero(host);
     return 0;
 }
@@ -671,6 +867,11 @@ void *postcopy_get_tmp_page(MigrationIncomingState *mis)
     return NULL;
 }
 
+void postcopy_ram_resend_requests(MigrationIncomingState *mis)
+{
+    assert(0);
+}
+
 #endif
 
 /* ------------------------------------------------------------------------- */
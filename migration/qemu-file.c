@@ -22,7 +22,6 @@
  * THE SOFTWARE.
  */
 #include "qemu/osdep.h"
-#include <zlib.h>
 #include "qemu-common.h"
 #include "qemu/error-report.h"
 #include "qemu/iov.h"
@@ -33,7 +32,11 @@
 #include "trace.h"
 
 #define IO_BUF_SIZE 32768
-#define MAX_IOV_SIZE MIN(IOV_MAX, 64)
+/* Each page queued with qemu_put_buffer_async() takes up to two
+ * entries (header in buf, data in place), so this batches a few
+ * hundred pages per writev() before a flush is forced.
+ */
+#define MAX_IOV_SIZE MIN(IOV_MAX, 1024)
 
 struct QEMUFile {
     const QEMUFileOps *ops;
@@ -543,6 +546,99 @@ int64_t qemu_ftell(QEMUFile *f)
     return f->pos;
 }
 
+bool qemu_file_is_seekable(QEMUFile *f)
+{
+    if (qemu_file_is_writable(f)) {
+        return f->ops->pwritev_buffer != NULL;
+    }
+    return f->ops->preadv_buffer != NULL;
+}
+
+bool qemu_file_pio_thread_safe(QEMUFile *f)
+{
+    return f->ops->pio_thread_safe;
+}
+
+/* Position of the next byte read or written in the stream */
+int64_t qemu_get_offset(QEMUFile *f)
+{
+    if (qemu_file_is_writable(f)) {
+        return qemu_ftell_fast(f);
+    }
+    return f->pos - f->buf_size + f->buf_index;
+}
+
+/*
+ * Continue the stream at @pos of a seekable file, dropping anything
+ * buffered for reading.
+ */
+int qemu_set_offset(QEMUFile *f, int64_t pos)
+{
+    int ret;
+
+    assert(qemu_file_is_seekable(f));
+
+    qemu_fflush(f);
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+    if (f->ops->seek) {
+        ret = f->ops->seek(f->opaque, pos);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+            return ret;
+        }
+    }
+    f->pos = pos;
+    f->buf_index = 0;
+    f->buf_size = 0;
+
+    return 0;
+}
+
+size_t qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t size,
+                          int64_t pos)
+{
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = size };
+    ssize_t ret;
+
+    if (qemu_file_get_error(f)) {
+        return 0;
+    }
+    assert(qemu_file_is_seekable(f));
+
+    ret = f->ops->pwritev_buffer(f->opaque, &iov, 1, pos);
+    if (ret != size) {
+        qemu_file_set_error(f, ret < 0 ? ret : -EIO);
+        return 0;
+    }
+    f->bytes_xfer += size;
+
+    return size;
+}
+
+/*
+ * Can be called from several threads at once if qemu_file_pio_thread_safe();
+ * a short read is left to the caller to handle.
+ */
+size_t qemu_get_buffer_at(QEMUFile *f, uint8_t *buf, size_t size,
+                          int64_t pos)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+    ssize_t ret;
+
+    assert(qemu_file_is_seekable(f));
+
+    ret = f->ops->preadv_buffer(f->opaque, &iov, 1, pos);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return 0;
+    }
+
+    return ret;
+}
+
 int qemu_file_rate_limit(QEMUFile *f)
 {
     if (qemu_file_get_error(f)) {
@@ -554,6 +650,15 @@ int qemu_file_rate_limit(QEMUFile *f)
     return 0;
 }
 
+/*
+ * Account for data that was sent on behalf of this file through another
+ * channel, so that it counts against the rate limit.
+ */
+void qemu_file_update_transfer(QEMUFile *f, int64_t len)
+{
+    f->bytes_xfer += len;
+}
+
 int64_t qemu_file_get_rate_limit(QEMUFile *f)
 {
     return f->xfer_limit;
@@ -615,47 +720,6 @@ uint64_t qemu_get_be64(QEMUFile *f)
     return v;
 }
 
-/* Compress size bytes of data start at p with specific compression
- * level and store the compressed data to the buffer of f.
- *
- * When f is not writable, return -1 if f has no space to save the
- * compressed data.
- * When f is wirtable and it has no space to save the compressed data,
- * do fflush first, if f still has no space to save the compressed
- * data, return -1.
- */
-
-ssize_t qemu_put_compression_data(QEMUFile *f, const uint8_t *p, size_t size,
-                                  int level)
-{
-    ssize_t blen = IO_BUF_SIZE - f->buf_index - sizeof(int32_t);
-
-    if (blen < compressBound(size)) {
-        if (!qemu_file_is_writable(f)) {
-            return -1;
-        }
-        qemu_fflush(f);
-        blen = IO_BUF_SIZE - sizeof(int32_t);
-        if (blen < compressBound(size)) {
-            return -1;
-        }
-    }
-    if (compress2(f->buf + f->buf_index + sizeof(int32_t), (uLongf *)&blen,
-                  (Bytef *)p, size, level) != Z_OK) {
-        error_report("Compress Failed!");
-        return 0;
-    }
-    qemu_put_be32(f, blen);
-    if (f->ops->writev_buffer) {
-        add_to_iovec(f, f->buf + f->buf_index, blen);
-    }
-    f->buf_index += blen;
-    if (f->buf_index == IO_BUF_SIZE) {
-        qemu_fflush(f);
-    }
-    return blen + sizeof(int32_t);
-}
-
 /* Put the data in the buffer of f_src to the buffer of f_des, and
  * then reset the buf_index of f_src to 0.
  */
@@ -28,21 +28,29 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "cpu.h"
-#include <zlib.h>
 #include "qapi-event.h"
 #include "qemu/cutils.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
+#include "qemu/host-utils.h"
 #include "qemu/timer.h"
 #include "qemu/main-loop.h"
+#include "sysemu/sysemu.h"
+#include "sysemu/kvm.h"
 #include "migration/migration.h"
 #include "migration/postcopy-ram.h"
+#include "migration/compress.h"
 #include "exec/address-spaces.h"
 #include "migration/page_cache.h"
 #include "qemu/error-report.h"
 #include "trace.h"
 #include "exec/ram_addr.h"
 #include "qemu/rcu_queue.h"
+#include "io/channel-socket.h"
+#ifdef CONFIG_LINUX
+#include <poll.h>
+#include "qemu/userfaultfd.h"
+#endif
 
 #ifdef DEBUG_MIGRATION_RAM
 #define DPRINTF(fmt, ...) \
@@ -56,10 +64,14 @@ static int dirty_rate_high_cnt;
 
 static uint64_t bitmap_sync_count;
 
+/* The dirty bitmap was synced since the last multifd sync point */
+static bool multifd_needs_sync;
+
 /***********************************************************/
 /* ram save/restore */
 
-#define RAM_SAVE_FLAG_FULL     0x01 /* Obsolete, not used anymore */
+/* 0x01 was RAM_SAVE_FLAG_FULL, which has not been sent for ages */
+#define RAM_SAVE_FLAG_COMPRESS_METHOD 0x01 /* followed by the codec id */
 #define RAM_SAVE_FLAG_COMPRESS 0x02
 #define RAM_SAVE_FLAG_MEM_SIZE 0x04
 #define RAM_SAVE_FLAG_PAGE     0x08
@@ -68,6 +80,11 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+/* All multifd channels must reach this point before loading continues */
+#define RAM_SAVE_FLAG_MULTIFD_SYNC     0x200
+
+/* Ends the received bitmap of a RAMBlock on the return path */
+#define RAMBLOCK_RECV_BITMAP_ENDING (0x0123456789abcdefULL)
 
 static const uint8_t ZERO_TARGET_PAGE[TARGET_PAGE_SIZE];
 
@@ -83,6 +100,8 @@ static struct {
     uint8_t *encoded_buf;
     /* buffer for storing page content */
     uint8_t *current_buf;
+    /* buffer for the cached copy of the page */
+    uint8_t *prev_buf;
     /* Cache for XBZRLE, Protected by lock. */
     PageCache *cache;
     QemuMutex lock;
@@ -111,7 +130,6 @@ static void XBZRLE_cache_unlock(void)
  */
 int64_t xbzrle_cache_resize(int64_t new_size)
 {
-    PageCache *new_cache;
     int64_t ret;
 
     if (new_size < TARGET_PAGE_SIZE) {
@@ -124,16 +142,12 @@ int64_t xbzrle_cache_resize(int64_t new_size)
         if (pow2floor(new_size) == migrate_xbzrle_cache_size()) {
             goto out_new_size;
         }
-        new_cache = cache_init(new_size / TARGET_PAGE_SIZE,
-                                        TARGET_PAGE_SIZE);
-        if (!new_cache) {
-            error_report("Error creating cache");
+        /* Keep the pages we have, so encoding carries on efficiently */
+        if (cache_resize(XBZRLE.cache, new_size) < 0) {
+            error_report("Error resizing cache");
             ret = -1;
             goto out;
         }
-
-        cache_fini(XBZRLE.cache);
-        XBZRLE.cache = new_cache;
     }
 
 out_new_size:
@@ -213,6 +227,56 @@ double xbzrle_mig_cache_miss_rate(void)
     return acct_info.xbzrle_cache_miss_rate;
 }
 
+XBZRLECacheBlockStatsList *xbzrle_mig_block_stats(void)
+{
+    XBZRLECacheBlockStatsList *head = NULL, **tail = &head;
+    RAMBlock *block;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        uint64_t hits = atomic_read(&block->xbzrle_cache_hits);
+        uint64_t misses = atomic_read(&block->xbzrle_cache_misses);
+        XBZRLECacheBlockStatsList *entry;
+
+        if (!hits && !misses) {
+            continue;
+        }
+        entry = g_new0(XBZRLECacheBlockStatsList, 1);
+        entry->value = g_new0(XBZRLECacheBlockStats, 1);
+        entry->value->name = g_strdup(block->idstr);
+        entry->value->hits = hits;
+        entry->value->misses = misses;
+        entry->value->hit_rate = (double)hits / (hits + misses);
+        *tail = entry;
+        tail = &entry->next;
+    }
+    rcu_read_unlock();
+
+    return head;
+}
+
+RAMBlockDirtyRateList *ram_block_dirty_rates(void)
+{
+    RAMBlockDirtyRateList *head = NULL, **tail = &head;
+    RAMBlock *block;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        RAMBlockDirtyRateList *entry;
+
+        entry = g_new0(RAMBlockDirtyRateList, 1);
+        entry->value = g_new0(RAMBlockDirtyRate, 1);
+        entry->value->name = g_strdup(block->idstr);
+        entry->value->size = block->used_length;
+        entry->value->dirty_pages_rate = block->dirty_pages_rate;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    rcu_read_unlock();
+
+    return head;
+}
+
 uint64_t xbzrle_mig_pages_overflow(void)
 {
     return acct_info.xbzrle_overflows;
@@ -240,6 +304,24 @@ struct PageSearchStatus {
 };
 typedef struct PageSearchStatus PageSearchStatus;
 
+/*
+ * Postcopy faults tend to cluster, so the pages following a requested
+ * page are sent ahead of the background search.  A hotspot is the
+ * window [offset, end) of a recently requested page that hasn't been
+ * sent yet.
+ */
+#define POSTCOPY_HOTSPOTS 8
+
+struct PostcopyHotspot {
+    RAMBlock *block;
+    ram_addr_t offset;
+    ram_addr_t end;
+};
+
+static struct PostcopyHotspot postcopy_hotspots[POSTCOPY_HOTSPOTS];
+/* Slot of the next new hotspot, the one before it is the most recent */
+static unsigned int postcopy_hotspot_next;
+
 static struct BitmapRcu {
     struct rcu_head rcu;
     /* Main migration bitmap */
@@ -260,6 +342,9 @@ struct CompressParam {
     QemuCond cond;
     RAMBlock *block;
     ram_addr_t offset;
+    /* codec state and output buffer, only used by the thread */
+    void *ctx;
+    uint8_t *compbuf;
 };
 typedef struct CompressParam CompressParam;
 
@@ -269,11 +354,34 @@ struct DecompressParam {
     QemuMutex mutex;
     QemuCond cond;
     void *des;
+    void *ctx;
     uint8_t *compbuf;
     int len;
 };
 typedef struct DecompressParam DecompressParam;
 
+/*
+ * Pages that don't shrink by at least 1/8 are sent as they are, which
+ * costs less on the wire than the length header and less on the
+ * destination than running the decompressor.
+ */
+#define COMPRESS_MIN_SAVING(size)  ((size) / 8)
+
+/*
+ * Every 2MB region of RAM has a score that goes up by 2 each time one of
+ * its pages doesn't compress well, and is halved each time one does.
+ * Pages of regions whose score reached COMPRESS_SCORE_BYPASS are sent
+ * without even trying to compress them; the score drops by 1 for each
+ * bypassed page, so that the region is probed again every few pages in
+ * case its content changed.
+ */
+#define COMPRESS_REGION_BITS       21
+#define COMPRESS_SCORE_MAX         15
+#define COMPRESS_SCORE_BYPASS      8
+
+static const MigrationCodec *compress_codec;
+static uint8_t *compress_score;
+
 static CompressParam *comp_param;
 static QemuThread *compress_threads;
 /* comp_done_cond is used to wake up the migration thread when
@@ -286,12 +394,16 @@ static QemuCond comp_done_cond;
 static const QEMUFileOps empty_ops = { };
 
 static bool compression_switch;
+static const MigrationCodec *decompress_codec;
+static size_t decompress_bound;
 static DecompressParam *decomp_param;
+/* Where the decompression threads report errors */
+static QEMUFile *decomp_file;
 static QemuThread *decompress_threads;
 static QemuMutex decomp_done_lock;
 static QemuCond decomp_done_cond;
 
-static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
+static int do_compress_ram_page(CompressParam *param, RAMBlock *block,
                                 ram_addr_t offset);
 
 static void *do_data_compress(void *opaque)
@@ -308,7 +420,7 @@ static void *do_data_compress(void *opaque)
             param->block = NULL;
             qemu_mutex_unlock(&param->mutex);
 
-            do_compress_ram_page(param->file, block, offset);
+            do_compress_ram_page(param, block, offset);
 
             qemu_mutex_lock(&comp_done_lock);
             param->done = true;
@@ -352,13 +464,18 @@ void migrate_compress_threads_join(void)
         qemu_fclose(comp_param[i].file);
         qemu_mutex_destroy(&comp_param[i].mutex);
         qemu_cond_destroy(&comp_param[i].cond);
+        compress_codec->context_free(comp_param[i].ctx);
+        g_free(comp_param[i].compbuf);
     }
     qemu_mutex_destroy(&comp_done_lock);
     qemu_cond_destroy(&comp_done_cond);
     g_free(compress_threads);
     g_free(comp_param);
+    g_free(compress_score);
     compress_threads = NULL;
     comp_param = NULL;
+    compress_score = NULL;
+    compress_codec = NULL;
 }
 
 void migrate_compress_threads_create(void)
@@ -369,6 +486,12 @@ void migrate_compress_threads_create(void)
         return;
     }
     compression_switch = true;
+    compress_codec = migration_codec_get(migrate_compress_method());
+    /* migrate-set-parameters only accepts the codecs that are built in */
+    assert(compress_codec);
+    compress_score = g_new0(uint8_t,
+                            DIV_ROUND_UP(last_ram_offset(),
+                                         1ULL << COMPRESS_REGION_BITS));
     thread_count = migrate_compress_threads();
     compress_threads = g_new0(QemuThread, thread_count);
     comp_param = g_new0(CompressParam, thread_count);
@@ -381,6 +504,9 @@ void migrate_compress_threads_create(void)
         comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops);
         comp_param[i].done = true;
         comp_param[i].quit = false;
+        comp_param[i].ctx = compress_codec->context_new();
+        comp_param[i].compbuf = g_malloc(compress_codec->bound(
+                                             TARGET_PAGE_SIZE));
         qemu_mutex_init(&comp_param[i].mutex);
         qemu_cond_init(&comp_param[i].cond);
         qemu_thread_create(compress_threads + i, "compress",
@@ -479,30 +605,28 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
                             uint64_t *bytes_transferred)
 {
     int encoded_len = 0, bytes_xbzrle;
-    uint8_t *prev_cached_page;
 
-    if (!cache_is_cached(XBZRLE.cache, current_addr, bitmap_sync_count)) {
+    if (!cache_get_data(XBZRLE.cache, current_addr, XBZRLE.prev_buf,
+                        bitmap_sync_count)) {
         acct_info.xbzrle_cache_miss++;
+        atomic_inc(&block->xbzrle_cache_misses);
         if (!last_stage) {
-            if (cache_insert(XBZRLE.cache, current_addr, *current_data,
-                             bitmap_sync_count) == -1) {
-                return -1;
-            } else {
-                /* update *current_data when the page has been
-                   inserted into cache */
-                *current_data = get_cached_data(XBZRLE.cache, current_addr);
-            }
+            /* send the same snapshot of the page that gets cached, the
+               guest may still be writing to it */
+            memcpy(XBZRLE.current_buf, *current_data, TARGET_PAGE_SIZE);
+            *current_data = XBZRLE.current_buf;
+            cache_insert(XBZRLE.cache, current_addr, XBZRLE.current_buf,
+                         bitmap_sync_count);
         }
         return -1;
     }
-
-    prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
+    atomic_inc(&block->xbzrle_cache_hits);
 
     /* save current buffer into memory */
     memcpy(XBZRLE.current_buf, *current_data, TARGET_PAGE_SIZE);
 
     /* XBZRLE encoding (if there is no overflow) */
-    encoded_len = xbzrle_encode_buffer(prev_cached_page, XBZRLE.current_buf,
+    encoded_len = xbzrle_encode_buffer(XBZRLE.prev_buf, XBZRLE.current_buf,
                                        TARGET_PAGE_SIZE, XBZRLE.encoded_buf,
                                        TARGET_PAGE_SIZE);
     if (encoded_len == 0) {
@@ -513,15 +637,17 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
         acct_info.xbzrle_overflows++;
         /* update data in the cache */
         if (!last_stage) {
-            memcpy(prev_cached_page, *current_data, TARGET_PAGE_SIZE);
-            *current_data = prev_cached_page;
+            cache_insert(XBZRLE.cache, current_addr, XBZRLE.current_buf,
+                         bitmap_sync_count);
+            *current_data = XBZRLE.current_buf;
         }
         return -1;
     }
 
     /* we need to update the data in the cache, in order to get the same data */
     if (!last_stage) {
-        memcpy(prev_cached_page, XBZRLE.current_buf, TARGET_PAGE_SIZE);
+        cache_insert(XBZRLE.cache, current_addr, XBZRLE.current_buf,
+                     bitmap_sync_count);
     }
 
     /* Send XBZRLE based compressed page */
@@ -583,12 +709,47 @@ static inline bool migration_bitmap_clear_dirty(ram_addr_t addr)
     return ret;
 }
 
-static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
+static uint64_t migration_bitmap_sync_range(ram_addr_t start,
+                                            ram_addr_t length)
 {
     unsigned long *bitmap;
+    uint64_t num_dirty;
+
     bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
-    migration_dirty_pages +=
-        cpu_physical_memory_sync_dirty_bitmap(bitmap, start, length);
+    num_dirty = cpu_physical_memory_sync_dirty_bitmap(bitmap, start, length);
+    migration_dirty_pages += num_dirty;
+
+    return num_dirty;
+}
+
+/* Called by kvm_dirty_ring_sync() for every page a vCPU wrote, with
+ * migration_bitmap_mutex and the RCU read lock held.  @opaque caches the
+ * RAMBlock of the previous page, since consecutive entries tend to share it.
+ */
+static void migration_bitmap_set_dirty(ram_addr_t addr, void *opaque)
+{
+    RAMBlock **last = opaque;
+    RAMBlock *block = *last;
+    unsigned long *bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+
+    if (test_and_set_bit(addr >> TARGET_PAGE_BITS, bitmap)) {
+        return;
+    }
+    migration_dirty_pages++;
+
+    if (!block || addr < block->offset ||
+        !offset_in_ramblock(block, addr - block->offset)) {
+        QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+            if (addr >= block->offset &&
+                offset_in_ramblock(block, addr - block->offset)) {
+                break;
+            }
+        }
+        *last = block;
+    }
+    if (block) {
+        block->dirty_pages_period++;
+    }
 }
 
 /* Fix me: there are too many global variables used in migration process. */
@@ -600,11 +761,20 @@ static uint64_t iterations_prev;
 
 static void migration_bitmap_sync_init(void)
 {
+    RAMBlock *block;
+
     start_time = 0;
     bytes_xfer_prev = 0;
     num_dirty_pages_period = 0;
     xbzrle_cache_miss_prev = 0;
     iterations_prev = 0;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        block->dirty_pages_period = 0;
+        block->dirty_pages_rate = 0;
+    }
+    rcu_read_unlock();
 }
 
 static void migration_bitmap_sync(void)
@@ -614,6 +784,7 @@ static void migration_bitmap_sync(void)
     MigrationState *s = migrate_get_current();
     int64_t end_time;
     int64_t bytes_xfer_now;
+    int64_t sync_start, log_end, sync_end;
 
     bitmap_sync_count++;
 
@@ -626,18 +797,39 @@ static void migration_bitmap_sync(void)
     }
 
     trace_migration_bitmap_sync_start();
+    sync_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    if (kvm_dirty_ring_enabled()) {
+        /* Pages written by vCPUs go straight into the migration bitmap.
+         * What the log_sync below still finds, e.g. vhost or device writes,
+         * is picked up from the dirty bitmap, whose summary keeps the walk
+         * proportional to the memory actually written.
+         */
+        RAMBlock *last = NULL;
+
+        qemu_mutex_lock(&migration_bitmap_mutex);
+        kvm_dirty_ring_sync(migration_bitmap_set_dirty, &last);
+        qemu_mutex_unlock(&migration_bitmap_mutex);
+    }
     address_space_sync_dirty_bitmap(&address_space_memory);
+    log_end = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
 
     qemu_mutex_lock(&migration_bitmap_mutex);
     rcu_read_lock();
     QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-        migration_bitmap_sync_range(block->offset, block->used_length);
+        block->dirty_pages_period +=
+            migration_bitmap_sync_range(block->offset, block->used_length);
     }
     rcu_read_unlock();
     qemu_mutex_unlock(&migration_bitmap_mutex);
+    sync_end = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
 
+    s->dirty_sync_pages = migration_dirty_pages - num_dirty_pages_init;
+    s->dirty_sync_time = sync_end - sync_start;
+    s->dirty_sync_total_time += s->dirty_sync_time;
     trace_migration_bitmap_sync_end(migration_dirty_pages
                                     - num_dirty_pages_init);
+    trace_migration_bitmap_sync_time(log_end - sync_start,
+                                     sync_end - log_end);
     num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
@@ -675,10 +867,20 @@ static void migration_bitmap_sync(void)
         s->dirty_pages_rate = num_dirty_pages_period * 1000
             / (end_time - start_time);
         s->dirty_bytes_rate = s->dirty_pages_rate * TARGET_PAGE_SIZE;
+        rcu_read_lock();
+        QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+            block->dirty_pages_rate = block->dirty_pages_period * 1000
+                / (end_time - start_time);
+            block->dirty_pages_period = 0;
+        }
+        rcu_read_unlock();
         start_time = end_time;
         num_dirty_pages_period = 0;
     }
     s->dirty_sync_count = bitmap_sync_count;
+    if (migrate_use_multifd()) {
+        multifd_needs_sync = true;
+    }
     if (migrate_use_events()) {
         qapi_event_send_migration_pass(bitmap_sync_count, NULL);
     }
@@ -712,6 +914,95 @@ static int save_zero_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
     return pages;
 }
 
+/*
+ * mapped-ram: every RAMBlock gets a region of the migration file that is
+ * an image of its RAM, plus a bitmap of the pages stored there.  Both are
+ * aligned so that the pages can be read with large, aligned requests.
+ */
+#define MAPPED_RAM_VERSION 1
+#define MAPPED_RAM_ALIGNMENT (1024 * 1024)
+/* be32 version, be64 page size, be64 bitmap and pages offsets */
+#define MAPPED_RAM_HEADER_SIZE (4 + 3 * 8)
+/* Pages loaded at a time by one thread */
+#define MAPPED_RAM_LOAD_CHUNK 1024
+
+static uint64_t mapped_ram_bitmap_size(ram_addr_t length)
+{
+    return DIV_ROUND_UP(length >> TARGET_PAGE_BITS, 64) * sizeof(uint64_t);
+}
+
+/* Lay out the file regions of @block and tell the destination about them */
+static void mapped_ram_setup_block(QEMUFile *f, RAMBlock *block)
+{
+    uint64_t header_end = qemu_get_offset(f) + MAPPED_RAM_HEADER_SIZE;
+
+    block->bitmap_offset = ROUND_UP(header_end, MAPPED_RAM_ALIGNMENT);
+    block->pages_offset = ROUND_UP(block->bitmap_offset +
+                                   mapped_ram_bitmap_size(block->used_length),
+                                   MAPPED_RAM_ALIGNMENT);
+    g_free(block->file_bmap);
+    block->file_bmap = bitmap_new(block->used_length >> TARGET_PAGE_BITS);
+
+    qemu_put_be32(f, MAPPED_RAM_VERSION);
+    qemu_put_be64(f, TARGET_PAGE_SIZE);
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+
+    /* The stream continues after the pages */
+    qemu_set_offset(f, block->pages_offset + block->used_length);
+}
+
+/*
+ * Store a page at its offset in the file.  A page that became zero
+ * overwrites an older copy, so that the region stays an image of RAM.
+ */
+static int ram_save_page_mapped(QEMUFile *f, PageSearchStatus *pss,
+                                uint64_t *bytes_transferred)
+{
+    RAMBlock *block = pss->block;
+    ram_addr_t offset = pss->offset;
+    unsigned long page = offset >> TARGET_PAGE_BITS;
+    uint8_t *p = block->host + offset;
+
+    if (is_zero_range(p, TARGET_PAGE_SIZE)) {
+        acct_info.dup_pages++;
+        if (!test_and_clear_bit(page, block->file_bmap)) {
+            return 1;
+        }
+        p = (uint8_t *)ZERO_TARGET_PAGE;
+    } else {
+        set_bit(page, block->file_bmap);
+        acct_info.norm_pages++;
+    }
+    qemu_put_buffer_at(f, p, TARGET_PAGE_SIZE, block->pages_offset + offset);
+    *bytes_transferred += TARGET_PAGE_SIZE;
+
+    return 1;
+}
+
+/* The bitmaps are stored as little endian 64 bit words */
+static void mapped_ram_save_bitmaps(QEMUFile *f)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        unsigned long npages = block->used_length >> TARGET_PAGE_BITS;
+        uint64_t size = mapped_ram_bitmap_size(block->used_length);
+        uint64_t *words = g_malloc0(size);
+        unsigned long page, i;
+
+        for (page = find_first_bit(block->file_bmap, npages); page < npages;
+             page = find_next_bit(block->file_bmap, npages, page + 1)) {
+            words[page / 64] |= 1ULL << (page % 64);
+        }
+        for (i = 0; i < size / sizeof(uint64_t); i++) {
+            cpu_to_le64s(&words[i]);
+        }
+        qemu_put_buffer_at(f, (uint8_t *)words, size, block->bitmap_offset);
+        g_free(words);
+    }
+}
+
 /**
  * ram_save_page: Send the given page to the stream
  *
@@ -734,10 +1025,18 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
     ram_addr_t current_addr;
     uint8_t *p;
     int ret;
-    bool send_async = true;
+    /*
+     * A background snapshot lets the guest write the page as soon as it
+     * is saved, so its contents must be copied right away
+     */
+    bool send_async = !migrate_background_snapshot();
     RAMBlock *block = pss->block;
     ram_addr_t offset = pss->offset;
 
+    if (migrate_use_mapped_ram()) {
+        return ram_save_page_mapped(f, pss, bytes_transferred);
+    }
+
     p = block->host + offset;
 
     /* In doubt sent page as normal */
@@ -802,23 +1101,68 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
     return pages;
 }
 
-static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
+/*
+ * compress_page_bypass: decide whether to send a page without compressing
+ * it, based on how well other pages of its region compressed so far
+ */
+static bool compress_page_bypass(ram_addr_t addr)
+{
+    uint8_t *score = &compress_score[addr >> COMPRESS_REGION_BITS];
+    uint8_t old = atomic_read(score);
+
+    if (old < COMPRESS_SCORE_BYPASS) {
+        return false;
+    }
+    atomic_set(score, old - 1);
+    return true;
+}
+
+static void compress_page_update_score(ram_addr_t addr, bool good)
+{
+    uint8_t *score = &compress_score[addr >> COMPRESS_REGION_BITS];
+    uint8_t old = atomic_read(score);
+
+    /* Racing updates from other threads only lose a hint, not data */
+    if (good) {
+        atomic_set(score, old / 2);
+    } else {
+        atomic_set(score, MIN(old + 2, COMPRESS_SCORE_MAX));
+    }
+}
+
+static int do_compress_ram_page(CompressParam *param, RAMBlock *block,
                                 ram_addr_t offset)
 {
-    int bytes_sent, blen;
+    QEMUFile *f = param->file;
+    int bytes_sent;
+    ssize_t blen = -1;
+    ram_addr_t addr = block->offset + (offset & TARGET_PAGE_MASK);
     uint8_t *p = block->host + (offset & TARGET_PAGE_MASK);
 
-    bytes_sent = save_page_header(f, block, offset |
-                                  RAM_SAVE_FLAG_COMPRESS_PAGE);
-    blen = qemu_put_compression_data(f, p, TARGET_PAGE_SIZE,
-                                     migrate_compress_level());
+    if (!compress_page_bypass(addr)) {
+        blen = compress_codec->compress(param->ctx, param->compbuf,
+                                        compress_codec->bound(TARGET_PAGE_SIZE),
+                                        p, TARGET_PAGE_SIZE,
+                                        migrate_compress_level());
+        if (blen > TARGET_PAGE_SIZE - COMPRESS_MIN_SAVING(TARGET_PAGE_SIZE)) {
+            blen = -1;
+        }
+        compress_page_update_score(addr, blen >= 0);
+    }
+
+    /* The thread's file only holds one page, so it can't run out of space */
     if (blen < 0) {
-        bytes_sent = 0;
-        qemu_file_set_error(migrate_get_current()->to_dst_file, blen);
-        error_report("compressed data failed!");
+        bytes_sent = save_page_header(f, block, offset | RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+        bytes_sent += TARGET_PAGE_SIZE;
     } else {
-        bytes_sent += blen;
+        bytes_sent = save_page_header(f, block, offset |
+                                      RAM_SAVE_FLAG_COMPRESS_PAGE);
+        qemu_put_be32(f, blen);
+        qemu_put_buffer(f, param->compbuf, blen);
+        bytes_sent += sizeof(int32_t) + blen;
     }
+    trace_ram_compress_page(block->idstr, offset & TARGET_PAGE_MASK, blen);
 
     return bytes_sent;
 }
@@ -911,7 +1255,7 @@ static int ram_save_compressed_page(QEMUFile *f, PageSearchStatus *pss,
     int pages = -1;
     uint64_t bytes_xmit = 0;
     uint8_t *p;
-    int ret, blen;
+    int ret;
     RAMBlock *block = pss->block;
     ram_addr_t offset = pss->offset;
 
@@ -942,19 +1286,17 @@ static int ram_save_compressed_page(QEMUFile *f, PageSearchStatus *pss,
             flush_compressed_data(f);
             pages = save_zero_page(f, block, offset, p, bytes_transferred);
             if (pages == -1) {
-                /* Make sure the first page is sent out before other pages */
+                /*
+                 * Make sure the first page is sent out before other pages.
+                 * It is sent uncompressed, so that the migration thread
+                 * never has to wait for the codec.
+                 */
                 bytes_xmit = save_page_header(f, block, offset |
-                                              RAM_SAVE_FLAG_COMPRESS_PAGE);
-                blen = qemu_put_compression_data(f, p, TARGET_PAGE_SIZE,
-                                                 migrate_compress_level());
-                if (blen > 0) {
-                    *bytes_transferred += bytes_xmit + blen;
-                    acct_info.norm_pages++;
-                    pages = 1;
-                } else {
-                    qemu_file_set_error(f, blen);
-                    error_report("compressed data failed!");
-                }
+                                              RAM_SAVE_FLAG_PAGE);
+                qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+                *bytes_transferred += bytes_xmit + TARGET_PAGE_SIZE;
+                acct_info.norm_pages++;
+                pages = 1;
             }
         } else {
             offset |= RAM_SAVE_FLAG_CONTINUE;
@@ -969,117 +1311,1172 @@ static int ram_save_compressed_page(QEMUFile *f, PageSearchStatus *pss,
     return pages;
 }
 
-/*
- * Find the next dirty page and update any state associated with
- * the search process.
- *
- * Returns: True if a page is found
- *
- * @f: Current migration stream.
- * @pss: Data about the state of the current dirty page scan.
- * @*again: Set to false if the search has scanned the whole of RAM
- * *ram_addr_abs: Pointer into which to store the address of the dirty page
- *               within the global ram_addr space
- */
-static bool find_dirty_block(QEMUFile *f, PageSearchStatus *pss,
-                             bool *again, ram_addr_t *ram_addr_abs)
+/* Multiple fd's */
+
+#define MULTIFD_MAGIC 0x11223344U
+#define MULTIFD_VERSION 1
+
+#define MULTIFD_FLAG_SYNC (1 << 0)
+
+/* Sent once on each channel, right after connecting */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint8_t id;
+    uint8_t unused[7];
+} QEMU_PACKED MultiFDInit_t;
+
+/* Header of each batch of pages; all fields are big endian */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    /* maximum number of pages in a packet */
+    uint32_t size;
+    /* pages whose contents follow the header */
+    uint32_t normal_pages;
+    /* pages that are all zeroes and have no contents on the wire */
+    uint32_t zero_pages;
+    uint64_t packet_num;
+    char ramblock[256];
+    /* normal pages first, then zero pages */
+    uint64_t offset[];
+} QEMU_PACKED MultiFDPacket_t;
+
+typedef struct {
+    /* number of used pages */
+    uint32_t used;
+    /* number of allocated pages */
+    uint32_t allocated;
+    /* offset of each page inside the block */
+    ram_addr_t *offset;
+    RAMBlock *block;
+} MultiFDPages_t;
+
+typedef struct {
+    uint8_t id;
+    char *name;
+    QemuThread thread;
+    QIOChannel *c;
+    /* kicks the thread when there is work to do or it must quit */
+    QemuSemaphore sem;
+    /* protects the fields below */
+    QemuMutex mutex;
+    bool running;
+    bool quit;
+    /* pages are waiting to be sent */
+    bool pending_job;
+    /* MULTIFD_FLAG_* to send with the next packet */
+    uint32_t flags;
+    uint64_t packet_num;
+    /* owned by the thread while pending_job is set */
+    MultiFDPages_t *pages;
+    /* statistics for the migration thread to pick up */
+    uint64_t done_normal_pages;
+    uint64_t done_zero_pages;
+    uint64_t done_bytes;
+    /* used only by the thread */
+    MultiFDPacket_t *packet;
+    uint32_t packet_len;
+    struct iovec *iov;
+    uint64_t num_packets;
+} MultiFDSendParams;
+
+static struct {
+    MultiFDSendParams *params;
+    int count;
+    uint32_t page_count;
+    /* pages queued by the migration thread for the next packet */
+    MultiFDPages_t *pages;
+    /* posted each time a channel becomes idle */
+    QemuSemaphore channels_ready;
+    /* posted by each channel once it has sent a sync packet */
+    QemuSemaphore sem_sync;
+    uint64_t packet_num;
+    int next_channel;
+    /* set once any channel has failed */
+    bool error;
+} *multifd_send_state;
+
+static MultiFDPages_t *multifd_pages_init(uint32_t size)
 {
-    pss->offset = migration_bitmap_find_dirty(pss->block, pss->offset,
-                                              ram_addr_abs);
-    if (pss->complete_round && pss->block == last_seen_block &&
-        pss->offset >= last_offset) {
-        /*
-         * We've been once around the RAM and haven't found anything.
-         * Give up.
-         */
-        *again = false;
-        return false;
-    }
-    if (pss->offset >= pss->block->used_length) {
-        /* Didn't find anything in this RAM Block */
-        pss->offset = 0;
-        pss->block = QLIST_NEXT_RCU(pss->block, next);
-        if (!pss->block) {
-            /* Hit the end of the list */
-            pss->block = QLIST_FIRST_RCU(&ram_list.blocks);
-            /* Flag that we've looped */
-            pss->complete_round = true;
-            ram_bulk_stage = false;
-            if (migrate_use_xbzrle()) {
-                /* If xbzrle is on, stop using the data compression at this
-                 * point. In theory, xbzrle can do better than compression.
-                 */
-                flush_compressed_data(f);
-                compression_switch = false;
-            }
-        }
-        /* Didn't find anything this time, but try again on the new block */
-        *again = true;
-        return false;
-    } else {
-        /* Can go around again, but... */
-        *again = true;
-        /* We've found something so probably don't need to */
-        return true;
-    }
+    MultiFDPages_t *pages = g_new0(MultiFDPages_t, 1);
+
+    pages->allocated = size;
+    pages->offset = g_new0(ram_addr_t, size);
+    return pages;
+}
+
+static void multifd_pages_clear(MultiFDPages_t *pages)
+{
+    g_free(pages->offset);
+    g_free(pages);
+}
+
+static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDInit_t msg = {};
+    struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+
+    msg.magic = cpu_to_be32(MULTIFD_MAGIC);
+    msg.version = cpu_to_be32(MULTIFD_VERSION);
+    msg.id = p->id;
+
+    return qio_channel_writev_all(p->c, &iov, 1, errp);
 }
 
 /*
- * Helper for 'get_queued_page' - gets a page off the queue
- *      ms:      MigrationState in
- * *offset:      Used to return the offset within the RAMBlock
- * ram_addr_abs: global offset in the dirty/sent bitmaps
- *
- * Returns:      block (or NULL if none available)
+ * Build the packet for the pages owned by @p, checking which of them are
+ * zero so that only the others are put on the wire.  Returns the number
+ * of iovec elements to send, including the header.
  */
-static RAMBlock *unqueue_page(MigrationState *ms, ram_addr_t *offset,
-                              ram_addr_t *ram_addr_abs)
+static int multifd_send_fill_packet(MultiFDSendParams *p, uint32_t flags,
+                                    uint64_t packet_num)
 {
-    RAMBlock *block = NULL;
+    MultiFDPacket_t *packet = p->packet;
+    MultiFDPages_t *pages = p->pages;
+    uint32_t normal = 0, zero = 0;
+    int niov = 1;
+    int i;
 
-    qemu_mutex_lock(&ms->src_page_req_mutex);
-    if (!QSIMPLEQ_EMPTY(&ms->src_page_requests)) {
-        struct MigrationSrcPageRequest *entry =
-                                QSIMPLEQ_FIRST(&ms->src_page_requests);
-        block = entry->rb;
-        *offset = entry->offset;
-        *ram_addr_abs = (entry->offset + entry->rb->offset) &
-                        TARGET_PAGE_MASK;
+    memset(packet->ramblock, 0, sizeof(packet->ramblock));
+    if (pages->block) {
+        pstrcpy(packet->ramblock, sizeof(packet->ramblock),
+                pages->block->idstr);
+    }
 
-        if (entry->len > TARGET_PAGE_SIZE) {
-            entry->len -= TARGET_PAGE_SIZE;
-            entry->offset += TARGET_PAGE_SIZE;
+    for (i = 0; i < pages->used; i++) {
+        uint8_t *host = pages->block->host + pages->offset[i];
+
+        if (is_zero_range(host, TARGET_PAGE_SIZE)) {
+            zero++;
+            packet->offset[pages->used - zero] = cpu_to_be64(pages->offset[i]);
         } else {
-            memory_region_unref(block->mr);
-            QSIMPLEQ_REMOVE_HEAD(&ms->src_page_requests, next_req);
-            g_free(entry);
+            packet->offset[normal++] = cpu_to_be64(pages->offset[i]);
+            p->iov[niov].iov_base = host;
+            p->iov[niov].iov_len = TARGET_PAGE_SIZE;
+            niov++;
         }
     }
-    qemu_mutex_unlock(&ms->src_page_req_mutex);
 
-    return block;
+    packet->magic = cpu_to_be32(MULTIFD_MAGIC);
+    packet->version = cpu_to_be32(MULTIFD_VERSION);
+    packet->flags = cpu_to_be32(flags);
+    packet->size = cpu_to_be32(multifd_send_state->page_count);
+    packet->normal_pages = cpu_to_be32(normal);
+    packet->zero_pages = cpu_to_be32(zero);
+    packet->packet_num = cpu_to_be64(packet_num);
+
+    p->iov[0].iov_base = packet;
+    p->iov[0].iov_len = p->packet_len;
+
+    p->done_normal_pages += normal;
+    p->done_zero_pages += zero;
+    p->done_bytes += p->packet_len + (uint64_t)normal * TARGET_PAGE_SIZE;
+
+    return niov;
 }
 
-/*
- * Unqueue a page from the queue fed by postcopy page requests; skips pages
- * that are already sent (!dirty)
- *
- *      ms:      MigrationState in
- *     pss:      PageSearchStatus structure updated with found block/offset
- * ram_addr_abs: global offset in the dirty/sent bitmaps
- *
- * Returns:      true if a queued page is found
- */
-static bool get_queued_page(MigrationState *ms, PageSearchStatus *pss,
-                            ram_addr_t *ram_addr_abs)
+static void multifd_send_set_error(MultiFDSendParams *p, Error *err)
 {
-    RAMBlock  *block;
-    ram_addr_t offset;
-    bool dirty;
+    MigrationState *s = migrate_get_current();
 
-    do {
-        block = unqueue_page(ms, &offset, ram_addr_abs);
-        /*
+    error_reportf_err(err, "multifd channel %d: ", p->id);
+    atomic_set(&multifd_send_state->error, true);
+    qemu_file_set_error(s->to_dst_file, -EIO);
+    /* Wake up the migration thread in case it waits for us */
+    qemu_sem_post(&multifd_send_state->channels_ready);
+    qemu_sem_post(&multifd_send_state->sem_sync);
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+    Error *local_err = NULL;
+
+    rcu_register_thread();
+
+    if (socket_send_channel_connect(p->c, &local_err) < 0 ||
+        multifd_send_initial_packet(p, &local_err) < 0) {
+        goto out;
+    }
+    if (migrate_use_zero_copy() &&
+        !qio_channel_has_feature(p->c, QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+        error_setg(&local_err, "x-zero-copy is not supported by the "
+                   "migration channel");
+        goto out;
+    }
+    trace_multifd_send_thread_start(p->id);
+    qemu_sem_post(&multifd_send_state->channels_ready);
+
+    while (true) {
+        qemu_sem_wait(&p->sem);
+        qemu_mutex_lock(&p->mutex);
+        if (p->pending_job || p->flags) {
+            bool job = p->pending_job;
+            uint32_t flags = p->flags;
+            uint64_t packet_num = p->packet_num;
+            int niov, ret;
+
+            p->flags = 0;
+            qemu_mutex_unlock(&p->mutex);
+
+            rcu_read_lock();
+            niov = multifd_send_fill_packet(p, flags, packet_num);
+            if (migrate_use_zero_copy()) {
+                /* The packet header is reused, so it must be copied;
+                 * the pages stay put until the next flush.
+                 */
+                ret = qio_channel_writev_all(p->c, p->iov, 1, &local_err);
+                if (ret == 0 && niov > 1) {
+                    ret = qio_channel_writev_zero_copy_all(p->c, p->iov + 1,
+                                                           niov - 1,
+                                                           &local_err);
+                }
+            } else {
+                ret = qio_channel_writev_all(p->c, p->iov, niov, &local_err);
+            }
+            rcu_read_unlock();
+            if (ret < 0) {
+                break;
+            }
+
+            if ((flags & MULTIFD_FLAG_SYNC) && migrate_use_zero_copy()) {
+                /* Everything queued before a sync must have left the
+                 * host before the main thread moves on to the next
+                 * iteration or to completion.
+                 */
+                ret = qio_channel_flush(p->c, &local_err);
+                if (ret < 0) {
+                    break;
+                }
+                trace_multifd_send_flush(p->id, ret == 1);
+            }
+
+            qemu_mutex_lock(&p->mutex);
+            p->pages->used = 0;
+            p->pages->block = NULL;
+            p->pending_job = false;
+            p->num_packets++;
+            qemu_mutex_unlock(&p->mutex);
+
+            if (flags & MULTIFD_FLAG_SYNC) {
+                qemu_sem_post(&multifd_send_state->sem_sync);
+            }
+            if (job) {
+                qemu_sem_post(&multifd_send_state->channels_ready);
+            }
+        } else if (p->quit) {
+            qemu_mutex_unlock(&p->mutex);
+            break;
+        } else {
+            qemu_mutex_unlock(&p->mutex);
+        }
+    }
+
+out:
+    qemu_mutex_lock(&p->mutex);
+    if (local_err && p->quit) {
+        /* The channel was shut down by multifd_save_cleanup() */
+        error_free(local_err);
+        local_err = NULL;
+    }
+    p->running = false;
+    qemu_mutex_unlock(&p->mutex);
+
+    if (local_err) {
+        multifd_send_set_error(p, local_err);
+    }
+    trace_multifd_send_thread_end(p->id, p->num_packets);
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+void multifd_save_setup(void)
+{
+    uint32_t page_count;
+    int i, thread_count;
+
+    if (!migrate_use_multifd()) {
+        return;
+    }
+    thread_count = migrate_multifd_channels();
+    page_count = migrate_multifd_page_count();
+    multifd_send_state = g_new0(typeof(*multifd_send_state), 1);
+    multifd_send_state->params = g_new0(MultiFDSendParams, thread_count);
+    multifd_send_state->count = thread_count;
+    multifd_send_state->page_count = page_count;
+    multifd_send_state->pages = multifd_pages_init(page_count);
+    qemu_sem_init(&multifd_send_state->channels_ready, 0);
+    qemu_sem_init(&multifd_send_state->sem_sync, 0);
+    multifd_needs_sync = false;
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_init(&p->mutex);
+        qemu_sem_init(&p->sem, 0);
+        p->id = i;
+        p->quit = false;
+        p->running = true;
+        p->pages = multifd_pages_init(page_count);
+        p->packet_len = sizeof(MultiFDPacket_t)
+                      + sizeof(uint64_t) * page_count;
+        p->packet = g_malloc0(p->packet_len);
+        p->iov = g_new0(struct iovec, page_count + 1);
+        p->c = QIO_CHANNEL(qio_channel_socket_new());
+        p->name = g_strdup_printf("multifdsend_%d", i);
+        qemu_thread_create(&p->thread, p->name, multifd_send_thread, p,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+void multifd_save_cleanup(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->quit = true;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+        qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_thread_join(&p->thread);
+        object_unref(OBJECT(p->c));
+        qemu_mutex_destroy(&p->mutex);
+        qemu_sem_destroy(&p->sem);
+        multifd_pages_clear(p->pages);
+        g_free(p->packet);
+        g_free(p->iov);
+        g_free(p->name);
+    }
+    qemu_sem_destroy(&multifd_send_state->channels_ready);
+    qemu_sem_destroy(&multifd_send_state->sem_sync);
+    multifd_pages_clear(multifd_send_state->pages);
+    g_free(multifd_send_state->params);
+    g_free(multifd_send_state);
+    multifd_send_state = NULL;
+}
+
+/*
+ * Move the statistics of the packets @p has sent into the migration
+ * counters, so that they also count against the rate limit of @f.
+ * Called with p->mutex held.
+ */
+static void multifd_send_account(QEMUFile *f, MultiFDSendParams *p)
+{
+    acct_info.norm_pages += p->done_normal_pages;
+    acct_info.dup_pages += p->done_zero_pages;
+    bytes_transferred += p->done_bytes;
+    qemu_update_position(f, p->done_bytes);
+    qemu_file_update_transfer(f, p->done_bytes);
+    p->done_normal_pages = 0;
+    p->done_zero_pages = 0;
+    p->done_bytes = 0;
+}
+
+/* Hand the queued pages over to the next idle channel */
+static int multifd_send_pages(QEMUFile *f)
+{
+    MultiFDPages_t *pages = multifd_send_state->pages;
+    MultiFDSendParams *p;
+    int i;
+
+    qemu_sem_wait(&multifd_send_state->channels_ready);
+    if (atomic_read(&multifd_send_state->error)) {
+        return -1;
+    }
+
+    for (i = multifd_send_state->next_channel;;
+         i = (i + 1) % multifd_send_state->count) {
+        p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        if (!p->pending_job) {
+            break;
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+    multifd_send_state->next_channel = (i + 1) % multifd_send_state->count;
+
+    multifd_send_account(f, p);
+    p->pending_job = true;
+    p->packet_num = multifd_send_state->packet_num++;
+    multifd_send_state->pages = p->pages;
+    p->pages = pages;
+    qemu_mutex_unlock(&p->mutex);
+    qemu_sem_post(&p->sem);
+
+    return 0;
+}
+
+static int multifd_queue_page(QEMUFile *f, RAMBlock *block,
+                              ram_addr_t offset)
+{
+    MultiFDPages_t *pages = multifd_send_state->pages;
+
+    /* A packet only carries pages of a single RAMBlock */
+    if (pages->block && pages->block != block) {
+        if (multifd_send_pages(f) < 0) {
+            return -1;
+        }
+        pages = multifd_send_state->pages;
+    }
+
+    pages->block = block;
+    pages->offset[pages->used++] = offset;
+    if (pages->used == pages->allocated) {
+        return multifd_send_pages(f);
+    }
+
+    return 0;
+}
+
+/*
+ * Flush the queued pages and make every channel send a sync packet, then
+ * tell the destination about it on the main stream.  The destination
+ * finishes loading everything sent before the sync point on all channels
+ * before anything sent after it, so newer copies of a page that was sent
+ * again after a bitmap sync can never be overwritten by older ones.
+ */
+static int multifd_send_sync_main(QEMUFile *f)
+{
+    int i;
+
+    if (!migrate_use_multifd()) {
+        return 0;
+    }
+    if (multifd_send_state->pages->used) {
+        if (multifd_send_pages(f) < 0) {
+            return -1;
+        }
+    }
+
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->flags |= MULTIFD_FLAG_SYNC;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        qemu_sem_wait(&multifd_send_state->sem_sync);
+    }
+    if (atomic_read(&multifd_send_state->error)) {
+        return -1;
+    }
+
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        multifd_send_account(f, p);
+        qemu_mutex_unlock(&p->mutex);
+    }
+    trace_multifd_send_sync_main(multifd_send_state->packet_num);
+
+    multifd_needs_sync = false;
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+    bytes_transferred += 8;
+
+    return 0;
+}
+
+/**
+ * ram_save_multifd_page: queue the given page for one of the multifd
+ *                        channels
+ *
+ * Returns: Number of pages queued, or -1 on error.  Zero pages are
+ *          detected by the channel threads, and only their offset is
+ *          sent.
+ *
+ * @f: QEMUFile where to account for the data
+ * @pss: Data about the page we want to send
+ */
+static int ram_save_multifd_page(QEMUFile *f, PageSearchStatus *pss)
+{
+    if (multifd_queue_page(f, pss->block, pss->offset) < 0) {
+        qemu_file_set_error(f, -EIO);
+        return -1;
+    }
+
+    return 1;
+}
+
+typedef struct {
+    uint8_t id;
+    char *name;
+    QemuThread thread;
+    QIOChannel *c;
+    /* released by the main thread once all channels reached a sync point */
+    QemuSemaphore sem_sync;
+    /* protects running and quit */
+    QemuMutex mutex;
+    bool running;
+    bool quit;
+    /* used only by the thread */
+    MultiFDPacket_t *packet;
+    uint32_t packet_len;
+    struct iovec *iov;
+    uint32_t flags;
+    uint64_t packet_num;
+    uint64_t num_packets;
+} MultiFDRecvParams;
+
+static struct {
+    MultiFDRecvParams *params;
+    /* number of channels we expect */
+    int channels;
+    /* number of channels that are connected */
+    int count;
+    uint32_t page_count;
+    /* posted by each channel when it reaches a sync point */
+    QemuSemaphore sem_sync;
+    /* set once any channel has failed or reached end of file */
+    bool error;
+} *multifd_recv_state;
+
+static void multifd_load_setup(void)
+{
+    uint32_t page_count = migrate_multifd_page_count();
+    int i, thread_count;
+
+    thread_count = migrate_multifd_channels();
+    multifd_recv_state = g_new0(typeof(*multifd_recv_state), 1);
+    multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
+    multifd_recv_state->channels = thread_count;
+    multifd_recv_state->page_count = page_count;
+    qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        qemu_mutex_init(&p->mutex);
+        qemu_sem_init(&p->sem_sync, 0);
+        p->id = i;
+        p->packet_len = sizeof(MultiFDPacket_t)
+                      + sizeof(uint64_t) * page_count;
+        p->packet = g_malloc0(p->packet_len);
+        p->iov = g_new0(struct iovec, page_count);
+        p->name = g_strdup_printf("multifdrecv_%d", i);
+    }
+}
+
+void multifd_load_cleanup(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        return;
+    }
+    for (i = 0; i < multifd_recv_state->channels; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        if (p->c) {
+            qemu_mutex_lock(&p->mutex);
+            p->quit = true;
+            qemu_mutex_unlock(&p->mutex);
+            qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+            qemu_sem_post(&p->sem_sync);
+        }
+    }
+    for (i = 0; i < multifd_recv_state->channels; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        if (p->c) {
+            qemu_thread_join(&p->thread);
+            object_unref(OBJECT(p->c));
+        }
+        qemu_mutex_destroy(&p->mutex);
+        qemu_sem_destroy(&p->sem_sync);
+        g_free(p->packet);
+        g_free(p->iov);
+        g_free(p->name);
+    }
+    qemu_sem_destroy(&multifd_recv_state->sem_sync);
+    g_free(multifd_recv_state->params);
+    g_free(multifd_recv_state);
+    multifd_recv_state = NULL;
+}
+
+/*
+ * Validate the packet header that was just read, zero the pages that were
+ * sent as zero pages, and prepare p->iov to receive the contents of the
+ * others directly into guest RAM.  Returns the number of elements in
+ * p->iov, or -1 on error.
+ */
+static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
+{
+    MultiFDPacket_t *packet = p->packet;
+    uint32_t page_count = multifd_recv_state->page_count;
+    uint32_t normal, zero, i;
+    RAMBlock *block;
+    int niov = 0;
+
+    if (be32_to_cpu(packet->magic) != MULTIFD_MAGIC) {
+        error_setg(errp, "multifd: received packet magic %x "
+                   "and expected magic %x",
+                   be32_to_cpu(packet->magic), MULTIFD_MAGIC);
+        return -1;
+    }
+    if (be32_to_cpu(packet->version) != MULTIFD_VERSION) {
+        error_setg(errp, "multifd: received packet version %d "
+                   "and expected version %d",
+                   be32_to_cpu(packet->version), MULTIFD_VERSION);
+        return -1;
+    }
+    if (be32_to_cpu(packet->size) != page_count) {
+        error_setg(errp, "multifd: received packet with %d pages "
+                   "and expected %d pages (x-multifd-page-count)",
+                   be32_to_cpu(packet->size), page_count);
+        return -1;
+    }
+
+    p->flags = be32_to_cpu(packet->flags);
+    p->packet_num = be64_to_cpu(packet->packet_num);
+    normal = be32_to_cpu(packet->normal_pages);
+    zero = be32_to_cpu(packet->zero_pages);
+    if (normal > page_count || zero > page_count - normal) {
+        error_setg(errp, "multifd: received packet with %u normal and "
+                   "%u zero pages, more than the maximum of %u",
+                   normal, zero, page_count);
+        return -1;
+    }
+    if (normal + zero == 0) {
+        return 0;
+    }
+
+    packet->ramblock[sizeof(packet->ramblock) - 1] = 0;
+    block = qemu_ram_block_by_name(packet->ramblock);
+    if (!block) {
+        error_setg(errp, "multifd: unknown ram block %s", packet->ramblock);
+        return -1;
+    }
+
+    for (i = 0; i < normal + zero; i++) {
+        uint64_t offset = be64_to_cpu(packet->offset[i]);
+        uint8_t *host;
+
+        if ((offset & ~TARGET_PAGE_MASK) ||
+            !offset_in_ramblock(block, offset)) {
+            error_setg(errp, "multifd: offset %" PRIx64 " outside of "
+                       "ram block %s", offset, block->idstr);
+            return -1;
+        }
+        host = block->host + offset;
+        if (i < normal) {
+            p->iov[niov].iov_base = host;
+            p->iov[niov].iov_len = TARGET_PAGE_SIZE;
+            niov++;
+        } else {
+            ram_handle_compressed(host, 0, TARGET_PAGE_SIZE);
+        }
+    }
+
+    return niov;
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParams *p = opaque;
+    Error *local_err = NULL;
+    int ret;
+
+    rcu_register_thread();
+    trace_multifd_recv_thread_start(p->id);
+
+    while (true) {
+        struct iovec iov = { .iov_base = p->packet,
+                             .iov_len = p->packet_len };
+        int niov;
+
+        ret = qio_channel_readv_all_eof(p->c, &iov, 1, &local_err);
+        if (ret <= 0) {
+            /* 0 means the source closed the channel */
+            break;
+        }
+
+        rcu_read_lock();
+        niov = multifd_recv_unfill_packet(p, &local_err);
+        ret = niov;
+        if (niov > 0) {
+            ret = qio_channel_readv_all(p->c, p->iov, niov, &local_err);
+        }
+        rcu_read_unlock();
+        if (ret < 0) {
+            break;
+        }
+        p->num_packets++;
+
+        if (p->flags & MULTIFD_FLAG_SYNC) {
+            qemu_sem_post(&multifd_recv_state->sem_sync);
+            qemu_sem_wait(&p->sem_sync);
+        }
+    }
+
+    qemu_mutex_lock(&p->mutex);
+    if (local_err && !p->quit) {
+        error_reportf_err(local_err, "multifd channel %d: ", p->id);
+    } else {
+        error_free(local_err);
+    }
+    p->running = false;
+    qemu_mutex_unlock(&p->mutex);
+
+    /* No more sync points will come from this channel */
+    atomic_set(&multifd_recv_state->error, true);
+    qemu_sem_post(&multifd_recv_state->sem_sync);
+
+    trace_multifd_recv_thread_end(p->id, p->num_packets);
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+static int multifd_recv_initial_packet(QIOChannel *c, Error **errp)
+{
+    MultiFDInit_t msg;
+    struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+
+    if (qio_channel_readv_all(c, &iov, 1, errp) < 0) {
+        return -1;
+    }
+    if (be32_to_cpu(msg.magic) != MULTIFD_MAGIC) {
+        error_setg(errp, "multifd: received channel magic %x "
+                   "and expected magic %x",
+                   be32_to_cpu(msg.magic), MULTIFD_MAGIC);
+        return -1;
+    }
+    if (be32_to_cpu(msg.version) != MULTIFD_VERSION) {
+        error_setg(errp, "multifd: received channel version %d "
+                   "and expected version %d",
+                   be32_to_cpu(msg.version), MULTIFD_VERSION);
+        return -1;
+    }
+    if (msg.id >= multifd_recv_state->channels) {
+        error_setg(errp, "multifd: received channel id %d but only %d "
+                   "channels are expected (x-multifd-channels)",
+                   msg.id, multifd_recv_state->channels);
+        return -1;
+    }
+
+    return msg.id;
+}
+
+bool multifd_recv_all_channels_created(void)
+{
+    if (!migrate_use_multifd()) {
+        return true;
+    }
+    if (!multifd_recv_state) {
+        return false;
+    }
+    return multifd_recv_state->count == multifd_recv_state->channels;
+}
+
+/* Called from the main thread for each channel after the main one */
+int multifd_recv_new_channel(QIOChannel *ioc, Error **errp)
+{
+    MultiFDRecvParams *p;
+    int id;
+
+    if (!multifd_recv_state) {
+        multifd_load_setup();
+    }
+
+    qio_channel_set_blocking(ioc, true, NULL);
+    id = multifd_recv_initial_packet(ioc, errp);
+    if (id < 0) {
+        return -1;
+    }
+    trace_multifd_recv_new_channel(id);
+
+    p = &multifd_recv_state->params[id];
+    if (p->c) {
+        error_setg(errp, "multifd: received channel id %d twice", id);
+        return -1;
+    }
+    p->c = ioc;
+    object_ref(OBJECT(ioc));
+    p->running = true;
+    qemu_thread_create(&p->thread, p->name, multifd_recv_thread, p,
+                       QEMU_THREAD_JOINABLE);
+    multifd_recv_state->count++;
+
+    return 0;
+}
+
+/* Wait until every channel has loaded all the pages before the sync point */
+static int multifd_recv_sync_main(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        error_report("multifd sync point received, but x-multifd is not "
+                     "enabled");
+        return -EINVAL;
+    }
+
+    for (i = 0; i < multifd_recv_state->channels; i++) {
+        qemu_sem_wait(&multifd_recv_state->sem_sync);
+    }
+    if (atomic_read(&multifd_recv_state->error)) {
+        return -EIO;
+    }
+    for (i = 0; i < multifd_recv_state->channels; i++) {
+        qemu_sem_post(&multifd_recv_state->params[i].sem_sync);
+    }
+    trace_multifd_recv_sync_main();
+
+    return 0;
+}
+
+/*
+ * Find the next dirty page and update any state associated with
+ * the search process.
+ *
+ * Returns: True if a page is found
+ *
+ * @f: Current migration stream.
+ * @pss: Data about the state of the current dirty page scan.
+ * @*again: Set to false if the search has scanned the whole of RAM
+ * *ram_addr_abs: Pointer into which to store the address of the dirty page
+ *               within the global ram_addr space
+ */
+static bool find_dirty_block(QEMUFile *f, PageSearchStatus *pss,
+                             bool *again, ram_addr_t *ram_addr_abs)
+{
+    pss->offset = migration_bitmap_find_dirty(pss->block, pss->offset,
+                                              ram_addr_abs);
+    if (pss->complete_round && pss->block == last_seen_block &&
+        pss->offset >= last_offset) {
+        /*
+         * We've been once around the RAM and haven't found anything.
+         * Give up.
+         */
+        *again = false;
+        return false;
+    }
+    if (pss->offset >= pss->block->used_length) {
+        /* Didn't find anything in this RAM Block */
+        pss->offset = 0;
+        pss->block = QLIST_NEXT_RCU(pss->block, next);
+        if (!pss->block) {
+            /* Hit the end of the list */
+            pss->block = QLIST_FIRST_RCU(&ram_list.blocks);
+            /* Flag that we've looped */
+            pss->complete_round = true;
+            ram_bulk_stage = false;
+            if (migrate_use_xbzrle()) {
+                /* If xbzrle is on, stop using the data compression at this
+                 * point. In theory, xbzrle can do better than compression.
+                 */
+                flush_compressed_data(f);
+                compression_switch = false;
+            }
+        }
+        /* Didn't find anything this time, but try again on the new block */
+        *again = true;
+        return false;
+    } else {
+        /* Can go around again, but... */
+        *again = true;
+        /* We've found something so probably don't need to */
+        return true;
+    }
+}
+
+/*
+ * Helper for 'get_queued_page' - gets a page off the queue
+ *      ms:      MigrationState in
+ * *offset:      Used to return the offset within the RAMBlock
+ * ram_addr_abs: global offset in the dirty/sent bitmaps
+ *
+ * Returns:      block (or NULL if none available)
+ */
+static RAMBlock *unqueue_page(MigrationState *ms, ram_addr_t *offset,
+                              ram_addr_t *ram_addr_abs)
+{
+    RAMBlock *block = NULL;
+
+    qemu_mutex_lock(&ms->src_page_req_mutex);
+    if (!QSIMPLEQ_EMPTY(&ms->src_page_requests)) {
+        struct MigrationSrcPageRequest *entry =
+                                QSIMPLEQ_FIRST(&ms->src_page_requests);
+        block = entry->rb;
+        *offset = entry->offset;
+        *ram_addr_abs = (entry->offset + entry->rb->offset) &
+                        TARGET_PAGE_MASK;
+
+        if (entry->len > TARGET_PAGE_SIZE) {
+            entry->len -= TARGET_PAGE_SIZE;
+            entry->offset += TARGET_PAGE_SIZE;
+        } else {
+            memory_region_unref(block->mr);
+            QSIMPLEQ_REMOVE_HEAD(&ms->src_page_requests, next_req);
+            g_free(entry);
+        }
+    }
+    qemu_mutex_unlock(&ms->src_page_req_mutex);
+
+    return block;
+}
+
+/*
+ * Write tracking for background snapshots: all of RAM is write protected
+ * with userfaultfd when the snapshot starts.  A guest write to a page
+ * that hasn't been saved yet blocks until the migration thread saves the
+ * page, which then removes the protection.
+ */
+#ifdef CONFIG_LINUX
+static int write_tracking_fd = -1;
+
+/* Largest number of write faults read from the userfaultfd at once */
+#define WRITE_TRACKING_FAULT_BATCH 16
+
+bool ram_write_tracking_available(void)
+{
+    uint64_t features;
+
+    if (uffd_query_features(&features)) {
+        return false;
+    }
+    return !!(features & UFFD_FEATURE_PAGEFAULT_FLAG_WP);
+}
+
+/* Check that every RAMBlock can be write protected */
+bool ram_write_tracking_compatible(void)
+{
+    const uint64_t needed = (uint64_t)1 << _UFFDIO_WRITEPROTECT;
+    RAMBlock *block;
+    bool ret = true;
+    int uffd_fd;
+
+    uffd_fd = uffd_create_fd(UFFD_FEATURE_PAGEFAULT_FLAG_WP, false);
+    if (uffd_fd < 0) {
+        return false;
+    }
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        uint64_t ioctls;
+
+        if (uffd_register_memory(uffd_fd, block->host, block->max_length,
+                                 UFFDIO_REGISTER_MODE_WP, &ioctls)) {
+            ret = false;
+            break;
+        }
+        uffd_unregister_memory(uffd_fd, block->host, block->max_length);
+        if ((ioctls & needed) != needed) {
+            error_report("RAMBlock %s can't be write protected",
+                         block->idstr);
+            ret = false;
+            break;
+        }
+    }
+    rcu_read_unlock();
+
+    uffd_close_fd(uffd_fd);
+    return ret;
+}
+
+int ram_write_tracking_start(void)
+{
+    RAMBlock *block, *failed = NULL;
+    int uffd_fd;
+
+    uffd_fd = uffd_create_fd(UFFD_FEATURE_PAGEFAULT_FLAG_WP, true);
+    if (uffd_fd < 0) {
+        return -1;
+    }
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (uffd_register_memory(uffd_fd, block->host, block->max_length,
+                                 UFFDIO_REGISTER_MODE_WP, NULL)) {
+            failed = block;
+            break;
+        }
+        if (uffd_change_protection(uffd_fd, block->host, block->used_length,
+                                   true, false)) {
+            uffd_unregister_memory(uffd_fd, block->host, block->max_length);
+            failed = block;
+            break;
+        }
+        trace_ram_write_tracking_start(block->idstr);
+    }
+    if (failed) {
+        QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+            if (block == failed) {
+                break;
+            }
+            uffd_change_protection(uffd_fd, block->host, block->used_length,
+                                   false, false);
+            uffd_unregister_memory(uffd_fd, block->host, block->max_length);
+        }
+    }
+    rcu_read_unlock();
+
+    if (failed) {
+        uffd_close_fd(uffd_fd);
+        return -1;
+    }
+    write_tracking_fd = uffd_fd;
+    return 0;
+}
+
+void ram_write_tracking_stop(void)
+{
+    RAMBlock *block;
+
+    if (write_tracking_fd < 0) {
+        return;
+    }
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        /* Releases any vCPU still waiting on a page */
+        uffd_change_protection(write_tracking_fd, block->host,
+                               block->used_length, false, false);
+        uffd_unregister_memory(write_tracking_fd, block->host,
+                               block->max_length);
+    }
+    rcu_read_unlock();
+
+    uffd_close_fd(write_tracking_fd);
+    write_tracking_fd = -1;
+}
+
+/*
+ * Pending write faults not handled yet; read in batches, handed out one
+ * by one.
+ */
+static struct uffd_msg write_faults[WRITE_TRACKING_FAULT_BATCH];
+static int write_faults_count;
+static int write_faults_next;
+
+/*
+ * Get the page of the next guest write to a protected page, if any.
+ *
+ * Returns:      block (or NULL if none available)
+ */
+static RAMBlock *poll_write_fault(ram_addr_t *offset, ram_addr_t *ram_addr_abs)
+{
+    RAMBlock *block;
+    void *addr;
+
+    if (write_tracking_fd < 0) {
+        return NULL;
+    }
+
+    while (true) {
+        if (write_faults_next == write_faults_count) {
+            int ret = uffd_read_events(write_tracking_fd, write_faults,
+                                       WRITE_TRACKING_FAULT_BATCH);
+            if (ret <= 0) {
+                if (ret < 0) {
+                    error_report("%s: failed to read write faults: %s",
+                                 __func__, strerror(-ret));
+                }
+                write_faults_count = write_faults_next = 0;
+                return NULL;
+            }
+            write_faults_count = ret;
+            write_faults_next = 0;
+        }
+
+        addr = (void *)(uintptr_t)
+               write_faults[write_faults_next++].arg.pagefault.address;
+        block = qemu_ram_block_from_host(addr, false, offset);
+        if (block) {
+            break;
+        }
+        error_report("%s: write fault outside of guest RAM: %p", __func__,
+                     addr);
+    }
+
+    *offset &= TARGET_PAGE_MASK;
+    *ram_addr_abs = block->offset + *offset;
+    trace_ram_write_tracking_fault(block->idstr, (uint64_t)*offset);
+    return block;
+}
+
+/* Called once the host page at @offset is saved, lets the guest write it */
+static void ram_write_tracking_unprotect(RAMBlock *block, ram_addr_t offset)
+{
+    if (write_tracking_fd < 0) {
+        return;
+    }
+
+    offset &= ~((ram_addr_t)qemu_host_page_size - 1);
+    uffd_change_protection(write_tracking_fd, block->host + offset,
+                           qemu_host_page_size, false, false);
+}
+#else
+bool ram_write_tracking_available(void)
+{
+    return false;
+}
+
+bool ram_write_tracking_compatible(void)
+{
+    return false;
+}
+
+int ram_write_tracking_start(void)
+{
+    return -1;
+}
+
+void ram_write_tracking_stop(void)
+{
+}
+
+static RAMBlock *poll_write_fault(ram_addr_t *offset, ram_addr_t *ram_addr_abs)
+{
+    return NULL;
+}
+
+static void ram_write_tracking_unprotect(RAMBlock *block, ram_addr_t offset)
+{
+}
+#endif
+
+/*
+ * Unqueue a page from the queue fed by postcopy page requests, or by
+ * guest writes during a background snapshot; skips pages that are
+ * already sent (!dirty)
+ *
+ *      ms:      MigrationState in
+ *     pss:      PageSearchStatus structure updated with found block/offset
+ * ram_addr_abs: global offset in the dirty/sent bitmaps
+ *
+ * Returns:      true if a queued page is found
+ */
+static bool get_queued_page(MigrationState *ms, PageSearchStatus *pss,
+                            ram_addr_t *ram_addr_abs)
+{
+    RAMBlock  *block;
+    ram_addr_t offset;
+    bool dirty;
+
+    do {
+        block = unqueue_page(ms, &offset, ram_addr_abs);
+        if (!block) {
+            block = poll_write_fault(&offset, ram_addr_abs);
+        }
+        /*
          * We're sending this page, and since it's postcopy nothing else
          * will dirty it, and we must make sure it doesn't get sent again
          * even if this queue request was received after the background
@@ -1113,16 +2510,94 @@ static bool get_queued_page(MigrationState *ms, PageSearchStatus *pss,
          */
         ram_bulk_stage = false;
 
-        /*
-         * We want the background search to continue from the queued page
-         * since the guest is likely to want other pages near to the page
-         * it just requested.
-         */
         pss->block = block;
         pss->offset = offset;
     }
 
-    return !!block;
+    return !!block;
+}
+
+static bool page_queue_empty(MigrationState *ms)
+{
+    bool empty;
+
+    qemu_mutex_lock(&ms->src_page_req_mutex);
+    empty = QSIMPLEQ_EMPTY(&ms->src_page_requests);
+    qemu_mutex_unlock(&ms->src_page_req_mutex);
+
+    return empty;
+}
+
+/*
+ * Start prefetching the pages that follow a requested page; @offset is
+ * the first page after it.  Reuses the hotspot of an earlier fault that
+ * this one falls into, so a guest touching pages in sequence doesn't
+ * evict all the other hotspots.
+ */
+static void postcopy_hotspot_add(RAMBlock *block, ram_addr_t offset)
+{
+    ram_addr_t window = (ram_addr_t)migrate_postcopy_prefetch_pages() *
+                        TARGET_PAGE_SIZE;
+    struct PostcopyHotspot *hs;
+    int i;
+
+    if (!window) {
+        return;
+    }
+
+    for (i = 0; i < POSTCOPY_HOTSPOTS; i++) {
+        hs = &postcopy_hotspots[i];
+        if (hs->block == block && offset >= hs->offset &&
+            offset <= hs->end) {
+            break;
+        }
+    }
+    if (i == POSTCOPY_HOTSPOTS) {
+        i = postcopy_hotspot_next;
+        postcopy_hotspot_next = (i + 1) % POSTCOPY_HOTSPOTS;
+        hs = &postcopy_hotspots[i];
+    }
+
+    hs->block = block;
+    hs->offset = offset;
+    hs->end = MIN(offset + window, block->used_length);
+    trace_postcopy_hotspot_add(block->idstr, (uint64_t)offset,
+                               (uint64_t)hs->end);
+}
+
+/*
+ * Find a dirty page in one of the hotspots, most recent first, dropping
+ * the hotspots that have been sent completely.
+ *
+ * Returns: true if a page was found
+ */
+static bool get_hotspot_page(PageSearchStatus *pss, ram_addr_t *ram_addr_abs)
+{
+    unsigned int i, n;
+
+    for (n = 1; n <= POSTCOPY_HOTSPOTS; n++) {
+        struct PostcopyHotspot *hs;
+        ram_addr_t offset;
+
+        i = (postcopy_hotspot_next + POSTCOPY_HOTSPOTS - n) %
+            POSTCOPY_HOTSPOTS;
+        hs = &postcopy_hotspots[i];
+        if (!hs->block) {
+            continue;
+        }
+        offset = migration_bitmap_find_dirty(hs->block, hs->offset,
+                                             ram_addr_abs);
+        if (offset >= hs->end) {
+            hs->block = NULL;
+            continue;
+        }
+        pss->block = hs->block;
+        pss->offset = offset;
+        hs->offset = offset + TARGET_PAGE_SIZE;
+        return true;
+    }
+
+    return false;
 }
 
 /**
@@ -1239,6 +2714,8 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
             res = ram_save_compressed_page(f, pss,
                                            last_stage,
                                            bytes_transferred);
+        } else if (migrate_use_multifd()) {
+            res = ram_save_multifd_page(f, pss);
         } else {
             res = ram_save_page(f, pss, last_stage,
                                 bytes_transferred);
@@ -1301,6 +2778,7 @@ static int ram_save_host_page(MigrationState *ms, QEMUFile *f,
 
     /* The offset we leave with is the last one we looked at */
     pss->offset -= TARGET_PAGE_SIZE;
+    ram_write_tracking_unprotect(pss->block, pss->offset);
     return pages;
 }
 
@@ -1323,10 +2801,10 @@ static int ram_save_host_page(MigrationState *ms, QEMUFile *f,
 static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
                                    uint64_t *bytes_transferred)
 {
-    PageSearchStatus pss;
+    PageSearchStatus pss, upss;
     MigrationState *ms = migrate_get_current();
     int pages = 0;
-    bool again, found;
+    bool again, found, queued;
     ram_addr_t dirty_ram_abs; /* Address of the start of the dirty page in
                                  ram_addr_t space */
 
@@ -1340,17 +2818,38 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
 
     do {
         again = true;
-        found = get_queued_page(ms, &pss, &dirty_ram_abs);
-
-        if (!found) {
-            /* priority queue empty, so just search for something dirty */
-            found = find_dirty_block(f, &pss, &again, &dirty_ram_abs);
-        }
+        /* Pages sent out of order don't move the background search */
+        upss = pss;
+        queued = get_queued_page(ms, &upss, &dirty_ram_abs);
+        found = queued || get_hotspot_page(&upss, &dirty_ram_abs);
 
         if (found) {
-            pages = ram_save_host_page(ms, f, &pss,
+            pages = ram_save_host_page(ms, f, &upss,
                                        last_stage, bytes_transferred,
                                        dirty_ram_abs);
+            if (!migrate_postcopy_prefetch_pages()) {
+                /*
+                 * Without prefetching, the background search continues
+                 * from the queued page since the guest is likely to want
+                 * other pages near to the page it just requested.
+                 */
+                pss = upss;
+            } else if (queued && pages >= 0) {
+                postcopy_hotspot_add(upss.block,
+                                     upss.offset + TARGET_PAGE_SIZE);
+            }
+            if (queued && page_queue_empty(ms)) {
+                /* Don't leave a faulting vCPU waiting for a full buffer */
+                qemu_fflush(f);
+            }
+        } else {
+            /* priority queue empty, so just search for something dirty */
+            found = find_dirty_block(f, &pss, &again, &dirty_ram_abs);
+            if (found) {
+                pages = ram_save_host_page(ms, f, &pss,
+                                           last_stage, bytes_transferred,
+                                           dirty_ram_abs);
+            }
         }
     } while (!pages && again);
 
@@ -1360,6 +2859,85 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
     return pages;
 }
 
+/**
+ * ram_write_tracking_wait: Waits for the guest to write a protected page
+ *
+ * Called by the migration thread instead of sleeping when the rate limit
+ * is reached during a background snapshot.  A vCPU blocked on a write
+ * can't wait for the next rate limiting period, so this returns as soon
+ * as a fault arrives; the page is then saved by the next ram_save_iterate,
+ * even if that goes over the limit.
+ *
+ * Returns true if a write fault is pending.
+ *
+ * @timeout_ms: how long to wait for faults
+ */
+#ifdef CONFIG_LINUX
+bool ram_write_tracking_wait(int64_t timeout_ms)
+{
+    struct pollfd pfd = { .fd = write_tracking_fd, .events = POLLIN };
+
+    if (write_tracking_fd < 0) {
+        g_usleep(timeout_ms * 1000);
+        return false;
+    }
+    if (write_faults_next < write_faults_count) {
+        return true;
+    }
+    return poll(&pfd, 1, MAX(timeout_ms, 0)) > 0;
+}
+
+/* Whether a vCPU is waiting for a page to be saved */
+static bool ram_save_urgent(void *opaque)
+{
+    struct pollfd pfd = { .fd = write_tracking_fd, .events = POLLIN };
+
+    if (write_tracking_fd < 0) {
+        return false;
+    }
+    return write_faults_next < write_faults_count || poll(&pfd, 1, 0) > 0;
+}
+#else
+bool ram_write_tracking_wait(int64_t timeout_ms)
+{
+    g_usleep(timeout_ms * 1000);
+    return false;
+}
+
+static bool ram_save_urgent(void *opaque)
+{
+    return false;
+}
+#endif
+
+/*
+ * Save the pages that vCPUs are blocked on during a background snapshot,
+ * regardless of the rate limit.
+ *
+ * Returns the number of pages written, or negative on error.
+ */
+static int ram_save_write_faults(QEMUFile *f)
+{
+    MigrationState *ms = migrate_get_current();
+    PageSearchStatus pss = { 0 };
+    ram_addr_t dirty_ram_abs;
+    int pages = 0, ret;
+
+    if (!ram_save_urgent(NULL)) {
+        return 0;
+    }
+
+    while (get_queued_page(ms, &pss, &dirty_ram_abs)) {
+        ret = ram_save_host_page(ms, f, &pss, false, &bytes_transferred,
+                                 dirty_ram_abs);
+        if (ret < 0) {
+            return ret;
+        }
+        pages += ret;
+    }
+    return pages;
+}
+
 void acct_update_position(QEMUFile *f, size_t size, bool zero)
 {
     uint64_t pages = size / TARGET_PAGE_SIZE;
@@ -1420,20 +2998,37 @@ static void ram_migration_cleanup(void *opaque)
     struct BitmapRcu *bitmap = migration_bitmap_rcu;
     atomic_rcu_set(&migration_bitmap_rcu, NULL);
     if (bitmap) {
-        memory_global_dirty_log_stop();
+        if (!migrate_background_snapshot()) {
+            memory_global_dirty_log_stop();
+        }
         call_rcu(bitmap, migration_bitmap_free, rcu);
     }
+    /* Normally stopped already, unless the snapshot failed */
+    ram_write_tracking_stop();
 
     XBZRLE_cache_lock();
     if (XBZRLE.cache) {
         cache_fini(XBZRLE.cache);
         g_free(XBZRLE.encoded_buf);
         g_free(XBZRLE.current_buf);
+        g_free(XBZRLE.prev_buf);
         XBZRLE.cache = NULL;
         XBZRLE.encoded_buf = NULL;
         XBZRLE.current_buf = NULL;
+        XBZRLE.prev_buf = NULL;
     }
     XBZRLE_cache_unlock();
+
+    if (migrate_use_mapped_ram()) {
+        RAMBlock *block;
+
+        rcu_read_lock();
+        QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+            g_free(block->file_bmap);
+            block->file_bmap = NULL;
+        }
+        rcu_read_unlock();
+    }
 }
 
 static void reset_ram_globals(void)
@@ -1443,6 +3038,8 @@ static void reset_ram_globals(void)
     last_offset = 0;
     last_version = ram_list.version;
     ram_bulk_stage = true;
+    memset(postcopy_hotspots, 0, sizeof(postcopy_hotspots));
+    postcopy_hotspot_next = 0;
 }
 
 #define MAX_WAIT 50 /* ms, half buffered_file limit */
@@ -1855,6 +3452,10 @@ int ram_discard_range(MigrationIncomingState *mis,
                          host_endaddr);
             goto err;
         }
+        if (rb->receivedmap) {
+            bitmap_clear(rb->receivedmap, start >> TARGET_PAGE_BITS,
+                         length >> TARGET_PAGE_BITS);
+        }
         ret = postcopy_ram_discard_range(mis, host_startaddr, length);
     } else {
         error_report("ram_discard_range: Overrun block '%s' (%" PRIu64
@@ -1880,6 +3481,12 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     RAMBlock *block;
     int64_t ram_bitmap_pages; /* Size of bitmap in pages, including gaps */
 
+    if (migrate_use_mapped_ram() && !qemu_file_is_seekable(f)) {
+        error_report("mapped-ram needs a migration file that can be "
+                     "written at any offset, e.g. a file: URI");
+        return -1;
+    }
+
     dirty_rate_high_cnt = 0;
     bitmap_sync_count = 0;
     migration_bitmap_sync_init();
@@ -1887,8 +3494,7 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
 
     if (migrate_use_xbzrle()) {
         XBZRLE_cache_lock();
-        XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
-                                  TARGET_PAGE_SIZE,
+        XBZRLE.cache = cache_init(migrate_xbzrle_cache_size(),
                                   TARGET_PAGE_SIZE);
         if (!XBZRLE.cache) {
             XBZRLE_cache_unlock();
@@ -1912,6 +3518,23 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
             return -1;
         }
 
+        XBZRLE.prev_buf = g_try_malloc(TARGET_PAGE_SIZE);
+        if (!XBZRLE.prev_buf) {
+            error_report("Error allocating prev_buf");
+            g_free(XBZRLE.encoded_buf);
+            g_free(XBZRLE.current_buf);
+            XBZRLE.encoded_buf = NULL;
+            XBZRLE.current_buf = NULL;
+            return -1;
+        }
+
+        rcu_read_lock();
+        QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+            atomic_set(&block->xbzrle_cache_hits, 0);
+            atomic_set(&block->xbzrle_cache_misses, 0);
+        }
+        rcu_read_unlock();
+
         acct_clear();
     }
 
@@ -1939,8 +3562,14 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
      */
     migration_dirty_pages = ram_bytes_total() >> TARGET_PAGE_BITS;
 
-    memory_global_dirty_log_start();
-    migration_bitmap_sync();
+    /*
+     * A background snapshot saves each page once, write protection
+     * takes care of the pages the guest changes in the meantime
+     */
+    if (!migrate_background_snapshot()) {
+        memory_global_dirty_log_start();
+        migration_bitmap_sync();
+    }
     qemu_mutex_unlock_ramlist();
     qemu_mutex_unlock_iothread();
 
@@ -1950,10 +3579,19 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         qemu_put_byte(f, strlen(block->idstr));
         qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
         qemu_put_be64(f, block->used_length);
+        if (migrate_use_mapped_ram()) {
+            mapped_ram_setup_block(f, block);
+        }
     }
 
     rcu_read_unlock();
 
+    /* The destination must decompress with the same codec */
+    if (migrate_use_compression()) {
+        qemu_put_be64(f, RAM_SAVE_FLAG_COMPRESS_METHOD);
+        qemu_put_byte(f, migrate_compress_method());
+    }
+
     ram_control_before_iterate(f, RAM_CONTROL_SETUP);
     ram_control_after_iterate(f, RAM_CONTROL_SETUP);
 
@@ -1979,6 +3617,22 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 
     ram_control_before_iterate(f, RAM_CONTROL_ROUND);
 
+    /* Pages sent from now on belong to a new round of the dirty bitmap */
+    if (multifd_needs_sync && multifd_send_sync_main(f) < 0) {
+        rcu_read_unlock();
+        qemu_file_set_error(f, -EIO);
+        return -EIO;
+    }
+
+    /* vCPUs blocked on a write go first, even over the rate limit */
+    ret = ram_save_write_faults(f);
+    if (ret < 0) {
+        rcu_read_unlock();
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+    pages_sent += ret;
+
     t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     i = 0;
     while ((ret = qemu_file_rate_limit(f)) == 0) {
@@ -2032,12 +3686,19 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 {
     rcu_read_lock();
 
-    if (!migration_in_postcopy(migrate_get_current())) {
+    if (!migration_in_postcopy(migrate_get_current()) &&
+        !migrate_background_snapshot()) {
         migration_bitmap_sync();
     }
 
     ram_control_before_iterate(f, RAM_CONTROL_FINISH);
 
+    if (multifd_needs_sync && multifd_send_sync_main(f) < 0) {
+        rcu_read_unlock();
+        qemu_file_set_error(f, -EIO);
+        return -EIO;
+    }
+
     /* try transferring iterative blocks of memory */
 
     /* flush all remaining blocks regardless of rate limiting */
@@ -2052,6 +3713,15 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     }
 
     flush_compressed_data(f);
+    /* The destination must have loaded all pages before the devices */
+    if (multifd_send_sync_main(f) < 0) {
+        rcu_read_unlock();
+        qemu_file_set_error(f, -EIO);
+        return -EIO;
+    }
+    if (migrate_use_mapped_ram()) {
+        mapped_ram_save_bitmaps(f);
+    }
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
     rcu_read_unlock();
@@ -2070,6 +3740,7 @@ static void ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size,
     remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
 
     if (!migration_in_postcopy(migrate_get_current()) &&
+        !migrate_background_snapshot() &&
         remaining_size < max_size) {
         qemu_mutex_lock_iothread();
         rcu_read_lock();
@@ -2167,6 +3838,130 @@ static inline void *host_from_ram_block_offset(RAMBlock *block,
     return block->host + offset;
 }
 
+/* Mark @len bytes at @host of @block as received by the destination */
+static inline void ramblock_recv_bitmap_set(RAMBlock *block, void *host,
+                                            size_t len)
+{
+    if (block->receivedmap) {
+        bitmap_set_atomic(block->receivedmap,
+                          ((uint8_t *)host - block->host) >> TARGET_PAGE_BITS,
+                          len >> TARGET_PAGE_BITS);
+    }
+}
+
+bool ram_page_received(RAMBlock *block, ram_addr_t offset)
+{
+    return block->receivedmap &&
+           test_bit(offset >> TARGET_PAGE_BITS, block->receivedmap);
+}
+
+/* Word @i of a bitmap as sent on the wire, whatever the size of a long */
+static inline uint64_t recv_bitmap_get_word(const unsigned long *map, long i)
+{
+#if HOST_LONG_BITS == 64
+    return map[i];
+#else
+    return map[2 * i] | ((uint64_t)map[2 * i + 1] << 32);
+#endif
+}
+
+/*
+ * Send the received bitmap of a RAMBlock on the return path of a
+ * recovering postcopy: its size in bytes, the bitmap as 64-bit words
+ * and an end mark.
+ * Returns 0 on success.
+ */
+int ram_send_recv_bitmap(QEMUFile *f, const char *block_name)
+{
+    RAMBlock *block;
+    long i, nwords;
+    int ret = 0;
+
+    rcu_read_lock();
+    block = qemu_ram_block_by_name(block_name);
+    if (!block || !block->receivedmap) {
+        error_report("%s: No received bitmap for block '%s'", __func__,
+                     block_name);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    nwords = DIV_ROUND_UP(block->used_length >> TARGET_PAGE_BITS, 64);
+    trace_ram_send_recv_bitmap(block_name, nwords);
+    qemu_put_be64(f, nwords * sizeof(uint64_t));
+    for (i = 0; i < nwords; i++) {
+        qemu_put_be64(f, recv_bitmap_get_word(block->receivedmap, i));
+    }
+    qemu_put_be64(f, RAMBLOCK_RECV_BITMAP_ENDING);
+    ret = qemu_file_get_error(f);
+
+out:
+    rcu_read_unlock();
+    return ret;
+}
+
+/*
+ * Source side of ram_send_recv_bitmap(): the pages the destination did
+ * not receive are all the pages we still have to send, whether we did
+ * already or not.
+ * Returns 0 on success.
+ */
+int ram_load_recv_bitmap(QEMUFile *f, const char *block_name)
+{
+    RAMBlock *block;
+    unsigned long *bitmap, base, nbits, i, j;
+    uint64_t size, word;
+    int ret = 0;
+
+    rcu_read_lock();
+    block = qemu_ram_block_by_name(block_name);
+    if (!block) {
+        error_report("%s: Can't find block '%s'", __func__, block_name);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    nbits = block->used_length >> TARGET_PAGE_BITS;
+    size = qemu_get_be64(f);
+    if (size != DIV_ROUND_UP(nbits, 64) * sizeof(uint64_t)) {
+        error_report("%s: Block '%s' bitmap has size %" PRIu64
+                     " expecting %lu", __func__, block_name, size,
+                     DIV_ROUND_UP(nbits, 64) * sizeof(uint64_t));
+        ret = -EINVAL;
+        goto out;
+    }
+
+    base = block->offset >> TARGET_PAGE_BITS;
+    qemu_mutex_lock(&migration_bitmap_mutex);
+    bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+    for (i = 0; i < nbits; i += 64) {
+        word = qemu_get_be64(f);
+        for (j = i; j < MIN(i + 64, nbits); j++) {
+            bool received = word & (1ULL << (j - i));
+
+            if (received && test_and_clear_bit(base + j, bitmap)) {
+                migration_dirty_pages--;
+            } else if (!received && !test_and_set_bit(base + j, bitmap)) {
+                migration_dirty_pages++;
+            }
+        }
+    }
+    qemu_mutex_unlock(&migration_bitmap_mutex);
+
+    if (qemu_get_be64(f) != RAMBLOCK_RECV_BITMAP_ENDING) {
+        error_report("%s: Bad end mark for block '%s'", __func__,
+                     block_name);
+        ret = -EINVAL;
+        goto out;
+    }
+    ret = qemu_file_get_error(f);
+    trace_ram_load_recv_bitmap(block_name, migration_dirty_pages);
+
+out:
+    rcu_read_unlock();
+    return ret;
+}
+
 /*
  * If a page (or a whole RDMA chunk) has been
  * determined to be zero, then zap it.
@@ -2181,7 +3976,6 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
 static void *do_data_decompress(void *opaque)
 {
     DecompressParam *param = opaque;
-    unsigned long pagesize;
     uint8_t *des;
     int len;
 
@@ -2193,14 +3987,17 @@ static void *do_data_decompress(void *opaque)
             param->des = 0;
             qemu_mutex_unlock(&param->mutex);
 
-            pagesize = TARGET_PAGE_SIZE;
-            /* uncompress() will return failed in some case, especially
-             * when the page is dirted when doing the compression, it's
-             * not a problem because the dirty page will be retransferred
-             * and uncompress() won't break the data in other pages.
+            /* The source compresses a consistent stream even if the
+             * guest changes the page meanwhile, so a failure means
+             * that the stream is corrupted; stop the load.
              */
-            uncompress((Bytef *)des, &pagesize,
-                       (const Bytef *)param->compbuf, len);
+            if (decompress_codec->decompress(param->ctx, des,
+                                             TARGET_PAGE_SIZE, param->compbuf,
+                                             len) != TARGET_PAGE_SIZE) {
+                error_report("Failed to decompress %s page at %p",
+                             decompress_codec->name, des);
+                qemu_file_set_error(decomp_file, -EIO);
+            }
 
             qemu_mutex_lock(&decomp_done_lock);
             param->done = true;
@@ -2239,6 +4036,9 @@ void migrate_decompress_threads_create(void)
 {
     int i, thread_count;
 
+    decompress_codec = migration_codec_get(migrate_compress_method());
+    assert(decompress_codec);
+    decompress_bound = decompress_codec->bound(TARGET_PAGE_SIZE);
     thread_count = migrate_decompress_threads();
     decompress_threads = g_new0(QemuThread, thread_count);
     decomp_param = g_new0(DecompressParam, thread_count);
@@ -2247,7 +4047,8 @@ void migrate_decompress_threads_create(void)
     for (i = 0; i < thread_count; i++) {
         qemu_mutex_init(&decomp_param[i].mutex);
         qemu_cond_init(&decomp_param[i].cond);
-        decomp_param[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
+        decomp_param[i].compbuf = g_malloc0(decompress_bound);
+        decomp_param[i].ctx = decompress_codec->context_new();
         decomp_param[i].done = true;
         decomp_param[i].quit = false;
         qemu_thread_create(decompress_threads + i, "decompress",
@@ -2272,6 +4073,7 @@ void migrate_decompress_threads_join(void)
         qemu_mutex_destroy(&decomp_param[i].mutex);
         qemu_cond_destroy(&decomp_param[i].cond);
         g_free(decomp_param[i].compbuf);
+        decompress_codec->context_free(decomp_param[i].ctx);
     }
     g_free(decompress_threads);
     g_free(decomp_param);
@@ -2284,6 +4086,7 @@ static void decompress_data_with_multi_threads(QEMUFile *f,
 {
     int idx, thread_count;
 
+    decomp_file = f;
     thread_count = migrate_decompress_threads();
     qemu_mutex_lock(&decomp_done_lock);
     while (true) {
@@ -2315,10 +4118,56 @@ static void decompress_data_with_multi_threads(QEMUFile *f,
 int ram_postcopy_incoming_init(MigrationIncomingState *mis)
 {
     size_t ram_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+    RAMBlock *block;
+
+    /* Rounded up to 64 bits, the unit ram_send_recv_bitmap() sends */
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        block->receivedmap =
+            bitmap_new(ROUND_UP(block->max_length >> TARGET_PAGE_BITS, 64));
+    }
+    rcu_read_unlock();
 
     return postcopy_ram_incoming_init(mis, ram_pages);
 }
 
+void ram_recv_bitmap_cleanup(void)
+{
+    RAMBlock *block;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        g_free(block->receivedmap);
+        block->receivedmap = NULL;
+    }
+    rcu_read_unlock();
+}
+
+/*
+ * Called by the migration thread when a paused postcopy resumes: ask the
+ * destination which pages it has.
+ * Returns the number of RECV_BITMAP requests sent, each is answered on
+ * the return path.
+ */
+int ram_postcopy_resume_prepare(MigrationState *s)
+{
+    RAMBlock *block;
+    int nblocks = 0;
+
+    /* The first page on the new channel must name its block */
+    last_sent_block = NULL;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        qemu_savevm_send_recv_bitmap(s->to_dst_file, block->idstr);
+        nblocks++;
+    }
+    rcu_read_unlock();
+    qemu_fflush(s->to_dst_file);
+
+    return nblocks;
+}
+
 /*
  * Called in postcopy mode by ram_load().
  * rcu_read_lock is taken prior to this being called.
@@ -2333,6 +4182,7 @@ static int ram_load_postcopy(QEMUFile *f)
     void *postcopy_host_page = postcopy_get_tmp_page(mis);
     void *last_host = NULL;
     bool all_zero = false;
+    RAMBlock *block = NULL;
 
     while (!ret && !(flags & RAM_SAVE_FLAG_EOS)) {
         ram_addr_t addr;
@@ -2348,7 +4198,7 @@ static int ram_load_postcopy(QEMUFile *f)
         trace_ram_load_postcopy_loop((uint64_t)addr, flags);
         place_needed = false;
         if (flags & (RAM_SAVE_FLAG_COMPRESS | RAM_SAVE_FLAG_PAGE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+            block = ram_block_from_stream(f, flags);
 
             host = host_from_ram_block_offset(block, addr);
             if (!host) {
@@ -2432,6 +4282,11 @@ static int ram_load_postcopy(QEMUFile *f)
                                                qemu_host_page_size,
                                                place_source);
             }
+            if (!ret) {
+                ramblock_recv_bitmap_set(block, host + TARGET_PAGE_SIZE -
+                                                qemu_host_page_size,
+                                         qemu_host_page_size);
+            }
         }
         if (!ret) {
             ret = qemu_file_get_error(f);
@@ -2441,6 +4296,168 @@ static int ram_load_postcopy(QEMUFile *f)
     return ret;
 }
 
+typedef struct MappedRamLoad {
+    QEMUFile *f;
+    uint8_t *host;
+    unsigned long *bmap;
+    unsigned long npages;
+    uint64_t pages_offset;
+    /* Pages missing from the file must be cleared */
+    bool zero_clear;
+    /* First page not handed out to a thread yet */
+    unsigned long next_page;
+    int error;
+} MappedRamLoad;
+
+static void *mapped_ram_load_thread(void *opaque)
+{
+    MappedRamLoad *load = opaque;
+
+    while (!atomic_read(&load->error)) {
+        unsigned long start, end, page, next;
+
+        start = atomic_fetch_add(&load->next_page, MAPPED_RAM_LOAD_CHUNK);
+        if (start >= load->npages) {
+            break;
+        }
+        end = MIN(start + MAPPED_RAM_LOAD_CHUNK, load->npages);
+
+        for (page = start; page < end; page = next) {
+            uint8_t *host = load->host + (page << TARGET_PAGE_BITS);
+            size_t size;
+
+            if (test_bit(page, load->bmap)) {
+                next = find_next_zero_bit(load->bmap, end, page);
+                size = (next - page) << TARGET_PAGE_BITS;
+                if (qemu_get_buffer_at(load->f, host, size, load->pages_offset +
+                                       (page << TARGET_PAGE_BITS)) != size) {
+                    atomic_set(&load->error, -EIO);
+                    break;
+                }
+            } else {
+                next = find_next_bit(load->bmap, end, page);
+                if (load->zero_clear) {
+                    ram_handle_compressed(host, 0,
+                                          (next - page) << TARGET_PAGE_BITS);
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Load the pages of @block from its region of a mapped-ram file, with as
+ * many threads as x-multifd-channels if the file can be read in parallel
+ */
+static int ram_load_mapped(QEMUFile *f, RAMBlock *block, ram_addr_t length)
+{
+    MappedRamLoad load = { .f = f, .host = block->host };
+    uint32_t version = qemu_get_be32(f);
+    uint64_t page_size = qemu_get_be64(f);
+    uint64_t bitmap_offset = qemu_get_be64(f);
+    uint64_t size = mapped_ram_bitmap_size(length);
+    uint64_t *words;
+    QemuThread *threads;
+    int i, nthreads;
+    unsigned long w;
+
+    load.pages_offset = qemu_get_be64(f);
+    load.npages = length >> TARGET_PAGE_BITS;
+
+    if (qemu_file_get_error(f)) {
+        return qemu_file_get_error(f);
+    }
+    if (!qemu_file_is_seekable(f)) {
+        error_report("mapped-ram needs a migration file that can be "
+                     "read at any offset, e.g. a file: URI");
+        return -EINVAL;
+    }
+    if (version != MAPPED_RAM_VERSION || page_size != TARGET_PAGE_SIZE) {
+        error_report("Unsupported mapped-ram layout of ramblock \"%s\": "
+                     "version %" PRIu32 ", page size %" PRIu64,
+                     block->idstr, version, page_size);
+        return -EINVAL;
+    }
+
+    words = g_try_malloc(size);
+    if (!words) {
+        error_report("Error allocating the mapped-ram bitmap");
+        return -ENOMEM;
+    }
+    if (qemu_get_buffer_at(f, (uint8_t *)words, size, bitmap_offset) != size) {
+        error_report("Failed to read the mapped-ram bitmap of ramblock "
+                     "\"%s\"", block->idstr);
+        g_free(words);
+        return -EIO;
+    }
+    load.bmap = bitmap_new(load.npages);
+    for (w = 0; w < size / sizeof(uint64_t); w++) {
+        uint64_t bits = le64_to_cpu(words[w]);
+
+        while (bits) {
+            unsigned long page = w * 64 + ctz64(bits);
+
+            if (page < load.npages) {
+                set_bit(page, load.bmap);
+            }
+            bits &= bits - 1;
+        }
+    }
+    g_free(words);
+
+    /* Fresh RAM of an incoming migration is zero already, loadvm's isn't */
+    load.zero_clear = !runstate_check(RUN_STATE_INMIGRATE);
+
+    nthreads = qemu_file_pio_thread_safe(f) ? migrate_multifd_channels() : 1;
+    threads = g_new0(QemuThread, nthreads);
+    for (i = 1; i < nthreads; i++) {
+        qemu_thread_create(&threads[i], "mapped-ram-load",
+                           mapped_ram_load_thread, &load,
+                           QEMU_THREAD_JOINABLE);
+    }
+    mapped_ram_load_thread(&load);
+    for (i = 1; i < nthreads; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    g_free(threads);
+    g_free(load.bmap);
+
+    if (load.error) {
+        error_report("Failed to load the pages of ramblock \"%s\"",
+                     block->idstr);
+        return load.error;
+    }
+
+    /* The stream continues after the pages */
+    return qemu_set_offset(f, load.pages_offset + length);
+}
+
+/* Check that the pages will be compressed with the codec used here */
+static int ram_load_compress_method(QEMUFile *f)
+{
+    int method = qemu_get_byte(f);
+
+    if (method >= MIGRATION_COMPRESS_METHOD__MAX) {
+        error_report("Unknown compression method %d", method);
+        return -EINVAL;
+    }
+    if (!migrate_use_compression()) {
+        error_report("The source compresses pages, but the compress "
+                     "capability is not set");
+        return -EINVAL;
+    }
+    if (method != migrate_compress_method()) {
+        error_report("The source compresses pages with %s, but "
+                     "compress-method is %s",
+                     MigrationCompressMethod_lookup[method],
+                     MigrationCompressMethod_lookup[migrate_compress_method()]);
+        return -EINVAL;
+    }
+    return 0;
+}
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     int flags = 0, ret = 0;
@@ -2488,6 +4505,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 ret = -EINVAL;
                 break;
             }
+            ramblock_recv_bitmap_set(block, host, TARGET_PAGE_SIZE);
         }
 
         switch (flags & ~RAM_SAVE_FLAG_CONTINUE) {
@@ -2517,6 +4535,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                     }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
+                    if (!ret && migrate_use_mapped_ram()) {
+                        ret = ram_load_mapped(f, block, length);
+                    }
                 } else {
                     error_report("Unknown ramblock \"%s\", cannot "
                                  "accept migration", id);
@@ -2538,7 +4559,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
         case RAM_SAVE_FLAG_COMPRESS_PAGE:
             len = qemu_get_be32(f);
-            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+            if (len < 0 || len > decompress_bound) {
                 error_report("Invalid compressed data length: %d", len);
                 ret = -EINVAL;
                 break;
@@ -2554,6 +4575,12 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            ret = multifd_recv_sync_main();
+            break;
+        case RAM_SAVE_FLAG_COMPRESS_METHOD:
+            ret = ram_load_compress_method(f);
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
@@ -2572,6 +4599,10 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     }
 
     wait_for_decompress_done();
+    if (!ret) {
+        /* Errors of the decompression threads */
+        ret = qemu_file_get_error(f);
+    }
     rcu_read_unlock();
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
@@ -2581,6 +4612,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 static SaveVMHandlers savevm_ram_handlers = {
     .save_live_setup = ram_save_setup,
     .save_live_iterate = ram_save_iterate,
+    .save_live_urgent = ram_save_urgent,
     .save_live_complete_postcopy = ram_save_complete,
     .save_live_complete_precopy = ram_save_complete,
     .save_live_pending = ram_save_pending,
@@ -79,6 +79,8 @@ static struct mig_cmd_args {
     [MIG_CMD_POSTCOPY_RAM_DISCARD] = {
                                    .len = -1, .name = "POSTCOPY_RAM_DISCARD" },
     [MIG_CMD_PACKAGED]         = { .len =  4, .name = "PACKAGED" },
+    [MIG_CMD_RECV_BITMAP]      = { .len = -1, .name = "RECV_BITMAP" },
+    [MIG_CMD_POSTCOPY_RESUME]  = { .len =  0, .name = "POSTCOPY_RESUME" },
     [MIG_CMD_MAX]              = { .len = -1, .name = "MAX" },
 };
 
@@ -167,18 +169,36 @@ static ssize_t block_get_buffer(void *opaque, uint8_t *buf, int64_t pos,
     return bdrv_load_vmstate(opaque, buf, pos, size);
 }
 
+static ssize_t block_readv_buffer(void *opaque, struct iovec *iov, int iovcnt,
+                                  int64_t pos)
+{
+    int ret;
+    QEMUIOVector qiov;
+
+    qemu_iovec_init_external(&qiov, iov, iovcnt);
+    ret = bdrv_readv_vmstate(opaque, &qiov, pos);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return qiov.size;
+}
+
 static int bdrv_fclose(void *opaque)
 {
     return bdrv_flush(opaque);
 }
 
+/* The vmstate is addressed by position, so no seek is needed */
 static const QEMUFileOps bdrv_read_ops = {
-    .get_buffer = block_get_buffer,
-    .close =      bdrv_fclose
+    .get_buffer     = block_get_buffer,
+    .preadv_buffer  = block_readv_buffer,
+    .close          = bdrv_fclose
 };
 
 static const QEMUFileOps bdrv_write_ops = {
     .writev_buffer  = block_writev_buffer,
+    .pwritev_buffer = block_writev_buffer,
     .close          = bdrv_fclose
 };
 
@@ -846,6 +866,32 @@ void qemu_savevm_send_postcopy_run(QEMUFile *f)
     qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_RUN, 0, NULL);
 }
 
+/*
+ * Ask the destination of a recovering postcopy which pages of a RAMBlock
+ * it has; it replies with MIG_RP_MSG_RECV_BITMAP.
+ * CMD_RECV_BITMAP consists of:
+ *      byte   Length of name field (not including 0)
+ *  n x byte   RAM block name
+ */
+void qemu_savevm_send_recv_bitmap(QEMUFile *f, const char *block_name)
+{
+    uint8_t buf[1 + 256];
+    size_t name_len = strlen(block_name);
+
+    trace_savevm_send_recv_bitmap(block_name);
+    assert(name_len < 256);
+    buf[0] = name_len;
+    memcpy(buf + 1, block_name, name_len);
+    qemu_savevm_command_send(f, MIG_CMD_RECV_BITMAP, 1 + name_len, buf);
+}
+
+/* Tell the destination of a recovering postcopy to carry on */
+void qemu_savevm_send_postcopy_resume(QEMUFile *f)
+{
+    trace_savevm_send_postcopy_resume();
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_RESUME, 0, NULL);
+}
+
 bool qemu_savevm_state_blocked(Error **errp)
 {
     SaveStateEntry *se;
@@ -943,7 +989,9 @@ int qemu_savevm_state_iterate(QEMUFile *f, bool postcopy)
         if (postcopy && !se->ops->save_live_complete_postcopy) {
             continue;
         }
-        if (qemu_file_rate_limit(f)) {
+        if (qemu_file_rate_limit(f) &&
+            !(se->ops->save_live_urgent &&
+              se->ops->save_live_urgent(se->opaque))) {
             return 0;
         }
         trace_savevm_section_start(se->idstr, se->section_id);
@@ -1014,22 +1062,17 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
     qemu_fflush(f);
 }
 
-void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
+/*
+ * Let the iterative devices send out their final data.
+ */
+int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
 {
-    QJSON *vmdesc;
-    int vmdesc_len;
     SaveStateEntry *se;
     int ret;
-    bool in_postcopy = migration_in_postcopy(migrate_get_current());
-
-    trace_savevm_state_complete_precopy();
-
-    cpu_synchronize_all_states();
 
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
         if (!se->ops ||
             (in_postcopy && se->ops->save_live_complete_postcopy) ||
-            (in_postcopy && !iterable_only) ||
             !se->ops->save_live_complete_precopy) {
             continue;
         }
@@ -1048,13 +1091,23 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
         save_section_footer(f, se);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
-            return;
+            return ret;
         }
     }
 
-    if (iterable_only) {
-        return;
-    }
+    return 0;
+}
+
+/*
+ * Save the state of all the devices that aren't iterative, then end the
+ * stream unless postcopy is still going.
+ */
+void qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
+                                                     bool in_postcopy)
+{
+    QJSON *vmdesc;
+    int vmdesc_len;
+    SaveStateEntry *se;
 
     vmdesc = qjson_new();
     json_prop_int(vmdesc, "page_size", TARGET_PAGE_SIZE);
@@ -1102,6 +1155,25 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
     qemu_fflush(f);
 }
 
+void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
+{
+    bool in_postcopy = migration_in_postcopy(migrate_get_current());
+
+    trace_savevm_state_complete_precopy();
+
+    cpu_synchronize_all_states();
+
+    if ((!in_postcopy || iterable_only) &&
+        qemu_savevm_state_complete_precopy_iterable(f, in_postcopy) < 0) {
+        return;
+    }
+    if (iterable_only) {
+        return;
+    }
+
+    qemu_savevm_state_complete_precopy_non_iterable(f, in_postcopy);
+}
+
 /* Give an estimate of the amount left to be transferred,
  * the result is split into the amount for units that can and
  * for units that can't do postcopy.
@@ -1390,6 +1462,56 @@ static int loadvm_postcopy_ram_handle_discard(MigrationIncomingState *mis,
  * (TODO:This could do with being in a postcopy file - but there again it's
  * just another input loop, not that postcopy specific)
  */
+/*
+ * The stream of a running postcopy broke.  The guest can't go on without
+ * the source, so rather than failing wait for migrate-recover to give us
+ * a new channel.
+ * Returns true once the new channel is in mis->from_src_file.
+ */
+static bool postcopy_pause_incoming(MigrationIncomingState *mis)
+{
+    if (postcopy_state_get() != POSTCOPY_INCOMING_RUNNING) {
+        /* The source still runs the guest, just fail */
+        return false;
+    }
+    trace_postcopy_pause_incoming();
+
+    /* migrate-pause shuts from_src_file down under the iothread lock */
+    qemu_mutex_lock_iothread();
+    qemu_fclose(mis->from_src_file);
+    mis->from_src_file = NULL;
+    qemu_mutex_unlock_iothread();
+
+    /*
+     * The fault thread may be sending page requests, and can be stuck in
+     * qemu_fflush() with rp_mutex held if the network went away.  Shut
+     * the channel down first so that the write fails and the lock is
+     * released.  Only this thread replaces to_src_file, so reading it
+     * without the lock is fine.
+     */
+    if (mis->to_src_file) {
+        qemu_file_shutdown(mis->to_src_file);
+    }
+    qemu_mutex_lock(&mis->rp_mutex);
+    if (mis->to_src_file) {
+        qemu_fclose(mis->to_src_file);
+        mis->to_src_file = NULL;
+    }
+    qemu_mutex_unlock(&mis->rp_mutex);
+
+    migrate_set_state(&mis->state, mis->state,
+                      MIGRATION_STATUS_POSTCOPY_PAUSED);
+    error_report("Postcopy migration paused, "
+                 "use migrate-recover to continue it");
+
+    while (mis->state == MIGRATION_STATUS_POSTCOPY_PAUSED) {
+        qemu_sem_wait(&mis->postcopy_pause_sem_dst);
+    }
+    trace_postcopy_pause_incoming_continued();
+
+    return true;
+}
+
 static void *postcopy_ram_listen_thread(void *opaque)
 {
     QEMUFile *f = opaque;
@@ -1406,7 +1528,18 @@ static void *postcopy_ram_listen_thread(void *opaque)
      * in qemu_file, and thus we must be blocking now.
      */
     qemu_file_set_blocking(f, true);
-    load_res = qemu_loadvm_state_main(f, mis);
+    while (true) {
+        load_res = qemu_loadvm_state_main(f, mis);
+        if (load_res >= 0 && qemu_file_get_error(f)) {
+            /* A broken stream reads as zeroes, i.e. as QEMU_VM_EOF */
+            load_res = qemu_file_get_error(f);
+        }
+        if (load_res >= 0 || !postcopy_pause_incoming(mis)) {
+            break;
+        }
+        /* Carry on where we left over the recovered channel */
+        f = mis->from_src_file;
+    }
     /* And non-blocking again so we don't block in any cleanup */
     qemu_file_set_blocking(f, false);
 
@@ -1557,6 +1690,59 @@ static int loadvm_postcopy_handle_run(MigrationIncomingState *mis)
     return LOADVM_QUIT;
 }
 
+/*
+ * A recovering source asks for the pages we received for a RAMBlock, so
+ * that it doesn't send them again.
+ */
+static int loadvm_handle_recv_bitmap(MigrationIncomingState *mis,
+                                     uint16_t len)
+{
+    QEMUFile *f = mis->from_src_file;
+    char block_name[256];
+    uint8_t name_len;
+
+    if (mis->state != MIGRATION_STATUS_POSTCOPY_RECOVER) {
+        error_report("CMD_RECV_BITMAP in wrong state (%s)",
+                     MigrationStatus_lookup[mis->state]);
+        return -EINVAL;
+    }
+
+    name_len = qemu_get_byte(f);
+    if (len != name_len + 1) {
+        error_report("CMD_RECV_BITMAP with length %d expecting %d",
+                     len, name_len + 1);
+        return -EINVAL;
+    }
+    qemu_get_buffer(f, (uint8_t *)block_name, name_len);
+    block_name[name_len] = '\0';
+    trace_loadvm_handle_recv_bitmap(block_name);
+
+    if (!mis->to_src_file) {
+        error_report("CMD_RECV_BITMAP received with no return path");
+        return -EINVAL;
+    }
+    return migrate_send_rp_recv_bitmap(mis, block_name);
+}
+
+/* The source got all our bitmaps, we can run the postcopy again */
+static int loadvm_postcopy_handle_resume(MigrationIncomingState *mis)
+{
+    if (mis->state != MIGRATION_STATUS_POSTCOPY_RECOVER) {
+        error_report("CMD_POSTCOPY_RESUME in wrong state (%s)",
+                     MigrationStatus_lookup[mis->state]);
+        return -EINVAL;
+    }
+    trace_loadvm_postcopy_handle_resume();
+
+    migrate_set_state(&mis->state, MIGRATION_STATUS_POSTCOPY_RECOVER,
+                      MIGRATION_STATUS_POSTCOPY_ACTIVE);
+    migrate_send_rp_resume_ack(mis, 1);
+
+    /* Page requests sent while paused were lost */
+    postcopy_ram_resend_requests(mis);
+    return 0;
+}
+
 /**
  * Immediately following this command is a blob of data containing an embedded
  * chunk of migration stream; read it and load it.
@@ -1640,7 +1826,9 @@ static int loadvm_process_command(QEMUFile *f)
             /* Not really a problem, so don't give up */
             return 0;
         }
+        qemu_mutex_lock(&mis->rp_mutex);
         mis->to_src_file = qemu_file_get_return_path(f);
+        qemu_mutex_unlock(&mis->rp_mutex);
         if (!mis->to_src_file) {
             error_report("CMD_OPEN_RETURN_PATH failed");
             return -1;
@@ -1672,6 +1860,12 @@ static int loadvm_process_command(QEMUFile *f)
 
     case MIG_CMD_POSTCOPY_RAM_DISCARD:
         return loadvm_postcopy_ram_handle_discard(mis, len);
+
+    case MIG_CMD_RECV_BITMAP:
+        return loadvm_handle_recv_bitmap(mis, len);
+
+    case MIG_CMD_POSTCOPY_RESUME:
+        return loadvm_postcopy_handle_resume(mis);
     }
 
     return 0;
@@ -1958,20 +2152,277 @@ int qemu_loadvm_state(QEMUFile *f)
     return ret;
 }
 
+/* Called with the AioContext of @bs acquired */
+static void savevm_init_snapshot_info(BlockDriverState *bs,
+                                      QEMUSnapshotInfo *sn, const char *name)
+{
+    QEMUSnapshotInfo old_sn1, *old_sn = &old_sn1;
+    qemu_timeval tv;
+    struct tm tm;
+
+    memset(sn, 0, sizeof(*sn));
+
+    /* fill auxiliary fields */
+    qemu_gettimeofday(&tv);
+    sn->date_sec = tv.tv_sec;
+    sn->date_nsec = tv.tv_usec * 1000;
+    sn->vm_clock_nsec = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    if (name) {
+        if (bdrv_snapshot_find(bs, old_sn, name) >= 0) {
+            pstrcpy(sn->name, sizeof(sn->name), old_sn->name);
+            pstrcpy(sn->id_str, sizeof(sn->id_str), old_sn->id_str);
+        } else {
+            pstrcpy(sn->name, sizeof(sn->name), name);
+        }
+    } else {
+        /* cast below needed for OpenBSD where tv_sec is still 'long' */
+        localtime_r((const time_t *)&tv.tv_sec, &tm);
+        strftime(sn->name, sizeof(sn->name), "vm-%Y%m%d%H%M%S", &tm);
+    }
+}
+
+/*
+ * Live savevm: RAM is saved while the guest keeps running, with dirty
+ * logging as in precopy migration, and the VM is only stopped to save the
+ * last dirty pages and the devices, and to snapshot the disks.  The
+ * snapshot is thus the state of the VM at the end of the save.
+ *
+ * Write protecting RAM as the background-snapshot capability does would
+ * give the state at the start instead, but the disks have to be
+ * snapshotted at the same point, and the VM state of a qcow2 internal
+ * snapshot can't be written once the snapshot exists.
+ */
+typedef struct SaveVMLiveState {
+    Monitor *mon;
+    BlockDriverState *bs;
+    char *name;
+    QEMUFile *f;
+    QemuThread thread;
+    QEMUBH *bh;
+    Error *err;
+} SaveVMLiveState;
+
+/*
+ * Give up waiting for the dirty pages to converge once this many times
+ * the size of RAM has been written, and save the rest with the VM stopped
+ */
+#define SAVEVM_LIVE_MAX_RAM_PASSES 3
+
+static void savevm_live_complete(SaveVMLiveState *s)
+{
+    MigrationState *ms = migrate_get_current();
+    AioContext *aio_context = bdrv_get_aio_context(s->bs);
+    BlockDriverState *bs;
+    QEMUSnapshotInfo sn;
+    uint64_t vm_state_size = 0;
+    bool running = runstate_is_running();
+    int ret;
+
+    ret = qemu_file_get_error(s->f);
+    if (ret) {
+        error_setg_errno(&s->err, -ret, "Error while writing VM state");
+    } else if (ms->state != MIGRATION_STATUS_ACTIVE) {
+        error_setg(&s->err, "Snapshot cancelled");
+    } else if (global_state_store() ||
+               vm_stop_force_state(RUN_STATE_SAVE_VM)) {
+        error_setg(&s->err, "Error while stopping the VM");
+    } else {
+        aio_context_acquire(aio_context);
+        qemu_savevm_state_complete_precopy(s->f, false);
+        aio_context_release(aio_context);
+        ret = qemu_file_get_error(s->f);
+        if (ret) {
+            error_setg_errno(&s->err, -ret, "Error while writing VM state");
+        }
+    }
+    qemu_savevm_state_cleanup();
+
+    aio_context_acquire(aio_context);
+    vm_state_size = qemu_ftell(s->f);
+    ms->to_dst_file = NULL;
+    if (qemu_fclose(s->f) < 0 && !s->err) {
+        error_setg(&s->err, "Error while writing VM state");
+    }
+    if (!s->err) {
+        savevm_init_snapshot_info(s->bs, &sn, s->name);
+        if (bdrv_all_create_snapshot(&sn, s->bs, vm_state_size, &bs) < 0) {
+            error_setg(&s->err, "Error while creating snapshot on '%s'",
+                       bdrv_get_device_name(bs));
+        }
+    }
+    aio_context_release(aio_context);
+
+    if (ms->state == MIGRATION_STATUS_CANCELLING) {
+        migrate_set_state(&ms->state, MIGRATION_STATUS_CANCELLING,
+                          MIGRATION_STATUS_CANCELLED);
+    } else {
+        migrate_set_state(&ms->state, MIGRATION_STATUS_ACTIVE,
+                          s->err ? MIGRATION_STATUS_FAILED :
+                                   MIGRATION_STATUS_COMPLETED);
+    }
+    if (running) {
+        vm_start();
+    }
+}
+
+static void *savevm_live_thread(void *opaque)
+{
+    SaveVMLiveState *s = opaque;
+    MigrationState *ms = migrate_get_current();
+    AioContext *aio_context = bdrv_get_aio_context(s->bs);
+    int64_t initial_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    int64_t initial_bytes = qemu_ftell(s->f);
+    uint64_t max_size = 0;
+
+    rcu_register_thread();
+
+    while (!qemu_file_get_error(s->f) &&
+           atomic_read(&ms->state) == MIGRATION_STATUS_ACTIVE) {
+        uint64_t pend_nonpost, pend_post;
+        int64_t current_time;
+
+        if (!qemu_file_rate_limit(s->f)) {
+            qemu_savevm_state_pending(s->f, max_size, &pend_nonpost,
+                                      &pend_post);
+            if (pend_nonpost + pend_post <= max_size ||
+                qemu_ftell(s->f) >
+                    SAVEVM_LIVE_MAX_RAM_PASSES * ram_bytes_total()) {
+                break;
+            }
+            /*
+             * The VM state goes to a block device: write it with the
+             * iothread lock held, but drop the lock between iterations
+             * so that the guest and the monitor keep running.
+             */
+            qemu_mutex_lock_iothread();
+            aio_context_acquire(aio_context);
+            qemu_savevm_state_iterate(s->f, false);
+            aio_context_release(aio_context);
+            qemu_mutex_unlock_iothread();
+        }
+
+        current_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+        if (current_time >= initial_time + BUFFER_DELAY) {
+            double bandwidth = (double)(qemu_ftell(s->f) - initial_bytes) /
+                               (current_time - initial_time);
+
+            max_size = bandwidth * migrate_max_downtime() / 1000000;
+            qemu_file_reset_rate_limit(s->f);
+            initial_time = current_time;
+            initial_bytes = qemu_ftell(s->f);
+        }
+        if (qemu_file_rate_limit(s->f)) {
+            /* usleep expects microseconds */
+            g_usleep((initial_time + BUFFER_DELAY - current_time) * 1000);
+        }
+    }
+
+    qemu_mutex_lock_iothread();
+    savevm_live_complete(s);
+    qemu_bh_schedule(s->bh);
+    qemu_mutex_unlock_iothread();
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void savevm_live_done(void *opaque)
+{
+    SaveVMLiveState *s = opaque;
+
+    qemu_thread_join(&s->thread);
+    qemu_bh_delete(s->bh);
+
+    if (s->err && s->mon) {
+        monitor_printf(s->mon, "%s\n", error_get_pretty(s->err));
+        error_free(s->err);
+    } else if (s->err) {
+        error_report_err(s->err);
+    }
+    if (s->mon) {
+        monitor_resume(s->mon);
+    }
+    bdrv_unref(s->bs);
+    g_free(s->name);
+    g_free(s);
+}
+
+static void savevm_live_start(Monitor *mon, BlockDriverState *bs,
+                              const char *name)
+{
+    MigrationParams params = {
+        .blk = 0,
+        .shared = 0
+    };
+    AioContext *aio_context = bdrv_get_aio_context(bs);
+    Error *local_err = NULL;
+    MigrationState *ms;
+    SaveVMLiveState *s;
+
+    if (migrate_background_snapshot()) {
+        monitor_printf(mon, "A live snapshot can't be taken with the "
+                       "background-snapshot capability set\n");
+        return;
+    }
+    if (migration_is_blocked(&local_err)) {
+        error_report_err(local_err);
+        return;
+    }
+
+    s = g_new0(SaveVMLiveState, 1);
+    s->bs = bs;
+    bdrv_ref(bs);
+    s->name = g_strdup(name);
+
+    aio_context_acquire(aio_context);
+    s->f = qemu_fopen_bdrv(bs, 1);
+    ms = migrate_init(&params);
+    ms->to_dst_file = s->f;
+    qemu_file_set_rate_limit(s->f, ms->bandwidth_limit / XFER_LIMIT_RATIO);
+
+    qemu_mutex_unlock_iothread();
+    qemu_savevm_state_header(s->f);
+    qemu_savevm_state_begin(s->f, &params);
+    qemu_mutex_lock_iothread();
+    aio_context_release(aio_context);
+    migrate_set_state(&ms->state, MIGRATION_STATUS_SETUP,
+                      MIGRATION_STATUS_ACTIVE);
+
+    if (monitor_suspend(mon) < 0) {
+        monitor_printf(mon, "terminal does not allow synchronous "
+                       "savevm, continuing detached\n");
+    } else {
+        s->mon = mon;
+    }
+    s->bh = qemu_bh_new(savevm_live_done, s);
+    qemu_thread_create(&s->thread, "savevm", savevm_live_thread, s,
+                       QEMU_THREAD_JOINABLE);
+}
+
 void hmp_savevm(Monitor *mon, const QDict *qdict)
 {
     BlockDriverState *bs, *bs1;
-    QEMUSnapshotInfo sn1, *sn = &sn1, old_sn1, *old_sn = &old_sn1;
+    QEMUSnapshotInfo sn1, *sn = &sn1;
     int ret;
     QEMUFile *f;
     int saved_vm_running;
     uint64_t vm_state_size;
-    qemu_timeval tv;
-    struct tm tm;
     const char *name = qdict_get_try_str(qdict, "name");
+    bool live = qdict_get_try_bool(qdict, "live", false);
     Error *local_err = NULL;
     AioContext *aio_context;
 
+    if (migration_is_setup_or_active(migrate_get_current()->state)) {
+        monitor_printf(mon, "Migration is in progress\n");
+        return;
+    }
+    /* Saving RAM would stop the dirty log and clear its bits under it */
+    if (dirty_rate_measuring()) {
+        monitor_printf(mon, "Dirty page rate measurement in progress\n");
+        return;
+    }
+
     if (!bdrv_all_can_snapshot(&bs)) {
         monitor_printf(mon, "Device '%s' is writable but does not "
                        "support snapshots.\n", bdrv_get_device_name(bs));
@@ -1995,6 +2446,12 @@ void hmp_savevm(Monitor *mon, const QDict *qdict)
 
     saved_vm_running = runstate_is_running();
 
+    /* A stopped VM has nothing to gain from a live snapshot */
+    if (live && saved_vm_running) {
+        savevm_live_start(mon, bs, name);
+        return;
+    }
+
     ret = global_state_store();
     if (ret) {
         monitor_printf(mon, "Error saving global state\n");
@@ -2004,27 +2461,7 @@ void hmp_savevm(Monitor *mon, const QDict *qdict)
 
     aio_context_acquire(aio_context);
 
-    memset(sn, 0, sizeof(*sn));
-
-    /* fill auxiliary fields */
-    qemu_gettimeofday(&tv);
-    sn->date_sec = tv.tv_sec;
-    sn->date_nsec = tv.tv_usec * 1000;
-    sn->vm_clock_nsec = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
-
-    if (name) {
-        ret = bdrv_snapshot_find(bs, old_sn, name);
-        if (ret >= 0) {
-            pstrcpy(sn->name, sizeof(sn->name), old_sn->name);
-            pstrcpy(sn->id_str, sizeof(sn->id_str), old_sn->id_str);
-        } else {
-            pstrcpy(sn->name, sizeof(sn->name), name);
-        }
-    } else {
-        /* cast below needed for OpenBSD where tv_sec is still 'long' */
-        localtime_r((const time_t *)&tv.tv_sec, &tm);
-        strftime(sn->name, sizeof(sn->name), "vm-%Y%m%d%H%M%S", &tm);
-    }
+    savevm_init_snapshot_info(bs, sn, name);
 
     /* save the VM state */
     f = qemu_fopen_bdrv(bs, 1);
@@ -55,6 +55,21 @@ static SocketAddress *unix_build_address(const char *path)
 }
 
 
+/* Address of the current outgoing migration, for the multifd channels */
+static SocketAddress *outgoing_saddr;
+
+int socket_send_channel_connect(QIOChannel *ioc, Error **errp)
+{
+    if (!outgoing_saddr) {
+        error_setg(errp, "Additional migration channels require a tcp: "
+                   "or unix: migration");
+        return -1;
+    }
+    return qio_channel_socket_connect_sync(QIO_CHANNEL_SOCKET(ioc),
+                                           outgoing_saddr, errp);
+}
+
+
 struct SocketConnectData {
     MigrationState *s;
     char *hostname;
@@ -105,7 +120,8 @@ static void socket_start_outgoing_migration(MigrationState *s,
                                      socket_outgoing_migration,
                                      data,
                                      socket_connect_data_free);
-    qapi_free_SocketAddress(saddr);
+    qapi_free_SocketAddress(outgoing_saddr);
+    outgoing_saddr = saddr;
 }
 
 void tcp_start_outgoing_migration(MigrationState *s,
@@ -146,6 +162,11 @@ static gboolean socket_accept_incoming_migration(QIOChannel *ioc,
                                        QIO_CHANNEL(sioc));
     object_unref(OBJECT(sioc));
 
+    if (!migration_has_all_channels()) {
+        /* Wait for the remaining multifd channels */
+        return TRUE;
+    }
+
 out:
     /* Close listening socket as its no longer needed */
     qio_channel_close(ioc, NULL);
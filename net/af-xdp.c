@@ -0,0 +1,641 @@
+/*
+ * AF_XDP network backend.
+ *
+ * Each queue of the netdev owns an AF_XDP socket bound to one queue of
+ * the host interface, and a UMEM area that backs the frames of its four
+ * rings: fill and rx for packets coming from the host, tx and completion
+ * for packets going to it.  Frames that are not in one of the rings are
+ * kept in a LIFO pool.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/socket.h>
+#include <net/if.h>
+#include <bpf/bpf.h>
+#include <xdp/xsk.h>
+
+#include "net/net.h"
+#include "clients.h"
+#include "monitor/monitor.h"
+#include "qapi/error.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/iov.h"
+#include "qemu/main-loop.h"
+#include "block/aio.h"
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70
+#endif
+
+/* Packets moved between the rings and the peer in one go */
+#define AF_XDP_BATCH_SIZE 64
+
+typedef struct AFXDPState {
+    NetClientState      nc;
+
+    struct xsk_socket   *xsk;
+    struct xsk_ring_cons rx;
+    struct xsk_ring_prod tx;
+    struct xsk_ring_cons cq;
+    struct xsk_ring_prod fq;
+
+    char                ifname[IFNAMSIZ];
+    int                 ifindex;
+    bool                read_poll;
+    bool                write_poll;
+    uint32_t            outstanding_tx;
+
+    uint64_t            *pool;
+    uint32_t            n_pool;
+    char                *buffer;
+    struct xsk_umem     *umem;
+
+    uint32_t            n_queues;
+    uint32_t            xdp_flags;
+    bool                inhibit;
+
+    AioContext          *ctx; /* NULL when polled by the main loop */
+} AFXDPState;
+
+static void af_xdp_send(void *opaque);
+static void af_xdp_writable(void *opaque);
+static bool af_xdp_poll_rx(void *opaque);
+
+static void af_xdp_update_fd_handler(AFXDPState *s)
+{
+    IOHandler *io_read = s->read_poll ? af_xdp_send : NULL;
+    IOHandler *io_write = s->write_poll ? af_xdp_writable : NULL;
+    int fd = xsk_socket__fd(s->xsk);
+
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, fd, false, io_read, io_write, s);
+        if (io_read || io_write) {
+            aio_set_fd_poll(s->ctx, fd, af_xdp_poll_rx);
+        }
+    } else {
+        qemu_set_fd_handler(fd, io_read, io_write, s);
+    }
+}
+
+static void af_xdp_read_poll(AFXDPState *s, bool enable)
+{
+    if (s->read_poll != enable) {
+        s->read_poll = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+static void af_xdp_write_poll(AFXDPState *s, bool enable)
+{
+    if (s->write_poll != enable) {
+        s->write_poll = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+static void af_xdp_poll(NetClientState *nc, bool enable)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    if (s->read_poll != enable || s->write_poll != enable) {
+        s->read_poll = enable;
+        s->write_poll = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+/* Return the frames of the packets that the kernel has sent to the pool */
+static void af_xdp_complete_tx(AFXDPState *s)
+{
+    uint32_t idx = 0;
+    uint32_t done, i;
+
+    done = xsk_ring_cons__peek(&s->cq, XSK_RING_CONS__DEFAULT_NUM_DESCS, &idx);
+    for (i = 0; i < done; i++) {
+        s->pool[s->n_pool++] = *xsk_ring_cons__comp_addr(&s->cq, idx++);
+    }
+    if (done) {
+        xsk_ring_cons__release(&s->cq, done);
+        s->outstanding_tx -= done;
+    }
+}
+
+static void af_xdp_writable(void *opaque)
+{
+    AFXDPState *s = opaque;
+
+    af_xdp_complete_tx(s);
+
+    /* Keep polling only if the kernel still has to be kicked */
+    if (!s->outstanding_tx || !xsk_ring_prod__needs_wakeup(&s->tx)) {
+        af_xdp_write_poll(s, false);
+    }
+
+    qemu_flush_queued_packets(&s->nc);
+}
+
+/*
+ * Copy up to @count packets into the tx ring and submit them together.
+ * Returns the number of packets consumed; the caller queues the others
+ * until af_xdp_writable() runs.
+ */
+static int af_xdp_transmit(AFXDPState *s, const NetBatchPacket *pkts,
+                           int count)
+{
+    uint32_t idx = 0, n = 0;
+    int i, consumed;
+
+    af_xdp_complete_tx(s);
+
+    /* Oversized packets can't be sent, they are consumed and dropped */
+    for (i = 0; i < count && n < s->n_pool; i++) {
+        if (iov_size(pkts[i].iov, pkts[i].iovcnt) <=
+            XSK_UMEM__DEFAULT_FRAME_SIZE) {
+            n++;
+        }
+    }
+    consumed = i;
+    if (n && !xsk_ring_prod__reserve(&s->tx, n, &idx)) {
+        consumed = 0;
+    }
+    if (!consumed) {
+        /* Out of frames or tx slots; this also kicks a stalled tx ring */
+        af_xdp_write_poll(s, true);
+        return 0;
+    }
+
+    for (i = 0; i < consumed; i++) {
+        size_t size = iov_size(pkts[i].iov, pkts[i].iovcnt);
+        struct xdp_desc *desc;
+
+        if (size > XSK_UMEM__DEFAULT_FRAME_SIZE) {
+            continue;
+        }
+        desc = xsk_ring_prod__tx_desc(&s->tx, idx++);
+        desc->addr = s->pool[--s->n_pool];
+        desc->len = iov_to_buf(pkts[i].iov, pkts[i].iovcnt, 0,
+                               xsk_umem__get_data(s->buffer, desc->addr),
+                               size);
+    }
+    if (n) {
+        xsk_ring_prod__submit(&s->tx, n);
+        s->outstanding_tx += n;
+        if (xsk_ring_prod__needs_wakeup(&s->tx)) {
+            af_xdp_write_poll(s, true);
+        }
+    }
+    return consumed;
+}
+
+static ssize_t af_xdp_receive(NetClientState *nc,
+                              const uint8_t *buf, size_t size)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = size };
+    NetBatchPacket pkt = { .iov = &iov, .iovcnt = 1 };
+
+    return af_xdp_transmit(s, &pkt, 1) ? size : 0;
+}
+
+static ssize_t af_xdp_receive_iov(NetClientState *nc,
+                                  const struct iovec *iov, int iovcnt)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    NetBatchPacket pkt = { .iov = iov, .iovcnt = iovcnt };
+
+    return af_xdp_transmit(s, &pkt, 1) ? iov_size(iov, iovcnt) : 0;
+}
+
+static int af_xdp_receive_batch(NetClientState *nc,
+                                const NetBatchPacket *pkts, int count)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    int done = 0, n;
+
+    do {
+        n = af_xdp_transmit(s, pkts + done, count - done);
+        done += n;
+    } while (n && done < count);
+    return done;
+}
+
+static void af_xdp_send_completed(NetClientState *nc, ssize_t len)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    af_xdp_read_poll(s, true);
+}
+
+static void af_xdp_fq_refill(AFXDPState *s, uint32_t n)
+{
+    uint32_t i, idx = 0;
+
+    /* Leave one frame for tx, just in case */
+    if (s->n_pool < n + 1) {
+        n = s->n_pool ? s->n_pool - 1 : 0;
+    }
+
+    if (!n || !xsk_ring_prod__reserve(&s->fq, n, &idx)) {
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        *xsk_ring_prod__fill_addr(&s->fq, idx++) = s->pool[--s->n_pool];
+    }
+    /*
+     * If the kernel ran out of frames, it is woken up by the next poll()
+     * on the socket, which happens as long as reads are enabled.
+     */
+    xsk_ring_prod__submit(&s->fq, n);
+}
+
+/* Move a batch of packets from the rx ring to the peer */
+static bool af_xdp_receive_rx(AFXDPState *s)
+{
+    NetBatchPacket pkts[AF_XDP_BATCH_SIZE];
+    struct iovec iov[AF_XDP_BATCH_SIZE];
+    uint64_t addr[AF_XDP_BATCH_SIZE];
+    uint32_t i, n_rx, idx = 0;
+    int sent;
+
+    n_rx = xsk_ring_cons__peek(&s->rx, AF_XDP_BATCH_SIZE, &idx);
+    if (!n_rx) {
+        return false;
+    }
+
+    for (i = 0; i < n_rx; i++) {
+        const struct xdp_desc *desc = xsk_ring_cons__rx_desc(&s->rx, idx++);
+
+        addr[i] = desc->addr;
+        iov[i].iov_base = xsk_umem__get_data(s->buffer, desc->addr);
+        iov[i].iov_len = desc->len;
+        pkts[i].iov = &iov[i];
+        pkts[i].iovcnt = 1;
+    }
+
+    sent = qemu_sendv_packet_batch(&s->nc, pkts, n_rx, af_xdp_send_completed);
+    if (sent < n_rx) {
+        /*
+         * Packet @sent was queued by the peer, which doesn't want more.
+         * Stop reading until af_xdp_send_completed() and give the rest
+         * back to the ring.
+         */
+        af_xdp_read_poll(s, false);
+        xsk_ring_cons__cancel(&s->rx, n_rx - sent - 1);
+        n_rx = sent + 1;
+    }
+
+    /* The net queue copies what it keeps, so the frames can be reused */
+    for (i = 0; i < n_rx; i++) {
+        s->pool[s->n_pool++] = addr[i];
+    }
+    xsk_ring_cons__release(&s->rx, n_rx);
+    af_xdp_fq_refill(s, AF_XDP_BATCH_SIZE);
+    return true;
+}
+
+static void af_xdp_send(void *opaque)
+{
+    af_xdp_receive_rx(opaque);
+}
+
+/* aio_poll() callback used while the queue runs in an IOThread */
+static bool af_xdp_poll_rx(void *opaque)
+{
+    AFXDPState *s = opaque;
+
+    if (!s->read_poll) {
+        return false;
+    }
+    return af_xdp_receive_rx(s);
+}
+
+static void af_xdp_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    int fd = xsk_socket__fd(s->xsk);
+
+    if (s->ctx == ctx) {
+        return;
+    }
+
+    /* Remove the handlers from the old context before installing them */
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, fd, false, NULL, NULL, NULL);
+    } else {
+        qemu_set_fd_handler(fd, NULL, NULL, NULL);
+    }
+    s->ctx = ctx;
+    af_xdp_update_fd_handler(s);
+}
+
+/* Remove the XDP program that the sockets were loaded with, if any */
+static void af_xdp_detach_prog(const char *ifname, int ifindex,
+                               uint32_t xdp_flags)
+{
+    uint32_t prog_id = 0;
+
+    if (bpf_xdp_query_id(ifindex, xdp_flags, &prog_id) || !prog_id) {
+        return;
+    }
+    if (bpf_xdp_detach(ifindex, xdp_flags, NULL) != 0) {
+        error_report("af-xdp: unable to remove XDP program from '%s', "
+                     "ifindex: %d", ifname, ifindex);
+    }
+}
+
+static void af_xdp_cleanup(NetClientState *nc)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    qemu_purge_queued_packets(nc);
+
+    if (s->xsk) {
+        af_xdp_poll(nc, false);
+        xsk_socket__delete(s->xsk);
+        s->xsk = NULL;
+    }
+    g_free(s->pool);
+    s->pool = NULL;
+    if (s->umem) {
+        xsk_umem__delete(s->umem);
+        s->umem = NULL;
+    }
+    qemu_vfree(s->buffer);
+    s->buffer = NULL;
+
+    /* Remove the program when the last queue goes away */
+    if (!s->inhibit && nc->queue_index == s->n_queues - 1 && s->xdp_flags) {
+        af_xdp_detach_prog(s->ifname, s->ifindex, s->xdp_flags);
+    }
+}
+
+static NetClientInfo net_af_xdp_info = {
+    .type = NET_CLIENT_DRIVER_AF_XDP,
+    .size = sizeof(AFXDPState),
+    .receive = af_xdp_receive,
+    .receive_iov = af_xdp_receive_iov,
+    .receive_batch = af_xdp_receive_batch,
+    .poll = af_xdp_poll,
+    .cleanup = af_xdp_cleanup,
+    .set_aio_context = af_xdp_set_aio_context,
+};
+
+static int af_xdp_umem_create(AFXDPState *s, int sock_fd, Error **errp)
+{
+    struct xsk_umem_config config = {
+        .fill_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+        .comp_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+        .frame_size = XSK_UMEM__DEFAULT_FRAME_SIZE,
+        .frame_headroom = 0,
+    };
+    uint64_t n_descs, size, i;
+    int ret;
+
+    /* Enough frames to fill all four rings */
+    n_descs = (XSK_RING_PROD__DEFAULT_NUM_DESCS +
+               XSK_RING_CONS__DEFAULT_NUM_DESCS) * 2;
+    size = n_descs * XSK_UMEM__DEFAULT_FRAME_SIZE;
+
+    s->buffer = qemu_memalign(getpagesize(), size);
+    memset(s->buffer, 0, size);
+
+    if (sock_fd < 0) {
+        ret = xsk_umem__create(&s->umem, s->buffer, size,
+                               &s->fq, &s->cq, &config);
+    } else {
+        ret = xsk_umem__create_with_fd(&s->umem, sock_fd, s->buffer, size,
+                                       &s->fq, &s->cq, &config);
+    }
+    if (ret) {
+        error_setg_errno(errp, -ret, "failed to create umem for %s queue %d",
+                         s->ifname, s->nc.queue_index);
+        qemu_vfree(s->buffer);
+        s->buffer = NULL;
+        s->umem = NULL;
+        return -1;
+    }
+
+    /* The pool is a LIFO, fill it so that frame 0 is handed out first */
+    s->pool = g_new(uint64_t, n_descs);
+    for (i = 0; i < n_descs; i++) {
+        s->pool[i] = (n_descs - 1 - i) * XSK_UMEM__DEFAULT_FRAME_SIZE;
+    }
+    s->n_pool = n_descs;
+
+    af_xdp_fq_refill(s, XSK_RING_PROD__DEFAULT_NUM_DESCS);
+    return 0;
+}
+
+static int af_xdp_socket_create(AFXDPState *s,
+                                const NetdevAFXDPOptions *opts, Error **errp)
+{
+    struct xsk_socket_config cfg = {
+        .rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+        .tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+        .libxdp_flags = 0,
+        .bind_flags = XDP_USE_NEED_WAKEUP,
+        .xdp_flags = XDP_FLAGS_UPDATE_IF_NOEXIST,
+    };
+    int queue_id, ret;
+
+    s->inhibit = opts->has_inhibit && opts->inhibit;
+    if (s->inhibit) {
+        cfg.libxdp_flags |= XSK_LIBXDP_FLAGS__INHIBIT_PROG_LOAD;
+    }
+    if (opts->has_force_copy && opts->force_copy) {
+        cfg.bind_flags |= XDP_COPY;
+    }
+
+    queue_id = s->nc.queue_index;
+    if (opts->has_start_queue) {
+        queue_id += opts->start_queue;
+    }
+
+    if (opts->has_mode) {
+        cfg.xdp_flags |= opts->mode == AFXDP_MODE_NATIVE ?
+                         XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE;
+        ret = xsk_socket__create(&s->xsk, s->ifname, queue_id,
+                                 s->umem, &s->rx, &s->tx, &cfg);
+    } else {
+        /* Try native mode first, skb mode works with every driver */
+        cfg.xdp_flags |= XDP_FLAGS_DRV_MODE;
+        ret = xsk_socket__create(&s->xsk, s->ifname, queue_id,
+                                 s->umem, &s->rx, &s->tx, &cfg);
+        if (ret) {
+            cfg.xdp_flags &= ~XDP_FLAGS_DRV_MODE;
+            cfg.xdp_flags |= XDP_FLAGS_SKB_MODE;
+            ret = xsk_socket__create(&s->xsk, s->ifname, queue_id,
+                                     s->umem, &s->rx, &s->tx, &cfg);
+        }
+    }
+    if (ret) {
+        error_setg_errno(errp, -ret,
+                         "failed to create AF_XDP socket for %s queue %d",
+                         s->ifname, queue_id);
+        s->xsk = NULL;
+        return -1;
+    }
+    s->xdp_flags = cfg.xdp_flags;
+    return 0;
+}
+
+static int af_xdp_set_busy_poll(AFXDPState *s, int64_t usecs, Error **errp)
+{
+    int fd = xsk_socket__fd(s->xsk);
+    int prefer = 1, timeout = usecs, budget = AF_XDP_BATCH_SIZE;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL,
+                   &prefer, sizeof(prefer)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL,
+                   &timeout, sizeof(timeout)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET,
+                   &budget, sizeof(budget)) < 0) {
+        error_setg_errno(errp, errno,
+                         "failed to enable busy polling for %s queue %d",
+                         s->ifname, s->nc.queue_index);
+        return -1;
+    }
+    return 0;
+}
+
+static int *af_xdp_parse_socket_fds(const char *sock_fds_str,
+                                    int64_t n_expected, Error **errp)
+{
+    gchar **substrings = g_strsplit(sock_fds_str, ":", -1);
+    int64_t i, n_sock_fds = g_strv_length(substrings);
+    int *sock_fds = NULL;
+
+    if (n_sock_fds != n_expected) {
+        error_setg(errp, "expected %" PRIi64 " socket fds, got %" PRIi64,
+                   n_expected, n_sock_fds);
+        goto out;
+    }
+
+    sock_fds = g_new(int, n_sock_fds);
+    for (i = 0; i < n_sock_fds; i++) {
+        sock_fds[i] = monitor_fd_param(cur_mon, substrings[i], errp);
+        if (sock_fds[i] < 0) {
+            g_free(sock_fds);
+            sock_fds = NULL;
+            goto out;
+        }
+    }
+
+out:
+    g_strfreev(substrings);
+    return sock_fds;
+}
+
+/*
+ * ... -netdev af-xdp,id=str,ifname=name[,queues=n]...
+ *
+ * Each queue becomes a NetClientState of its own, with queue_index set,
+ * so that a multiqueue virtio-net peer pairs its queues with them.
+ */
+int net_init_af_xdp(const Netdev *netdev,
+                    const char *name, NetClientState *peer, Error **errp)
+{
+    const NetdevAFXDPOptions *opts = &netdev->u.af_xdp;
+    NetClientState *nc, *nc0 = NULL;
+    AFXDPState *s = NULL;
+    unsigned int ifindex;
+    uint32_t prog_id = 0, xdp_flags;
+    int *sock_fds = NULL;
+    int64_t i, queues;
+
+    ifindex = if_nametoindex(opts->ifname);
+    if (!ifindex) {
+        error_setg_errno(errp, errno, "failed to get ifindex for '%s'",
+                         opts->ifname);
+        return -1;
+    }
+
+    queues = opts->has_queues ? opts->queues : 1;
+    if (queues < 1 || queues > MAX_QUEUE_NUM) {
+        error_setg(errp, "invalid number of queues (%" PRIi64 ") for '%s'",
+                   queues, opts->ifname);
+        return -1;
+    }
+    if (opts->has_start_queue && opts->start_queue < 0) {
+        error_setg(errp, "invalid start-queue (%" PRIi64 ") for '%s'",
+                   opts->start_queue, opts->ifname);
+        return -1;
+    }
+    if (opts->has_busy_poll &&
+        (opts->busy_poll < 0 || opts->busy_poll > INT_MAX)) {
+        error_setg(errp, "invalid busy-poll (%" PRIi64 ") for '%s'",
+                   opts->busy_poll, opts->ifname);
+        return -1;
+    }
+
+    if ((opts->has_inhibit && opts->inhibit) != opts->has_sock_fds) {
+        error_setg(errp, "'inhibit=on' requires 'sock-fds' and vice versa");
+        return -1;
+    }
+    if (opts->has_sock_fds) {
+        sock_fds = af_xdp_parse_socket_fds(opts->sock_fds, queues, errp);
+        if (!sock_fds) {
+            return -1;
+        }
+    }
+
+    for (i = 0; i < queues; i++) {
+        nc = qemu_new_net_client(&net_af_xdp_info, peer, "af-xdp", name);
+        snprintf(nc->info_str, sizeof(nc->info_str),
+                 "af-xdp%" PRIi64 " to %s", i, opts->ifname);
+        nc->queue_index = i;
+        if (!nc0) {
+            nc0 = nc;
+        }
+
+        s = DO_UPCAST(AFXDPState, nc, nc);
+        pstrcpy(s->ifname, sizeof(s->ifname), opts->ifname);
+        s->ifindex = ifindex;
+        s->n_queues = queues;
+
+        if (af_xdp_umem_create(s, sock_fds ? sock_fds[i] : -1, errp) ||
+            af_xdp_socket_create(s, opts, errp)) {
+            goto err;
+        }
+        if (opts->has_busy_poll && opts->busy_poll &&
+            af_xdp_set_busy_poll(s, opts->busy_poll, errp)) {
+            goto err;
+        }
+
+        af_xdp_read_poll(s, true); /* Initially only poll for reads */
+    }
+
+    s = DO_UPCAST(AFXDPState, nc, nc0);
+    if (bpf_xdp_query_id(s->ifindex, s->xdp_flags, &prog_id) || !prog_id) {
+        error_setg_errno(errp, errno,
+                         "no XDP program loaded on '%s', ifindex: %d",
+                         s->ifname, s->ifindex);
+        goto err;
+    }
+
+    g_free(sock_fds);
+    return 0;
+
+err:
+    g_free(sock_fds);
+    if (nc0) {
+        s = DO_UPCAST(AFXDPState, nc, nc0);
+        xdp_flags = s->inhibit ? 0 : s->xdp_flags;
+        qemu_del_net_client(nc0);
+        /* Only the last queue removes the program on cleanup, and it may
+         * not have been created; make sure the program does not stay.
+         */
+        if (xdp_flags) {
+            af_xdp_detach_prog(opts->ifname, ifindex, xdp_flags);
+        }
+    }
+    return -1;
+}
@@ -216,6 +216,12 @@ static void netfilter_complete(UserCreatable *uc, Error **errp)
         error_setg(errp, "Vhost is not supported");
         return;
     }
+    /* Filters run in the main loop only */
+    if (ncs[0]->aio_context) {
+        error_setg(errp, "A network backend polled from an IOThread "
+                   "is not supported");
+        return;
+    }
 
     nf->netdev = ncs[0];
 
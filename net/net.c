@@ -258,7 +258,8 @@ static void qemu_net_client_setup(NetClientState *nc,
     }
     QTAILQ_INSERT_TAIL(&net_clients, nc, next);
 
-    nc->incoming_queue = qemu_new_net_queue(qemu_deliver_packet_iov, nc);
+    nc->incoming_queue = qemu_new_net_queue(qemu_deliver_packet_iov,
+                                            qemu_deliver_packet_batch, nc);
     nc->destructor = destructor;
     QTAILQ_INIT(&nc->filters);
 }
@@ -520,6 +521,22 @@ int qemu_set_vnet_be(NetClientState *nc, bool is_be)
 #endif
 }
 
+/*
+ * Move the file descriptor handlers of @nc to @ctx, so that its packets
+ * are sent and received from that AioContext's thread.  A NULL @ctx
+ * moves them back to the main loop.
+ */
+int qemu_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    if (!nc || !nc->info->set_aio_context) {
+        return -ENOSYS;
+    }
+
+    nc->info->set_aio_context(nc, ctx);
+    nc->aio_context = ctx;
+    return 0;
+}
+
 int qemu_can_send_packet(NetClientState *sender)
 {
     int vm_running = runstate_is_running();
@@ -766,6 +783,77 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
                                    iov, iovcnt, sent_cb);
 }
 
+int qemu_deliver_packet_batch(NetClientState *sender,
+                              unsigned flags,
+                              const NetBatchPacket *pkts,
+                              int count,
+                              void *opaque)
+{
+    NetClientState *nc = opaque;
+    int i;
+
+    if (nc->link_down) {
+        return count;
+    }
+
+    if (nc->receive_disabled) {
+        return 0;
+    }
+
+    if (!nc->info->receive_batch || (flags & QEMU_NET_PACKET_FLAG_RAW)) {
+        for (i = 0; i < count; i++) {
+            if (qemu_deliver_packet_iov(sender, flags, pkts[i].iov,
+                                        pkts[i].iovcnt, opaque) == 0) {
+                break;
+            }
+        }
+        return i;
+    }
+
+    i = nc->info->receive_batch(nc, pkts, count);
+    if (i < count) {
+        nc->receive_disabled = 1;
+    }
+
+    return i;
+}
+
+/*
+ * Send @count packets from @sender to its peer in one go, which lets the
+ * peer amortize its per-packet work over the whole batch.
+ *
+ * Returns the number of packets that were sent (or dropped).  If it is
+ * less than @count, the packet at that index was queued, @sent_cb will
+ * be called when it is sent, and the caller must hold on to the rest.
+ * See qemu_net_queue_send_batch() for what happens without @sent_cb.
+ */
+int qemu_sendv_packet_batch(NetClientState *sender,
+                            const NetBatchPacket *pkts, int count,
+                            NetPacketSent *sent_cb)
+{
+    int i;
+
+    if (sender->link_down || !sender->peer) {
+        return count;
+    }
+
+    /* Filters look at one packet at a time */
+    if (!QTAILQ_EMPTY(&sender->filters) ||
+        !QTAILQ_EMPTY(&sender->peer->filters)) {
+        for (i = 0; i < count; i++) {
+            if (qemu_sendv_packet_async(sender, pkts[i].iov, pkts[i].iovcnt,
+                                        sent_cb) == 0 && sent_cb) {
+                return i;
+            }
+        }
+        return count;
+    }
+
+    return qemu_net_queue_send_batch(sender->peer->incoming_queue, sender,
+                                     QEMU_NET_PACKET_FLAG_NONE,
+                                     pkts, count, sent_cb);
+}
+
 ssize_t
 qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
 {
@@ -945,6 +1033,9 @@ static int (* const net_client_init_fun[NET_CLIENT_DRIVER__MAX])(
 #endif
 #ifdef CONFIG_NETMAP
         [NET_CLIENT_DRIVER_NETMAP]    = net_init_netmap,
+#endif
+#ifdef CONFIG_AF_XDP
+        [NET_CLIENT_DRIVER_AF_XDP]    = net_init_af_xdp,
 #endif
         [NET_CLIENT_DRIVER_DUMP]      = net_init_dump,
 #ifdef CONFIG_NET_BRIDGE
@@ -54,13 +54,16 @@ struct NetQueue {
     uint32_t nq_maxlen;
     uint32_t nq_count;
     NetQueueDeliverFunc *deliver;
+    NetQueueDeliverBatchFunc *deliver_batch;
 
     QTAILQ_HEAD(packets, NetPacket) packets;
 
     unsigned delivering : 1;
 };
 
-NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque)
+NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver,
+                             NetQueueDeliverBatchFunc *deliver_batch,
+                             void *opaque)
 {
     NetQueue *queue;
 
@@ -70,6 +73,7 @@ NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque)
     queue->nq_maxlen = 10000;
     queue->nq_count = 0;
     queue->deliver = deliver;
+    queue->deliver_batch = deliver_batch;
 
     QTAILQ_INIT(&queue->packets);
 
@@ -232,6 +236,46 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     return ret;
 }
 
+/*
+ * Send @count packets at once.  Returns the number of packets that were
+ * consumed.  If a packet cannot be delivered and @sent_cb is set, it is
+ * queued, the function returns its index and the packets after it are
+ * left to the caller; @sent_cb is called once the queued packet is sent.
+ * Without @sent_cb, packets that cannot be delivered are queued (or
+ * dropped if the queue is full) and the whole batch is consumed.
+ */
+int qemu_net_queue_send_batch(NetQueue *queue,
+                              NetClientState *sender,
+                              unsigned flags,
+                              const NetBatchPacket *pkts,
+                              int count,
+                              NetPacketSent *sent_cb)
+{
+    int i = 0;
+
+    if (queue->deliver_batch && !queue->delivering &&
+        qemu_can_send_packet(sender)) {
+        queue->delivering = 1;
+        i = queue->deliver_batch(sender, flags, pkts, count, queue->opaque);
+        queue->delivering = 0;
+
+        if (i == count) {
+            qemu_net_queue_flush(queue);
+            return count;
+        }
+    }
+
+    /* Queue the rest one at a time, or deliver it if the receiver is back */
+    for (; i < count; i++) {
+        if (qemu_net_queue_send_iov(queue, sender, flags, pkts[i].iov,
+                                    pkts[i].iovcnt, sent_cb) == 0 &&
+            sent_cb) {
+            return i;
+        }
+    }
+    return count;
+}
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 {
     NetPacket *packet, *next;
@@ -44,6 +44,7 @@
 #include "net/tap.h"
 
 #include "net/vhost_net.h"
+#include "block/aio.h"
 
 typedef struct TAPState {
     NetClientState nc;
@@ -59,6 +60,7 @@ typedef struct TAPState {
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
     Notifier exit;
+    AioContext *ctx; /* NULL when polled by the main loop */
 } TAPState;
 
 static void launch_script(const char *setup_script, const char *ifname,
@@ -69,10 +71,16 @@ static void tap_writable(void *opaque);
 
 static void tap_update_fd_handler(TAPState *s)
 {
-    qemu_set_fd_handler(s->fd,
-                        s->read_poll && s->enabled ? tap_send : NULL,
-                        s->write_poll && s->enabled ? tap_writable : NULL,
-                        s);
+    IOHandler *io_read = s->read_poll && s->enabled ? tap_send : NULL;
+    IOHandler *io_write = s->write_poll && s->enabled ? tap_writable : NULL;
+
+    if (s->ctx) {
+        aio_context_acquire(s->ctx);
+        aio_set_fd_handler(s->ctx, s->fd, false, io_read, io_write, s);
+        aio_context_release(s->ctx);
+    } else {
+        qemu_set_fd_handler(s->fd, io_read, io_write, s);
+    }
 }
 
 static void tap_read_poll(TAPState *s, bool enable)
@@ -131,6 +139,24 @@ static ssize_t tap_receive_iov(NetClientState *nc, const struct iovec *iov,
     return tap_write_packet(s, iovp, iovcnt);
 }
 
+/*
+ * The tap device takes exactly one packet per write, so a batch still
+ * costs one syscall per packet; what it saves is the trip through the
+ * net queue for each of them.  Stop at the first packet that would block.
+ */
+static int tap_receive_batch(NetClientState *nc, const NetBatchPacket *pkts,
+                             int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (tap_receive_iov(nc, pkts[i].iov, pkts[i].iovcnt) == 0) {
+            break;
+        }
+    }
+    return i;
+}
+
 static ssize_t tap_receive_raw(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -334,6 +360,26 @@ static void tap_poll(NetClientState *nc, bool enable)
     tap_write_poll(s, enable);
 }
 
+static void tap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+
+    if (s->ctx == ctx) {
+        return;
+    }
+
+    /* Remove the handlers from the old context before installing them */
+    if (s->ctx) {
+        aio_context_acquire(s->ctx);
+        aio_set_fd_handler(s->ctx, s->fd, false, NULL, NULL, NULL);
+        aio_context_release(s->ctx);
+    } else {
+        qemu_set_fd_handler(s->fd, NULL, NULL, NULL);
+    }
+    s->ctx = ctx;
+    tap_update_fd_handler(s);
+}
+
 int tap_get_fd(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -349,6 +395,7 @@ static NetClientInfo net_tap_info = {
     .receive = tap_receive,
     .receive_raw = tap_receive_raw,
     .receive_iov = tap_receive_iov,
+    .receive_batch = tap_receive_batch,
     .poll = tap_poll,
     .cleanup = tap_cleanup,
     .has_ufo = tap_has_ufo,
@@ -359,6 +406,7 @@ static NetClientInfo net_tap_info = {
     .set_vnet_hdr_len = tap_set_vnet_hdr_len,
     .set_vnet_le = tap_set_vnet_le,
     .set_vnet_be = tap_set_vnet_be,
+    .set_aio_context = tap_set_aio_context,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
@@ -25,6 +25,7 @@
 #include "qemu/osdep.h"
 #include "sysemu/numa.h"
 #include "exec/cpu-common.h"
+#include "exec/ramlist.h"
 #include "qemu/bitmap.h"
 #include "qom/cpu.h"
 #include "qemu/error-report.h"
@@ -550,3 +551,47 @@ MemdevList *qmp_query_memdev(Error **errp)
     object_child_foreach(obj, query_memdev, &list);
     return list;
 }
+
+static QLIST_HEAD(, RAMBlockNotifier) ram_block_notifiers =
+    QLIST_HEAD_INITIALIZER(ram_block_notifiers);
+
+static int ram_block_notify_add_single(const char *block_name, void *host,
+                                       ram_addr_t offset, ram_addr_t length,
+                                       void *opaque)
+{
+    RAMBlockNotifier *notifier = opaque;
+
+    if (host) {
+        notifier->ram_block_added(notifier, host, length);
+    }
+    return 0;
+}
+
+void ram_block_notifier_add(RAMBlockNotifier *n)
+{
+    QLIST_INSERT_HEAD(&ram_block_notifiers, n, next);
+    qemu_ram_foreach_block(ram_block_notify_add_single, n);
+}
+
+void ram_block_notifier_remove(RAMBlockNotifier *n)
+{
+    QLIST_REMOVE(n, next);
+}
+
+void ram_block_notify_add(void *host, size_t size)
+{
+    RAMBlockNotifier *notifier;
+
+    QLIST_FOREACH(notifier, &ram_block_notifiers, next) {
+        notifier->ram_block_added(notifier, host, size);
+    }
+}
+
+void ram_block_notify_remove(void *host, size_t size)
+{
+    RAMBlockNotifier *notifier;
+
+    QLIST_FOREACH(notifier, &ram_block_notifiers, next) {
+        notifier->ram_block_removed(notifier, host, size);
+    }
+}
@@ -1,6 +1,7 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is a set-associative cache indexed by a hash of the page
+ * address, with least recently used replacement inside each set
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -16,6 +17,8 @@
 
 #include "qemu-common.h"
 #include "qemu/host-utils.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
 #include "migration/page_cache.h"
 
 #ifdef DEBUG_CACHE
@@ -29,25 +32,43 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/* number of pages sharing a set, must be a power of 2 */
+#define CACHE_WAYS 8
+
+#define CACHE_ADDR_INVALID ((uint64_t)-1)
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
+    /* bitmap generation of the last use */
     uint64_t it_age;
+    /* global access order of the last use, breaks ties within a generation */
+    unsigned long it_stamp;
     uint8_t *it_data;
 };
 
+/*
+ * Items of set i are page_cache[i * ways ... (i + 1) * ways - 1] and are
+ * protected by set_lock[i], so threads working on pages of different sets
+ * never contend.  Only cache_resize() needs the whole cache to itself.
+ */
 struct PageCache {
     CacheItem *page_cache;
-    unsigned int page_size;
+    QemuSpin *set_lock;
+    size_t page_size;
+    unsigned int ways;
+    unsigned int set_bits;
+    int64_t num_sets;
     int64_t max_num_items;
-    uint64_t max_item_age;
-    int64_t num_items;
+    long num_items;
+    unsigned long stamp;
 };
 
-PageCache *cache_init(int64_t num_pages, unsigned int page_size)
+PageCache *cache_init(int64_t new_size, size_t page_size)
 {
     int64_t i;
+    int64_t num_pages = new_size / page_size;
 
     PageCache *cache;
 
@@ -57,7 +78,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     }
 
     /* We prefer not to abort if there is no memory */
-    cache = g_try_malloc(sizeof(*cache));
+    cache = g_try_malloc0(sizeof(*cache));
     if (!cache) {
         DPRINTF("Failed to allocate cache\n");
         return NULL;
@@ -69,16 +90,24 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     }
     cache->page_size = page_size;
     cache->num_items = 0;
-    cache->max_item_age = 0;
+    cache->stamp = 0;
+    cache->ways = MIN(CACHE_WAYS, num_pages);
+    cache->num_sets = num_pages / cache->ways;
+    cache->set_bits = ctz64(cache->num_sets);
     cache->max_num_items = num_pages;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache sets to %" PRId64 " of %u pages\n",
+            cache->num_sets, cache->ways);
 
     /* We prefer not to abort if there is no memory */
     cache->page_cache = g_try_malloc((cache->max_num_items) *
                                      sizeof(*cache->page_cache));
-    if (!cache->page_cache) {
+    cache->set_lock = g_try_malloc(cache->num_sets *
+                                   sizeof(*cache->set_lock));
+    if (!cache->page_cache || !cache->set_lock) {
         DPRINTF("Failed to allocate cache->page_cache\n");
+        g_free(cache->page_cache);
+        g_free(cache->set_lock);
         g_free(cache);
         return NULL;
     }
@@ -86,7 +115,11 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     for (i = 0; i < cache->max_num_items; i++) {
         cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
-        cache->page_cache[i].it_addr = -1;
+        cache->page_cache[i].it_stamp = 0;
+        cache->page_cache[i].it_addr = CACHE_ADDR_INVALID;
+    }
+    for (i = 0; i < cache->num_sets; i++) {
+        qemu_spin_init(&cache->set_lock[i]);
     }
 
     return cache;
@@ -104,82 +137,152 @@ void cache_fini(PageCache *cache)
     }
 
     g_free(cache->page_cache);
+    g_free(cache->set_lock);
     cache->page_cache = NULL;
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+static int64_t cache_get_set(const PageCache *cache, uint64_t addr)
 {
-    g_assert(cache->max_num_items);
-    return (address / cache->page_size) & (cache->max_num_items - 1);
+    uint64_t page = addr / cache->page_size;
+
+    g_assert(cache->num_sets);
+    if (!cache->set_bits) {
+        return 0;
+    }
+    /* Fibonacci hashing, so that strided access patterns spread out */
+    return (page * 0x9e3779b97f4a7c15ULL) >> (64 - cache->set_bits);
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+static CacheItem *cache_set_items(const PageCache *cache, int64_t set)
 {
-    size_t pos;
-
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    return &cache->page_cache[set * cache->ways];
+}
 
-    pos = cache_get_cache_pos(cache, addr);
+/* Called with the set lock held */
+static CacheItem *cache_find_item(const PageCache *cache, int64_t set,
+                                  uint64_t addr)
+{
+    CacheItem *items = cache_set_items(cache, set);
+    unsigned int i;
 
-    return &cache->page_cache[pos];
+    for (i = 0; i < cache->ways; i++) {
+        if (items[i].it_addr == addr) {
+            return &items[i];
+        }
+    }
+    return NULL;
 }
 
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
+/* Called with the set lock held */
+static void cache_touch_item(PageCache *cache, CacheItem *it,
+                             uint64_t current_age)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    it->it_age = current_age;
+    it->it_stamp = atomic_fetch_inc(&cache->stamp);
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr,
+bool cache_is_cached(PageCache *cache, uint64_t addr,
                      uint64_t current_age)
 {
+    int64_t set = cache_get_set(cache, addr);
     CacheItem *it;
 
-    it = cache_get_by_addr(cache, addr);
-
-    if (it->it_addr == addr) {
+    qemu_spin_lock(&cache->set_lock[set]);
+    it = cache_find_item(cache, set, addr);
+    if (it) {
         /* update the it_age when the cache hit */
-        it->it_age = current_age;
-        return true;
+        cache_touch_item(cache, it, current_age);
     }
-    return false;
+    qemu_spin_unlock(&cache->set_lock[set]);
+
+    return it != NULL;
 }
 
-int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
-                 uint64_t current_age)
+bool cache_get_data(PageCache *cache, uint64_t addr, uint8_t *buf,
+                    uint64_t current_age)
 {
-
+    int64_t set = cache_get_set(cache, addr);
     CacheItem *it;
 
-    /* actual update of entry */
-    it = cache_get_by_addr(cache, addr);
+    qemu_spin_lock(&cache->set_lock[set]);
+    it = cache_find_item(cache, set, addr);
+    if (it) {
+        memcpy(buf, it->it_data, cache->page_size);
+        cache_touch_item(cache, it, current_age);
+    }
+    qemu_spin_unlock(&cache->set_lock[set]);
 
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
+    return it != NULL;
+}
+
+/* Called with the set lock held: pick a free item or the LRU one */
+static CacheItem *cache_get_victim(const PageCache *cache, int64_t set)
+{
+    CacheItem *items = cache_set_items(cache, set);
+    CacheItem *victim = &items[0];
+    unsigned int i;
+
+    for (i = 0; i < cache->ways; i++) {
+        if (items[i].it_addr == CACHE_ADDR_INVALID) {
+            return &items[i];
+        }
+        if (items[i].it_age < victim->it_age ||
+            (items[i].it_age == victim->it_age &&
+             items[i].it_stamp < victim->it_stamp)) {
+            victim = &items[i];
+        }
+    }
+    return victim;
+}
+
+int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
+                 uint64_t current_age)
+{
+    int64_t set = cache_get_set(cache, addr);
+    CacheItem *it;
+    int ret = 0;
+
+    qemu_spin_lock(&cache->set_lock[set]);
+
+    it = cache_find_item(cache, set, addr);
+    if (!it) {
+        it = cache_get_victim(cache, set);
+        if (it->it_addr != CACHE_ADDR_INVALID &&
+            it->it_age + CACHED_PAGE_LIFETIME > current_age) {
+            /* even the oldest page of the set is fresh, don't replace it */
+            ret = -1;
+            goto out;
+        }
     }
-    /* allocate page */
+
+    /* allocate page.  This happens on the first insert into the item, from
+     * the thread doing it, so with the host's default first-touch policy
+     * the data ends up on the NUMA node of the migration thread that uses
+     * it.  There is no explicit binding: QEMU does not know which host
+     * nodes the migration threads will run on.
+     */
     if (!it->it_data) {
         it->it_data = g_try_malloc(cache->page_size);
         if (!it->it_data) {
             DPRINTF("Error allocating page\n");
-            return -1;
+            ret = -1;
+            goto out;
         }
-        cache->num_items++;
+        atomic_inc(&cache->num_items);
     }
 
     memcpy(it->it_data, pdata, cache->page_size);
 
-    it->it_age = current_age;
+    cache_touch_item(cache, it, current_age);
     it->it_addr = addr;
 
-    return 0;
+out:
+    qemu_spin_unlock(&cache->set_lock[set]);
+    return ret;
 }
 
-int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
+int64_t cache_resize(PageCache *cache, int64_t new_size)
 {
     PageCache *new_cache;
     int64_t i;
@@ -194,11 +297,11 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
     }
 
     /* same size */
-    if (pow2floor(new_num_pages) == cache->max_num_items) {
-        return cache->max_num_items;
+    if (pow2floor(new_size / cache->page_size) == cache->max_num_items) {
+        return cache->max_num_items * cache->page_size;
     }
 
-    new_cache = cache_init(new_num_pages, cache->page_size);
+    new_cache = cache_init(new_size, cache->page_size);
     if (!(new_cache)) {
         DPRINTF("Error creating new cache\n");
         return -1;
@@ -207,30 +310,33 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
     /* move all data from old cache */
     for (i = 0; i < cache->max_num_items; i++) {
         old_it = &cache->page_cache[i];
-        if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data && new_it->it_age >= old_it->it_age) {
-                /* keep the MRU page */
-                g_free(old_it->it_data);
-            } else {
-                if (!new_it->it_data) {
-                    new_cache->num_items++;
-                }
-                g_free(new_it->it_data);
-                new_it->it_data = old_it->it_data;
-                new_it->it_age = old_it->it_age;
-                new_it->it_addr = old_it->it_addr;
-            }
+        if (old_it->it_addr == CACHE_ADDR_INVALID) {
+            g_free(old_it->it_data);
+            continue;
+        }
+        new_it = cache_get_victim(new_cache,
+                                  cache_get_set(new_cache, old_it->it_addr));
+        if (new_it->it_addr != CACHE_ADDR_INVALID &&
+            (new_it->it_age > old_it->it_age ||
+             (new_it->it_age == old_it->it_age &&
+              new_it->it_stamp >= old_it->it_stamp))) {
+            /* the set is full of more recently used pages */
+            g_free(old_it->it_data);
+            continue;
+        }
+        if (!new_it->it_data) {
+            new_cache->num_items++;
         }
+        g_free(new_it->it_data);
+        *new_it = *old_it;
     }
+    new_cache->stamp = cache->stamp;
 
     g_free(cache->page_cache);
-    cache->page_cache = new_cache->page_cache;
-    cache->max_num_items = new_cache->max_num_items;
-    cache->num_items = new_cache->num_items;
+    g_free(cache->set_lock);
+    *cache = *new_cache;
 
     g_free(new_cache);
 
-    return cache->max_num_items;
+    return cache->max_num_items * cache->page_size;
 }
@@ -36,6 +36,7 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                kernel_irqchip=on|off|split controls accelerated irqchip support (default=off)\n"
     "                vmport=on|off|auto controls emulation of vmport (default: auto)\n"
     "                kvm_shadow_mem=size of KVM shadow MMU in bytes\n"
+    "                kvm-dirty-ring-size=n entries in each KVM per-vCPU dirty ring (default=0, use dirty bitmap)\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
     "                mem-merge=on|off controls memory merge support (default: on)\n"
     "                igd-passthru=on|off controls IGD GFX passthrough support (default=off)\n"
@@ -66,6 +67,12 @@ value based on accel. For accel=xen the default is off otherwise the default
 is on.
 @item kvm_shadow_mem=size
 Defines the size of the KVM shadow MMU.
+@item kvm-dirty-ring-size=@var{n}
+Track guest memory writes with per-vCPU KVM dirty rings of @var{n} entries
+instead of the per-slot dirty bitmap. Dirty page synchronization then costs
+time proportional to the number of pages written rather than to guest size.
+@var{n} must be a power of 2 between 1024 and 65536. If the host kernel lacks
+support, a warning is printed and the dirty bitmap is used. The default is 0.
 @item dump-guest-core=on|off
 Include guest memory in a core dump. The default is on.
 @item mem-merge=on|off
@@ -1673,6 +1680,18 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                attach to the existing netmap-enabled network interface 'name', or to a\n"
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
+#endif
+#ifdef CONFIG_AF_XDP
+    "-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off]\n"
+    "         [,queues=n][,start-queue=m][,inhibit=on|off][,sock-fds=x:y:...:z]\n"
+    "         [,busy-poll=usecs]\n"
+    "                attach to the host network interface 'name' with AF_XDP\n"
+    "                sockets, using 'n' queue pairs starting from queue 'm'\n"
+    "                use 'mode' to pick how the XDP program is attached\n"
+    "                use 'force-copy=on' to disable zero-copy mode\n"
+    "                use 'inhibit=on' and 'sock-fds' to use sockets and an XDP\n"
+    "                program prepared by a privileged process\n"
+    "                use 'busy-poll' to busy poll the device queues\n"
 #endif
     "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
     "                configure a vhost-user network, backed by a chardev 'dev'\n"
@@ -2125,6 +2144,44 @@ qemu -m 512 -object memory-backend-file,id=mem,size=512M,mem-path=/hugetlbfs,sha
      -device virtio-net-pci,netdev=net0
 @end example
 
+@item -netdev af-xdp,id=@var{id},ifname=@var{name}[,mode=native|skb][,force-copy=on|off][,queues=@var{n}][,start-queue=@var{m}][,inhibit=on|off][,sock-fds=@var{x}:@var{y}:...:@var{z}][,busy-poll=@var{usecs}]
+
+Connect the netdev to the host network interface @var{name} through AF_XDP
+sockets.  Packets are exchanged with the kernel through rings that share a
+memory area (UMEM) with it, bypassing the rest of the host network stack.
+
+@option{mode} selects whether the XDP program runs in the network driver
+(@code{native}) or in the generic network stack (@code{skb}); by default
+native mode is tried first.  @option{force-copy=on} disables zero-copy even
+if the driver supports it.
+
+@option{queues} opens @var{n} queue pairs, starting from host queue
+@var{m} (@option{start-queue}, 0 by default).  A multiqueue virtio-net device
+attached to the netdev uses one of them for each of its queue pairs.  Make
+sure that the host interface has the corresponding number of channels and
+that the traffic is steered to them, e.g. with @code{ethtool -L} and
+@code{ethtool -N}.
+
+Loading an XDP program and creating AF_XDP sockets requires privileges.
+A management application can do that on behalf of QEMU and pass the socket
+file descriptors with @option{sock-fds}, one for each queue, together with
+@option{inhibit=on}, which tells QEMU not to load an XDP program itself.
+
+@option{busy-poll} makes the kernel busy poll the device queue for up to
+@var{usecs} microseconds when QEMU polls the socket, instead of waiting for
+an interrupt.  It is 0, i.e. disabled, by default.  When the netdev is used
+by a virtio-net device running in an IOThread, the rings are also polled in
+userspace according to the polling parameters of the IOThread.
+
+Example, using a veth pair to test on a single host:
+@example
+ip link add veth0 type veth peer name veth1
+ip link set veth0 up
+ip link set veth1 up
+qemu-system-x86_64 -netdev af-xdp,id=net0,ifname=veth0,mode=native \
+                   -device virtio-net-pci,netdev=net0
+@end example
+
 @item -net dump[,vlan=@var{n}][,file=@var{file}][,len=@var{len}]
 Dump network traffic on VLAN @var{n} to file @var{file} (@file{qemu-vlan0.pcap} by default).
 At most @var{len} bytes (64k by default) per packet are stored. The file format is
@@ -3522,6 +3579,8 @@ DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming exec:cmdline\n" \
     "                accept incoming migration on given file descriptor\n" \
     "                or from given external command\n" \
+    "-incoming file:filename\n" \
+    "                load the state saved by migrating to a file\n" \
     "-incoming defer\n" \
     "                wait for the URI to be specified via migrate_incoming\n",
     QEMU_ARCH_ALL)
@@ -3540,6 +3599,9 @@ Accept incoming migration from a given filedescriptor.
 @item -incoming exec:@var{cmdline}
 Accept incoming migration as an output from specified external command.
 
+@item -incoming file:@var{filename}
+Load the state saved by a migration to the file @var{filename}.
+
 @item -incoming defer
 Wait for the URI to be specified via migrate_incoming.  The monitor can
 be used to change settings (such as migration parameters) prior to issuing
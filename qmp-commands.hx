@@ -639,7 +639,7 @@ EQMP
 
     {
         .name       = "migrate",
-        .args_type  = "detach:-d,blk:-b,inc:-i,uri:s",
+        .args_type  = "detach:-d,blk:-b,inc:-i,resume:-r,uri:s",
         .mhandler.cmd_new = qmp_marshal_migrate,
     },
 
@@ -653,6 +653,7 @@ Arguments:
 
 - "blk": block migration, full disk copy (json-bool, optional)
 - "inc": incremental disk copy (json-bool, optional)
+- "resume": resume a paused postcopy migration (json-bool, optional)
 - "uri": Destination URI (json-string)
 
 Example:
@@ -719,6 +720,53 @@ Notes:
 (2) The uri format is the same as for -incoming
 
 EQMP
+
+    {
+        .name       = "migrate-recover",
+        .args_type  = "uri:s",
+        .mhandler.cmd_new = qmp_marshal_migrate_recover,
+    },
+
+SQMP
+migrate-recover
+---------------
+
+Listen for a new channel for a paused postcopy migration; this is
+issued on the destination before resuming the migration on the source.
+
+Arguments:
+
+- "uri": Source/listening URI (json-string)
+
+Example:
+
+-> { "execute": "migrate-recover", "arguments": { "uri": "tcp::4447" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "migrate-pause",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_migrate_pause,
+    },
+
+SQMP
+migrate-pause
+-------------
+
+Shut down the channel of a postcopy migration, moving it to the
+postcopy-paused state.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "migrate-pause" }
+<- { "return": {} }
+
+EQMP
+
     {
         .name       = "migrate-set-cache-size",
         .args_type  = "value:o",
@@ -1217,7 +1265,8 @@ EQMP
     {
         .name       = "drive-backup",
         .args_type  = "job-id:s?,sync:s,device:B,target:s,speed:i?,mode:s?,"
-                      "format:s?,bitmap:s?,on-source-error:s?,on-target-error:s?",
+                      "format:s?,bitmap:s?,on-source-error:s?,on-target-error:s?,"
+                      "max-workers:i?",
         .mhandler.cmd_new = qmp_marshal_drive_backup,
     },
 
@@ -1261,6 +1310,8 @@ Arguments:
                      'report' (no limitations, since this applies to
                      a different block device than device).
                      (BlockdevOnError, optional)
+- "max-workers": maximum number of clusters copied in parallel by the
+                 background copy, default 1 (json-int, optional)
 
 Example:
 -> { "execute": "drive-backup", "arguments": { "device": "drive0",
@@ -1273,7 +1324,7 @@ EQMP
     {
         .name       = "blockdev-backup",
         .args_type  = "job-id:s?,sync:s,device:B,target:B,speed:i?,"
-                      "on-source-error:s?,on-target-error:s?",
+                      "on-source-error:s?,on-target-error:s?,max-workers:i?",
         .mhandler.cmd_new = qmp_marshal_blockdev_backup,
     },
 
@@ -1304,6 +1355,8 @@ Arguments:
                      'report' (no limitations, since this applies to
                      a different block device than device).
                      (BlockdevOnError, optional)
+- "max-workers": maximum number of clusters copied in parallel by the
+                 background copy, default 1 (json-int, optional)
 
 Example:
 -> { "execute": "blockdev-backup", "arguments": { "device": "src-id",
@@ -2125,6 +2178,41 @@ Example:
                                                "iops_size": 0 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block-set-group-io-throttle",
+        .args_type  = "group:s,limits:q",
+        .mhandler.cmd_new = qmp_marshal_block_set_group_io_throttle,
+    },
+
+SQMP
+block-set-group-io-throttle
+---------------------------
+
+Change the I/O throttle limits of a throttle group. This also works for
+the parents of nested groups, which do not have devices of their own.
+
+Arguments:
+
+- "group": throttle group name (json-string)
+- "limits": the new I/O limits, with the same members and meaning as the
+            limits of block_set_io_throttle (json-object)
+
+Example:
+
+-> { "execute": "block-set-group-io-throttle",
+     "arguments": { "group": "tenant1",
+                    "limits": { "bps": 100000000,
+                                "bps_rd": 0,
+                                "bps_wr": 0,
+                                "iops": 0,
+                                "iops_rd": 0,
+                                "iops_wr": 0,
+                                "bps_max": 400000000,
+                                "bps_max_length": 300 } } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -2941,6 +3029,9 @@ Return a json-array. Each iothread is represented by a json-object, which contai
 
 - "id": name of iothread (json-str)
 - "thread-id": ID of the underlying host thread (json-int)
+- "poll-max-ns": maximum polling time in ns, 0 if disabled (json-int)
+- "poll-grow": polling time growth factor (json-int)
+- "poll-shrink": polling time shrink factor (json-int)
 
 Example:
 
@@ -2949,11 +3040,17 @@ Example:
       "return":[
          {
             "id":"iothread0",
-            "thread-id":3134
+            "thread-id":3134,
+            "poll-max-ns":32768,
+            "poll-grow":0,
+            "poll-shrink":0
          },
          {
             "id":"iothread1",
-            "thread-id":3135
+            "thread-id":3135,
+            "poll-max-ns":0,
+            "poll-grow":0,
+            "poll-shrink":0
          }
       ]
    }
@@ -3560,6 +3657,10 @@ The main json-object contains the following:
 - "expected-downtime": only present while migration is active
                 total amount in ms for downtime that was calculated on
                 the last bitmap round (json-int)
+- "expected-converge-time": only present while precopy migration is
+                active and expected to converge; time in ms until the
+                remaining RAM can be sent within the downtime limit
+                (json-int)
 - "ram": only present if "status" is "active", it is a json-object with the
   following RAM information:
          - "transferred": amount transferred in bytes (json-int)
@@ -3576,6 +3677,14 @@ The main json-object contains the following:
             but this way upper levels don't need to care about page
             size (json-int)
          - "dirty-sync-count": times that dirty ram was synchronized (json-int)
+         - "dirty-sync-time": microseconds taken by the last dirty ram
+            synchronization (json-int)
+         - "dirty-sync-total-time": microseconds taken by all dirty ram
+            synchronizations (json-int)
+         - "dirty-sync-pages": pages newly found dirty by the last dirty
+            ram synchronization (json-int)
+         - "blocks": dirty page rate of each RAM block (json-array of
+            json-objects with "name", "size" and "dirty-pages-rate")
 - "disk": only present if "status" is "active" and it is a block migration,
   it is a json-object with the following disk information:
          - "transferred": amount transferred in bytes (json-int)
@@ -3592,6 +3701,17 @@ The main json-object contains the following:
            that the XBZRLE encoding was bigger than just sent the
            whole page, and then we sent the whole page instead (as as
            normal page).
+         - "blocks": optional list of per RAM block cache statistics,
+           each a json-object with "name" (json-string), "hits" and
+           "misses" (json-int) and "hit-rate" (json-number)
+- "postcopy-faults": only present on the destination of a postcopy migration.
+  It is a json-object with the following page fault information:
+         - "faults": number of host pages faulted on by the guest (json-int)
+         - "requests": number of page requests sent to the source (json-int)
+         - "latency-avg": average fault latency in microseconds (json-int)
+         - "latency-max": maximum fault latency in microseconds (json-int)
+         - "latency-histogram": number of faults by latency, in buckets
+           doubling from 64 microseconds (json-array of json-int)
 
 Examples:
 
@@ -3710,6 +3830,64 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_query_migrate,
     },
 
+SQMP
+calc-dirty-rate
+---------------
+
+Start measuring the rate at which the guest dirties its memory, without
+migrating it.  Not possible while a migration is in progress.
+
+Arguments:
+
+- "calc-time": time in seconds to measure for, 1 to 60 (json-int)
+
+Example:
+
+-> { "execute": "calc-dirty-rate", "arguments": { "calc-time": 1 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "calc-dirty-rate",
+        .args_type  = "calc-time:i",
+        .mhandler.cmd_new = qmp_marshal_calc_dirty_rate,
+    },
+
+SQMP
+query-dirty-rate
+----------------
+
+Return the state and result of the last calc-dirty-rate.
+
+- "status": "unstarted", "measuring" or "measured" (json-string)
+- "start-time": start of the measurement in seconds since the epoch (json-int)
+- "calc-time": duration of the measurement in seconds (json-int)
+- "dirty-rate": dirtied memory in MiB per second (json-int, optional)
+- "blocks": dirty page rate of each RAM block (json-array, optional)
+- "expected-converge-time": time in ms a precopy migration using all of
+  max-bandwidth would take to converge, if it does (json-int, optional)
+
+Example:
+
+-> { "execute": "query-dirty-rate" }
+<- { "return": {
+        "status": "measured", "start-time": 1476801234, "calc-time": 1,
+        "dirty-rate": 108,
+        "blocks": [
+          { "name": "pc.ram", "size": 1073741824,
+            "dirty-pages-rate": 27648 },
+          { "name": "vga.vram", "size": 16777216,
+            "dirty-pages-rate": 0 } ] } }
+
+EQMP
+
+    {
+        .name       = "query-dirty-rate",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_dirty_rate,
+    },
+
 SQMP
 migrate-set-capabilities
 ------------------------
@@ -3723,6 +3901,10 @@ Enable/Disable migration capabilities
 - "compress": use multiple compression threads to accelerate live migration
 - "events": generate events for each migration state change
 - "postcopy-ram": postcopy mode for live migration
+- "x-multifd": send RAM over multiple parallel connections
+- "x-zero-copy": send multifd RAM pages without copying them (MSG_ZEROCOPY)
+- "background-snapshot": save a snapshot of the VM while it keeps running
+- "mapped-ram": save RAM pages at fixed offsets of a seekable file
 
 Arguments:
 
@@ -3753,6 +3935,10 @@ Query current migration capabilities
          - "compress": Multiple compression threads state (json-bool)
          - "events": Migration state change event state (json-bool)
          - "postcopy-ram": postcopy ram state (json-bool)
+         - "x-multifd": multiple RAM channels state (json-bool)
+         - "x-zero-copy": zero copy multifd send state (json-bool)
+         - "background-snapshot": background snapshot state (json-bool)
+         - "mapped-ram": mapped RAM file format state (json-bool)
 
 Arguments:
 
@@ -3766,7 +3952,11 @@ Example:
      {"state": false, "capability": "zero-blocks"},
      {"state": false, "capability": "compress"},
      {"state": true, "capability": "events"},
-     {"state": false, "capability": "postcopy-ram"}
+     {"state": false, "capability": "postcopy-ram"},
+     {"state": false, "capability": "x-multifd"},
+     {"state": false, "capability": "x-zero-copy"},
+     {"state": false, "capability": "background-snapshot"},
+     {"state": false, "capability": "mapped-ram"}
    ]}
 
 EQMP
@@ -3790,6 +3980,12 @@ Set migration parameters
                           throttled for auto-converge (json-int)
 - "cpu-throttle-increment": set throttle increasing percentage for
                             auto-converge (json-int)
+- "x-multifd-channels": set number of additional RAM channels (json-int)
+- "x-multifd-page-count": set number of pages per multifd packet (json-int)
+- "compress-method": set compression codec, one of "zlib", "zstd" or "lz4"
+                     (json-string)
+- "postcopy-prefetch-pages": set number of pages sent after a page requested
+                             by the postcopy destination (json-int)
 
 Arguments:
 
@@ -3803,7 +3999,7 @@ EQMP
     {
         .name       = "migrate-set-parameters",
         .args_type  =
-            "compress-level:i?,compress-threads:i?,decompress-threads:i?,cpu-throttle-initial:i?,cpu-throttle-increment:i?",
+            "compress-level:i?,compress-threads:i?,decompress-threads:i?,cpu-throttle-initial:i?,cpu-throttle-increment:i?,x-multifd-channels:i?,x-multifd-page-count:i?,compress-method:s?,postcopy-prefetch-pages:i?",
         .mhandler.cmd_new = qmp_marshal_migrate_set_parameters,
     },
 SQMP
@@ -3820,6 +4016,14 @@ Query current migration parameters
                                     throttled (json-int)
          - "cpu-throttle-increment" : throttle increasing percentage for
                                       auto-converge (json-int)
+         - "x-multifd-channels" : number of additional RAM channels
+                                  (json-int)
+         - "x-multifd-page-count" : number of pages per multifd packet
+                                    (json-int)
+         - "compress-method" : compression codec (json-string)
+         - "postcopy-prefetch-pages" : number of pages sent after a page
+                                       requested by the postcopy destination
+                                       (json-int)
 
 Arguments:
 
@@ -3832,7 +4036,11 @@ Example:
          "cpu-throttle-increment": 10,
          "compress-threads": 8,
          "compress-level": 1,
-         "cpu-throttle-initial": 20
+         "cpu-throttle-initial": 20,
+         "x-multifd-channels": 2,
+         "x-multifd-page-count": 16,
+         "compress-method": "zlib",
+         "postcopy-prefetch-pages": 64
       }
    }
 
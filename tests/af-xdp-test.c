@@ -0,0 +1,119 @@
+/*
+ * QTest testcase for the AF_XDP network backend, on a veth pair
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+
+static char *ifname, *peer_ifname;
+
+static int run(const char *fmt, ...)
+{
+    va_list ap;
+    char *cmd;
+    int ret;
+
+    va_start(ap, fmt);
+    cmd = g_strdup_vprintf(fmt, ap);
+    va_end(ap);
+    ret = system(cmd);
+    g_free(cmd);
+    return ret;
+}
+
+static bool xdp_prog_attached(void)
+{
+    char *cmd = g_strdup_printf("ip link show dev %s", ifname);
+    char buf[1024];
+    bool attached = false;
+    FILE *f;
+
+    f = popen(cmd, "r");
+    g_assert(f);
+    while (fgets(buf, sizeof(buf), f)) {
+        if (strstr(buf, "prog/xdp")) {
+            attached = true;
+        }
+    }
+    pclose(f);
+    g_free(cmd);
+    return attached;
+}
+
+static QDict *netdev_add(int queues)
+{
+    return qmp("{ 'execute': 'netdev_add',"
+               "  'arguments': { 'type': 'af-xdp', 'id': 'xdp0',"
+               "                 'ifname': %s, 'queues': %d } }",
+               ifname, queues);
+}
+
+static void test_add_del(void)
+{
+    QDict *response;
+
+    response = netdev_add(1);
+    g_assert(response);
+    g_assert(!qdict_haskey(response, "error"));
+    QDECREF(response);
+    g_assert(xdp_prog_attached());
+
+    response = qmp("{ 'execute': 'netdev_del',"
+                   "  'arguments': { 'id': 'xdp0' } }");
+    g_assert(response);
+    g_assert(!qdict_haskey(response, "error"));
+    QDECREF(response);
+    g_assert(!xdp_prog_attached());
+}
+
+/* The veth has a single queue, so the second socket cannot be bound */
+static void test_queue_failure(void)
+{
+    QDict *response;
+
+    response = netdev_add(2);
+    g_assert(response);
+    g_assert(qdict_haskey(response, "error"));
+    QDECREF(response);
+    g_assert(!xdp_prog_attached());
+
+    /* Nothing was left behind that would prevent a working setup */
+    test_add_del();
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    if (getuid() != 0) {
+        g_test_message("Skipping test, it requires root");
+        return 0;
+    }
+
+    ifname = g_strdup_printf("qxdp%d", getpid() % 100000);
+    peer_ifname = g_strdup_printf("%sp", ifname);
+    if (run("ip link add %s numrxqueues 1 numtxqueues 1 type veth "
+            "peer name %s >/dev/null 2>&1", ifname, peer_ifname)) {
+        g_test_message("Skipping test, could not create a veth pair");
+        return 0;
+    }
+    run("ip link set dev %s up", ifname);
+    run("ip link set dev %s up", peer_ifname);
+
+    qtest_add_func("/af-xdp/add-del", test_add_del);
+    qtest_add_func("/af-xdp/queue-failure", test_queue_failure);
+
+    qtest_start("-machine none -nodefaults");
+    ret = g_test_run();
+    qtest_end();
+
+    run("ip link del %s", ifname);
+    g_free(peer_ifname);
+    g_free(ifname);
+    return ret;
+}
@@ -375,6 +375,119 @@ static void test_flush_event_notifier(void)
     event_notifier_cleanup(&data.e);
 }
 
+static bool event_poll_cb(void *opaque)
+{
+    EventNotifierTestData *data = container_of(opaque, EventNotifierTestData,
+                                               e);
+    if (data->active == 0) {
+        return false;
+    }
+    data->n++;
+    data->active--;
+    return true;
+}
+
+static void test_poll_event_notifier(void)
+{
+    EventNotifierTestData data = { .n = 0, .active = 0 };
+    BHTestData bh_data = { .n = 0 };
+
+    event_notifier_init(&data.e, false);
+    set_event_notifier(ctx, &data.e, dummy_notifier_read);
+    aio_set_event_notifier_poll(ctx, &data.e, event_poll_cb);
+    aio_context_set_poll_params(ctx, 1000000, 0, 0, &error_abort);
+    g_assert_cmpint(ctx->poll_ns, ==, 0);
+
+    /* An event that did not arrive while polling grows the polling time */
+    bh_data.bh = aio_bh_new(ctx, bh_test_cb, &bh_data);
+    qemu_bh_schedule(bh_data.bh);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(bh_data.n, ==, 1);
+    g_assert_cmpint(ctx->poll_ns, >, 0);
+    qemu_bh_delete(bh_data.bh);
+
+    /* Work found by the poll handler is processed without blocking, and
+     * without the file descriptor ever becoming readable.
+     */
+    data.active = 1;
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(data.active, ==, 0);
+    g_assert(!aio_poll(ctx, false));
+
+    aio_context_set_poll_params(ctx, 0, 0, 0, &error_abort);
+    set_event_notifier(ctx, &data.e, NULL);
+    g_assert(!aio_poll(ctx, false));
+    event_notifier_cleanup(&data.e);
+}
+
+static int poll_begin_n, poll_end_n;
+static bool queue_in_poll_end;
+
+static void event_poll_begin_cb(EventNotifier *e)
+{
+    poll_begin_n++;
+}
+
+static void event_poll_end_cb(EventNotifier *e)
+{
+    EventNotifierTestData *data = container_of(e, EventNotifierTestData, e);
+
+    poll_end_n++;
+    /* Pretend that work was queued while notifications were disabled */
+    if (queue_in_poll_end) {
+        queue_in_poll_end = false;
+        data->active = 1;
+    }
+}
+
+static void test_poll_begin_end(void)
+{
+    EventNotifierTestData data = { .n = 0, .active = 0 };
+    BHTestData bh_data = { .n = 0 };
+
+    event_notifier_init(&data.e, false);
+    set_event_notifier(ctx, &data.e, dummy_notifier_read);
+    aio_set_event_notifier_poll(ctx, &data.e, event_poll_cb);
+    aio_set_event_notifier_poll_begin_end(ctx, &data.e, event_poll_begin_cb,
+                                          event_poll_end_cb);
+    aio_context_set_poll_params(ctx, 1000000, 0, 0, &error_abort);
+
+    bh_data.bh = aio_bh_new(ctx, bh_test_cb, &bh_data);
+    qemu_bh_schedule(bh_data.bh);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(ctx->poll_ns, >, 0);
+    qemu_bh_delete(bh_data.bh);
+    poll_begin_n = poll_end_n = 0;
+
+    /* Polling stays started as long as it makes progress */
+    data.active = 1;
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(poll_begin_n, ==, 1);
+    g_assert_cmpint(poll_end_n, ==, 0);
+
+    /* ... and ends before blocking, with one last look for work */
+    queue_in_poll_end = true;
+    g_assert(aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 2);
+    g_assert_cmpint(poll_begin_n, ==, 1);
+    g_assert_cmpint(poll_end_n, ==, 1);
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(poll_end_n, ==, 1);
+
+    /* Removing the handler while polling ends it */
+    data.active = 1;
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(poll_begin_n, ==, 2);
+    set_event_notifier(ctx, &data.e, NULL);
+    g_assert_cmpint(poll_end_n, ==, 2);
+
+    aio_context_set_poll_params(ctx, 0, 0, 0, &error_abort);
+    g_assert(!aio_poll(ctx, false));
+    event_notifier_cleanup(&data.e);
+}
+
 static void test_aio_external_client(void)
 {
     int i, j;
@@ -855,6 +968,8 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait",              test_wait_event_notifier);
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
+    g_test_add_func("/aio/event/poll",              test_poll_event_notifier);
+    g_test_add_func("/aio/event/poll-begin-end",    test_poll_begin_end);
     g_test_add_func("/aio/external-client",         test_aio_external_client);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
 
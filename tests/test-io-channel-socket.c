@@ -522,6 +522,129 @@ static void test_io_channel_ipv4_fd(void)
 }
 
 
+struct TestZeroCopyData {
+    QIOChannel *ioc;
+    struct iovec iov;
+};
+
+
+static gpointer test_io_channel_zero_copy_reader(gpointer opaque)
+{
+    struct TestZeroCopyData *data = opaque;
+
+    g_assert_cmpint(qio_channel_readv_all(data->ioc, &data->iov, 1,
+                                          &error_abort), ==, 0);
+    return NULL;
+}
+
+
+static void test_io_channel_ipv4_zero_copy(void)
+{
+    SocketAddress *listen_addr = g_new0(SocketAddress, 1);
+    SocketAddress *connect_addr = g_new0(SocketAddress, 1);
+    QIOChannel *src, *dst;
+    struct TestZeroCopyData data;
+    struct iovec iov[4];
+    size_t len = 1024 * 1024;
+    char *sendbuf, *recvbuf;
+    GThread *reader;
+    size_t i;
+
+    listen_addr->type = SOCKET_ADDRESS_KIND_INET;
+    listen_addr->u.inet.data = g_new(InetSocketAddress, 1);
+    *listen_addr->u.inet.data = (InetSocketAddress) {
+        .host = g_strdup("127.0.0.1"),
+        .port = NULL, /* Auto-select */
+    };
+
+    connect_addr->type = SOCKET_ADDRESS_KIND_INET;
+    connect_addr->u.inet.data = g_new(InetSocketAddress, 1);
+    *connect_addr->u.inet.data = (InetSocketAddress) {
+        .host = g_strdup("127.0.0.1"),
+        .port = NULL, /* Filled in later */
+    };
+
+    test_io_channel_setup_sync(listen_addr, connect_addr, &src, &dst);
+
+    if (!qio_channel_has_feature(src, QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+        g_test_message("Skipping test: MSG_ZEROCOPY not supported");
+        goto out;
+    }
+
+    sendbuf = g_malloc(len);
+    recvbuf = g_malloc0(len);
+    for (i = 0; i < len; i++) {
+        sendbuf[i] = i % 251;
+    }
+    for (i = 0; i < ARRAY_SIZE(iov); i++) {
+        iov[i].iov_base = sendbuf + i * (len / ARRAY_SIZE(iov));
+        iov[i].iov_len = len / ARRAY_SIZE(iov);
+    }
+
+    data.ioc = dst;
+    data.iov.iov_base = recvbuf;
+    data.iov.iov_len = len;
+    reader = g_thread_new("reader", test_io_channel_zero_copy_reader, &data);
+
+    g_assert_cmpint(qio_channel_writev_zero_copy_all(src, iov,
+                                                     ARRAY_SIZE(iov),
+                                                     &error_abort), ==, 0);
+    /* Loopback traffic is always copied, so 1 is fine too */
+    g_assert_cmpint(qio_channel_flush(src, &error_abort), >=, 0);
+    g_assert_cmpint(QIO_CHANNEL_SOCKET(src)->zero_copy_sent, ==,
+                    QIO_CHANNEL_SOCKET(src)->zero_copy_queued);
+
+    g_thread_join(reader);
+    g_assert(memcmp(sendbuf, recvbuf, len) == 0);
+
+    g_free(sendbuf);
+    g_free(recvbuf);
+ out:
+    object_unref(OBJECT(src));
+    object_unref(OBJECT(dst));
+    qapi_free_SocketAddress(listen_addr);
+    qapi_free_SocketAddress(connect_addr);
+}
+
+
+#ifndef _WIN32
+static void test_io_channel_unix_zero_copy(void)
+{
+    SocketAddress *listen_addr = g_new0(SocketAddress, 1);
+    SocketAddress *connect_addr = g_new0(SocketAddress, 1);
+    QIOChannel *src, *dst;
+    char buf[16] = "";
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+    Error *err = NULL;
+
+#define TEST_SOCKET "test-io-channel-socket.sock"
+    listen_addr->type = SOCKET_ADDRESS_KIND_UNIX;
+    listen_addr->u.q_unix.data = g_new0(UnixSocketAddress, 1);
+    listen_addr->u.q_unix.data->path = g_strdup(TEST_SOCKET);
+
+    connect_addr->type = SOCKET_ADDRESS_KIND_UNIX;
+    connect_addr->u.q_unix.data = g_new0(UnixSocketAddress, 1);
+    connect_addr->u.q_unix.data->path = g_strdup(TEST_SOCKET);
+
+    test_io_channel_setup_sync(listen_addr, connect_addr, &src, &dst);
+
+    /* Only TCP sockets can do zero copy; flushing is then a no-op */
+    g_assert(!qio_channel_has_feature(src,
+                                      QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY));
+    g_assert_cmpint(qio_channel_writev_zero_copy(src, &iov, 1, &err), ==, -1);
+    g_assert(err);
+    error_free(err);
+    g_assert_cmpint(qio_channel_flush(src, &error_abort), ==, 0);
+
+    object_unref(OBJECT(src));
+    object_unref(OBJECT(dst));
+    qapi_free_SocketAddress(listen_addr);
+    qapi_free_SocketAddress(connect_addr);
+    unlink(TEST_SOCKET);
+}
+#endif /* _WIN32 */
+
+
 int main(int argc, char **argv)
 {
     bool has_ipv4, has_ipv6;
@@ -547,6 +670,8 @@ int main(int argc, char **argv)
                         test_io_channel_ipv4_async);
         g_test_add_func("/io/channel/socket/ipv4-fd",
                         test_io_channel_ipv4_fd);
+        g_test_add_func("/io/channel/socket/ipv4-zero-copy",
+                        test_io_channel_ipv4_zero_copy);
     }
     if (has_ipv6) {
         g_test_add_func("/io/channel/socket/ipv6-sync",
@@ -562,6 +687,8 @@ int main(int argc, char **argv)
                     test_io_channel_unix_async);
     g_test_add_func("/io/channel/socket/unix-fd-pass",
                     test_io_channel_unix_fd_pass);
+    g_test_add_func("/io/channel/socket/unix-zero-copy",
+                    test_io_channel_unix_zero_copy);
 #endif /* _WIN32 */
 
     return g_test_run();
@@ -0,0 +1,144 @@
+/*
+ * Tests for the migration compression codecs
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/bswap.h"
+#include "migration/compress.h"
+
+#define TEST_PAGE_SIZE 4096
+
+/* A page like most guest pages: mostly zeroes with some structure */
+static void fill_compressible(uint8_t *page)
+{
+    int i;
+
+    memset(page, 0, TEST_PAGE_SIZE);
+    for (i = 0; i < TEST_PAGE_SIZE; i += 64) {
+        page[i] = i / 64;
+        stl_le_p(page + i + 8, 0xdeadbeef);
+    }
+}
+
+static void fill_random(uint8_t *page)
+{
+    int i;
+
+    for (i = 0; i < TEST_PAGE_SIZE; i += 4) {
+        stl_le_p(page + i, g_test_rand_int());
+    }
+}
+
+static void test_roundtrip(const MigrationCodec *codec, const uint8_t *page,
+                           bool shrinks)
+{
+    size_t bound = codec->bound(TEST_PAGE_SIZE);
+    uint8_t *buf = g_malloc(bound);
+    uint8_t out[TEST_PAGE_SIZE];
+    void *ctx = codec->context_new();
+    ssize_t clen, dlen;
+
+    g_assert_cmpint(bound, >=, TEST_PAGE_SIZE);
+
+    clen = codec->compress(ctx, buf, bound, page, TEST_PAGE_SIZE, 1);
+    g_assert_cmpint(clen, >, 0);
+    g_assert_cmpint(clen, <=, bound);
+    if (shrinks) {
+        g_assert_cmpint(clen, <, TEST_PAGE_SIZE / 2);
+    }
+
+    memset(out, 0x55, sizeof(out));
+    dlen = codec->decompress(ctx, out, TEST_PAGE_SIZE, buf, clen);
+    g_assert_cmpint(dlen, ==, TEST_PAGE_SIZE);
+    g_assert(memcmp(out, page, TEST_PAGE_SIZE) == 0);
+
+    codec->context_free(ctx);
+    g_free(buf);
+}
+
+static void test_compressible(gconstpointer opaque)
+{
+    const MigrationCodec *codec = opaque;
+    uint8_t page[TEST_PAGE_SIZE];
+
+    fill_compressible(page);
+    test_roundtrip(codec, page, true);
+}
+
+static void test_incompressible(gconstpointer opaque)
+{
+    const MigrationCodec *codec = opaque;
+    uint8_t page[TEST_PAGE_SIZE];
+    uint8_t small[TEST_PAGE_SIZE / 2];
+    void *ctx = codec->context_new();
+
+    fill_random(page);
+    test_roundtrip(codec, page, false);
+
+    /* What ram.c relies on to send such pages raw */
+    g_assert_cmpint(codec->compress(ctx, small, sizeof(small),
+                                    page, TEST_PAGE_SIZE, 1), ==, -1);
+    codec->context_free(ctx);
+}
+
+static void test_bad_input(gconstpointer opaque)
+{
+    const MigrationCodec *codec = opaque;
+    size_t bound = codec->bound(TEST_PAGE_SIZE);
+    uint8_t *buf = g_malloc(bound);
+    uint8_t page[TEST_PAGE_SIZE], out[TEST_PAGE_SIZE];
+    void *ctx = codec->context_new();
+    ssize_t clen;
+
+    fill_compressible(page);
+    clen = codec->compress(ctx, buf, bound, page, TEST_PAGE_SIZE, 1);
+    g_assert_cmpint(clen, >, 0);
+
+    /* The destination must never write past the page */
+    g_assert_cmpint(codec->decompress(ctx, out, TEST_PAGE_SIZE / 2, buf, clen),
+                    ==, -1);
+    /* ... nor accept a truncated stream */
+    g_assert_cmpint(codec->decompress(ctx, out, TEST_PAGE_SIZE, buf, clen / 2),
+                    ==, -1);
+
+    codec->context_free(ctx);
+    g_free(buf);
+}
+
+int main(int argc, char **argv)
+{
+    MigrationCompressMethod method;
+
+    g_test_init(&argc, &argv, NULL);
+
+    /* zlib is always built in */
+    g_assert(migration_codec_get(MIGRATION_COMPRESS_METHOD_ZLIB));
+
+    for (method = 0; method < MIGRATION_COMPRESS_METHOD__MAX; method++) {
+        const MigrationCodec *codec = migration_codec_get(method);
+        char *path;
+
+        if (!codec) {
+            continue;
+        }
+        path = g_strdup_printf("/migration/compress/%s/compressible",
+                               codec->name);
+        g_test_add_data_func(path, codec, test_compressible);
+        g_free(path);
+        path = g_strdup_printf("/migration/compress/%s/incompressible",
+                               codec->name);
+        g_test_add_data_func(path, codec, test_incompressible);
+        g_free(path);
+        path = g_strdup_printf("/migration/compress/%s/bad-input",
+                               codec->name);
+        g_test_add_data_func(path, codec, test_bad_input);
+        g_free(path);
+    }
+
+    return g_test_run();
+}
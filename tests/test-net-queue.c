@@ -0,0 +1,197 @@
+/*
+ * Tests for batched delivery through the net queue
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "net/net.h"
+#include "net/queue.h"
+#include "qemu/iov.h"
+
+#define NR_PACKETS 5
+
+/* The receiving end: takes packets until @nr_accept_left drops to zero */
+static bool can_send = true;
+static int nr_accept_left;
+static int nr_deliver, nr_deliver_batch, nr_sent_cb;
+static uint8_t received[64];
+static int nr_received;
+
+static NetClientState sender;
+
+int qemu_can_send_packet(NetClientState *nc)
+{
+    g_assert(nc == &sender);
+    return can_send;
+}
+
+static ssize_t mock_deliver(NetClientState *nc, unsigned flags,
+                            const struct iovec *iov, int iovcnt,
+                            void *opaque)
+{
+    size_t size = iov_size(iov, iovcnt);
+
+    nr_deliver++;
+    if (!nr_accept_left) {
+        return 0;
+    }
+    nr_accept_left--;
+    g_assert_cmpint(size, ==, 1);
+    iov_to_buf(iov, iovcnt, 0, &received[nr_received++], 1);
+    return size;
+}
+
+static int mock_deliver_batch(NetClientState *nc, unsigned flags,
+                              const NetBatchPacket *pkts, int count,
+                              void *opaque)
+{
+    int i;
+
+    nr_deliver_batch++;
+    for (i = 0; i < count && nr_accept_left; i++, nr_accept_left--) {
+        g_assert_cmpint(iov_size(pkts[i].iov, pkts[i].iovcnt), ==, 1);
+        iov_to_buf(pkts[i].iov, pkts[i].iovcnt, 0,
+                   &received[nr_received++], 1);
+    }
+    return i;
+}
+
+static void mock_sent_cb(NetClientState *nc, ssize_t ret)
+{
+    g_assert(nc == &sender);
+    g_assert_cmpint(ret, ==, 1);
+    nr_sent_cb++;
+}
+
+static uint8_t payload[NR_PACKETS];
+static struct iovec iovs[NR_PACKETS];
+static NetBatchPacket pkts[NR_PACKETS];
+
+static NetQueue *setup(bool batch, int nr_accept)
+{
+    int i;
+
+    for (i = 0; i < NR_PACKETS; i++) {
+        payload[i] = i;
+        iovs[i].iov_base = &payload[i];
+        iovs[i].iov_len = 1;
+        pkts[i].iov = &iovs[i];
+        pkts[i].iovcnt = 1;
+    }
+    can_send = true;
+    nr_accept_left = nr_accept;
+    nr_deliver = nr_deliver_batch = nr_sent_cb = 0;
+    nr_received = 0;
+
+    return qemu_new_net_queue(mock_deliver,
+                              batch ? mock_deliver_batch : NULL, NULL);
+}
+
+static void check_received_in_order(int n)
+{
+    int i;
+
+    g_assert_cmpint(nr_received, ==, n);
+    for (i = 0; i < n; i++) {
+        g_assert_cmpint(received[i], ==, i);
+    }
+}
+
+static void test_whole_batch(void)
+{
+    NetQueue *q = setup(true, NR_PACKETS);
+
+    g_assert_cmpint(qemu_net_queue_send_batch(q, &sender, 0, pkts, NR_PACKETS,
+                                              mock_sent_cb), ==, NR_PACKETS);
+    g_assert_cmpint(nr_deliver_batch, ==, 1);
+    g_assert_cmpint(nr_deliver, ==, 0);
+    g_assert_cmpint(nr_sent_cb, ==, 0);
+    check_received_in_order(NR_PACKETS);
+
+    qemu_del_net_queue(q);
+}
+
+static void test_partial_with_cb(void)
+{
+    NetQueue *q = setup(true, 2);
+
+    /* The first undelivered packet is queued, the caller keeps the rest */
+    g_assert_cmpint(qemu_net_queue_send_batch(q, &sender, 0, pkts, NR_PACKETS,
+                                              mock_sent_cb), ==, 2);
+    check_received_in_order(2);
+    g_assert_cmpint(nr_sent_cb, ==, 0);
+
+    nr_accept_left = NR_PACKETS;
+    g_assert(qemu_net_queue_flush(q));
+    check_received_in_order(3);
+    g_assert_cmpint(nr_sent_cb, ==, 1);
+
+    /* The caller resubmits from where it stopped */
+    g_assert_cmpint(qemu_net_queue_send_batch(q, &sender, 0, &pkts[3],
+                                              NR_PACKETS - 3, mock_sent_cb),
+                    ==, NR_PACKETS - 3);
+    check_received_in_order(NR_PACKETS);
+
+    qemu_del_net_queue(q);
+}
+
+static void test_partial_without_cb(void)
+{
+    NetQueue *q = setup(true, 2);
+
+    /* Everything is consumed, what was not delivered is queued */
+    g_assert_cmpint(qemu_net_queue_send_batch(q, &sender, 0, pkts, NR_PACKETS,
+                                              NULL), ==, NR_PACKETS);
+    check_received_in_order(2);
+
+    nr_accept_left = NR_PACKETS;
+    g_assert(qemu_net_queue_flush(q));
+    check_received_in_order(NR_PACKETS);
+    g_assert_cmpint(nr_sent_cb, ==, 0);
+
+    qemu_del_net_queue(q);
+}
+
+static void test_cannot_send(void)
+{
+    NetQueue *q = setup(true, NR_PACKETS);
+
+    can_send = false;
+    g_assert_cmpint(qemu_net_queue_send_batch(q, &sender, 0, pkts, NR_PACKETS,
+                                              mock_sent_cb), ==, 0);
+    g_assert_cmpint(nr_deliver_batch, ==, 0);
+    g_assert_cmpint(nr_received, ==, 0);
+
+    can_send = true;
+    g_assert(qemu_net_queue_flush(q));
+    check_received_in_order(1);
+    g_assert_cmpint(nr_sent_cb, ==, 1);
+
+    qemu_del_net_queue(q);
+}
+
+static void test_no_batch_receiver(void)
+{
+    NetQueue *q = setup(false, NR_PACKETS);
+
+    g_assert_cmpint(qemu_net_queue_send_batch(q, &sender, 0, pkts, NR_PACKETS,
+                                              mock_sent_cb), ==, NR_PACKETS);
+    g_assert_cmpint(nr_deliver, ==, NR_PACKETS);
+    check_received_in_order(NR_PACKETS);
+
+    qemu_del_net_queue(q);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/queue/batch/whole", test_whole_batch);
+    g_test_add_func("/net/queue/batch/partial-cb", test_partial_with_cb);
+    g_test_add_func("/net/queue/batch/partial-no-cb", test_partial_without_cb);
+    g_test_add_func("/net/queue/batch/cannot-send", test_cannot_send);
+    g_test_add_func("/net/queue/batch/no-batch-receiver",
+                    test_no_batch_receiver);
+    return g_test_run();
+}
@@ -0,0 +1,129 @@
+/*
+ * Migration page cache unit tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "migration/page_cache.h"
+
+#define PAGE_SIZE 4096
+
+static void fill_page(uint8_t *page, uint64_t addr)
+{
+    memset(page, addr / PAGE_SIZE, PAGE_SIZE);
+}
+
+static void test_insert_get(void)
+{
+    PageCache *cache = cache_init(64 * PAGE_SIZE, PAGE_SIZE);
+    uint8_t *page = g_malloc(PAGE_SIZE);
+    uint8_t *buf = g_malloc(PAGE_SIZE);
+    uint64_t addr;
+
+    g_assert(cache);
+    for (addr = 0; addr < 16 * PAGE_SIZE; addr += PAGE_SIZE) {
+        fill_page(page, addr);
+        g_assert_cmpint(cache_insert(cache, addr, page, 1), ==, 0);
+    }
+    for (addr = 0; addr < 16 * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(cache_is_cached(cache, addr, 1));
+        g_assert(cache_get_data(cache, addr, buf, 1));
+        fill_page(page, addr);
+        g_assert(memcmp(buf, page, PAGE_SIZE) == 0);
+    }
+    g_assert(!cache_is_cached(cache, 1000 * PAGE_SIZE, 1));
+    g_assert(!cache_get_data(cache, 1000 * PAGE_SIZE, buf, 1));
+
+    /* updating a cached page never fails, even if it is fresh */
+    memset(page, 0xff, PAGE_SIZE);
+    g_assert_cmpint(cache_insert(cache, 0, page, 1), ==, 0);
+    g_assert(cache_get_data(cache, 0, buf, 1));
+    g_assert(memcmp(buf, page, PAGE_SIZE) == 0);
+
+    cache_fini(cache);
+    g_free(page);
+    g_free(buf);
+}
+
+static void test_aging(void)
+{
+    /* a single set, so every page competes with every other one */
+    PageCache *cache = cache_init(8 * PAGE_SIZE, PAGE_SIZE);
+    uint8_t *page = g_malloc0(PAGE_SIZE);
+    uint64_t addr;
+
+    for (addr = 0; addr < 8 * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert_cmpint(cache_insert(cache, addr, page, 1), ==, 0);
+    }
+
+    /* all pages are fresh, nothing gets replaced */
+    g_assert_cmpint(cache_insert(cache, 8 * PAGE_SIZE, page, 2), ==, -1);
+    g_assert(!cache_is_cached(cache, 8 * PAGE_SIZE, 2));
+
+    /* use every page but the third one, which then is the LRU one */
+    for (addr = 0; addr < 8 * PAGE_SIZE; addr += PAGE_SIZE) {
+        if (addr != 2 * PAGE_SIZE) {
+            g_assert(cache_is_cached(cache, addr, 5));
+        }
+    }
+    g_assert_cmpint(cache_insert(cache, 8 * PAGE_SIZE, page, 5), ==, 0);
+    g_assert(cache_is_cached(cache, 8 * PAGE_SIZE, 5));
+    g_assert(!cache_is_cached(cache, 2 * PAGE_SIZE, 5));
+    for (addr = 0; addr < 8 * PAGE_SIZE; addr += PAGE_SIZE) {
+        if (addr != 2 * PAGE_SIZE) {
+            g_assert(cache_is_cached(cache, addr, 5));
+        }
+    }
+
+    cache_fini(cache);
+    g_free(page);
+}
+
+static void test_resize(void)
+{
+    PageCache *cache = cache_init(32 * PAGE_SIZE, PAGE_SIZE);
+    uint8_t *page = g_malloc(PAGE_SIZE);
+    uint8_t *buf = g_malloc(PAGE_SIZE);
+    uint64_t addr;
+    int cached = 0;
+
+    for (addr = 0; addr < 8 * PAGE_SIZE; addr += PAGE_SIZE) {
+        fill_page(page, addr);
+        cache_insert(cache, addr, page, 1);
+    }
+
+    /* growing keeps everything, sizes are rounded down to a power of 2 */
+    g_assert_cmpint(cache_resize(cache, 100 * PAGE_SIZE), ==, 64 * PAGE_SIZE);
+    for (addr = 0; addr < 8 * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(cache_get_data(cache, addr, buf, 1));
+        fill_page(page, addr);
+        g_assert(memcmp(buf, page, PAGE_SIZE) == 0);
+    }
+
+    /* shrinking keeps what fits */
+    g_assert_cmpint(cache_resize(cache, 4 * PAGE_SIZE), ==, 4 * PAGE_SIZE);
+    for (addr = 0; addr < 8 * PAGE_SIZE; addr += PAGE_SIZE) {
+        if (cache_get_data(cache, addr, buf, 1)) {
+            fill_page(page, addr);
+            g_assert(memcmp(buf, page, PAGE_SIZE) == 0);
+            cached++;
+        }
+    }
+    g_assert_cmpint(cached, ==, 4);
+
+    cache_fini(cache);
+    g_free(page);
+    g_free(buf);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page-cache/insert_get", test_insert_get);
+    g_test_add_func("/page-cache/aging", test_aging);
+    g_test_add_func("/page-cache/resize", test_resize);
+    return g_test_run();
+}
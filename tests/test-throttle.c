@@ -587,6 +587,47 @@ static void test_accounting(void)
                                 (64.0 / 13)));
 }
 
+static void test_nested_accounting(void)
+{
+    ThrottleState parent;
+    ThrottleConfig cfg;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    throttle_init(&ts);
+    throttle_init(&parent);
+    throttle_timers_init(&tt, ctx, QEMU_CLOCK_VIRTUAL,
+                         read_timer_cb, write_timer_cb, &ts);
+    throttle_set_parent(&ts, &parent);
+
+    /* the child has no limits, the parent counts operations of 4 KB */
+    throttle_config_init(&cfg);
+    throttle_config(&ts, &tt, &cfg);
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = 10;
+    cfg.op_size = 4096;
+    throttle_config_state(&parent, QEMU_CLOCK_VIRTUAL, &cfg);
+    g_assert(ts.parent == &parent);
+
+    /* I/O done in the child is accounted in the parent as well */
+    throttle_account(&ts, false, 8192);
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_TOTAL].level, 1));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_TOTAL].level, 8192));
+    g_assert(double_cmp(parent.cfg.buckets[THROTTLE_OPS_TOTAL].level, 2));
+    g_assert(double_cmp(parent.cfg.buckets[THROTTLE_BPS_TOTAL].level, 8192));
+
+    /* the child is not over its limits but the parent is */
+    throttle_account(&ts, true, 4096);
+    g_assert(!throttle_compute_wait(&ts.cfg.buckets[THROTTLE_OPS_TOTAL]));
+    g_assert(throttle_schedule_timer(&ts, &tt, false));
+    g_assert(timer_pending(tt.timers[0]));
+    g_assert(tt.timers[0]->expire_time > now);
+
+    /* ... so the child is only waiting for the budget of the parent */
+    g_assert(!throttle_own_limits_exceeded(&ts, false));
+    g_assert(throttle_own_limits_exceeded(&parent, false));
+
+    throttle_timers_destroy(&tt);
+}
+
 static void test_groups(void)
 {
     ThrottleConfig cfg1, cfg2;
@@ -648,6 +689,64 @@ static void test_groups(void)
     g_assert(blkp3->throttle_state == NULL);
 }
 
+static void test_nested_groups(void)
+{
+    ThrottleConfig cfg1, cfg2;
+    BlockBackend *blk1, *blk2;
+    BlockBackendPublic *blkp1, *blkp2;
+    ThrottleState *parent;
+    Error *local_err = NULL;
+
+    g_assert(throttle_group_name_is_valid("foo", NULL));
+    g_assert(throttle_group_name_is_valid("foo/bar/baz/qux", NULL));
+    g_assert(!throttle_group_name_is_valid("foo/bar/baz/qux/quux", NULL));
+    g_assert(!throttle_group_name_is_valid("foo//bar", NULL));
+    g_assert(!throttle_group_name_is_valid("foo/", NULL));
+    g_assert(!throttle_group_name_is_valid("", NULL));
+
+    blk1 = blk_new();
+    blk2 = blk_new();
+
+    blkp1 = blk_get_public(blk1);
+    blkp2 = blk_get_public(blk2);
+
+    throttle_group_register_blk(blk1, "tenant/vm1");
+    throttle_group_register_blk(blk2, "tenant/vm2");
+
+    /* Both groups are children of the same parent */
+    g_assert(blkp1->throttle_state != blkp2->throttle_state);
+    parent = blkp1->throttle_state->parent;
+    g_assert(parent != NULL);
+    g_assert(parent == blkp2->throttle_state->parent);
+    g_assert(parent->parent == NULL);
+
+    /* The parent group can be configured even if it has no members */
+    throttle_config_init(&cfg1);
+    cfg1.buckets[THROTTLE_BPS_TOTAL].avg = 1000000;
+    cfg1.op_size = 8192;
+    throttle_group_config_by_name("tenant", &cfg1, &error_abort);
+    throttle_get_config(parent, &cfg2);
+    g_assert(cfg2.buckets[THROTTLE_BPS_TOTAL].avg == 1000000);
+    g_assert(cfg2.op_size == 8192);
+
+    /* ... without affecting its children */
+    throttle_group_get_config(blk1, &cfg2);
+    g_assert(!throttle_enabled(&cfg2));
+
+    throttle_group_config_by_name("tenant/vm3", &cfg1, &local_err);
+    g_assert(local_err);
+    error_free(local_err);
+
+    throttle_group_unregister_blk(blk1);
+    throttle_group_unregister_blk(blk2);
+
+    /* The parent goes away together with its last child */
+    local_err = NULL;
+    throttle_group_config_by_name("tenant", &cfg1, &local_err);
+    g_assert(local_err);
+    error_free(local_err);
+}
+
 int main(int argc, char **argv)
 {
     qemu_init_main_loop(&error_fatal);
@@ -672,7 +771,9 @@ int main(int argc, char **argv)
                     test_iops_size_is_missing_limit);
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
+    g_test_add_func("/throttle/nested_accounting",  test_nested_accounting);
     g_test_add_func("/throttle/groups",             test_groups);
+    g_test_add_func("/throttle/nested_groups",      test_nested_groups);
     return g_test_run();
 }
 
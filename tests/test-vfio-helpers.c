@@ -0,0 +1,193 @@
+/*
+ * Tests for the VFIO IOVA allocator, using a mock container
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/vfio.h>
+#include "qemu/vfio-helpers.h"
+
+/* The container is a plain file descriptor; the type1 IOMMU ioctls issued
+ * on it are intercepted below and recorded instead of reaching the kernel.
+ */
+static int mock_container = -1;
+static int mock_map_errno;
+static int mock_nr_map, mock_nr_unmap;
+static struct vfio_iommu_type1_dma_map mock_last_map;
+static struct vfio_iommu_type1_dma_unmap mock_last_unmap;
+
+int ioctl(int fd, unsigned long request, ...)
+{
+    va_list ap;
+    void *arg;
+
+    va_start(ap, request);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+
+    if (fd != mock_container) {
+        return syscall(SYS_ioctl, fd, request, arg);
+    }
+
+    switch (request) {
+    case VFIO_IOMMU_MAP_DMA:
+        if (mock_map_errno) {
+            errno = mock_map_errno;
+            return -1;
+        }
+        mock_last_map = *(struct vfio_iommu_type1_dma_map *)arg;
+        mock_nr_map++;
+        return 0;
+    case VFIO_IOMMU_UNMAP_DMA:
+        mock_last_unmap = *(struct vfio_iommu_type1_dma_unmap *)arg;
+        mock_nr_unmap++;
+        return 0;
+    default:
+        errno = ENOTTY;
+        return -1;
+    }
+}
+
+static QEMUVFIOState *mock_open(void)
+{
+    mock_container = open("/dev/null", O_RDWR);
+    g_assert(mock_container >= 0);
+    mock_map_errno = 0;
+    mock_nr_map = 0;
+    mock_nr_unmap = 0;
+    return qemu_vfio_open_container(mock_container);
+}
+
+static void mock_close(QEMUVFIOState *s)
+{
+    qemu_vfio_close(s);
+    mock_container = -1;
+}
+
+/* The allocator never dereferences host addresses, so fake ones are fine */
+static void *fake_host(int page)
+{
+    return (void *)(uintptr_t)((page + 1) * getpagesize() * 16);
+}
+
+static void test_persistent(void)
+{
+    QEMUVFIOState *s = mock_open();
+    size_t pg = getpagesize();
+    uint8_t *a = fake_host(0);
+    uint8_t *b = fake_host(1);
+    uint64_t iova_a, iova_b, iova;
+
+    g_assert_cmpint(qemu_vfio_dma_map(s, a, 8 * pg, false, &iova_a), ==, 0);
+    g_assert_cmpint(mock_nr_map, ==, 1);
+    g_assert_cmpint(mock_last_map.iova, ==, iova_a);
+    g_assert_cmpint(mock_last_map.vaddr, ==, (uintptr_t)a);
+    g_assert_cmpint(mock_last_map.size, ==, 8 * pg);
+
+    /* Sub-ranges of a persistent mapping reuse it without another ioctl */
+    g_assert_cmpint(qemu_vfio_dma_map(s, a + 2 * pg, 4 * pg, true, &iova),
+                    ==, 0);
+    g_assert_cmpint(iova, ==, iova_a + 2 * pg);
+    g_assert_cmpint(qemu_vfio_dma_map(s, a, 8 * pg, false, &iova), ==, 0);
+    g_assert_cmpint(iova, ==, iova_a);
+    g_assert_cmpint(mock_nr_map, ==, 1);
+
+    g_assert_cmpint(qemu_vfio_dma_map(s, b, pg, false, &iova_b), ==, 0);
+    g_assert_cmpint(iova_b, ==, iova_a + 8 * pg);
+    g_assert_cmpint(mock_nr_map, ==, 2);
+
+    /* Dropping the highest mapping lets its IOVA be reused */
+    qemu_vfio_dma_unmap(s, b);
+    g_assert_cmpint(mock_nr_unmap, ==, 1);
+    g_assert_cmpint(mock_last_unmap.iova, ==, iova_b);
+    g_assert_cmpint(mock_last_unmap.size, ==, pg);
+    g_assert_cmpint(qemu_vfio_dma_map(s, b, 2 * pg, false, &iova), ==, 0);
+    g_assert_cmpint(iova, ==, iova_b);
+
+    mock_close(s);
+}
+
+static void test_temporary(void)
+{
+    QEMUVFIOState *s = mock_open();
+    size_t pg = getpagesize();
+    uint64_t iova1, iova2, iova;
+
+    g_assert_cmpint(qemu_vfio_dma_map(s, fake_host(0), pg, true, &iova1),
+                    ==, 0);
+    g_assert_cmpint(qemu_vfio_dma_map(s, fake_host(1), 2 * pg, true, &iova2),
+                    ==, 0);
+    g_assert_cmpint(iova2, ==, iova1 - 2 * pg);
+    g_assert_cmpint(mock_nr_map, ==, 2);
+
+    /* The whole temporary area goes away with a single ioctl */
+    g_assert_cmpint(qemu_vfio_dma_reset_temporary(s), ==, 0);
+    g_assert_cmpint(mock_nr_unmap, ==, 1);
+    g_assert_cmpint(mock_last_unmap.iova, ==, iova2);
+    g_assert_cmpint(mock_last_unmap.size, ==, 3 * pg);
+
+    g_assert_cmpint(qemu_vfio_dma_map(s, fake_host(2), pg, true, &iova),
+                    ==, 0);
+    g_assert_cmpint(iova, ==, iova1);
+
+    mock_close(s);
+}
+
+static void test_exhausted(void)
+{
+    QEMUVFIOState *s = mock_open();
+    uint64_t iova;
+
+    if (sizeof(size_t) < 8) {
+        g_test_message("Skipping test, size_t is too small");
+        mock_close(s);
+        return;
+    }
+    g_assert_cmpint(qemu_vfio_dma_map(s, fake_host(0), (size_t)1 << 40, true,
+                                      &iova), ==, -ENOMEM);
+    g_assert_cmpint(qemu_vfio_dma_map(s, fake_host(0), (size_t)1 << 40, false,
+                                      &iova), ==, -ENOMEM);
+    g_assert_cmpint(mock_nr_map, ==, 0);
+
+    mock_close(s);
+}
+
+static void test_map_failure(void)
+{
+    QEMUVFIOState *s = mock_open();
+    size_t pg = getpagesize();
+    uint64_t iova1, iova2;
+
+    g_assert_cmpint(qemu_vfio_dma_map(s, fake_host(0), pg, false, &iova1),
+                    ==, 0);
+
+    mock_map_errno = EFAULT;
+    g_assert_cmpint(qemu_vfio_dma_map(s, fake_host(1), pg, false, &iova2),
+                    ==, -EFAULT);
+    g_assert_cmpint(qemu_vfio_dma_map(s, fake_host(1), pg, true, &iova2),
+                    ==, -EFAULT);
+
+    /* Nothing was recorded for the failed mappings */
+    mock_map_errno = 0;
+    g_assert_cmpint(qemu_vfio_dma_map(s, fake_host(1), pg, false, &iova2),
+                    ==, 0);
+    g_assert_cmpint(iova2, ==, iova1 + pg);
+    g_assert_cmpint(mock_nr_map, ==, 2);
+
+    mock_close(s);
+    g_assert_cmpint(mock_nr_unmap, ==, 2);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/vfio-helpers/persistent", test_persistent);
+    g_test_add_func("/vfio-helpers/temporary", test_temporary);
+    g_test_add_func("/vfio-helpers/exhausted", test_exhausted);
+    g_test_add_func("/vfio-helpers/map-failure", test_map_failure);
+    return g_test_run();
+}
@@ -0,0 +1,593 @@
+/*
+ * Packet rate and latency benchmark for virtio-net over vhost-user
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The test drives a virtio-net-pci device through libqos and plays the
+ * guest driver directly on the vrings, which live in a guest RAM file
+ * that is mapped here as well.  The other end of the vhost-user socket
+ * is tests/vhost-user-bridge in one of its benchmark modes:
+ *
+ *   /vhost-user-bench/tx       guest -> sink, reports the TX packet rate
+ *   /vhost-user-bench/rx       gen -> guest, reports the RX packet rate
+ *                              and the one-way latency
+ *   /vhost-user-bench/latency  guest -> reflect -> guest ping-pong,
+ *                              reports the round trip time
+ *
+ * The bridge busy-polls the rings and the test never waits for
+ * interrupts, so the numbers measure the vhost-user data path rather
+ * than qtest.  The benchmark is not part of "make check"; run it as
+ *
+ *   QTEST_QEMU_BINARY=x86_64-softmmu/qemu-system-x86_64 \
+ *       tests/vhost-user-bench [-d secs] [-q queues] [-s size]
+ *
+ * QTEST_VHOST_USER_BRIDGE overrides the path to vhost-user-bridge.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/mman.h>
+#include "libqtest.h"
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "libqos/pci-pc.h"
+#include "libqos/virtio.h"
+#include "libqos/virtio-pci.h"
+#include "libqos/malloc.h"
+#include "libqos/malloc-pc.h"
+#include "hw/virtio/virtio-net.h"
+#include "standard-headers/linux/virtio_ids.h"
+#include "standard-headers/linux/virtio_ring.h"
+#include "vhost-user-bridge.h"
+
+#define QEMU_CMD_ACCEL  " -machine accel=tcg"
+#define QEMU_CMD_MEM    " -m %d -object memory-backend-file,id=mem,size=%dM,"\
+                        "mem-path=%s,share=on -numa node,memdev=mem"
+#define QEMU_CMD_CHR    " -chardev socket,id=chr0,path=%s"
+#define QEMU_CMD_NETDEV " -netdev vhost-user,id=net0,chardev=chr0,vhostforce," \
+                        "queues=%d"
+#define QEMU_CMD_NET    " -device virtio-net-pci,netdev=net0,mq=%s"
+
+#define QEMU_CMD        QEMU_CMD_ACCEL QEMU_CMD_MEM QEMU_CMD_CHR \
+                        QEMU_CMD_NETDEV QEMU_CMD_NET
+
+#define BENCH_MEM_MB            256
+#define BENCH_MAX_QUEUE_PAIRS   8   /* as many as vhost-user-bridge has */
+#define BENCH_BUF_SIZE          2048
+#define BENCH_MAX_SAMPLES       (4 * 1024 * 1024)
+#define BENCH_TIMEOUT_US        (5 * 1000 * 1000)
+#define VNET_HDR_SIZE           sizeof(struct virtio_net_hdr_mrg_rxbuf)
+
+typedef struct BenchRing {
+    QVirtQueue *vq;
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    struct vring_used *used;
+    uint64_t bufs;
+    uint16_t avail_idx;
+    uint16_t last_used;
+} BenchRing;
+
+typedef struct BenchQueuePair {
+    BenchRing rx;
+    BenchRing tx;
+    uint64_t seq;
+} BenchQueuePair;
+
+typedef struct Bench {
+    char *tmpdir;
+    char *socket_path;
+    char *mem_path;
+    uint8_t *mem;
+    GPid bridge_pid;
+    QPCIBus *pcibus;
+    QVirtioPCIDevice *dev;
+    QGuestAllocator *alloc;
+    BenchQueuePair qp[BENCH_MAX_QUEUE_PAIRS];
+    GArray *samples;
+} Bench;
+
+static unsigned int duration = 5;
+static unsigned int queues = 1;
+static unsigned int pkt_size = 64;
+static const char *bridge_path = "tests/vhost-user-bridge";
+
+static void *bench_host_addr(Bench *b, uint64_t gpa)
+{
+    g_assert(gpa < BENCH_MEM_MB * 1024 * 1024);
+    return b->mem + gpa;
+}
+
+static uint8_t *bench_ring_buf(Bench *b, BenchRing *r, unsigned int id)
+{
+    return bench_host_addr(b, r->bufs + id * BENCH_BUF_SIZE);
+}
+
+/*
+ * Attach a BenchRing to a libqos virtqueue.  Buffer i always goes with
+ * descriptor i, so that completed descriptors can be posted again
+ * without any bookkeeping.
+ */
+static void bench_ring_init(Bench *b, BenchRing *r, QVirtQueue *vq,
+                            bool write)
+{
+    unsigned int i;
+
+    r->vq = vq;
+    r->desc = bench_host_addr(b, vq->desc);
+    r->avail = bench_host_addr(b, vq->avail);
+    r->used = bench_host_addr(b, vq->used);
+    r->bufs = guest_alloc(b->alloc, vq->size * BENCH_BUF_SIZE);
+    r->avail_idx = 0;
+    r->last_used = 0;
+
+    for (i = 0; i < vq->size; i++) {
+        r->desc[i].addr = r->bufs + i * BENCH_BUF_SIZE;
+        r->desc[i].len = write ? BENCH_BUF_SIZE : VNET_HDR_SIZE + pkt_size;
+        r->desc[i].flags = write ? VRING_DESC_F_WRITE : 0;
+        r->desc[i].next = 0;
+        memset(bench_ring_buf(b, r, i), 0, VNET_HDR_SIZE);
+    }
+
+    /* the benchmark polls the used rings, interrupts would only hurt */
+    r->avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+}
+
+static void bench_ring_post(BenchRing *r, unsigned int id)
+{
+    r->avail->ring[r->avail_idx % r->vq->size] = id;
+    r->avail_idx++;
+}
+
+static void bench_ring_publish(Bench *b, BenchRing *r)
+{
+    smp_wmb();
+    atomic_set(&r->avail->idx, r->avail_idx);
+    smp_mb();
+    if (!(atomic_read(&r->used->flags) & VRING_USED_F_NO_NOTIFY)) {
+        qvirtio_pci.virtqueue_kick(&b->dev->vdev, r->vq);
+    }
+}
+
+/* Return the next completed descriptor, or -1 if there is none */
+static int bench_ring_get(BenchRing *r, uint32_t *len)
+{
+    struct vring_used_elem *elem;
+
+    if (atomic_read(&r->used->idx) == r->last_used) {
+        return -1;
+    }
+    smp_rmb();
+    elem = &r->used->ring[r->last_used % r->vq->size];
+    r->last_used++;
+    if (len) {
+        *len = elem->len;
+    }
+    return elem->id;
+}
+
+static void bench_stamp(Bench *b, BenchQueuePair *qp, unsigned int id,
+                        unsigned int queue)
+{
+    vubr_stamp_packet(bench_ring_buf(b, &qp->tx, id) + VNET_HDR_SIZE,
+                      queue, qp->seq++);
+}
+
+static void bench_sample(Bench *b, uint64_t ns)
+{
+    if (b->samples->len < BENCH_MAX_SAMPLES) {
+        g_array_append_val(b->samples, ns);
+    }
+}
+
+static int bench_compare_samples(gconstpointer a, gconstpointer b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void bench_report_latency(Bench *b, const char *what)
+{
+    static const double pct[] = { 50, 90, 99, 99.9 };
+    GArray *s = b->samples;
+    uint64_t sum = 0;
+    unsigned int i;
+
+    if (!s->len) {
+        printf("%s: no samples\n", what);
+        return;
+    }
+
+    g_array_sort(s, bench_compare_samples);
+    for (i = 0; i < s->len; i++) {
+        sum += g_array_index(s, uint64_t, i);
+    }
+    printf("%s (us): avg %.2f", what, sum / 1000.0 / s->len);
+    for (i = 0; i < ARRAY_SIZE(pct); i++) {
+        unsigned int idx = s->len * pct[i] / 100;
+
+        printf(" p%g %.2f", pct[i],
+               g_array_index(s, uint64_t, MIN(idx, s->len - 1)) / 1000.0);
+    }
+    printf(" max %.2f, %u samples\n",
+           g_array_index(s, uint64_t, s->len - 1) / 1000.0, s->len);
+}
+
+static void bench_report_rate(const char *what, uint64_t pkts, uint64_t ns)
+{
+    double secs = ns / 1e9;
+
+    printf("%s: %" PRIu64 " packets of %u bytes in %.2f s, %.0f pps, "
+           "%.1f Mbit/s\n", what, pkts, pkt_size, secs, pkts / secs,
+           pkts * pkt_size * 8 / secs / 1e6);
+}
+
+static void bench_wait_socket(const char *path)
+{
+    gint64 end = g_get_monotonic_time() + BENCH_TIMEOUT_US;
+
+    while (!g_file_test(path, G_FILE_TEST_EXISTS)) {
+        g_assert(g_get_monotonic_time() < end);
+        g_usleep(10 * 1000);
+    }
+}
+
+static void bench_spawn_bridge(Bench *b, const char *mode)
+{
+    char *queues_str = g_strdup_printf("%u", queues);
+    char *size_str = g_strdup_printf("%u", pkt_size);
+    char *argv[] = {
+        (char *)bridge_path, (char *)"-u", b->socket_path,
+        (char *)"-m", (char *)mode, (char *)"-q", queues_str,
+        (char *)"-s", size_str, (char *)"-p", NULL
+    };
+    GError *err = NULL;
+
+    if (!g_spawn_async(NULL, argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD,
+                       NULL, NULL, &b->bridge_pid, &err)) {
+        g_printerr("cannot run %s: %s\n", bridge_path, err->message);
+        g_error_free(err);
+        exit(1);
+    }
+    g_free(queues_str);
+    g_free(size_str);
+
+    bench_wait_socket(b->socket_path);
+}
+
+static void bench_driver_init(Bench *b)
+{
+    uint32_t features;
+
+    b->dev = qvirtio_pci_device_find(b->pcibus, VIRTIO_ID_NET);
+    g_assert(b->dev != NULL);
+
+    qvirtio_pci_device_enable(b->dev);
+    qvirtio_reset(&qvirtio_pci, &b->dev->vdev);
+    qvirtio_set_acknowledge(&qvirtio_pci, &b->dev->vdev);
+    qvirtio_set_driver(&qvirtio_pci, &b->dev->vdev);
+
+    features = qvirtio_get_features(&qvirtio_pci, &b->dev->vdev);
+    features &= ~(QVIRTIO_F_BAD_FEATURE |
+                  (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                  (1u << VIRTIO_RING_F_EVENT_IDX));
+    if (queues > 1) {
+        g_assert(features & (1u << VIRTIO_NET_F_MQ));
+    }
+    qvirtio_set_features(&qvirtio_pci, &b->dev->vdev, features);
+}
+
+/* Enable all queue pairs through the control virtqueue */
+static void bench_set_queue_pairs(Bench *b, QVirtQueue *vq)
+{
+    uint64_t req;
+    uint32_t free_head;
+    struct virtio_net_ctrl_hdr hdr = {
+        .class = VIRTIO_NET_CTRL_MQ,
+        .cmd = VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET,
+    };
+    uint16_t pairs = queues;
+    gint64 end;
+
+    req = guest_alloc(b->alloc, 8);
+    memwrite(req, &hdr, sizeof(hdr));
+    memwrite(req + 2, &pairs, sizeof(pairs));
+    writeb(req + 4, 0xff);
+
+    free_head = qvirtqueue_add(vq, req, sizeof(hdr), false, true);
+    qvirtqueue_add(vq, req + 2, sizeof(pairs), false, true);
+    qvirtqueue_add(vq, req + 4, 1, true, false);
+    qvirtqueue_kick(&qvirtio_pci, &b->dev->vdev, vq, free_head);
+
+    end = g_get_monotonic_time() + BENCH_TIMEOUT_US;
+    while (readb(req + 4) == 0xff) {
+        g_assert(g_get_monotonic_time() < end);
+        g_usleep(1000);
+    }
+    g_assert_cmpint(readb(req + 4), ==, VIRTIO_NET_OK);
+}
+
+static Bench *bench_start(const char *mode)
+{
+    Bench *b = g_new0(Bench, 1);
+    QVirtQueue *ctrl_vq = NULL;
+    char *cmdline;
+    unsigned int i;
+    int fd;
+
+    b->tmpdir = g_strdup("/tmp/vhost-user-bench-XXXXXX");
+    if (!mkdtemp(b->tmpdir)) {
+        g_printerr("mkdtemp on path (%s): %s\n", b->tmpdir, strerror(errno));
+        exit(1);
+    }
+    b->socket_path = g_strdup_printf("%s/vhost-user.sock", b->tmpdir);
+    b->mem_path = g_strdup_printf("%s/mem", b->tmpdir);
+
+    /* QEMU uses an existing file as is, so map it before QEMU starts */
+    fd = open(b->mem_path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    g_assert(fd >= 0);
+    g_assert(ftruncate(fd, BENCH_MEM_MB * 1024 * 1024) == 0);
+    b->mem = mmap(NULL, BENCH_MEM_MB * 1024 * 1024, PROT_READ | PROT_WRITE,
+                  MAP_SHARED, fd, 0);
+    g_assert(b->mem != MAP_FAILED);
+    close(fd);
+
+    b->samples = g_array_new(false, false, sizeof(uint64_t));
+
+    bench_spawn_bridge(b, mode);
+
+    cmdline = g_strdup_printf(QEMU_CMD, BENCH_MEM_MB, BENCH_MEM_MB,
+                              b->mem_path, b->socket_path, queues,
+                              queues > 1 ? "on" : "off");
+    qtest_start(cmdline);
+    g_free(cmdline);
+
+    b->pcibus = qpci_init_pc();
+    b->alloc = pc_alloc_init();
+    bench_driver_init(b);
+
+    for (i = 0; i < queues; i++) {
+        BenchQueuePair *qp = &b->qp[i];
+
+        bench_ring_init(b, &qp->rx, qvirtqueue_setup(&qvirtio_pci,
+                        &b->dev->vdev, b->alloc, i * 2), true);
+        bench_ring_init(b, &qp->tx, qvirtqueue_setup(&qvirtio_pci,
+                        &b->dev->vdev, b->alloc, i * 2 + 1), false);
+    }
+    if (queues > 1) {
+        ctrl_vq = qvirtqueue_setup(&qvirtio_pci, &b->dev->vdev, b->alloc,
+                                   queues * 2);
+    }
+
+    qvirtio_set_driver_ok(&qvirtio_pci, &b->dev->vdev);
+    if (ctrl_vq) {
+        bench_set_queue_pairs(b, ctrl_vq);
+    }
+    return b;
+}
+
+static void bench_end(Bench *b)
+{
+    qtest_end();
+
+    kill(b->bridge_pid, SIGTERM);
+    waitpid(b->bridge_pid, NULL, 0);
+    g_spawn_close_pid(b->bridge_pid);
+
+    munmap(b->mem, BENCH_MEM_MB * 1024 * 1024);
+    unlink(b->mem_path);
+    unlink(b->socket_path);
+    rmdir(b->tmpdir);
+    g_free(b->mem_path);
+    g_free(b->socket_path);
+    g_free(b->tmpdir);
+    g_array_free(b->samples, true);
+    g_free(b);
+}
+
+static void test_tx(void)
+{
+    Bench *b = bench_start("sink");
+    uint64_t start, end, now, pkts = 0;
+    unsigned int i, j;
+    int id;
+
+    for (i = 0; i < queues; i++) {
+        BenchQueuePair *qp = &b->qp[i];
+
+        for (j = 0; j < qp->tx.vq->size; j++) {
+            bench_stamp(b, qp, j, i);
+            bench_ring_post(&qp->tx, j);
+        }
+        bench_ring_publish(b, &qp->tx);
+    }
+
+    start = vubr_now_ns();
+    end = start + duration * 1000000000ULL;
+    do {
+        for (i = 0; i < queues; i++) {
+            BenchQueuePair *qp = &b->qp[i];
+            bool posted = false;
+
+            while ((id = bench_ring_get(&qp->tx, NULL)) >= 0) {
+                bench_stamp(b, qp, id, i);
+                bench_ring_post(&qp->tx, id);
+                posted = true;
+                pkts++;
+            }
+            if (posted) {
+                bench_ring_publish(b, &qp->tx);
+            }
+        }
+        now = vubr_now_ns();
+    } while (now < end);
+
+    bench_report_rate("tx", pkts, now - start);
+    g_assert_cmpint(pkts, >, 0);
+    bench_end(b);
+}
+
+static void test_rx(void)
+{
+    Bench *b = bench_start("gen");
+    uint64_t start, end, now, pkts = 0;
+    unsigned int i, j;
+    VubrStamp stamp;
+    uint32_t len;
+    int id;
+
+    for (i = 0; i < queues; i++) {
+        BenchQueuePair *qp = &b->qp[i];
+
+        for (j = 0; j < qp->rx.vq->size; j++) {
+            bench_ring_post(&qp->rx, j);
+        }
+        bench_ring_publish(b, &qp->rx);
+    }
+
+    start = vubr_now_ns();
+    end = start + duration * 1000000000ULL;
+    do {
+        for (i = 0; i < queues; i++) {
+            BenchQueuePair *qp = &b->qp[i];
+            bool posted = false;
+
+            while ((id = bench_ring_get(&qp->rx, &len)) >= 0) {
+                uint8_t *buf = bench_ring_buf(b, &qp->rx, id);
+
+                if (len > VNET_HDR_SIZE &&
+                    vubr_packet_stamp(buf + VNET_HDR_SIZE,
+                                      len - VNET_HDR_SIZE, &stamp)) {
+                    bench_sample(b, vubr_now_ns() - stamp.ns);
+                }
+                bench_ring_post(&qp->rx, id);
+                posted = true;
+                pkts++;
+            }
+            if (posted) {
+                bench_ring_publish(b, &qp->rx);
+            }
+        }
+        now = vubr_now_ns();
+    } while (now < end);
+
+    bench_report_rate("rx", pkts, now - start);
+    bench_report_latency(b, "rx one-way latency");
+    g_assert_cmpint(pkts, >, 0);
+    bench_end(b);
+}
+
+/*
+ * One packet in flight at a time on the first queue pair: each round
+ * trip goes through the TX ring, the bridge and back into the RX ring.
+ */
+static void test_latency(void)
+{
+    Bench *b = bench_start("reflect");
+    BenchQueuePair *qp = &b->qp[0];
+    uint64_t end, timeout, sent;
+    unsigned int j;
+    VubrStamp stamp;
+    uint32_t len;
+    int id, tx_id = 0;
+
+    for (j = 0; j < qp->rx.vq->size; j++) {
+        bench_ring_post(&qp->rx, j);
+    }
+    bench_ring_publish(b, &qp->rx);
+
+    end = vubr_now_ns() + duration * 1000000000ULL;
+    while (vubr_now_ns() < end) {
+        bench_stamp(b, qp, tx_id, 0);
+        sent = qp->seq - 1;
+        bench_ring_post(&qp->tx, tx_id);
+        bench_ring_publish(b, &qp->tx);
+
+        timeout = vubr_now_ns() + BENCH_TIMEOUT_US * 1000ULL;
+        for (;;) {
+            id = bench_ring_get(&qp->rx, &len);
+            if (id >= 0) {
+                uint8_t *buf = bench_ring_buf(b, &qp->rx, id);
+                bool done = len > VNET_HDR_SIZE &&
+                    vubr_packet_stamp(buf + VNET_HDR_SIZE,
+                                      len - VNET_HDR_SIZE, &stamp) &&
+                    stamp.seq == sent;
+
+                if (done) {
+                    bench_sample(b, vubr_now_ns() - stamp.ns);
+                }
+                bench_ring_post(&qp->rx, id);
+                bench_ring_publish(b, &qp->rx);
+                if (done) {
+                    break;
+                }
+            }
+            g_assert(vubr_now_ns() < timeout);
+        }
+
+        while ((id = bench_ring_get(&qp->tx, NULL)) < 0) {
+            g_assert(vubr_now_ns() < timeout);
+        }
+        tx_id = id;
+    }
+
+    bench_report_latency(b, "round trip time");
+    g_assert_cmpint(b->samples->len, >, 0);
+    bench_end(b);
+}
+
+static void usage(const char *progname)
+{
+    fprintf(stderr, "Usage: %s [glib test options] [-d secs] [-q queues] "
+            "[-s size]\n", progname);
+    fprintf(stderr, "\t-d duration of each test in seconds. default: %u\n",
+            duration);
+    fprintf(stderr, "\t-q number of queue pairs (1-%d). default: %u\n",
+            BENCH_MAX_QUEUE_PAIRS, queues);
+    fprintf(stderr, "\t-s packet size in bytes (%zu-%d). default: %u\n",
+            VUBR_MIN_PKT_SIZE, BENCH_BUF_SIZE - (int)VNET_HDR_SIZE,
+            pkt_size);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *env;
+    int opt;
+
+    g_test_init(&argc, &argv, NULL);
+
+    while ((opt = getopt(argc, argv, "d:q:s:h")) != -1) {
+        switch (opt) {
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'q':
+            queues = atoi(optarg);
+            break;
+        case 's':
+            pkt_size = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!duration || !queues || queues > BENCH_MAX_QUEUE_PAIRS ||
+        pkt_size < VUBR_MIN_PKT_SIZE ||
+        pkt_size > BENCH_BUF_SIZE - VNET_HDR_SIZE) {
+        usage(argv[0]);
+    }
+
+    env = getenv("QTEST_VHOST_USER_BRIDGE");
+    if (env) {
+        bridge_path = env;
+    }
+
+    qtest_add_func("/vhost-user-bench/tx", test_tx);
+    qtest_add_func("/vhost-user-bench/rx", test_rx);
+    qtest_add_func("/vhost-user-bench/latency", test_latency);
+
+    return g_test_run();
+}
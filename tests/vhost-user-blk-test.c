@@ -0,0 +1,183 @@
+/*
+ * QTest testcase for vhost-user-blk, against contrib/vhost-user-blk
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Without KVM there are no ioeventfds, so vhost cannot be started here;
+ * the tests cover what happens on the vhost-user socket before that:
+ * the initial handshake, the config space and reconnecting to a new
+ * instance of the backend.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/wait.h>
+#include "libqtest.h"
+#include "libqos/virtio.h"
+#include "libqos/virtio-pci.h"
+#include "libqos/pci-pc.h"
+#include "standard-headers/linux/virtio_ids.h"
+#include "standard-headers/linux/virtio_pci.h"
+
+#define TEST_IMAGE_SIZE         (64 * 1024 * 1024)
+#define TEST_IMAGE_SIZE2        (128 * 1024 * 1024)
+#define TIMEOUT_US              (10 * 1000 * 1000)
+
+static const char *backend_binary;
+static char *tmpdir, *sock_path;
+
+static char *image_create(const char *name, off_t size)
+{
+    char *path = g_strdup_printf("%s/%s", tmpdir, name);
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    g_assert_cmpint(fd, >=, 0);
+    g_assert_cmpint(ftruncate(fd, size), ==, 0);
+    close(fd);
+    return path;
+}
+
+/* Start the backend on @image and wait until it listens */
+static pid_t backend_start(const char *image)
+{
+    gint64 end_time = g_get_monotonic_time() + TIMEOUT_US;
+    pid_t pid;
+
+    unlink(sock_path);
+    pid = fork();
+    g_assert_cmpint(pid, >=, 0);
+    if (pid == 0) {
+        execl(backend_binary, backend_binary, "-s", sock_path,
+              "-f", "raw", image, NULL);
+        _exit(1);
+    }
+
+    while (access(sock_path, F_OK) < 0) {
+        g_assert_cmpint(g_get_monotonic_time(), <, end_time);
+        g_assert_cmpint(waitpid(pid, NULL, WNOHANG), ==, 0);
+        g_usleep(10 * 1000);
+    }
+    return pid;
+}
+
+static void backend_stop(pid_t pid)
+{
+    int status;
+
+    kill(pid, SIGTERM);
+    g_assert_cmpint(waitpid(pid, &status, 0), ==, pid);
+}
+
+static QVirtioPCIDevice *vhost_user_blk_start(QPCIBus **bus)
+{
+    QVirtioPCIDevice *dev;
+    char *cmdline;
+
+    /* Realize waits until the backend is connected */
+    cmdline = g_strdup_printf("-chardev socket,id=chr0,path=%s,reconnect=1 "
+                              "-device vhost-user-blk-pci,chardev=chr0",
+                              sock_path);
+    qtest_start(cmdline);
+    g_free(cmdline);
+
+    *bus = qpci_init_pc();
+    dev = qvirtio_pci_device_find(*bus, VIRTIO_ID_BLOCK);
+    g_assert(dev != NULL);
+    qvirtio_pci_device_enable(dev);
+    return dev;
+}
+
+static uint64_t read_capacity(QVirtioPCIDevice *dev)
+{
+    /* MSI-X is not enabled */
+    void *addr = dev->addr + VIRTIO_PCI_CONFIG_OFF(false);
+
+    return qvirtio_config_readq(&qvirtio_pci, &dev->vdev,
+                                (uint64_t)(uintptr_t)addr);
+}
+
+static void vhost_user_blk_end(QVirtioPCIDevice *dev, QPCIBus *bus)
+{
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    qtest_end();
+}
+
+/* Realize reads the config space from the backend */
+static void test_realize(void)
+{
+    char *image = image_create("disk0", TEST_IMAGE_SIZE);
+    pid_t pid = backend_start(image);
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+
+    dev = vhost_user_blk_start(&bus);
+    g_assert_cmphex(dev->vdev.device_type, ==, VIRTIO_ID_BLOCK);
+    g_assert_cmpint(read_capacity(dev), ==, TEST_IMAGE_SIZE / 512);
+    vhost_user_blk_end(dev, bus);
+
+    backend_stop(pid);
+    unlink(image);
+    g_free(image);
+}
+
+/* A restarted backend is picked up again, with its new config space */
+static void test_reconnect(void)
+{
+    char *image = image_create("disk0", TEST_IMAGE_SIZE);
+    char *image2 = image_create("disk1", TEST_IMAGE_SIZE2);
+    gint64 end_time;
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    pid_t pid;
+
+    pid = backend_start(image);
+    dev = vhost_user_blk_start(&bus);
+    g_assert_cmpint(read_capacity(dev), ==, TEST_IMAGE_SIZE / 512);
+
+    backend_stop(pid);
+    pid = backend_start(image2);
+
+    end_time = g_get_monotonic_time() + TIMEOUT_US;
+    while (read_capacity(dev) != TEST_IMAGE_SIZE2 / 512) {
+        g_assert_cmpint(g_get_monotonic_time(), <, end_time);
+        g_usleep(100 * 1000);
+    }
+    vhost_user_blk_end(dev, bus);
+
+    backend_stop(pid);
+    unlink(image);
+    unlink(image2);
+    g_free(image);
+    g_free(image2);
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    backend_binary = getenv("QTEST_VHOST_USER_BLK");
+    if (!backend_binary || access(backend_binary, X_OK) < 0) {
+        g_test_message("Skipping test, vhost-user-blk backend not found");
+        return 0;
+    }
+
+    tmpdir = g_strdup("/tmp/vhost-user-blk-test-XXXXXX");
+    g_assert(mkdtemp(tmpdir));
+    sock_path = g_strdup_printf("%s/vhost-user-blk.sock", tmpdir);
+
+    qtest_add_func("/vhost-user-blk/realize", test_realize);
+    qtest_add_func("/vhost-user-blk/reconnect", test_reconnect);
+
+    ret = g_test_run();
+
+    unlink(sock_path);
+    rmdir(tmpdir);
+    g_free(sock_path);
+    g_free(tmpdir);
+    return ret;
+}
@@ -11,17 +11,20 @@
  */
 
 /*
+ * The control socket is served by the main thread, while each queue pair
+ * is processed by a thread of its own.  Besides bridging the guest to a
+ * UDP socket, the backend can act as a traffic sink, a traffic generator
+ * or a reflector, which together with tests/vhost-user-bench.c make it a
+ * benchmark target for virtio-net over vhost-user.
+ *
  * TODO:
- *     - main should get parameters from the command line.
  *     - implement all request handlers. Still not implemented:
- *          vubr_get_queue_num_exec()
  *          vubr_send_rarp_exec()
  *     - test for broken requests and virtqueue.
  *     - implement features defined by Virtio 1.0 spec.
  *     - support mergeable buffers and indirect descriptors.
  *     - implement clean shutdown.
  *     - implement non-blocking writes to UDP backend.
- *     - implement polling strategy.
  *     - implement clean starting/stopping of vq processing
  *     - implement clean starting/stopping of used and buffers
  *       dirty page logging.
@@ -39,14 +42,19 @@
 #include <linux/vhost.h>
 
 #include "qemu/atomic.h"
+#include "qemu/thread.h"
 #include "standard-headers/linux/virtio_net.h"
 #include "standard-headers/linux/virtio_ring.h"
+#include "vhost-user-bridge.h"
 
 #define VHOST_USER_BRIDGE_DEBUG 1
 
+/* Off in the benchmark modes, where it would dominate the run time */
+static bool vubr_debug = VHOST_USER_BRIDGE_DEBUG;
+
 #define DPRINT(...) \
     do { \
-        if (VHOST_USER_BRIDGE_DEBUG) { \
+        if (vubr_debug) { \
             printf(__VA_ARGS__); \
         } \
     } while (0)
@@ -101,23 +109,6 @@ dispatcher_add(Dispatcher *dispr, int sock, void *ctx, CallbackFunc cb)
     return 0;
 }
 
-/* dispatcher_remove() is not currently in use but may be useful
- * in the future. */
-static int
-dispatcher_remove(Dispatcher *dispr, int sock)
-{
-    if (sock >= FD_SETSIZE) {
-        fprintf(stderr,
-                "Error: Failed to remove event. sock %d should be less than %d\n",
-                sock, FD_SETSIZE);
-        return -1;
-    }
-
-    FD_CLR(sock, &dispr->fdset);
-    DPRINT("Sock %d removed from dispatcher watch.\n", sock);
-    return 0;
-}
-
 /* timeout in us */
 static int
 dispatcher_wait(Dispatcher *dispr, uint32_t timeout)
@@ -256,7 +247,51 @@ typedef struct VhostUserMsg {
 /* The version of the protocol we support */
 #define VHOST_USER_VERSION    (0x1)
 
-#define MAX_NR_VIRTQUEUE (8)
+#define VHOST_USER_MAX_QUEUE_PAIRS (8)
+#define MAX_NR_VIRTQUEUE (2 * VHOST_USER_MAX_QUEUE_PAIRS)
+
+typedef enum VubrMode {
+    VUBR_MODE_BRIDGE,   /* forward packets to and from a UDP socket */
+    VUBR_MODE_SINK,     /* drop the packets sent by the guest */
+    VUBR_MODE_GEN,      /* fill the guest's RX queue with packets */
+    VUBR_MODE_REFLECT,  /* send the guest's packets back to it */
+} VubrMode;
+
+static const char *vubr_mode_str[] = {
+    [VUBR_MODE_BRIDGE]  = "bridge",
+    [VUBR_MODE_SINK]    = "sink",
+    [VUBR_MODE_GEN]     = "gen",
+    [VUBR_MODE_REFLECT] = "reflect",
+};
+
+/* Packets moved between a virtqueue and the backend in one go */
+#define VUBR_BATCH 256
+
+/* Latency histogram, in microseconds; the last bucket is for outliers */
+#define VUBR_LAT_BUCKETS 1024
+
+typedef struct VubrStats {
+    uint64_t tx_pkts;           /* from the guest */
+    uint64_t rx_pkts;           /* to the guest */
+    uint64_t rx_drops;          /* no RX buffer available */
+    uint64_t lat_count;
+    uint64_t lat_sum_ns;
+    uint64_t lat_max_ns;
+    uint64_t lat_hist[VUBR_LAT_BUCKETS];
+} VubrStats;
+
+typedef struct VubrQueuePair {
+    struct VubrDev *dev;
+    int index;
+    QemuThread thread;
+    /* Taken by the control path while it changes the virtqueues */
+    QemuMutex lock;
+    int backend_udp_sock;
+    struct sockaddr_in backend_udp_dest;
+    uint64_t gen_seq;
+    VubrStats stats;
+    VubrStats last_stats;       /* main thread only */
+} VubrQueuePair;
 
 typedef struct VubrDevRegion {
     /* Guest Physical address. */
@@ -280,11 +315,13 @@ typedef struct VubrDev {
     int log_call_fd;
     uint64_t log_size;
     uint8_t *log_table;
-    int backend_udp_sock;
-    struct sockaddr_in backend_udp_dest;
-    int ready;
     uint64_t features;
     int hdrlen;
+    VubrMode mode;
+    bool poll;                  /* busy poll the virtqueues */
+    uint32_t pkt_size;          /* of generated packets, without header */
+    int queues;
+    VubrQueuePair qp[VHOST_USER_MAX_QUEUE_PAIRS];
 } VubrDev;
 
 static const char *vubr_request_str[] = {
@@ -446,42 +483,51 @@ vubr_message_write(int conn_fd, VhostUserMsg *vmsg)
 }
 
 static void
-vubr_backend_udp_sendbuf(VubrDev *dev, uint8_t *buf, size_t len)
+vubr_backend_udp_sendbuf(VubrQueuePair *qp, uint8_t *buf, size_t len)
 {
     int slen = sizeof(struct sockaddr_in);
 
-    if (sendto(dev->backend_udp_sock, buf, len, 0,
-               (struct sockaddr *) &dev->backend_udp_dest, slen) == -1) {
+    if (sendto(qp->backend_udp_sock, buf, len, 0,
+               (struct sockaddr *) &qp->backend_udp_dest, slen) == -1) {
         vubr_die("sendto()");
     }
 }
 
+/* Returns -1 if there is nothing to read */
 static int
-vubr_backend_udp_recvbuf(VubrDev *dev, uint8_t *buf, size_t buflen)
+vubr_backend_udp_recvbuf(VubrQueuePair *qp, uint8_t *buf, size_t buflen)
 {
     int slen = sizeof(struct sockaddr_in);
     int rc;
 
-    rc = recvfrom(dev->backend_udp_sock, buf, buflen, 0,
-                  (struct sockaddr *) &dev->backend_udp_dest,
+    rc = recvfrom(qp->backend_udp_sock, buf, buflen, MSG_DONTWAIT,
+                  (struct sockaddr *) &qp->backend_udp_dest,
                   (socklen_t *)&slen);
-    if (rc == -1) {
+    if (rc == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
         vubr_die("recvfrom()");
     }
 
     return rc;
 }
 
+/* Statistics are only written by the thread of their queue pair. */
 static void
-vubr_consume_raw_packet(VubrDev *dev, uint8_t *buf, uint32_t len)
+vubr_stats_add(uint64_t *counter, uint64_t n)
 {
-    int hdrlen = dev->hdrlen;
-    DPRINT("    hdrlen = %d\n", dev->hdrlen);
+    atomic_set(counter, *counter + n);
+}
 
-    if (VHOST_USER_BRIDGE_DEBUG) {
-        print_buffer(buf, len);
+static void
+vubr_stats_latency(VubrStats *stats, uint64_t ns)
+{
+    uint64_t us = MIN(ns / 1000, VUBR_LAT_BUCKETS - 1);
+
+    vubr_stats_add(&stats->lat_hist[us], 1);
+    vubr_stats_add(&stats->lat_sum_ns, ns);
+    vubr_stats_add(&stats->lat_count, 1);
+    if (ns > stats->lat_max_ns) {
+        atomic_set(&stats->lat_max_ns, ns);
     }
-    vubr_backend_udp_sendbuf(dev, buf + hdrlen, len - hdrlen);
 }
 
 /* Kick the log_call_fd if required. */
@@ -531,6 +577,26 @@ vubr_log_write(VubrDev *dev, uint64_t address, uint64_t length)
     vubr_log_kick(dev);
 }
 
+static bool
+vubr_virtqueue_has_avail(VubrVirtq *vq)
+{
+    return vq->last_avail_index != atomic_mb_read(&vq->avail->idx);
+}
+
+/* Make the buffers added to the used ring visible and notify the guest. */
+static void
+vubr_virtqueue_flush(VubrDev *dev, VubrVirtq *vq)
+{
+    atomic_mb_set(&vq->used->idx, vq->last_used_index);
+    vubr_log_write(dev,
+                   vq->log_guest_addr + offsetof(struct vring_used, idx),
+                   sizeof(vq->used->idx));
+
+    /* Kick the guest if necessary. */
+    vubr_virtqueue_kick(vq);
+}
+
+/* Copy a packet to the guest; vubr_virtqueue_flush() publishes it. */
 static void
 vubr_post_buffer(VubrDev *dev, VubrVirtq *vq, uint8_t *buf, int32_t len)
 {
@@ -607,19 +673,67 @@ vubr_post_buffer(VubrDev *dev, VubrVirtq *vq, uint8_t *buf, int32_t len)
 
     vq->last_avail_index++;
     vq->last_used_index++;
+}
 
-    atomic_mb_set(&used->idx, vq->last_used_index);
-    vubr_log_write(dev,
-                   log_guest_addr + offsetof(struct vring_used, idx),
-                   sizeof(used->idx));
+/* Post a packet, virtio-net header included, to the guest's RX queue. */
+static void
+vubr_rx_packet(VubrQueuePair *qp, uint8_t *buf, int32_t len)
+{
+    VubrDev *dev = qp->dev;
+    VubrVirtq *rx_vq = &dev->vq[qp->index * 2];
+    struct virtio_net_hdr_v1 *hdr = (struct virtio_net_hdr_v1 *)buf;
 
-    /* Kick the guest if necessary. */
-    vubr_virtqueue_kick(vq);
+    if (!vubr_virtqueue_has_avail(rx_vq)) {
+        DPRINT("Got packet, but no available descriptors on RX virtq.\n");
+        vubr_stats_add(&qp->stats.rx_drops, 1);
+        return;
+    }
+
+    /* TODO: support mergeable buffers. */
+    if (dev->hdrlen == 12) {
+        hdr->num_buffers = 1;
+    }
+    vubr_post_buffer(dev, rx_vq, buf, len);
+    vubr_stats_add(&qp->stats.rx_pkts, 1);
+}
+
+static void
+vubr_consume_raw_packet(VubrQueuePair *qp, uint8_t *buf, uint32_t len)
+{
+    VubrDev *dev = qp->dev;
+    int hdrlen = dev->hdrlen;
+    VubrStamp stamp;
+
+    DPRINT("    hdrlen = %d\n", dev->hdrlen);
+
+    if (vubr_debug) {
+        print_buffer(buf, len);
+    }
+    vubr_stats_add(&qp->stats.tx_pkts, 1);
+
+    switch (dev->mode) {
+    case VUBR_MODE_BRIDGE:
+        vubr_backend_udp_sendbuf(qp, buf + hdrlen, len - hdrlen);
+        break;
+    case VUBR_MODE_SINK:
+        if (len > hdrlen &&
+            vubr_packet_stamp(buf + hdrlen, len - hdrlen, &stamp)) {
+            vubr_stats_latency(&qp->stats, vubr_now_ns() - stamp.ns);
+        }
+        break;
+    case VUBR_MODE_REFLECT:
+        memset(buf, 0, hdrlen);
+        vubr_rx_packet(qp, buf, len);
+        break;
+    case VUBR_MODE_GEN:
+        break;
+    }
 }
 
 static int
-vubr_process_desc(VubrDev *dev, VubrVirtq *vq)
+vubr_process_desc(VubrQueuePair *qp, VubrVirtq *vq)
 {
+    VubrDev *dev = qp->dev;
     struct vring_desc *desc = vq->desc;
     struct vring_avail *avail = vq->avail;
     struct vring_used *used = vq->used;
@@ -672,81 +786,161 @@ vubr_process_desc(VubrDev *dev, VubrVirtq *vq)
                    log_guest_addr + offsetof(struct vring_used, ring[u_index]),
                    sizeof(used->ring[u_index]));
 
-    vubr_consume_raw_packet(dev, buf, len);
+    vubr_consume_raw_packet(qp, buf, len);
 
     return 0;
 }
 
 static void
-vubr_process_avail(VubrDev *dev, VubrVirtq *vq)
+vubr_process_avail(VubrQueuePair *qp, VubrVirtq *vq)
 {
-    struct vring_avail *avail = vq->avail;
-    struct vring_used *used = vq->used;
-    uint64_t log_guest_addr = vq->log_guest_addr;
+    int n = 0;
 
-    while (vq->last_avail_index != atomic_mb_read(&avail->idx)) {
-        vubr_process_desc(dev, vq);
+    while (n < VUBR_BATCH && vubr_virtqueue_has_avail(vq)) {
+        vubr_process_desc(qp, vq);
         vq->last_avail_index++;
         vq->last_used_index++;
+        n++;
     }
 
-    atomic_mb_set(&used->idx, vq->last_used_index);
-    vubr_log_write(dev,
-                   log_guest_addr + offsetof(struct vring_used, idx),
-                   sizeof(used->idx));
+    if (n) {
+        vubr_virtqueue_flush(qp->dev, vq);
+    }
 }
 
 static void
-vubr_backend_recv_cb(int sock, void *ctx)
+vubr_backend_recv(VubrQueuePair *qp)
 {
-    VubrDev *dev = (VubrDev *) ctx;
-    VubrVirtq *rx_vq = &dev->vq[0];
+    VubrDev *dev = qp->dev;
+    VubrVirtq *rx_vq = &dev->vq[qp->index * 2];
     uint8_t buf[4096];
-    struct virtio_net_hdr_v1 *hdr = (struct virtio_net_hdr_v1 *)buf;
     int hdrlen = dev->hdrlen;
     int buflen = sizeof(buf);
-    int len;
+    int n, len;
+
+    /* If there are no available descriptors, just do nothing.
+     * The packets will be handled once the guest posts more
+     * buffers on the receive virtq. */
+    for (n = 0; n < VUBR_BATCH && vubr_virtqueue_has_avail(rx_vq); n++) {
+        memset(buf, 0, hdrlen);
+        len = vubr_backend_udp_recvbuf(qp, buf + hdrlen, buflen - hdrlen);
+        if (len < 0) {
+            break;
+        }
+        DPRINT("\n\n   ***   IN UDP RECEIVE CALLBACK    ***\n\n");
+        vubr_rx_packet(qp, buf, len + hdrlen);
+    }
+}
 
-    if (!dev->ready) {
-        return;
+static void
+vubr_generate(VubrQueuePair *qp)
+{
+    VubrDev *dev = qp->dev;
+    VubrVirtq *rx_vq = &dev->vq[qp->index * 2];
+    uint8_t buf[4096] = { };
+    int hdrlen = dev->hdrlen;
+    int n;
+
+    for (n = 0; n < VUBR_BATCH && vubr_virtqueue_has_avail(rx_vq); n++) {
+        memset(buf, 0, hdrlen);
+        vubr_stamp_packet(buf + hdrlen, qp->index, qp->gen_seq++);
+        vubr_rx_packet(qp, buf, hdrlen + dev->pkt_size);
     }
+}
 
-    DPRINT("\n\n   ***   IN UDP RECEIVE CALLBACK    ***\n\n");
-    DPRINT("    hdrlen = %d\n", hdrlen);
+/* Called with qp->lock held */
+static bool
+vubr_queue_pair_ready(VubrQueuePair *qp)
+{
+    VubrVirtq *rx_vq = &qp->dev->vq[qp->index * 2];
+    VubrVirtq *tx_vq = rx_vq + 1;
 
-    uint16_t avail_index = atomic_mb_read(&rx_vq->avail->idx);
+    return rx_vq->kick_fd != -1 && tx_vq->kick_fd != -1 &&
+           rx_vq->enable && tx_vq->enable;
+}
 
-    /* If there is no available descriptors, just do nothing.
-     * The buffer will be handled by next arrived UDP packet,
-     * or next kick on receive virtq. */
-    if (rx_vq->last_avail_index == avail_index) {
-        DPRINT("Got UDP packet, but no available descriptors on RX virtq.\n");
-        return;
+/* Wait for a kick or for a packet from the UDP socket. */
+static void
+vubr_queue_pair_wait(VubrQueuePair *qp)
+{
+    VubrDev *dev = qp->dev;
+    struct timeval tv = { .tv_sec = 0, .tv_usec = 100000 };
+    fd_set fdset;
+    int fd, max_fd = -1;
+    int i;
+
+    FD_ZERO(&fdset);
+    qemu_mutex_lock(&qp->lock);
+    for (i = 0; i < 2; i++) {
+        fd = dev->vq[qp->index * 2 + i].kick_fd;
+        if (fd != -1) {
+            FD_SET(fd, &fdset);
+            max_fd = MAX(max_fd, fd);
+        }
     }
+    qemu_mutex_unlock(&qp->lock);
 
-    memset(buf, 0, hdrlen);
-    /* TODO: support mergeable buffers. */
-    if (hdrlen == 12)
-        hdr->num_buffers = 1;
-    len = vubr_backend_udp_recvbuf(dev, buf + hdrlen, buflen - hdrlen);
+    if (dev->mode == VUBR_MODE_BRIDGE) {
+        FD_SET(qp->backend_udp_sock, &fdset);
+        max_fd = MAX(max_fd, qp->backend_udp_sock);
+    }
 
-    vubr_post_buffer(dev, rx_vq, buf, len + hdrlen);
+    /* The control path may close the kick fds meanwhile, so a failure
+     * only means that the virtqueues have to be looked at again. */
+    select(max_fd + 1, &fdset, NULL, NULL, &tv);
 }
 
-static void
-vubr_kick_cb(int sock, void *ctx)
+static void *
+vubr_queue_pair_thread(void *opaque)
 {
-    VubrDev *dev = (VubrDev *) ctx;
+    VubrQueuePair *qp = opaque;
+    VubrDev *dev = qp->dev;
+    VubrVirtq *rx_vq = &dev->vq[qp->index * 2];
+    VubrVirtq *tx_vq = rx_vq + 1;
+    uint16_t used_flags = dev->poll ? VRING_USED_F_NO_NOTIFY : 0;
     eventfd_t kick_data;
-    ssize_t rc;
+    bool ready;
 
-    rc = eventfd_read(sock, &kick_data);
-    if (rc == -1) {
-        vubr_die("eventfd_read()");
-    } else {
-        DPRINT("Got kick_data: %016"PRIx64"\n", kick_data);
-        vubr_process_avail(dev, &dev->vq[1]);
+    while (1) {
+        if (!dev->poll) {
+            vubr_queue_pair_wait(qp);
+        }
+
+        qemu_mutex_lock(&qp->lock);
+        ready = vubr_queue_pair_ready(qp);
+        if (ready) {
+            if (dev->poll) {
+                /* Tell the guest not to bother kicking us. */
+                if (rx_vq->used->flags != used_flags) {
+                    rx_vq->used->flags = used_flags;
+                }
+                if (tx_vq->used->flags != used_flags) {
+                    tx_vq->used->flags = used_flags;
+                }
+            } else {
+                /* The kick fds are non-blocking. */
+                eventfd_read(rx_vq->kick_fd, &kick_data);
+                eventfd_read(tx_vq->kick_fd, &kick_data);
+            }
+
+            vubr_process_avail(qp, tx_vq);
+            if (dev->mode == VUBR_MODE_BRIDGE) {
+                vubr_backend_recv(qp);
+            } else if (dev->mode == VUBR_MODE_GEN) {
+                vubr_generate(qp);
+            }
+            if (rx_vq->last_used_index != rx_vq->used->idx) {
+                vubr_virtqueue_flush(dev, rx_vq);
+            }
+        }
+        qemu_mutex_unlock(&qp->lock);
+
+        if (!ready && dev->poll) {
+            usleep(1000);
+        }
     }
+
+    return NULL;
 }
 
 static int
@@ -763,6 +957,7 @@ vubr_get_features_exec(VubrDev *dev, VhostUserMsg *vmsg)
             ((1ULL << VIRTIO_NET_F_MRG_RXBUF) |
              (1ULL << VHOST_F_LOG_ALL) |
              (1ULL << VIRTIO_NET_F_GUEST_ANNOUNCE) |
+             (1ULL << VIRTIO_NET_F_MQ) |
              (1ULL << VHOST_USER_F_PROTOCOL_FEATURES));
 
     vmsg->size = sizeof(vmsg->payload.u64);
@@ -815,7 +1010,6 @@ static int
 vubr_reset_device_exec(VubrDev *dev, VhostUserMsg *vmsg)
 {
     vubr_close_log(dev);
-    dev->ready = 0;
     dev->features = 0;
     return 0;
 }
@@ -974,19 +1168,14 @@ vubr_get_vring_base_exec(VubrDev *dev, VhostUserMsg *vmsg)
     DPRINT("State.index: %d\n", index);
     vmsg->payload.state.num = dev->vq[index].last_avail_index;
     vmsg->size = sizeof(vmsg->payload.state);
-    /* FIXME: this is a work-around for a bug in QEMU enabling
-     * too early vrings. When protocol features are enabled,
-     * we have to respect * VHOST_USER_SET_VRING_ENABLE request. */
-    dev->ready = 0;
 
+    /* Closing the kick fd stops the processing of the queue pair. */
     if (dev->vq[index].call_fd != -1) {
         close(dev->vq[index].call_fd);
-        dispatcher_remove(&dev->dispatcher, dev->vq[index].call_fd);
         dev->vq[index].call_fd = -1;
     }
     if (dev->vq[index].kick_fd != -1) {
         close(dev->vq[index].kick_fd);
-        dispatcher_remove(&dev->dispatcher, dev->vq[index].kick_fd);
         dev->vq[index].kick_fd = -1;
     }
 
@@ -1007,30 +1196,18 @@ vubr_set_vring_kick_exec(VubrDev *dev, VhostUserMsg *vmsg)
 
     if (dev->vq[index].kick_fd != -1) {
         close(dev->vq[index].kick_fd);
-        dispatcher_remove(&dev->dispatcher, dev->vq[index].kick_fd);
+    }
+    /* The queue pair's thread drains it without blocking. */
+    if (fcntl(vmsg->fds[0], F_SETFL,
+              fcntl(vmsg->fds[0], F_GETFL) | O_NONBLOCK) == -1) {
+        vubr_die("fcntl");
     }
     dev->vq[index].kick_fd = vmsg->fds[0];
     DPRINT("Got kick_fd: %d for vq: %d\n", vmsg->fds[0], index);
 
-    if (index % 2 == 1) {
-        /* TX queue. */
-        dispatcher_add(&dev->dispatcher, dev->vq[index].kick_fd,
-                       dev, vubr_kick_cb);
-
-        DPRINT("Waiting for kicks on fd: %d for vq: %d\n",
-               dev->vq[index].kick_fd, index);
-    }
-    /* We temporarily use this hack to determine that both TX and RX
-     * queues are set up and ready for processing.
-     * FIXME: we need to rely in VHOST_USER_SET_VRING_ENABLE and
-     * actual kicks. */
-    if (dev->vq[0].kick_fd != -1 &&
-        dev->vq[1].kick_fd != -1) {
-        dev->ready = 1;
-        DPRINT("vhost-user-bridge is ready for processing queues.\n");
-    }
+    /* The queue pair is processed once both its virtqueues have a kick
+     * fd and have been enabled with VHOST_USER_SET_VRING_ENABLE. */
     return 0;
-
 }
 
 static int
@@ -1045,7 +1222,6 @@ vubr_set_vring_call_exec(VubrDev *dev, VhostUserMsg *vmsg)
 
     if (dev->vq[index].call_fd != -1) {
         close(dev->vq[index].call_fd);
-        dispatcher_remove(&dev->dispatcher, dev->vq[index].call_fd);
     }
     dev->vq[index].call_fd = vmsg->fds[0];
     DPRINT("Got call_fd: %d for vq: %d\n", vmsg->fds[0], index);
@@ -1063,7 +1239,8 @@ vubr_set_vring_err_exec(VubrDev *dev, VhostUserMsg *vmsg)
 static int
 vubr_get_protocol_features_exec(VubrDev *dev, VhostUserMsg *vmsg)
 {
-    vmsg->payload.u64 = 1ULL << VHOST_USER_PROTOCOL_F_LOG_SHMFD;
+    vmsg->payload.u64 = 1ULL << VHOST_USER_PROTOCOL_F_LOG_SHMFD |
+                        1ULL << VHOST_USER_PROTOCOL_F_MQ;
     DPRINT("u64: 0x%016"PRIx64"\n", vmsg->payload.u64);
     vmsg->size = sizeof(vmsg->payload.u64);
 
@@ -1082,8 +1259,12 @@ vubr_set_protocol_features_exec(VubrDev *dev, VhostUserMsg *vmsg)
 static int
 vubr_get_queue_num_exec(VubrDev *dev, VhostUserMsg *vmsg)
 {
-    DPRINT("Function %s() not implemented yet.\n", __func__);
-    return 0;
+    vmsg->payload.u64 = dev->queues;
+    DPRINT("u64: 0x%016"PRIx64"\n", vmsg->payload.u64);
+    vmsg->size = sizeof(vmsg->payload.u64);
+
+    /* Reply */
+    return 1;
 }
 
 static int
@@ -1179,9 +1360,19 @@ vubr_receive_cb(int sock, void *ctx)
     VubrDev *dev = (VubrDev *) ctx;
     VhostUserMsg vmsg;
     int reply_requested;
+    int i;
 
     vubr_message_read(sock, &vmsg);
+
+    /* Keep the queue pairs out of the way while the request runs */
+    for (i = 0; i < dev->queues; i++) {
+        qemu_mutex_lock(&dev->qp[i].lock);
+    }
     reply_requested = vubr_execute_request(dev, &vmsg);
+    for (i = 0; i < dev->queues; i++) {
+        qemu_mutex_unlock(&dev->qp[i].lock);
+    }
+
     if (reply_requested) {
         /* Set the version in the flags when sending the reply */
         vmsg.flags &= ~VHOST_USER_VERSION_MASK;
@@ -1227,11 +1418,19 @@ vubr_new(const char *path, bool client)
         };
     }
 
+    for (i = 0; i < VHOST_USER_MAX_QUEUE_PAIRS; i++) {
+        dev->qp[i].dev = dev;
+        dev->qp[i].index = i;
+        dev->qp[i].backend_udp_sock = -1;
+        qemu_mutex_init(&dev->qp[i].lock);
+    }
+    dev->mode = VUBR_MODE_BRIDGE;
+    dev->queues = 1;
+
     /* Init log */
     dev->log_call_fd = -1;
     dev->log_size = 0;
     dev->log_table = 0;
-    dev->ready = 0;
     dev->features = 0;
 
     /* Get a UNIX socket. */
@@ -1298,6 +1497,7 @@ vubr_backend_udp_setup(VubrDev *dev,
 {
     int sock;
     const char *r;
+    int i;
 
     int lport, rport;
 
@@ -1313,42 +1513,133 @@ vubr_backend_udp_setup(VubrDev *dev,
         exit(1);
     }
 
-    struct sockaddr_in si_local = {
-        .sin_family = AF_INET,
-        .sin_port = htons(lport),
-    };
+    /* Queue pair i uses ports lport + i and rport + i. */
+    for (i = 0; i < dev->queues; i++) {
+        VubrQueuePair *qp = &dev->qp[i];
+        struct sockaddr_in si_local = {
+            .sin_family = AF_INET,
+            .sin_port = htons(lport + i),
+        };
 
-    vubr_set_host(&si_local, local_host);
+        vubr_set_host(&si_local, local_host);
 
-    /* setup destination for sends */
-    dev->backend_udp_dest = (struct sockaddr_in) {
-        .sin_family = AF_INET,
-        .sin_port = htons(rport),
-    };
-    vubr_set_host(&dev->backend_udp_dest, remote_host);
+        /* setup destination for sends */
+        qp->backend_udp_dest = (struct sockaddr_in) {
+            .sin_family = AF_INET,
+            .sin_port = htons(rport + i),
+        };
+        vubr_set_host(&qp->backend_udp_dest, remote_host);
 
-    sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if (sock == -1) {
-        vubr_die("socket");
+        sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (sock == -1) {
+            vubr_die("socket");
+        }
+
+        if (bind(sock, (struct sockaddr *)&si_local,
+                 sizeof(si_local)) == -1) {
+            vubr_die("bind");
+        }
+
+        qp->backend_udp_sock = sock;
+        DPRINT("Waiting for data from udp backend on %s:%d...\n",
+               local_host, lport + i);
     }
+}
+
+static void
+vubr_stats_read(VubrStats *dst, VubrStats *src)
+{
+    int i;
 
-    if (bind(sock, (struct sockaddr *)&si_local, sizeof(si_local)) == -1) {
-        vubr_die("bind");
+    dst->tx_pkts = atomic_read(&src->tx_pkts);
+    dst->rx_pkts = atomic_read(&src->rx_pkts);
+    dst->rx_drops = atomic_read(&src->rx_drops);
+    dst->lat_count = atomic_read(&src->lat_count);
+    dst->lat_sum_ns = atomic_read(&src->lat_sum_ns);
+    dst->lat_max_ns = atomic_read(&src->lat_max_ns);
+    for (i = 0; i < VUBR_LAT_BUCKETS; i++) {
+        dst->lat_hist[i] = atomic_read(&src->lat_hist[i]);
     }
+}
 
-    dev->backend_udp_sock = sock;
-    dispatcher_add(&dev->dispatcher, sock, dev, vubr_backend_recv_cb);
-    DPRINT("Waiting for data from udp backend on %s:%d...\n",
-           local_host, lport);
+/* Return the @pct percentile of the latencies, in microseconds. */
+static int
+vubr_stats_percentile(VubrStats *cur, VubrStats *last, int pct)
+{
+    uint64_t count = cur->lat_count - last->lat_count;
+    uint64_t target = (count * pct + 99) / 100;
+    uint64_t sum = 0;
+    int i;
+
+    for (i = 0; i < VUBR_LAT_BUCKETS - 1; i++) {
+        sum += cur->lat_hist[i] - last->lat_hist[i];
+        if (sum >= target) {
+            break;
+        }
+    }
+    return i;
+}
+
+static void
+vubr_print_stats(VubrDev *dev, double secs)
+{
+    VubrStats cur;
+    int i;
+
+    for (i = 0; i < dev->queues; i++) {
+        VubrQueuePair *qp = &dev->qp[i];
+        VubrStats *last = &qp->last_stats;
+        uint64_t lat_count;
+
+        vubr_stats_read(&cur, &qp->stats);
+        printf("queue %d: tx %.0f pps, rx %.0f pps, rx drops %" PRIu64, i,
+               (cur.tx_pkts - last->tx_pkts) / secs,
+               (cur.rx_pkts - last->rx_pkts) / secs,
+               cur.rx_drops - last->rx_drops);
+
+        lat_count = cur.lat_count - last->lat_count;
+        if (lat_count) {
+            /* the last bucket holds everything above it */
+            printf(", latency avg %.1f p50 %d p99 %d max %.1f us",
+                   (cur.lat_sum_ns - last->lat_sum_ns) / 1000.0 / lat_count,
+                   vubr_stats_percentile(&cur, last, 50),
+                   vubr_stats_percentile(&cur, last, 99),
+                   cur.lat_max_ns / 1000.0);
+        }
+        printf("\n");
+        *last = cur;
+    }
+    fflush(stdout);
+}
+
+static void
+vubr_start(VubrDev *dev)
+{
+    char name[32];
+    int i;
+
+    for (i = 0; i < dev->queues; i++) {
+        snprintf(name, sizeof(name), "vubr-qp%d", i);
+        qemu_thread_create(&dev->qp[i].thread, name, vubr_queue_pair_thread,
+                           &dev->qp[i], QEMU_THREAD_DETACHED);
+    }
 }
 
 static void
-vubr_run(VubrDev *dev)
+vubr_run(VubrDev *dev, int stats_interval)
 {
+    uint64_t now, last = vubr_now_ns();
+
     while (1) {
         /* timeout 200ms */
         dispatcher_wait(&dev->dispatcher, 200000);
-        /* Here one can try polling strategy. */
+
+        now = vubr_now_ns();
+        if (stats_interval &&
+            now - last >= stats_interval * 1000000000ULL) {
+            vubr_print_stats(dev, (now - last) / 1e9);
+            last = now;
+        }
     }
 }
 
@@ -1366,11 +1657,26 @@ vubr_parse_host_port(const char **host, const char **port, const char *buf)
     return 0;
 }
 
+static int
+vubr_parse_mode(VubrMode *mode, const char *buf)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(vubr_mode_str); i++) {
+        if (!strcmp(buf, vubr_mode_str[i])) {
+            *mode = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
 #define DEFAULT_UD_SOCKET "/tmp/vubr.sock"
 #define DEFAULT_LHOST "127.0.0.1"
 #define DEFAULT_LPORT "4444"
 #define DEFAULT_RHOST "127.0.0.1"
 #define DEFAULT_RPORT "5555"
+#define DEFAULT_PKT_SIZE 64
 
 static const char *ud_socket_path = DEFAULT_UD_SOCKET;
 static const char *lhost = DEFAULT_LHOST;
@@ -1384,8 +1690,13 @@ main(int argc, char *argv[])
     VubrDev *dev;
     int opt;
     bool client = false;
+    VubrMode mode = VUBR_MODE_BRIDGE;
+    int queues = 1;
+    int pkt_size = DEFAULT_PKT_SIZE;
+    int stats_interval = 0;
+    bool poll = false;
 
-    while ((opt = getopt(argc, argv, "l:r:u:c")) != -1) {
+    while ((opt = getopt(argc, argv, "l:r:u:cm:q:s:pi:")) != -1) {
 
         switch (opt) {
         case 'l':
@@ -1404,11 +1715,39 @@ main(int argc, char *argv[])
         case 'c':
             client = true;
             break;
+        case 'm':
+            if (vubr_parse_mode(&mode, optarg) < 0) {
+                goto out;
+            }
+            break;
+        case 'q':
+            queues = atoi(optarg);
+            if (queues < 1 || queues > VHOST_USER_MAX_QUEUE_PAIRS) {
+                goto out;
+            }
+            break;
+        case 's':
+            pkt_size = atoi(optarg);
+            /* generated packets must fit a 4k buffer with the header */
+            if (pkt_size < VUBR_MIN_PKT_SIZE || pkt_size > 4096 - 12) {
+                goto out;
+            }
+            break;
+        case 'p':
+            poll = true;
+            break;
+        case 'i':
+            stats_interval = atoi(optarg);
+            break;
         default:
             goto out;
         }
     }
 
+    if (mode != VUBR_MODE_BRIDGE) {
+        vubr_debug = false;
+    }
+
     DPRINT("ud socket: %s (%s)\n", ud_socket_path,
            client ? "client" : "server");
     DPRINT("local:     %s:%s\n", lhost, lport);
@@ -1418,14 +1757,22 @@ main(int argc, char *argv[])
     if (!dev) {
         return 1;
     }
+    dev->mode = mode;
+    dev->queues = queues;
+    dev->pkt_size = pkt_size;
+    dev->poll = poll;
 
-    vubr_backend_udp_setup(dev, lhost, lport, rhost, rport);
-    vubr_run(dev);
+    if (mode == VUBR_MODE_BRIDGE) {
+        vubr_backend_udp_setup(dev, lhost, lport, rhost, rport);
+    }
+    vubr_start(dev);
+    vubr_run(dev, stats_interval);
     return 0;
 
 out:
     fprintf(stderr, "Usage: %s ", argv[0]);
-    fprintf(stderr, "[-c] [-u ud_socket_path] [-l lhost:lport] [-r rhost:rport]\n");
+    fprintf(stderr, "[-c] [-u ud_socket_path] [-l lhost:lport] [-r rhost:rport]"
+            " [-m mode] [-q queues] [-s size] [-p] [-i secs]\n");
     fprintf(stderr, "\t-u path to unix doman socket. default: %s\n",
             DEFAULT_UD_SOCKET);
     fprintf(stderr, "\t-l local host and port. default: %s:%s\n",
@@ -1433,6 +1780,18 @@ out:
     fprintf(stderr, "\t-r remote host and port. default: %s:%s\n",
             DEFAULT_RHOST, DEFAULT_RPORT);
     fprintf(stderr, "\t-c client mode\n");
+    fprintf(stderr, "\t-m bridge: forward packets to and from UDP (default)\n"
+            "\t   sink: drop packets from the guest\n"
+            "\t   gen: send packets to the guest as fast as possible\n"
+            "\t   reflect: send packets from the guest back to it\n"
+            "\t   The modes other than bridge disable debug output.\n");
+    fprintf(stderr, "\t-q number of queue pairs (1-%d), each one with its "
+            "own thread. default: 1\n", VHOST_USER_MAX_QUEUE_PAIRS);
+    fprintf(stderr, "\t-s size of generated packets. default: %d\n",
+            DEFAULT_PKT_SIZE);
+    fprintf(stderr, "\t-p busy poll the virtqueues instead of waiting for "
+            "kicks\n");
+    fprintf(stderr, "\t-i print statistics every secs seconds\n");
 
     return 1;
 }
@@ -0,0 +1,69 @@
+/*
+ * Vhost User Bridge benchmark packets
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#ifndef VHOST_USER_BRIDGE_H
+#define VHOST_USER_BRIDGE_H
+
+/*
+ * Packets generated by vhost-user-bridge, or timestamped by the guest
+ * for it, are Ethernet frames with the local experimental ethertype and
+ * a VubrStamp right after the Ethernet header.  Timestamps are taken
+ * from CLOCK_MONOTONIC, so both ends have to run on the same host.
+ */
+#define VUBR_ETH_HLEN           14
+#define VUBR_ETH_P_BENCH        0x88b5
+#define VUBR_STAMP_MAGIC        0x56554252  /* "VUBR" */
+
+typedef struct VubrStamp {
+    uint32_t magic;
+    uint32_t queue;
+    uint64_t seq;
+    uint64_t ns;
+} VubrStamp;
+
+#define VUBR_MIN_PKT_SIZE       (VUBR_ETH_HLEN + sizeof(VubrStamp))
+
+static inline uint64_t vubr_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Fill in the Ethernet header and stamp of a benchmark packet */
+static inline void vubr_stamp_packet(uint8_t *pkt, uint32_t queue,
+                                     uint64_t seq)
+{
+    VubrStamp stamp = {
+        .magic = VUBR_STAMP_MAGIC,
+        .queue = queue,
+        .seq = seq,
+        .ns = vubr_now_ns(),
+    };
+
+    memset(pkt, 0xff, 6);
+    memcpy(pkt + 6, "\x52\x54\x00\x12\x34\x56", 6);
+    pkt[12] = VUBR_ETH_P_BENCH >> 8;
+    pkt[13] = VUBR_ETH_P_BENCH & 0xff;
+    memcpy(pkt + VUBR_ETH_HLEN, &stamp, sizeof(stamp));
+}
+
+/* Return the stamp of a benchmark packet, or false for other packets */
+static inline bool vubr_packet_stamp(const uint8_t *pkt, size_t len,
+                                     VubrStamp *stamp)
+{
+    if (len < VUBR_MIN_PKT_SIZE ||
+        pkt[12] != VUBR_ETH_P_BENCH >> 8 ||
+        pkt[13] != (VUBR_ETH_P_BENCH & 0xff)) {
+        return false;
+    }
+    memcpy(stamp, pkt + VUBR_ETH_HLEN, sizeof(*stamp));
+    return stamp->magic == VUBR_STAMP_MAGIC;
+}
+
+#endif
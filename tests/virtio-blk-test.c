@@ -30,6 +30,11 @@
 #define PCI_SLOT                0x04
 #define PCI_FN                  0x00
 
+/* VIRTIO_BLK_POP_BATCH and VIRTIO_BLK_POOL_SIZE in the device */
+#define POP_BATCH               16
+#define POOL_SIZE               128
+#define QUEUE_SIZE              128
+
 #define MMIO_PAGE_SIZE          4096
 #define MMIO_DEV_BASE_ADDR      0x0A003E00
 #define MMIO_RAM_ADDR           0x40000000
@@ -150,6 +155,35 @@ static uint64_t virtio_blk_request(QGuestAllocator *alloc, QVirtioBlkReq *req,
     return addr;
 }
 
+/* Make @n chains visible to the device at once, then notify it */
+static void virtio_blk_kick_batch(QVirtioDevice *d, QVirtQueue *vq,
+                                  const uint32_t *heads, int n)
+{
+    /* vq->avail->idx */
+    uint16_t idx = readw(vq->avail + 2);
+    int i;
+
+    for (i = 0; i < n; i++) {
+        /* vq->avail->ring[idx % vq->size] */
+        writew(vq->avail + 4 + 2 * ((uint16_t)(idx + i) % vq->size),
+               heads[i]);
+    }
+    writew(vq->avail + 2, idx + n);
+    qvirtio_pci.virtqueue_kick(d, vq);
+}
+
+static void virtio_blk_wait_used(QVirtQueue *vq, uint16_t idx)
+{
+    gint64 start_time = g_get_monotonic_time();
+
+    /* vq->used->idx */
+    while (readw(vq->used + 2) != idx) {
+        clock_step(100);
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_BLK_TIMEOUT_US);
+    }
+}
+
 static void test_basic(const QVirtioBus *bus, QVirtioDevice *dev,
             QGuestAllocator *alloc, QVirtQueue *vq, uint64_t device_specific)
 {
@@ -688,6 +722,213 @@ static void pci_idx(void)
     test_end();
 }
 
+/* Batches of requests that are not a multiple of what the device pops
+ * at once */
+static void pci_batch(void)
+{
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    QVirtQueuePCI *vqpci;
+    QGuestAllocator *alloc;
+    QVirtioBlkReq req;
+    uint64_t req_addr[POP_BATCH + 4];
+    uint32_t heads[POP_BATCH + 4];
+    uint32_t features;
+    char data[512], expected[512];
+    int i;
+
+    bus = pci_test_start();
+    dev = virtio_blk_pci_init(bus, PCI_SLOT);
+
+    features = qvirtio_get_features(&qvirtio_pci, &dev->vdev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                            (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                            (1u << VIRTIO_RING_F_EVENT_IDX) |
+                            (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(&qvirtio_pci, &dev->vdev, features);
+
+    alloc = pc_alloc_init();
+    vqpci = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                                                    alloc, 0);
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+
+    /* Fewer requests than a batch: write sectors 0-2 */
+    for (i = 0; i < 3; i++) {
+        req.type = VIRTIO_BLK_T_OUT;
+        req.ioprio = 1;
+        req.sector = i;
+        req.data = g_malloc0(512);
+        sprintf(req.data, "TEST%d", i);
+
+        req_addr[i] = virtio_blk_request(alloc, &req, 512);
+
+        g_free(req.data);
+
+        heads[i] = qvirtqueue_add(&vqpci->vq, req_addr[i], 16, false, true);
+        qvirtqueue_add(&vqpci->vq, req_addr[i] + 16, 512, false, true);
+        qvirtqueue_add(&vqpci->vq, req_addr[i] + 528, 1, true, false);
+    }
+    virtio_blk_kick_batch(&dev->vdev, &vqpci->vq, heads, 3);
+    virtio_blk_wait_used(&vqpci->vq, 3);
+
+    for (i = 0; i < 3; i++) {
+        g_assert_cmpint(readb(req_addr[i] + 528), ==, 0);
+        guest_free(alloc, req_addr[i]);
+    }
+
+    /* A full batch followed by a partial one: read sectors 0-19 */
+    for (i = 0; i < POP_BATCH + 4; i++) {
+        req.type = VIRTIO_BLK_T_IN;
+        req.ioprio = 1;
+        req.sector = i;
+        req.data = g_malloc0(512);
+
+        req_addr[i] = virtio_blk_request(alloc, &req, 512);
+
+        g_free(req.data);
+
+        heads[i] = qvirtqueue_add(&vqpci->vq, req_addr[i], 16, false, true);
+        qvirtqueue_add(&vqpci->vq, req_addr[i] + 16, 512, true, true);
+        qvirtqueue_add(&vqpci->vq, req_addr[i] + 528, 1, true, false);
+    }
+    virtio_blk_kick_batch(&dev->vdev, &vqpci->vq, heads, POP_BATCH + 4);
+    virtio_blk_wait_used(&vqpci->vq, 3 + POP_BATCH + 4);
+
+    for (i = 0; i < POP_BATCH + 4; i++) {
+        g_assert_cmpint(readb(req_addr[i] + 528), ==, 0);
+
+        memset(expected, 0, sizeof(expected));
+        if (i < 3) {
+            sprintf(expected, "TEST%d", i);
+        }
+        memread(req_addr[i] + 16, data, 512);
+        g_assert(memcmp(data, expected, 512) == 0);
+
+        guest_free(alloc, req_addr[i]);
+    }
+
+    /* End test */
+    qvirtqueue_cleanup(&qvirtio_pci, &vqpci->vq, alloc);
+    pc_alloc_uninit(alloc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    test_end();
+}
+
+/* Queue a full ring of write requests on @vq, without kicking it */
+static void pool_queue_requests(QVirtioDevice *d, QGuestAllocator *alloc,
+                                QVirtQueue *vq, uint64_t *req_addr,
+                                uint32_t *heads)
+{
+    QVirtioBlkReq req;
+    QVRingIndirectDesc *indirect;
+    int i;
+
+    for (i = 0; i < QUEUE_SIZE; i++) {
+        req.type = VIRTIO_BLK_T_OUT;
+        req.ioprio = 1;
+        req.sector = i;
+        req.data = g_malloc0(512);
+
+        req_addr[i] = virtio_blk_request(alloc, &req, 512);
+
+        g_free(req.data);
+
+        /* One ring slot per request, so that the ring can hold more
+         * requests than the pool */
+        indirect = qvring_indirect_desc_setup(d, alloc, 2);
+        qvring_indirect_desc_add(indirect, req_addr[i], 528, false);
+        qvring_indirect_desc_add(indirect, req_addr[i] + 528, 1, true);
+        heads[i] = qvirtqueue_add_indirect(vq, indirect);
+        g_free(indirect);
+    }
+}
+
+static void pool_check_requests(QGuestAllocator *alloc, QVirtQueue *vq,
+                                uint64_t *req_addr)
+{
+    int i;
+
+    virtio_blk_wait_used(vq, QUEUE_SIZE);
+    for (i = 0; i < QUEUE_SIZE; i++) {
+        g_assert_cmpint(readb(req_addr[i] + 528), ==, 0);
+        guest_free(alloc, req_addr[i]);
+    }
+}
+
+/* More requests in flight than the element pool has room for.  The ones
+ * that don't get a slot come from the heap, and the slots can be used
+ * again once all of them completed. */
+static void pci_pool(void)
+{
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    QVirtQueuePCI *vqpci[3];
+    QGuestAllocator *alloc;
+    uint64_t req_addr[3][QUEUE_SIZE];
+    uint32_t heads[3][QUEUE_SIZE];
+    uint32_t features;
+    char *cmdline;
+    int i;
+
+    /* The requests stay in flight for a second */
+    cmdline = g_strdup_printf("-drive if=none,id=drive0,file=null-aio://,"
+                              "file.latency-ns=1000000000,format=raw "
+                              "-device virtio-blk-pci,drive=drive0,"
+                              "num-queues=3,addr=%x.%x",
+                              PCI_SLOT, PCI_FN);
+    qtest_start(cmdline);
+    g_free(cmdline);
+    bus = qpci_init_pc();
+    dev = virtio_blk_pci_init(bus, PCI_SLOT);
+
+    features = qvirtio_get_features(&qvirtio_pci, &dev->vdev);
+    g_assert_cmphex(features & (1u << VIRTIO_RING_F_INDIRECT_DESC), !=, 0);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                            (1u << VIRTIO_RING_F_EVENT_IDX) |
+                            (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(&qvirtio_pci, &dev->vdev, features);
+
+    alloc = pc_alloc_init();
+    for (i = 0; i < 3; i++) {
+        vqpci[i] = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci,
+                                                     &dev->vdev, alloc, i);
+        g_assert_cmpint(vqpci[i]->vq.size, ==, QUEUE_SIZE);
+    }
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+
+    /* The first queue takes all of the pool, the second one none of it */
+    g_assert_cmpint(2 * QUEUE_SIZE, >, POOL_SIZE);
+    for (i = 0; i < 2; i++) {
+        pool_queue_requests(&dev->vdev, alloc, &vqpci[i]->vq,
+                            req_addr[i], heads[i]);
+    }
+    for (i = 0; i < 2; i++) {
+        virtio_blk_kick_batch(&dev->vdev, &vqpci[i]->vq, heads[i],
+                              QUEUE_SIZE);
+    }
+    for (i = 0; i < 2; i++) {
+        pool_check_requests(alloc, &vqpci[i]->vq, req_addr[i]);
+    }
+
+    /* Every slot went back to the pool */
+    pool_queue_requests(&dev->vdev, alloc, &vqpci[2]->vq,
+                        req_addr[2], heads[2]);
+    virtio_blk_kick_batch(&dev->vdev, &vqpci[2]->vq, heads[2], QUEUE_SIZE);
+    pool_check_requests(alloc, &vqpci[2]->vq, req_addr[2]);
+
+    /* End test */
+    for (i = 0; i < 3; i++) {
+        qvirtqueue_cleanup(&qvirtio_pci, &vqpci[i]->vq, alloc);
+    }
+    pc_alloc_uninit(alloc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    test_end();
+}
+
 static void pci_hotplug(void)
 {
     QPCIBus *bus;
@@ -763,6 +1004,8 @@ int main(int argc, char **argv)
         qtest_add_func("/virtio/blk/pci/config", pci_config);
         qtest_add_func("/virtio/blk/pci/msix", pci_msix);
         qtest_add_func("/virtio/blk/pci/idx", pci_idx);
+        qtest_add_func("/virtio/blk/pci/batch", pci_batch);
+        qtest_add_func("/virtio/blk/pci/pool", pci_pool);
         qtest_add_func("/virtio/blk/pci/hotplug", pci_hotplug);
     } else if (strcmp(arch, "arm") == 0) {
         qtest_add_func("/virtio/blk/mmio/basic", mmio_basic);
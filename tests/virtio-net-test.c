@@ -29,6 +29,7 @@
 
 #define QVIRTIO_NET_TIMEOUT_US (30 * 1000 * 1000)
 #define VNET_HDR_SIZE sizeof(struct virtio_net_hdr_mrg_rxbuf)
+#define TX_BATCH_SIZE 8
 
 static void test_end(void)
 {
@@ -140,6 +141,60 @@ static void tx_test(const QVirtioBus *bus, QVirtioDevice *dev,
     g_assert_cmpstr(buffer, ==, "TEST");
 }
 
+/* Several packets made available with a single kick */
+static void tx_batch_test(const QVirtioBus *bus, QVirtioDevice *dev,
+                          QGuestAllocator *alloc, QVirtQueue *vq,
+                          int socket)
+{
+    uint64_t req_addr[TX_BATCH_SIZE];
+    uint32_t heads[TX_BATCH_SIZE];
+    uint32_t len;
+    uint16_t idx;
+    char buffer[64], expected[64];
+    int i, ret;
+
+    /* vq->avail->idx */
+    idx = readw(vq->avail + 2);
+    for (i = 0; i < TX_BATCH_SIZE; i++) {
+        req_addr[i] = guest_alloc(alloc, 64);
+        snprintf(buffer, sizeof(buffer), "TEST%d", i);
+        memwrite(req_addr[i] + VNET_HDR_SIZE, buffer, strlen(buffer) + 1);
+        heads[i] = qvirtqueue_add(vq, req_addr[i], 64, false, false);
+
+        /* vq->avail->ring[idx % vq->size] */
+        writew(vq->avail + 4 + 2 * ((uint16_t)(idx + i) % vq->size),
+               heads[i]);
+    }
+    writew(vq->avail + 2, idx + TX_BATCH_SIZE);
+    bus->virtqueue_kick(dev, vq);
+
+    /* The used ring moves once, by the whole batch, before the interrupt */
+    qvirtio_wait_queue_isr(bus, dev, vq, QVIRTIO_NET_TIMEOUT_US);
+    /* vq->used->idx */
+    g_assert_cmpint(readw(vq->used + 2), ==, (uint16_t)(idx + TX_BATCH_SIZE));
+    for (i = 0; i < TX_BATCH_SIZE; i++) {
+        uint64_t used_elem = vq->used + 4 +
+            sizeof(struct vring_used_elem) * ((uint16_t)(idx + i) % vq->size);
+
+        g_assert_cmpint(readl(used_elem), ==, heads[i]);
+        g_assert_cmpint(readl(used_elem + 4), ==, 0);
+        guest_free(alloc, req_addr[i]);
+    }
+
+    /* ... and the packets went out in order */
+    for (i = 0; i < TX_BATCH_SIZE; i++) {
+        ret = qemu_recv(socket, &len, sizeof(len), 0);
+        g_assert_cmpint(ret, ==, sizeof(len));
+        len = ntohl(len);
+        g_assert_cmpint(len, ==, 64 - VNET_HDR_SIZE);
+
+        ret = qemu_recv(socket, buffer, len, MSG_WAITALL);
+        g_assert_cmpint(ret, ==, len);
+        snprintf(expected, sizeof(expected), "TEST%d", i);
+        g_assert_cmpstr(buffer, ==, expected);
+    }
+}
+
 static void rx_stop_cont_test(const QVirtioBus *bus, QVirtioDevice *dev,
                               QGuestAllocator *alloc, QVirtQueue *vq,
                               int socket)
@@ -195,6 +250,13 @@ static void send_recv_test(const QVirtioBus *bus, QVirtioDevice *dev,
     tx_test(bus, dev, alloc, tvq, socket);
 }
 
+static void batch_test(const QVirtioBus *bus, QVirtioDevice *dev,
+                       QGuestAllocator *alloc, QVirtQueue *rvq,
+                       QVirtQueue *tvq, int socket)
+{
+    tx_batch_test(bus, dev, alloc, tvq, socket);
+}
+
 static void stop_cont_test(const QVirtioBus *bus, QVirtioDevice *dev,
                            QGuestAllocator *alloc, QVirtQueue *rvq,
                            QVirtQueue *tvq, int socket)
@@ -242,8 +304,160 @@ static void pci_basic(gconstpointer data)
     qpci_free_pc(bus);
     test_end();
 }
+
+/*
+ * The tap backend is given one end of a datagram socketpair: it keeps the
+ * packet boundaries of a real tap device, without needing privileges.
+ */
+static void pci_dataplane(void)
+{
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    QVirtQueuePCI *tx, *rx;
+    QGuestAllocator *alloc;
+    uint64_t req_addr;
+    uint32_t free_head;
+    char buffer[64];
+    char *cmdline;
+    QDict *rsp;
+    int sv[2], ret;
+
+    ret = socketpair(PF_UNIX, SOCK_DGRAM, 0, sv);
+    g_assert_cmpint(ret, !=, -1);
+
+    cmdline = g_strdup_printf("-object iothread,id=iothread0 "
+                              "-netdev tap,fd=%d,id=hs0 "
+                              "-device virtio-net-pci,netdev=hs0,"
+                              "iothread=iothread0", sv[1]);
+    qtest_start(cmdline);
+    g_free(cmdline);
+    bus = qpci_init_pc();
+    dev = virtio_net_pci_init(bus, PCI_SLOT);
+
+    alloc = pc_alloc_init();
+    rx = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                           alloc, 0);
+    tx = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                           alloc, 1);
+
+    /* DRIVER_OK moves the queues and the tap to the IOThread */
+    driver_init(&qvirtio_pci, &dev->vdev);
+
+    /* Filters can't be attached to a backend polled from an IOThread */
+    rsp = qmp("{ 'execute': 'object-add',"
+              "  'arguments': { 'qom-type': 'filter-buffer', 'id': 'f0',"
+              "                 'props': { 'netdev': 'hs0',"
+              "                            'interval': 1000 } } }");
+    g_assert(qdict_haskey(rsp, "error"));
+    QDECREF(rsp);
+
+    /* Receive */
+    req_addr = guest_alloc(alloc, 64);
+    free_head = qvirtqueue_add(&rx->vq, req_addr, 64, true, false);
+    qvirtqueue_kick(&qvirtio_pci, &dev->vdev, &rx->vq, free_head);
+
+    ret = send(sv[0], "TEST", 5, 0);
+    g_assert_cmpint(ret, ==, 5);
+
+    qvirtio_wait_queue_isr(&qvirtio_pci, &dev->vdev, &rx->vq,
+                           QVIRTIO_NET_TIMEOUT_US);
+    memread(req_addr + VNET_HDR_SIZE, buffer, 5);
+    g_assert_cmpstr(buffer, ==, "TEST");
+    guest_free(alloc, req_addr);
+
+    /* Transmit */
+    req_addr = guest_alloc(alloc, 64);
+    memwrite(req_addr + VNET_HDR_SIZE, "TEST", 4);
+    free_head = qvirtqueue_add(&tx->vq, req_addr, 64, false, false);
+    qvirtqueue_kick(&qvirtio_pci, &dev->vdev, &tx->vq, free_head);
+
+    qvirtio_wait_queue_isr(&qvirtio_pci, &dev->vdev, &tx->vq,
+                           QVIRTIO_NET_TIMEOUT_US);
+    guest_free(alloc, req_addr);
+
+    ret = qemu_recv(sv[0], buffer, sizeof(buffer), 0);
+    g_assert_cmpint(ret, ==, 64 - VNET_HDR_SIZE);
+    g_assert(memcmp(buffer, "TEST", 4) == 0);
+
+    /* End test */
+    close(sv[0]);
+    qvirtqueue_cleanup(&qvirtio_pci, &tx->vq, alloc);
+    qvirtqueue_cleanup(&qvirtio_pci, &rx->vq, alloc);
+    pc_alloc_uninit(alloc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev->pdev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    test_end();
+}
+
+/* The guest sees the configured ring sizes, except that the tx ring can't
+ * be larger than 256 unless the backend is vhost-user */
+static void pci_queue_size(void)
+{
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    char *cmdline;
+    int sv[2], ret;
+
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sv);
+    g_assert_cmpint(ret, !=, -1);
+
+    cmdline = g_strdup_printf("-netdev socket,fd=%d,id=hs0 "
+                              "-device virtio-net-pci,netdev=hs0,"
+                              "rx_queue_size=1024,tx_queue_size=1024",
+                              sv[1]);
+    qtest_start(cmdline);
+    g_free(cmdline);
+    bus = qpci_init_pc();
+    dev = virtio_net_pci_init(bus, PCI_SLOT);
+
+    qvirtio_pci.queue_select(&dev->vdev, 0);
+    g_assert_cmpint(qvirtio_pci.get_queue_size(&dev->vdev), ==, 1024);
+    qvirtio_pci.queue_select(&dev->vdev, 1);
+    g_assert_cmpint(qvirtio_pci.get_queue_size(&dev->vdev), ==, 256);
+
+    /* End test */
+    close(sv[0]);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev->pdev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    test_end();
+}
 #endif
 
+/* Ring sizes must be powers of two between 256 and 1024 */
+static void queue_size_invalid(void)
+{
+    static const char *const props[] = {
+        "'rx_queue_size': 300",
+        "'rx_queue_size': 128",
+        "'rx_queue_size': 2048",
+        "'tx_queue_size': 300",
+        "'tx_queue_size': 128",
+        "'tx_queue_size': 2048",
+    };
+    QDict *rsp;
+    char *cmd;
+    int i;
+
+    qtest_start("");
+
+    for (i = 0; i < ARRAY_SIZE(props); i++) {
+        cmd = g_strdup_printf("{ 'execute': 'device_add',"
+                              "  'arguments': { 'driver': 'virtio-net-pci',"
+                              "                 'id': 'net1', %s } }",
+                              props[i]);
+        rsp = qmp(cmd);
+        g_free(cmd);
+        g_assert(qdict_haskey(rsp, "error"));
+        QDECREF(rsp);
+    }
+
+    test_end();
+}
+
 static void hotplug(void)
 {
     qtest_start("-device virtio-net-pci");
@@ -261,7 +475,11 @@ int main(int argc, char **argv)
     qtest_add_data_func("/virtio/net/pci/basic", send_recv_test, pci_basic);
     qtest_add_data_func("/virtio/net/pci/rx_stop_cont",
                         stop_cont_test, pci_basic);
+    qtest_add_data_func("/virtio/net/pci/tx_batch", batch_test, pci_basic);
+    qtest_add_func("/virtio/net/pci/dataplane", pci_dataplane);
+    qtest_add_func("/virtio/net/pci/queue_size", pci_queue_size);
 #endif
+    qtest_add_func("/virtio/net/pci/queue_size_invalid", queue_size_invalid);
     qtest_add_func("/virtio/net/pci/hotplug", hotplug);
 
     return g_test_run();
@@ -0,0 +1,414 @@
+/*
+ * QTest testcase for the packed virtqueue layout
+ *
+ * libqos only drives legacy virtio devices, which can't negotiate feature
+ * bits above 31, so this sets up a modern virtio-blk-pci device by hand and
+ * drives its request queue as a packed ring.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc.h"
+#include "libqos/malloc-pc.h"
+#include "hw/pci/pci_regs.h"
+#include "qemu/bswap.h"
+#include "standard-headers/linux/virtio_config.h"
+#include "standard-headers/linux/virtio_ring.h"
+#include "standard-headers/linux/virtio_blk.h"
+#include "standard-headers/linux/virtio_pci.h"
+
+#define TEST_IMAGE_SIZE         (64 * 1024 * 1024)
+#define TIMEOUT_US              (30 * 1000 * 1000)
+#define PCI_SLOT                0x04
+#define PCI_FN                  0x00
+/* Small, so that requests of three descriptors wrap around all the time */
+#define QUEUE_SIZE              8
+#define SECTOR_SIZE             512
+
+#define COMMON(field)   offsetof(struct virtio_pci_common_cfg, field)
+#define DESC(field)     offsetof(struct vring_packed_desc, field)
+
+typedef struct PackedDev {
+    QPCIBus *bus;
+    QPCIDevice *pdev;
+    QGuestAllocator *alloc;
+    char *tmp_path;
+    int bar;
+    void *bar_addr;
+    void *common;
+    void *notify;
+
+    /* The ring, as seen by the driver */
+    uint64_t desc;
+    uint64_t driver_event;
+    uint64_t device_event;
+    uint16_t next_avail;
+    bool avail_wrap;
+    uint16_t next_used;
+    bool used_wrap;
+    uint16_t next_id;
+    /* Number of ring slots taken by each buffer id */
+    uint16_t chain_len[QUEUE_SIZE];
+} PackedDev;
+
+/* A virtio-blk request and its buffers, in one guest allocation */
+typedef struct PackedReq {
+    uint64_t addr;
+    uint16_t id;
+} PackedReq;
+
+#define REQ_DATA(req)   ((req)->addr + sizeof(struct virtio_blk_outhdr))
+#define REQ_STATUS(req) (REQ_DATA(req) + SECTOR_SIZE)
+
+/* Find a virtio capability of type @type, returns its config space offset */
+static uint8_t find_virtio_cap(PackedDev *d, uint8_t type)
+{
+    uint8_t cap = qpci_config_readb(d->pdev, PCI_CAPABILITY_LIST);
+
+    while (cap) {
+        if (qpci_config_readb(d->pdev, cap + PCI_CAP_LIST_ID) ==
+            PCI_CAP_ID_VNDR &&
+            qpci_config_readb(d->pdev, cap + VIRTIO_PCI_CAP_CFG_TYPE) ==
+            type) {
+            return cap;
+        }
+        cap = qpci_config_readb(d->pdev, cap + PCI_CAP_LIST_NEXT);
+    }
+    g_assert_not_reached();
+}
+
+static void *map_virtio_cap(PackedDev *d, uint8_t cap)
+{
+    int bar = qpci_config_readb(d->pdev, cap + VIRTIO_PCI_CAP_BAR);
+    uint32_t offset = qpci_config_readl(d->pdev, cap + VIRTIO_PCI_CAP_OFFSET);
+
+    /* QEMU puts all the modern structures in the same BAR */
+    if (!d->bar_addr) {
+        d->bar = bar;
+        d->bar_addr = qpci_iomap(d->pdev, bar, NULL);
+        g_assert(d->bar_addr);
+    }
+    g_assert_cmpint(bar, ==, d->bar);
+    return d->bar_addr + offset;
+}
+
+static void set_status(PackedDev *d, uint8_t status)
+{
+    qpci_io_writeb(d->pdev, d->common + COMMON(device_status), status);
+}
+
+static uint8_t get_status(PackedDev *d)
+{
+    return qpci_io_readb(d->pdev, d->common + COMMON(device_status));
+}
+
+static void packed_dev_init(PackedDev *d)
+{
+    uint32_t features;
+    uint16_t notify_off;
+    uint32_t notify_mult;
+    uint8_t cap;
+    char *cmdline;
+    int fd;
+
+    d->tmp_path = g_strdup("/tmp/qtest.XXXXXX");
+    fd = mkstemp(d->tmp_path);
+    g_assert_cmpint(fd, >=, 0);
+    g_assert_cmpint(ftruncate(fd, TEST_IMAGE_SIZE), ==, 0);
+    close(fd);
+
+    cmdline = g_strdup_printf("-drive if=none,id=drive0,file=%s,format=raw "
+                              "-device virtio-blk-pci,drive=drive0,"
+                              "disable-legacy=on,packed=on,addr=%x.%x",
+                              d->tmp_path, PCI_SLOT, PCI_FN);
+    qtest_start(cmdline);
+    g_free(cmdline);
+
+    d->bus = qpci_init_pc();
+    d->pdev = qpci_device_find(d->bus, QPCI_DEVFN(PCI_SLOT, PCI_FN));
+    g_assert(d->pdev);
+    qpci_device_enable(d->pdev);
+    d->alloc = pc_alloc_init();
+
+    d->common = map_virtio_cap(d, find_virtio_cap(d,
+                                                  VIRTIO_PCI_CAP_COMMON_CFG));
+    cap = find_virtio_cap(d, VIRTIO_PCI_CAP_NOTIFY_CFG);
+    d->notify = map_virtio_cap(d, cap);
+    notify_mult = qpci_config_readl(d->pdev, cap +
+                        offsetof(struct virtio_pci_notify_cap,
+                                 notify_off_multiplier));
+
+    set_status(d, 0);
+    set_status(d, VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER);
+
+    qpci_io_writel(d->pdev, d->common + COMMON(device_feature_select), 1);
+    features = qpci_io_readl(d->pdev, d->common + COMMON(device_feature));
+    g_assert(features & (1u << (VIRTIO_F_VERSION_1 - 32)));
+    g_assert(features & (1u << (VIRTIO_F_RING_PACKED - 32)));
+
+    qpci_io_writel(d->pdev, d->common + COMMON(guest_feature_select), 0);
+    qpci_io_writel(d->pdev, d->common + COMMON(guest_feature), 0);
+    qpci_io_writel(d->pdev, d->common + COMMON(guest_feature_select), 1);
+    qpci_io_writel(d->pdev, d->common + COMMON(guest_feature),
+                   (1u << (VIRTIO_F_VERSION_1 - 32)) |
+                   (1u << (VIRTIO_F_RING_PACKED - 32)));
+    set_status(d, get_status(d) | VIRTIO_CONFIG_S_FEATURES_OK);
+    g_assert(get_status(d) & VIRTIO_CONFIG_S_FEATURES_OK);
+
+    d->desc = guest_alloc(d->alloc,
+                          QUEUE_SIZE * sizeof(struct vring_packed_desc));
+    d->driver_event = guest_alloc(d->alloc,
+                                  sizeof(struct vring_packed_desc_event));
+    d->device_event = guest_alloc(d->alloc,
+                                  sizeof(struct vring_packed_desc_event));
+    qmemset(d->desc, 0, QUEUE_SIZE * sizeof(struct vring_packed_desc));
+    qmemset(d->driver_event, 0, sizeof(struct vring_packed_desc_event));
+    qmemset(d->device_event, 0, sizeof(struct vring_packed_desc_event));
+
+    qpci_io_writew(d->pdev, d->common + COMMON(queue_select), 0);
+    qpci_io_writew(d->pdev, d->common + COMMON(queue_size), QUEUE_SIZE);
+    qpci_io_writel(d->pdev, d->common + COMMON(queue_desc_lo), d->desc);
+    qpci_io_writel(d->pdev, d->common + COMMON(queue_desc_hi),
+                   d->desc >> 32);
+    qpci_io_writel(d->pdev, d->common + COMMON(queue_avail_lo),
+                   d->driver_event);
+    qpci_io_writel(d->pdev, d->common + COMMON(queue_avail_hi),
+                   d->driver_event >> 32);
+    qpci_io_writel(d->pdev, d->common + COMMON(queue_used_lo),
+                   d->device_event);
+    qpci_io_writel(d->pdev, d->common + COMMON(queue_used_hi),
+                   d->device_event >> 32);
+    notify_off = qpci_io_readw(d->pdev, d->common + COMMON(queue_notify_off));
+    d->notify += notify_off * notify_mult;
+    qpci_io_writew(d->pdev, d->common + COMMON(queue_enable), 1);
+
+    set_status(d, get_status(d) | VIRTIO_CONFIG_S_DRIVER_OK);
+
+    d->avail_wrap = true;
+    d->used_wrap = true;
+}
+
+static void packed_dev_cleanup(PackedDev *d)
+{
+    set_status(d, 0);
+    guest_free(d->alloc, d->desc);
+    guest_free(d->alloc, d->driver_event);
+    guest_free(d->alloc, d->device_event);
+    pc_alloc_uninit(d->alloc);
+    g_free(d->pdev);
+    qpci_free_pc(d->bus);
+    qtest_end();
+    unlink(d->tmp_path);
+    g_free(d->tmp_path);
+}
+
+static uint16_t avail_flags(bool wrap)
+{
+    return wrap ? 1 << VRING_PACKED_DESC_F_AVAIL
+                : 1 << VRING_PACKED_DESC_F_USED;
+}
+
+/*
+ * Make a virtio-blk request available: header, one sector of data and
+ * the status byte, in three descriptors.  The flags of the head are
+ * written last so that the device never sees a partial chain.
+ */
+static void packed_add_req(PackedDev *d, PackedReq *req, uint32_t type,
+                           uint64_t sector)
+{
+    uint64_t addr[3];
+    uint64_t head = d->desc + d->next_avail * sizeof(struct vring_packed_desc);
+    uint32_t len[3] = { sizeof(struct virtio_blk_outhdr), SECTOR_SIZE, 1 };
+    uint16_t flags[3], head_flags = 0;
+    int i;
+
+    req->id = d->next_id;
+    d->next_id = (d->next_id + 1) % QUEUE_SIZE;
+    d->chain_len[req->id] = 3;
+
+    writel(req->addr, type);
+    writel(req->addr + 4, 0);
+    writeq(req->addr + 8, sector);
+    writeb(REQ_STATUS(req), 0xff);
+
+    addr[0] = req->addr;
+    addr[1] = REQ_DATA(req);
+    addr[2] = REQ_STATUS(req);
+    flags[0] = VRING_DESC_F_NEXT;
+    flags[1] = VRING_DESC_F_NEXT |
+               (type == VIRTIO_BLK_T_IN ? VRING_DESC_F_WRITE : 0);
+    flags[2] = VRING_DESC_F_WRITE;
+
+    for (i = 0; i < 3; i++) {
+        uint64_t desc = d->desc +
+                        d->next_avail * sizeof(struct vring_packed_desc);
+
+        writeq(desc + DESC(addr), addr[i]);
+        writel(desc + DESC(len), len[i]);
+        writew(desc + DESC(id), req->id);
+        if (i == 0) {
+            head_flags = flags[i] | avail_flags(d->avail_wrap);
+        } else {
+            writew(desc + DESC(flags), flags[i] | avail_flags(d->avail_wrap));
+        }
+        if (++d->next_avail == QUEUE_SIZE) {
+            d->next_avail = 0;
+            d->avail_wrap = !d->avail_wrap;
+        }
+    }
+    writew(head + DESC(flags), head_flags);
+}
+
+static void packed_kick(PackedDev *d)
+{
+    qpci_io_writew(d->pdev, d->notify, 0);
+}
+
+/* Wait for the next used buffer, returns its id */
+static uint16_t packed_wait_used(PackedDev *d, uint32_t *len)
+{
+    uint64_t desc = d->desc + d->next_used * sizeof(struct vring_packed_desc);
+    gint64 start_time = g_get_monotonic_time();
+    uint16_t flags, id;
+
+    for (;;) {
+        bool avail, used;
+
+        flags = readw(desc + DESC(flags));
+        avail = !!(flags & (1 << VRING_PACKED_DESC_F_AVAIL));
+        used = !!(flags & (1 << VRING_PACKED_DESC_F_USED));
+        if (avail == used && used == d->used_wrap) {
+            break;
+        }
+        clock_step(100);
+        g_assert(g_get_monotonic_time() - start_time <= TIMEOUT_US);
+    }
+
+    id = readw(desc + DESC(id));
+    g_assert_cmpint(id, <, QUEUE_SIZE);
+    *len = readl(desc + DESC(len));
+
+    d->next_used += d->chain_len[id];
+    if (d->next_used >= QUEUE_SIZE) {
+        d->next_used -= QUEUE_SIZE;
+        d->used_wrap = !d->used_wrap;
+    }
+    return id;
+}
+
+static void fill_sector(uint8_t *buf, uint64_t sector)
+{
+    memset(buf, 'a' + sector % 26, SECTOR_SIZE);
+    stq_le_p(buf, sector);
+}
+
+/* Requests of three descriptors on a ring of eight keep crossing its end */
+static void test_wrap(void)
+{
+    PackedDev d = { 0 };
+    PackedReq req;
+    uint8_t buf[SECTOR_SIZE], expected[SECTOR_SIZE];
+    uint32_t len;
+    uint64_t sector;
+
+    packed_dev_init(&d);
+    req.addr = guest_alloc(d.alloc, sizeof(struct virtio_blk_outhdr) +
+                                    SECTOR_SIZE + 1);
+
+    for (sector = 0; sector < 4 * QUEUE_SIZE; sector++) {
+        fill_sector(expected, sector);
+
+        memwrite(REQ_DATA(&req), expected, SECTOR_SIZE);
+        packed_add_req(&d, &req, VIRTIO_BLK_T_OUT, sector);
+        packed_kick(&d);
+        g_assert_cmpint(packed_wait_used(&d, &len), ==, req.id);
+        g_assert_cmpint(readb(REQ_STATUS(&req)), ==, VIRTIO_BLK_S_OK);
+
+        qmemset(REQ_DATA(&req), 0, SECTOR_SIZE);
+        packed_add_req(&d, &req, VIRTIO_BLK_T_IN, sector);
+        packed_kick(&d);
+        g_assert_cmpint(packed_wait_used(&d, &len), ==, req.id);
+        g_assert_cmpint(len, ==, SECTOR_SIZE + 1);
+        g_assert_cmpint(readb(REQ_STATUS(&req)), ==, VIRTIO_BLK_S_OK);
+        memread(REQ_DATA(&req), buf, SECTOR_SIZE);
+        g_assert(memcmp(buf, expected, SECTOR_SIZE) == 0);
+    }
+
+    guest_free(d.alloc, req.addr);
+    packed_dev_cleanup(&d);
+}
+
+/*
+ * Two requests per kick, so that a single notification covers chains on
+ * both sides of the wrap; they may complete in any order.
+ */
+static void test_batch(void)
+{
+    PackedDev d = { 0 };
+    PackedReq req[2];
+    uint8_t buf[SECTOR_SIZE], expected[SECTOR_SIZE];
+    uint32_t len;
+    uint64_t sector;
+    int i, done;
+
+    packed_dev_init(&d);
+    for (i = 0; i < 2; i++) {
+        req[i].addr = guest_alloc(d.alloc, sizeof(struct virtio_blk_outhdr) +
+                                           SECTOR_SIZE + 1);
+    }
+
+    for (sector = 0; sector < 4 * QUEUE_SIZE; sector += 2) {
+        for (i = 0; i < 2; i++) {
+            fill_sector(expected, sector + i);
+            memwrite(REQ_DATA(&req[i]), expected, SECTOR_SIZE);
+            packed_add_req(&d, &req[i], VIRTIO_BLK_T_OUT, sector + i);
+        }
+        packed_kick(&d);
+        for (done = 0; done < 2; done++) {
+            uint16_t id = packed_wait_used(&d, &len);
+
+            g_assert(id == req[0].id || id == req[1].id);
+        }
+
+        for (i = 0; i < 2; i++) {
+            qmemset(REQ_DATA(&req[i]), 0, SECTOR_SIZE);
+            packed_add_req(&d, &req[i], VIRTIO_BLK_T_IN, sector + i);
+        }
+        packed_kick(&d);
+        for (done = 0; done < 2; done++) {
+            uint16_t id = packed_wait_used(&d, &len);
+
+            g_assert(id == req[0].id || id == req[1].id);
+            g_assert_cmpint(len, ==, SECTOR_SIZE + 1);
+        }
+        for (i = 0; i < 2; i++) {
+            g_assert_cmpint(readb(REQ_STATUS(&req[i])), ==, VIRTIO_BLK_S_OK);
+            fill_sector(expected, sector + i);
+            memread(REQ_DATA(&req[i]), buf, SECTOR_SIZE);
+            g_assert(memcmp(buf, expected, SECTOR_SIZE) == 0);
+        }
+    }
+
+    for (i = 0; i < 2; i++) {
+        guest_free(d.alloc, req[i].addr);
+    }
+    packed_dev_cleanup(&d);
+}
+
+int main(int argc, char **argv)
+{
+    const char *arch = qtest_get_arch();
+
+    g_test_init(&argc, &argv, NULL);
+
+    if (strcmp(arch, "i386") == 0 || strcmp(arch, "x86_64") == 0) {
+        qtest_add_func("/virtio/packed/blk/pci/wrap", test_wrap);
+        qtest_add_func("/virtio/packed/blk/pci/batch", test_batch);
+    }
+
+    return g_test_run();
+}
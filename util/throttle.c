@@ -162,13 +162,16 @@ static bool throttle_compute_timer(ThrottleState *ts,
                                    int64_t now,
                                    int64_t *next_timestamp)
 {
-    int64_t wait;
+    int64_t wait = 0;
 
-    /* leak proportionally to the time elapsed */
-    throttle_do_leak(ts, now);
+    /* The I/O has to wait for the most restrictive level of the hierarchy */
+    for (; ts; ts = ts->parent) {
+        /* leak proportionally to the time elapsed */
+        throttle_do_leak(ts, now);
 
-    /* compute the wait time if any */
-    wait = throttle_compute_wait_for(ts, is_write);
+        /* compute the wait time if any */
+        wait = MAX(wait, throttle_compute_wait_for(ts, is_write));
+    }
 
     /* if the code must wait compute when the next timer should fire */
     if (wait) {
@@ -388,6 +391,28 @@ static void throttle_cancel_timer(QEMUTimer *timer)
     timer_del(timer);
 }
 
+/* Used to configure a throttle state that has no timers of its own, like
+ * the upper levels of a throttling hierarchy
+ *
+ * @ts:         the throttle state we are working on
+ * @clock_type: the clock used to leak the buckets
+ * @cfg:        the config to set
+ */
+void throttle_config_state(ThrottleState *ts,
+                           QEMUClockType clock_type,
+                           ThrottleConfig *cfg)
+{
+    int i;
+
+    ts->cfg = *cfg;
+
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        throttle_fix_bucket(&ts->cfg.buckets[i]);
+    }
+
+    ts->previous_leak = qemu_clock_get_ns(clock_type);
+}
+
 /* Used to configure the throttle
  *
  * @ts: the throttle state we are working on
@@ -400,13 +425,7 @@ void throttle_config(ThrottleState *ts,
 {
     int i;
 
-    ts->cfg = *cfg;
-
-    for (i = 0; i < BUCKETS_COUNT; i++) {
-        throttle_fix_bucket(&ts->cfg.buckets[i]);
-    }
-
-    ts->previous_leak = qemu_clock_get_ns(tt->clock_type);
+    throttle_config_state(ts, tt->clock_type, cfg);
 
     for (i = 0; i < 2; i++) {
         throttle_cancel_timer(tt->timers[i]);
@@ -423,6 +442,26 @@ void throttle_get_config(ThrottleState *ts, ThrottleConfig *cfg)
     *cfg = ts->cfg;
 }
 
+/* Nest a throttle state inside another one. All I/O accounted in @ts
+ * will also be accounted in @parent and its ancestors.
+ *
+ * @ts:     the throttle state we are working on
+ * @parent: the enclosing throttle state, or NULL to detach @ts
+ */
+void throttle_set_parent(ThrottleState *ts, ThrottleState *parent)
+{
+    ThrottleState *iter;
+    int depth = 1;
+
+    for (iter = parent; iter; iter = iter->parent) {
+        assert(iter != ts);
+        depth++;
+    }
+    assert(depth <= THROTTLE_MAX_DEPTH);
+
+    ts->parent = parent;
+}
+
 
 /* Schedule the read or write timer if needed
  *
@@ -460,6 +499,18 @@ bool throttle_schedule_timer(ThrottleState *ts,
     return true;
 }
 
+/* Check whether the limits of a throttle state itself, not counting the
+ * ones of its parents, delay the next request. The buckets must have
+ * been leaked recently, e.g. by throttle_schedule_timer().
+ *
+ * @is_write: the type of operation (read/write)
+ * @ret:      true if @ts is over its own limits
+ */
+bool throttle_own_limits_exceeded(ThrottleState *ts, bool is_write)
+{
+    return throttle_compute_wait_for(ts, is_write) != 0;
+}
+
 /* do the accounting for this operation
  *
  * @is_write: the type of operation (read/write)
@@ -475,27 +526,33 @@ void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
         { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
         { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
     };
-    double units = 1.0;
     unsigned i;
 
-    /* if cfg.op_size is defined and smaller than size we compute unit count */
-    if (ts->cfg.op_size && size > ts->cfg.op_size) {
-        units = (double) size / ts->cfg.op_size;
-    }
+    /* every level of the hierarchy uses its own op_size, so the cost of
+     * a large request can be normalized differently for each of them */
+    for (; ts; ts = ts->parent) {
+        double units = 1.0;
 
-    for (i = 0; i < 2; i++) {
-        LeakyBucket *bkt;
-
-        bkt = &ts->cfg.buckets[bucket_types_size[is_write][i]];
-        bkt->level += size;
-        if (bkt->burst_length > 1) {
-            bkt->burst_level += size;
+        /* if cfg.op_size is defined and smaller than size we compute unit
+         * count */
+        if (ts->cfg.op_size && size > ts->cfg.op_size) {
+            units = (double) size / ts->cfg.op_size;
         }
 
-        bkt = &ts->cfg.buckets[bucket_types_units[is_write][i]];
-        bkt->level += units;
-        if (bkt->burst_length > 1) {
-            bkt->burst_level += units;
+        for (i = 0; i < 2; i++) {
+            LeakyBucket *bkt;
+
+            bkt = &ts->cfg.buckets[bucket_types_size[is_write][i]];
+            bkt->level += size;
+            if (bkt->burst_length > 1) {
+                bkt->burst_level += size;
+            }
+
+            bkt = &ts->cfg.buckets[bucket_types_units[is_write][i]];
+            bkt->level += units;
+            if (bkt->burst_length > 1) {
+                bkt->burst_level += units;
+            }
         }
     }
 }
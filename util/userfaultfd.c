@@ -0,0 +1,182 @@
+/*
+ * Linux userfaultfd helpers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "qemu/userfaultfd.h"
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#ifdef __NR_userfaultfd
+
+static int uffd_open(int flags)
+{
+    return syscall(__NR_userfaultfd, flags);
+}
+
+#else
+
+static int uffd_open(int flags)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
+
+/* Ask the kernel which features a userfaultfd could be created with */
+int uffd_query_features(uint64_t *features)
+{
+    struct uffdio_api api_struct = { 0 };
+    int ret = -1;
+    int uffd_fd;
+
+    uffd_fd = uffd_open(O_CLOEXEC);
+    if (uffd_fd < 0) {
+        error_report("%s: userfaultfd() failed: %s", __func__,
+                     strerror(errno));
+        return -1;
+    }
+
+    api_struct.api = UFFD_API;
+    api_struct.features = 0;
+    if (ioctl(uffd_fd, UFFDIO_API, &api_struct)) {
+        error_report("%s: UFFDIO_API failed: %s", __func__, strerror(errno));
+        goto out;
+    }
+    *features = api_struct.features;
+    ret = 0;
+
+out:
+    close(uffd_fd);
+    return ret;
+}
+
+int uffd_create_fd(uint64_t features, bool non_blocking)
+{
+    struct uffdio_api api_struct = { 0 };
+    uint64_t ioctl_mask = (uint64_t)1 << _UFFDIO_REGISTER |
+                          (uint64_t)1 << _UFFDIO_UNREGISTER;
+    int uffd_fd;
+
+    uffd_fd = uffd_open(O_CLOEXEC | (non_blocking ? O_NONBLOCK : 0));
+    if (uffd_fd < 0) {
+        error_report("%s: userfaultfd() failed: %s", __func__,
+                     strerror(errno));
+        return -1;
+    }
+
+    api_struct.api = UFFD_API;
+    api_struct.features = features;
+    if (ioctl(uffd_fd, UFFDIO_API, &api_struct)) {
+        error_report("%s: UFFDIO_API failed: %s", __func__, strerror(errno));
+        goto fail;
+    }
+    if ((api_struct.ioctls & ioctl_mask) != ioctl_mask) {
+        error_report("%s: Missing userfault features: %" PRIx64, __func__,
+                     (uint64_t)(~api_struct.ioctls & ioctl_mask));
+        goto fail;
+    }
+
+    return uffd_fd;
+
+fail:
+    close(uffd_fd);
+    return -1;
+}
+
+void uffd_close_fd(int uffd_fd)
+{
+    assert(uffd_fd >= 0);
+    close(uffd_fd);
+}
+
+/*
+ * Start tracking faults of @mode (UFFDIO_REGISTER_MODE_*) in the range;
+ * @ioctls, if not NULL, returns the ioctls supported on it.
+ */
+int uffd_register_memory(int uffd_fd, void *addr, uint64_t length,
+                         uint64_t mode, uint64_t *ioctls)
+{
+    struct uffdio_register uffd_register;
+
+    uffd_register.range.start = (uintptr_t)addr;
+    uffd_register.range.len = length;
+    uffd_register.mode = mode;
+
+    if (ioctl(uffd_fd, UFFDIO_REGISTER, &uffd_register)) {
+        error_report("%s: UFFDIO_REGISTER failed: addr=%p length=%" PRIu64
+                     " mode=%" PRIx64 ": %s", __func__, addr, length, mode,
+                     strerror(errno));
+        return -1;
+    }
+    if (ioctls) {
+        *ioctls = uffd_register.ioctls;
+    }
+
+    return 0;
+}
+
+int uffd_unregister_memory(int uffd_fd, void *addr, uint64_t length)
+{
+    struct uffdio_range uffd_range;
+
+    uffd_range.start = (uintptr_t)addr;
+    uffd_range.len = length;
+
+    if (ioctl(uffd_fd, UFFDIO_UNREGISTER, &uffd_range)) {
+        error_report("%s: UFFDIO_UNREGISTER failed: addr=%p length=%" PRIu64
+                     ": %s", __func__, addr, length, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Write protect the range, or remove the protection and, unless
+ * @dont_wake, wake up the threads that faulted on it.
+ */
+int uffd_change_protection(int uffd_fd, void *addr, uint64_t length,
+                           bool wp, bool dont_wake)
+{
+    struct uffdio_writeprotect uffd_writeprotect;
+
+    uffd_writeprotect.range.start = (uintptr_t)addr;
+    uffd_writeprotect.range.len = length;
+    uffd_writeprotect.mode = (wp ? UFFDIO_WRITEPROTECT_MODE_WP : 0) |
+                             (dont_wake ? UFFDIO_WRITEPROTECT_MODE_DONTWAKE : 0);
+
+    if (ioctl(uffd_fd, UFFDIO_WRITEPROTECT, &uffd_writeprotect)) {
+        error_report("%s: UFFDIO_WRITEPROTECT failed: addr=%p length=%" PRIu64
+                     " mode=%" PRIx64 ": %s", __func__, addr, length,
+                     (uint64_t)uffd_writeprotect.mode, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int uffd_read_events(int uffd_fd, struct uffd_msg *msgs, int count)
+{
+    ssize_t res;
+
+    do {
+        res = read(uffd_fd, msgs, count * sizeof(struct uffd_msg));
+    } while (res < 0 && errno == EINTR);
+
+    if (res < 0) {
+        return errno == EAGAIN ? 0 : -errno;
+    }
+    if (res % sizeof(struct uffd_msg)) {
+        /* Lost alignment, don't know what we'd read next */
+        return -EIO;
+    }
+
+    return res / sizeof(struct uffd_msg);
+}